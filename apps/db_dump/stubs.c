@@ -93,11 +93,12 @@ ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count)
 	return 0;
 }
 
-int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics)
+int retain__store(const char *topic, struct mosquitto_msg_store *stored, const struct sub__token *tokens, int token_count)
 {
 	UNUSED(topic);
 	UNUSED(stored);
-	UNUSED(split_topics);
+	UNUSED(tokens);
+	UNUSED(token_count);
 	return 0;
 }
 
@@ -140,6 +141,18 @@ void db__msg_add_to_queued_stats(struct mosquitto_msg_data *msg_data, struct mos
 	UNUSED(msg);
 }
 
+void db__msg_add_to_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg)
+{
+	UNUSED(msg_data);
+	UNUSED(msg);
+}
+
+struct mosquitto_client_msg *db__msg_queue_push(struct mosquitto_msg_data *msg_data)
+{
+	UNUSED(msg_data);
+	return calloc(1, sizeof(struct mosquitto_client_msg));
+}
+
 int session_expiry__add_from_persistence(struct mosquitto *context, time_t expiry_time)
 {
 	UNUSED(context);
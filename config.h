@@ -82,6 +82,11 @@
 #  define HAVE_PTHREAD_CANCEL
 #endif
 
+/* SSE2 is available on every x86-64 CPU, so needs no runtime check */
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#  define HAVE_SSE2
+#endif
+
 #ifdef WITH_CJSON
 #  include <cjson/cJSON.h>
 #  define CJSON_VERSION_FULL (CJSON_VERSION_MAJOR*1000000+CJSON_VERSION_MINOR*1000+CJSON_VERSION_PATCH)
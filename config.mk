@@ -66,7 +66,9 @@ WITH_SYSTEMD:=no
 # Build with SRV lookup support.
 WITH_SRV:=no
 
-# Build with websockets support on the broker.
+# Build with websockets support on the broker. Set to yes to use
+# libwebsockets, or to builtin to use the broker's own websockets support,
+# which needs WITH_TLS.
 WITH_WEBSOCKETS:=no
 
 # Use elliptic keys in broker
@@ -98,6 +100,14 @@ WITH_SHARED_LIBRARIES:=yes
 # Build with epoll support.
 WITH_EPOLL:=yes
 
+# Build with io_uring support, which can be selected with the mux_backend
+# option. Linux only, and requires WITH_EPOLL.
+WITH_IO_URING:=no
+
+# Build with support for carrying out TLS handshakes on a pool of worker
+# threads, configured with the tls_handshake_threads option. Requires WITH_TLS.
+WITH_TLS_POOL:=yes
+
 # Build with bundled uthash.h
 WITH_BUNDLED_DEPS:=yes
 
@@ -116,6 +126,9 @@ WITH_CONTROL:=yes
 # Build the broker with the jemalloc allocator
 WITH_JEMALLOC:=no
 
+# Build the broker with zlib, for compressed bridge payloads
+WITH_ZLIB:=no
+
 # Build with xtreport capability. This is for debugging purposes and is
 # probably of no particular interest to end users.
 WITH_XTREPORT=no
@@ -331,6 +344,11 @@ ifeq ($(WITH_JEMALLOC),yes)
 	BROKER_LDADD:=$(BROKER_LDADD) -ljemalloc
 endif
 
+ifeq ($(WITH_ZLIB),yes)
+	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_ZLIB
+	BROKER_LDADD:=$(BROKER_LDADD) -lz
+endif
+
 ifeq ($(WITH_UNIX_SOCKETS),yes)
 	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_UNIX_SOCKETS
 	LIB_CPPFLAGS:=$(LIB_CPPFLAGS) -DWITH_UNIX_SOCKETS
@@ -342,6 +360,10 @@ ifeq ($(WITH_WEBSOCKETS),yes)
 	BROKER_LDADD:=$(BROKER_LDADD) -lwebsockets
 endif
 
+ifeq ($(WITH_WEBSOCKETS),builtin)
+	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_WEBSOCKETS_BUILTIN
+endif
+
 INSTALL?=install
 prefix?=/usr/local
 incdir?=${prefix}/include
@@ -360,6 +382,19 @@ ifeq ($(WITH_EPOLL),yes)
 	endif
 endif
 
+ifeq ($(WITH_IO_URING),yes)
+	ifeq ($(UNAME),Linux)
+		BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_IO_URING
+	endif
+endif
+
+ifeq ($(WITH_TLS),yes)
+	ifeq ($(WITH_TLS_POOL),yes)
+		BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -DWITH_TLS_POOL
+		BROKER_LDFLAGS:=$(BROKER_LDFLAGS) -pthread
+	endif
+endif
+
 ifeq ($(WITH_BUNDLED_DEPS),yes)
 	BROKER_CPPFLAGS:=$(BROKER_CPPFLAGS) -I../deps
 	LIB_CPPFLAGS:=$(LIB_CPPFLAGS) -I../deps
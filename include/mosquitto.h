@@ -182,6 +182,7 @@ struct mosquitto_message{
 };
 
 struct mosquitto;
+struct mosquitto_topic_filter;
 typedef struct mqtt5__property mosquitto_property;
 
 /*
@@ -2464,6 +2465,57 @@ libmosq_EXPORT int mosquitto_topic_matches_sub(const char *sub, const char *topi
  */
 libmosq_EXPORT int mosquitto_topic_matches_sub2(const char *sub, size_t sublen, const char *topic, size_t topiclen, bool *result);
 
+/*
+ * Function: mosquitto_topic_filter_compile
+ *
+ * Prepare a subscription filter for repeated matching with
+ * <mosquitto_topic_matches_compiled>. This is faster than
+ * <mosquitto_topic_matches_sub> when the same filter is checked against many
+ * topics.
+ *
+ * Parameters:
+ *	sub - subscription string to compile.
+ *	filter - pointer to a struct mosquitto_topic_filter pointer, which will be
+ *	         set to the compiled filter on success. Free with
+ *	         <mosquitto_topic_filter_free>.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ *	MOSQ_ERR_INVAL -   if the input parameters were invalid, or sub is not a
+ *	                   valid subscription.
+ *	MOSQ_ERR_NOMEM -   if an out of memory condition occurred.
+ */
+libmosq_EXPORT int mosquitto_topic_filter_compile(const char *sub, struct mosquitto_topic_filter **filter);
+
+/*
+ * Function: mosquitto_topic_matches_compiled
+ *
+ * Check whether a topic matches a subscription filter compiled with
+ * <mosquitto_topic_filter_compile>. The result is the same as for
+ * <mosquitto_topic_matches_sub>.
+ *
+ * Parameters:
+ *	filter - compiled subscription filter.
+ *	topic - topic to check.
+ *	result - bool pointer to hold result. Will be set to true if the topic
+ *	         matches the subscription.
+ *
+ * Returns:
+ *	MOSQ_ERR_SUCCESS - on success
+ *	MOSQ_ERR_INVAL -   if the input parameters were invalid.
+ */
+libmosq_EXPORT int mosquitto_topic_matches_compiled(const struct mosquitto_topic_filter *filter, const char *topic, bool *result);
+
+/*
+ * Function: mosquitto_topic_filter_free
+ *
+ * Free a subscription filter compiled with <mosquitto_topic_filter_compile>.
+ *
+ * Parameters:
+ *	filter - compiled subscription filter, may be NULL.
+ */
+libmosq_EXPORT void mosquitto_topic_filter_free(struct mosquitto_topic_filter *filter);
+
 /*
  * Function: mosquitto_pub_topic_check
  *
@@ -18,6 +18,13 @@ Contributors:
 
 #include "config.h"
 
+#include <string.h>
+
+#ifdef WITH_BROKER
+#  include <utlist.h>
+#  include "mosquitto_broker_internal.h"
+#endif
+
 #include "mosquitto.h"
 #include "alias_mosq.h"
 #include "memory_mosq.h"
@@ -84,3 +91,73 @@ void alias__free_all(struct mosquitto *mosq)
 	mosq->aliases = NULL;
 	mosq->alias_count = 0;
 }
+
+
+#ifdef WITH_BROKER
+/* Outgoing topic aliases, assigned by the broker up to the Topic Alias
+ * Maximum the client sent in its CONNECT. Once all aliases are in use, the
+ * least recently used one is given to the new topic. */
+
+struct mosquitto__alias_out *alias__out_find(struct mosquitto *mosq, const char *topic)
+{
+	struct mosquitto__alias_out *alias;
+
+	HASH_FIND(hh, mosq->aliases_out, topic, strlen(topic), alias);
+	return alias;
+}
+
+
+void alias__out_touch(struct mosquitto *mosq, struct mosquitto__alias_out *alias)
+{
+	if(alias->next){
+		DL_DELETE(mosq->aliases_out_lru, alias);
+		DL_APPEND(mosq->aliases_out_lru, alias);
+	}
+}
+
+
+int alias__out_add(struct mosquitto *mosq, const char *topic, uint16_t *alias_id)
+{
+	struct mosquitto__alias_out *alias;
+	char *topic_copy;
+
+	topic_copy = mosquitto__strdup(topic);
+	if(!topic_copy) return MOSQ_ERR_NOMEM;
+
+	if(mosq->alias_out_count < mosq->alias_out_max){
+		alias = mosquitto__calloc(1, sizeof(struct mosquitto__alias_out));
+		if(!alias){
+			mosquitto__free(topic_copy);
+			return MOSQ_ERR_NOMEM;
+		}
+		mosq->alias_out_count++;
+		alias->alias = (uint16_t)mosq->alias_out_count;
+	}else{
+		/* Reuse the alias of the least recently used topic */
+		alias = mosq->aliases_out_lru;
+		HASH_DELETE(hh, mosq->aliases_out, alias);
+		DL_DELETE(mosq->aliases_out_lru, alias);
+		mosquitto__free(alias->topic);
+	}
+	alias->topic = topic_copy;
+	HASH_ADD_KEYPTR(hh, mosq->aliases_out, alias->topic, strlen(alias->topic), alias);
+	DL_APPEND(mosq->aliases_out_lru, alias);
+
+	*alias_id = alias->alias;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void alias__out_free_all(struct mosquitto *mosq)
+{
+	struct mosquitto__alias_out *alias, *alias_tmp;
+
+	HASH_ITER(hh, mosq->aliases_out, alias, alias_tmp){
+		HASH_DELETE(hh, mosq->aliases_out, alias);
+		mosquitto__free(alias->topic);
+		mosquitto__free(alias);
+	}
+	mosq->aliases_out_lru = NULL;
+	mosq->alias_out_count = 0;
+}
+#endif
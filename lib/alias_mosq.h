@@ -24,5 +24,11 @@ Contributors:
 int alias__add(struct mosquitto *mosq, const char *topic, uint16_t alias);
 int alias__find(struct mosquitto *mosq, char **topic, uint16_t alias);
 void alias__free_all(struct mosquitto *mosq);
+#ifdef WITH_BROKER
+struct mosquitto__alias_out *alias__out_find(struct mosquitto *mosq, const char *topic);
+void alias__out_touch(struct mosquitto *mosq, struct mosquitto__alias_out *alias);
+int alias__out_add(struct mosquitto *mosq, const char *topic, uint16_t *alias_id);
+void alias__out_free_all(struct mosquitto *mosq);
+#endif
 
 #endif
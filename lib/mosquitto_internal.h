@@ -140,11 +140,45 @@ enum mosquitto__transport {
 };
 
 
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+enum mosquitto__ws_state {
+	ws_s_http = 0, /* Waiting for the HTTP upgrade request */
+	ws_s_open = 1,
+};
+
+/* State of the built in websockets framing for a single connection. */
+struct mosquitto__ws {
+	char *http_buf; /* The upgrade request, then any data sent with it */
+	uint32_t http_len;
+	uint32_t http_pos;
+	uint64_t payload_remaining;
+	uint8_t hdr[14];
+	uint8_t hdr_len;
+	uint8_t opcode;
+	uint8_t mask[4];
+	uint8_t mask_pos;
+	uint8_t ctrl[125];
+	uint8_t ctrl_len;
+	bool fragmented; /* A fragmented data message is being received */
+	enum mosquitto__ws_state state;
+};
+#endif
+
 struct mosquitto__alias{
 	char *topic;
 	uint16_t alias;
 };
 
+#ifdef WITH_BROKER
+/* Topic alias assigned by the broker for outgoing PUBLISH packets. */
+struct mosquitto__alias_out{
+	UT_hash_handle hh;
+	struct mosquitto__alias_out *prev, *next; /* least recently used first */
+	char *topic;
+	uint16_t alias;
+};
+#endif
+
 struct session_expiry_list {
 	struct mosquitto *context;
 	struct session_expiry_list *prev;
@@ -191,7 +225,8 @@ struct will_delay_list {
 struct mosquitto_msg_data{
 #ifdef WITH_BROKER
 	struct mosquitto_client_msg *inflight;
-	struct mosquitto_client_msg *queued;
+	struct mosquitto_client_msg *queued; /* ring buffer of queue_len entries starting at queue_first */
+	struct mosquitto_client_msg *inflight_by_mid; /* inflight indexed by mid, excluding mid==0 */
 	long inflight_bytes;
 	long inflight_bytes12;
 	int inflight_count;
@@ -200,6 +235,9 @@ struct mosquitto_msg_data{
 	long queued_bytes12;
 	int queued_count;
 	int queued_count12;
+	int queue_first;
+	int queue_len;
+	int queue_size;
 #else
 	struct mosquitto_message_all *inflight;
 	int queue_len;
@@ -270,6 +308,9 @@ struct mosquitto {
 	bool tls_ocsp_required;
 	bool tls_use_os_certs;
 	enum mosquitto__keyform tls_keyform;
+#ifdef WITH_BROKER
+	bool tls_ktls_send; /* kernel is doing record encryption */
+#endif
 #endif
 	bool want_write;
 #if defined(WITH_THREADING) && !defined(WITH_BROKER)
@@ -289,6 +330,11 @@ struct mosquitto {
 	bool in_by_id;
 	bool is_dropping;
 	bool is_bridge;
+	bool conflate_queued; /* from the listener, kept after disconnecting */
+	uint16_t alias_out_max; /* outgoing topic aliases the client accepts */
+	int alias_out_count;
+	struct mosquitto__alias_out *aliases_out; /* by topic */
+	struct mosquitto__alias_out *aliases_out_lru;
 	struct mosquitto__bridge *bridge;
 	struct mosquitto_msg_data msgs_in;
 	struct mosquitto_msg_data msgs_out;
@@ -301,11 +347,31 @@ struct mosquitto {
 #  ifndef WITH_EPOLL
 	int pollfd_index;
 #  endif
+#  ifdef WITH_IO_URING
+	uint64_t uring_id; /* user_data of this client's requests */
+	uint32_t uring_armed; /* events of the armed poll request */
+	bool uring_dirty;
+	bool uring_io; /* packets are sent through the ring */
+	bool uring_recv; /* data is received through the ring */
+	bool uring_recv_armed;
+	const uint8_t *uring_rx; /* received data not yet read by net__read() */
+	size_t uring_rx_len;
+	uint8_t *uring_rx_kept; /* received data packet__read() did not take */
+	size_t uring_rx_kept_len;
+	struct mux_uring_send *uring_send; /* send request in progress */
+#  endif
 #  ifdef WITH_WEBSOCKETS
 	struct lws *wsi;
+#  endif
+#  ifdef WITH_WEBSOCKETS_BUILTIN
+	enum mosquitto__transport transport;
+	struct mosquitto__ws ws;
 #  endif
 	bool ws_want_write;
 	bool assigned_id;
+	int out_packet_hold;
+	bool out_packet_deferred;
+	uint8_t compression;
 #else
 #  ifdef WITH_SOCKS
 	char *socks5_host;
@@ -355,6 +421,9 @@ struct mosquitto {
 	UT_hash_handle hh_id;
 	UT_hash_handle hh_sock;
 	struct mosquitto *for_free_next;
+	uint64_t last_direct_db_id; /* db_id of the last QoS 0 message sent without a client message */
+	struct mosquitto *write_deferred_prev;
+	struct mosquitto *write_deferred_next;
 	struct session_expiry_list *expiry_list_item;
 	uint16_t remote_port;
 #endif
@@ -74,6 +74,7 @@ Contributors:
 #include "memory_mosq.h"
 #include "mqtt_protocol.h"
 #include "net_mosq.h"
+#include "packet_mosq.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
 
@@ -210,6 +211,13 @@ int net__socket_close(struct mosquitto *mosq)
 #endif
 
 	assert(mosq);
+#ifdef WITH_BROKER
+	if(mosq->out_packet_deferred){
+		/* Anything queued just before closing, such as a DISCONNECT */
+		packet__write_undefer(mosq);
+		packet__write(mosq);
+	}
+#endif
 #ifdef WITH_TLS
 #ifdef WITH_WEBSOCKETS
 	if(!mosq->wsi)
@@ -237,6 +245,12 @@ int net__socket_close(struct mosquitto *mosq)
 	{
 		if(mosq->sock != INVALID_SOCKET){
 #ifdef WITH_BROKER
+#  ifdef WITH_IO_URING
+			if(mosq->uring_id){
+				/* A pending io_uring request would keep the socket open */
+				mux__delete(mosq);
+			}
+#  endif
 			HASH_FIND(hh_sock, db.contexts_by_sock, &mosq->sock, sizeof(mosq->sock), mosq_found);
 			if(mosq_found){
 				HASH_DELETE(hh_sock, db.contexts_by_sock, mosq_found);
@@ -974,6 +988,22 @@ ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count)
 #endif
 	assert(mosq);
 	errno = 0;
+#if defined(WITH_BROKER) && defined(WITH_IO_URING)
+	if(mosq->uring_recv){
+		/* The data has already been received by io_uring */
+		if(mosq->uring_rx_len == 0){
+			errno = EAGAIN;
+			return -1;
+		}
+		if(count > mosq->uring_rx_len){
+			count = mosq->uring_rx_len;
+		}
+		memcpy(buf, mosq->uring_rx, count);
+		mosq->uring_rx += count;
+		mosq->uring_rx_len -= count;
+		return (ssize_t)count;
+	}
+#endif
 #ifdef WITH_TLS
 	if(mosq->ssl){
 		ret = SSL_read(mosq->ssl, buf, (int)count);
@@ -1006,7 +1036,11 @@ ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count)
 
 	errno = 0;
 #ifdef WITH_TLS
-	if(mosq->ssl){
+	if(mosq->ssl
+#ifdef WITH_BROKER
+			&& !mosq->tls_ktls_send
+#endif
+			){
 		mosq->want_write = false;
 		ret = SSL_write(mosq->ssl, buf, (int)count);
 		if(ret < 0){
@@ -79,6 +79,12 @@ int net__socketpair(mosq_sock_t *sp1, mosq_sock_t *sp2);
 ssize_t net__read(struct mosquitto *mosq, void *buf, size_t count);
 ssize_t net__write(struct mosquitto *mosq, const void *buf, size_t count);
 
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+ssize_t net__read_ws(struct mosquitto *mosq, void *buf, size_t count);
+void ws__prepare_packet(struct mosquitto *mosq, struct mosquitto__packet *packet);
+int ws__send_control(struct mosquitto *mosq, uint8_t opcode, const uint8_t *data, uint8_t len);
+#endif
+
 #ifdef WITH_TLS
 void net__print_ssl_error(struct mosquitto *mosq);
 int net__socket_apply_tls(struct mosquitto *mosq);
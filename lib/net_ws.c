@@ -0,0 +1,328 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+
+#include <errno.h>
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "net_mosq.h"
+#include "packet_mosq.h"
+#include "sys_tree.h"
+
+/* RFC 6455 framing for the built in websockets support. Incoming frame
+ * payloads are read straight into the buffer supplied by packet__read() and
+ * unmasked in place. Outgoing frame headers are written into the space
+ * reserved in front of each packet by packet__alloc(). */
+
+#define WS_OPCODE_CONTINUATION 0x0
+#define WS_OPCODE_TEXT 0x1
+#define WS_OPCODE_BINARY 0x2
+#define WS_OPCODE_CLOSE 0x8
+#define WS_OPCODE_PING 0x9
+#define WS_OPCODE_PONG 0xA
+
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+
+/* Number of header bytes needed for the frame currently being read, as far
+ * as can be told from the bytes read so far. */
+static uint8_t ws__header_size(const struct mosquitto__ws *ws)
+{
+	uint8_t size = 2;
+
+	if(ws->hdr_len < 2){
+		return size;
+	}
+	if((ws->hdr[1] & 0x7F) == 126){
+		size += 2;
+	}else if((ws->hdr[1] & 0x7F) == 127){
+		size += 8;
+	}
+	if(ws->hdr[1] & 0x80){
+		size += 4;
+	}
+	return size;
+}
+
+
+static int ws__parse_header(struct mosquitto__ws *ws)
+{
+	uint8_t pos = 2;
+	int i;
+
+	if(ws->hdr[0] & 0x70){
+		/* No extensions are negotiated, so the reserved bits must be clear */
+		return MOSQ_ERR_PROTOCOL;
+	}
+	if(!(ws->hdr[1] & 0x80)){
+		/* Frames from clients must be masked */
+		return MOSQ_ERR_PROTOCOL;
+	}
+
+	ws->opcode = ws->hdr[0] & 0x0F;
+	ws->payload_remaining = ws->hdr[1] & 0x7F;
+	if(ws->payload_remaining == 126){
+		ws->payload_remaining = ((uint64_t)ws->hdr[2]<<8) + ws->hdr[3];
+		pos += 2;
+	}else if(ws->payload_remaining == 127){
+		if(ws->hdr[2] & 0x80){
+			return MOSQ_ERR_PROTOCOL;
+		}
+		ws->payload_remaining = 0;
+		for(i=0; i<8; i++){
+			ws->payload_remaining = (ws->payload_remaining<<8) + ws->hdr[2+i];
+		}
+		pos += 8;
+	}
+	memcpy(ws->mask, &ws->hdr[pos], 4);
+	ws->mask_pos = 0;
+	ws->ctrl_len = 0;
+
+	switch(ws->opcode){
+		case WS_OPCODE_CONTINUATION:
+		case WS_OPCODE_BINARY:
+			/* A continuation must follow a non-final data frame, and a new
+			 * message must not start until the current one is finished. */
+			if(ws->fragmented != (ws->opcode == WS_OPCODE_CONTINUATION)){
+				return MOSQ_ERR_PROTOCOL;
+			}
+			ws->fragmented = !(ws->hdr[0] & 0x80);
+			return MOSQ_ERR_SUCCESS;
+
+		case WS_OPCODE_CLOSE:
+		case WS_OPCODE_PING:
+		case WS_OPCODE_PONG:
+			/* Control frames must not be fragmented */
+			if(!(ws->hdr[0] & 0x80) || ws->payload_remaining > sizeof(ws->ctrl)){
+				return MOSQ_ERR_PROTOCOL;
+			}
+			return MOSQ_ERR_SUCCESS;
+
+		default:
+			/* MQTT must be carried in binary frames */
+			return MOSQ_ERR_PROTOCOL;
+	}
+}
+
+
+static void ws__unmask(struct mosquitto__ws *ws, uint8_t *buf, size_t len)
+{
+	uint64_t mask64, word;
+	size_t i = 0;
+	int j;
+
+	if(ws->mask_pos == 0 && len >= 8){
+		for(j=0; j<8; j++){
+			((uint8_t *)&mask64)[j] = ws->mask[j%4];
+		}
+		for(; i+8<=len; i+=8){
+			memcpy(&word, &buf[i], 8);
+			word ^= mask64;
+			memcpy(&buf[i], &word, 8);
+		}
+	}
+	for(; i<len; i++){
+		buf[i] ^= ws->mask[ws->mask_pos];
+		ws->mask_pos = (ws->mask_pos+1)%4;
+	}
+}
+
+
+/* Bytes that arrived with the HTTP upgrade request are used up before the
+ * socket is read again. */
+static ssize_t ws__net_read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	struct mosquitto__ws *ws = &mosq->ws;
+
+	if(ws->http_buf == NULL){
+		return net__read(mosq, buf, count);
+	}
+
+	if(count > ws->http_len - ws->http_pos){
+		count = ws->http_len - ws->http_pos;
+	}
+	memcpy(buf, &ws->http_buf[ws->http_pos], count);
+	ws->http_pos += (uint32_t)count;
+	if(ws->http_pos == ws->http_len){
+		mosquitto__free(ws->http_buf);
+		ws->http_buf = NULL;
+		ws->http_len = 0;
+		ws->http_pos = 0;
+	}
+	return (ssize_t)count;
+}
+
+
+static ssize_t ws__handle_control(struct mosquitto *mosq)
+{
+	struct mosquitto__ws *ws = &mosq->ws;
+
+	switch(ws->opcode){
+		case WS_OPCODE_PING:
+			if(ws__send_control(mosq, WS_OPCODE_PONG, ws->ctrl, ws->ctrl_len)){
+				errno = ENOMEM;
+				return -1;
+			}
+			return 1;
+
+		case WS_OPCODE_CLOSE:
+			/* Echo the status code, then report the end of the stream. The
+			 * close frame is queued like any other packet, and anything still
+			 * queued is written before the socket is closed. */
+			ws__send_control(mosq, WS_OPCODE_CLOSE, ws->ctrl, ws->ctrl_len < 2 ? ws->ctrl_len : 2);
+			return 0;
+
+		default:
+			return 1;
+	}
+}
+
+
+ssize_t net__read_ws(struct mosquitto *mosq, void *buf, size_t count)
+{
+	struct mosquitto__ws *ws = &mosq->ws;
+	ssize_t len;
+	uint8_t need;
+	uint8_t status[2];
+
+	while(1){
+		need = ws__header_size(ws);
+		if(ws->hdr_len < need){
+			do{
+				len = ws__net_read(mosq, &ws->hdr[ws->hdr_len], need - ws->hdr_len);
+				if(len <= 0){
+					return len;
+				}
+				G_BYTES_RECEIVED_INC(len);
+				ws->hdr_len = (uint8_t)(ws->hdr_len + len);
+				need = ws__header_size(ws);
+			}while(ws->hdr_len < need);
+
+			if(ws__parse_header(ws)){
+				status[0] = MOSQ_MSB(WS_CLOSE_PROTOCOL_ERROR);
+				status[1] = MOSQ_LSB(WS_CLOSE_PROTOCOL_ERROR);
+				ws__send_control(mosq, WS_OPCODE_CLOSE, status, 2);
+				errno = EPROTO;
+				return -1;
+			}
+		}
+
+		if(ws->opcode == WS_OPCODE_BINARY || ws->opcode == WS_OPCODE_CONTINUATION){
+			if(ws->payload_remaining == 0){
+				ws->hdr_len = 0;
+				continue;
+			}
+			if(count > ws->payload_remaining){
+				count = (size_t)ws->payload_remaining;
+			}
+			len = ws__net_read(mosq, buf, count);
+			if(len > 0){
+				ws__unmask(ws, buf, (size_t)len);
+				ws->payload_remaining -= (uint64_t)len;
+				if(ws->payload_remaining == 0){
+					ws->hdr_len = 0;
+				}
+			}
+			return len;
+		}
+
+		while(ws->payload_remaining > 0){
+			len = ws__net_read(mosq, &ws->ctrl[ws->ctrl_len], (size_t)ws->payload_remaining);
+			if(len <= 0){
+				return len;
+			}
+			G_BYTES_RECEIVED_INC(len);
+			ws__unmask(ws, &ws->ctrl[ws->ctrl_len], (size_t)len);
+			ws->ctrl_len = (uint8_t)(ws->ctrl_len + len);
+			ws->payload_remaining -= (uint64_t)len;
+		}
+		ws->hdr_len = 0;
+		len = ws__handle_control(mosq);
+		if(len <= 0){
+			return len;
+		}
+	}
+}
+
+
+void ws__prepare_packet(struct mosquitto *mosq, struct mosquitto__packet *packet)
+{
+	uint32_t len = packet->to_process;
+	uint8_t hdr_len;
+	uint8_t *hdr;
+	int i;
+
+	UNUSED(mosq);
+
+	if(len < 126){
+		hdr_len = 2;
+	}else if(len < 65536){
+		hdr_len = 4;
+	}else{
+		hdr_len = 10;
+	}
+	packet->pos -= hdr_len;
+	packet->to_process += hdr_len;
+	hdr = &packet->payload[packet->pos];
+
+	/* Packets with the reserved MQTT command 0 carry a websockets control
+	 * opcode instead. */
+	if((packet->command & 0xF0) == 0){
+		hdr[0] = 0x80 | packet->command;
+	}else{
+		hdr[0] = 0x80 | WS_OPCODE_BINARY;
+	}
+	if(hdr_len == 2){
+		hdr[1] = (uint8_t)len;
+	}else if(hdr_len == 4){
+		hdr[1] = 126;
+		hdr[2] = MOSQ_MSB(len);
+		hdr[3] = MOSQ_LSB(len);
+	}else{
+		hdr[1] = 127;
+		for(i=0; i<8; i++){
+			hdr[9-i] = (uint8_t)(((uint64_t)len >> (8*i)) & 0xFF);
+		}
+	}
+}
+
+
+int ws__send_control(struct mosquitto *mosq, uint8_t opcode, const uint8_t *data, uint8_t len)
+{
+	struct mosquitto__packet *packet;
+
+	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->command = opcode;
+	packet->packet_length = WS_PACKET_OFFSET + len;
+	packet->payload = mosquitto__malloc(packet->packet_length);
+	if(!packet->payload){
+		mosquitto__free(packet);
+		return MOSQ_ERR_NOMEM;
+	}
+	if(len){
+		memcpy(&packet->payload[WS_PACKET_OFFSET], data, len);
+	}
+	return packet__queue(mosq, packet);
+}
+#endif
@@ -21,8 +21,13 @@ Contributors:
 #include <assert.h>
 #include <errno.h>
 #include <string.h>
+#if defined(WITH_BROKER) && !defined(WIN32)
+#  include <sys/socket.h>
+#  include <sys/uio.h>
+#endif
 
 #ifdef WITH_BROKER
+#  include <utlist.h>
 #  include "mosquitto_broker_internal.h"
 #  ifdef WITH_WEBSOCKETS
 #    include <libwebsockets.h>
@@ -69,7 +74,7 @@ int packet__alloc(struct mosquitto__packet *packet)
 		packet->remaining_count++;
 	}while(remaining_length > 0 && packet->remaining_count < 5);
 	if(packet->remaining_count == 5) return MOSQ_ERR_PAYLOAD_SIZE;
-	packet->packet_length = packet->remaining_length + 1 + (uint8_t)packet->remaining_count;
+	packet->packet_length = packet->remaining_length + 1 + (uint8_t)packet->remaining_count + WS_PACKET_OFFSET;
 #ifdef WITH_WEBSOCKETS
 	packet->payload = mosquitto__malloc(sizeof(uint8_t)*packet->packet_length + LWS_PRE);
 #else
@@ -77,11 +82,11 @@ int packet__alloc(struct mosquitto__packet *packet)
 #endif
 	if(!packet->payload) return MOSQ_ERR_NOMEM;
 
-	packet->payload[0] = packet->command;
+	packet->payload[WS_PACKET_OFFSET] = packet->command;
 	for(i=0; i<packet->remaining_count; i++){
-		packet->payload[i+1] = remaining_bytes[i];
+		packet->payload[WS_PACKET_OFFSET+i+1] = remaining_bytes[i];
 	}
-	packet->pos = 1U + (uint8_t)packet->remaining_count;
+	packet->pos = WS_PACKET_OFFSET + 1U + (uint8_t)packet->remaining_count;
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -139,6 +144,39 @@ void packet__cleanup_all(struct mosquitto *mosq)
 }
 
 
+#ifdef WITH_BROKER
+/* With write_coalescing, packets for a client are not written as they are
+ * queued. The client is added to a list that is written out once per loop
+ * iteration, so everything generated for it during that iteration is sent
+ * with as few system calls and TCP segments as possible. */
+static void packet__write_defer(struct mosquitto *mosq)
+{
+	if(mosq->out_packet_deferred == false){
+		mosq->out_packet_deferred = true;
+		DL_APPEND2(db.ll_write_deferred, mosq, write_deferred_prev, write_deferred_next);
+	}
+}
+
+
+/* Will packet__queue() drop the next packet for this client? */
+bool packet__queue_full(struct mosquitto *mosq)
+{
+	return db.config->max_queued_messages > 0 && mosq->out_packet_count >= db.config->max_queued_messages;
+}
+
+
+void packet__write_undefer(struct mosquitto *mosq)
+{
+	if(mosq->out_packet_deferred){
+		DL_DELETE2(db.ll_write_deferred, mosq, write_deferred_prev, write_deferred_next);
+		mosq->write_deferred_prev = NULL;
+		mosq->write_deferred_next = NULL;
+		mosq->out_packet_deferred = false;
+	}
+}
+#endif
+
+
 int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 {
 #ifndef WITH_BROKER
@@ -147,14 +185,19 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 	assert(mosq);
 	assert(packet);
 
-	packet->pos = 0;
-	packet->to_process = packet->packet_length;
+	packet->pos = WS_PACKET_OFFSET;
+	packet->to_process = packet->packet_length - WS_PACKET_OFFSET;
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+	if(mosq->transport == mosq_t_ws && mosq->ws.state == ws_s_open){
+		ws__prepare_packet(mosq, packet);
+	}
+#endif
 
 	packet->next = NULL;
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 
 #ifdef WITH_BROKER
-	if(db.config->max_queued_messages > 0 && mosq->out_packet_count >= db.config->max_queued_messages){
+	if(packet__queue_full(mosq)){
 		mosquitto__free(packet);
 		if(mosq->is_dropping == false){
 			mosq->is_dropping = true;
@@ -180,12 +223,18 @@ int packet__queue(struct mosquitto *mosq, struct mosquitto__packet *packet)
 	if(mosq->wsi){
 		lws_callback_on_writable(mosq->wsi);
 		return MOSQ_ERR_SUCCESS;
-	}else{
-		return packet__write(mosq);
 	}
-#  else
-	return packet__write(mosq);
 #  endif
+	if(mosq->out_packet_hold && mosq->out_packet_count < PACKET_WRITE_BATCH){
+		/* Written by packet__write_release() */
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(db.config->write_coalescing && mosq->out_packet_count < PACKET_WRITE_BATCH){
+		/* Written at the end of the current loop iteration */
+		packet__write_defer(mosq);
+		return MOSQ_ERR_SUCCESS;
+	}
+	return packet__write(mosq);
 #else
 
 	/* Write a single byte to sockpairW (connected to sockpairR) to break out
@@ -223,6 +272,96 @@ int packet__check_oversize(struct mosquitto *mosq, uint32_t remaining_length)
 }
 
 
+#ifdef WITH_BROKER
+/* Stop packet__queue() from writing each packet as it is queued, so that
+ * packets generated together can be sent with as few system calls and TCP
+ * segments as possible. Calls may be nested. */
+void packet__write_hold(struct mosquitto *mosq)
+{
+	mosq->out_packet_hold++;
+}
+
+
+int packet__write_release(struct mosquitto *mosq)
+{
+	if(mosq->out_packet_hold > 0){
+		mosq->out_packet_hold--;
+	}
+	if(mosq->out_packet_hold > 0 || mosq->sock == INVALID_SOCKET){
+		return MOSQ_ERR_SUCCESS;
+	}
+#  ifdef WITH_WEBSOCKETS
+	if(mosq->wsi){
+		return MOSQ_ERR_SUCCESS;
+	}
+#  endif
+	if(mosq->out_packet || mosq->current_out_packet){
+		return packet__write(mosq);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+#  ifndef WIN32
+/* Gathered writes are used where several packets are expected to be queued
+ * together: on bridges, and for every client when write_coalescing is set.
+ * Other clients keep writing one packet at a time. */
+static bool packet__write_can_gather(struct mosquitto *mosq)
+{
+	if(mosq->out_packet == NULL) return false;
+#    ifdef WITH_TLS
+	if(mosq->ssl && mosq->tls_ktls_send == false) return false;
+#    endif
+	return mosq->bridge != NULL || db.config->write_coalescing;
+}
+
+
+/* Write the current packet and as many of the following queued packets as
+ * possible with a single system call. */
+static ssize_t packet__write_gather(struct mosquitto *mosq)
+{
+	struct iovec iov[PACKET_WRITE_BATCH];
+	struct msghdr msg;
+	struct mosquitto__packet *packet;
+	int count;
+
+	packet = mosq->current_out_packet;
+	iov[0].iov_base = &(packet->payload[packet->pos]);
+	iov[0].iov_len = packet->to_process;
+	count = 1;
+	for(packet = mosq->out_packet; packet && count < PACKET_WRITE_BATCH; packet = packet->next){
+		iov[count].iov_base = &(packet->payload[packet->pos]);
+		iov[count].iov_len = packet->to_process;
+		count++;
+	}
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = iov;
+	msg.msg_iovlen = (size_t)count;
+
+	errno = 0;
+	return sendmsg(mosq->sock, &msg, MSG_NOSIGNAL);
+}
+
+
+/* Account for bytes from a gathered write that went beyond the current
+ * packet. */
+static void packet__write_gather_advance(struct mosquitto *mosq, uint32_t length)
+{
+	struct mosquitto__packet *packet;
+	uint32_t n;
+
+	for(packet = mosq->out_packet; packet && length > 0; packet = packet->next){
+		n = length < packet->to_process ? length : packet->to_process;
+		packet->pos += n;
+		packet->to_process -= n;
+		length -= n;
+	}
+}
+#  endif
+#endif
+
+
 int packet__write(struct mosquitto *mosq)
 {
 	ssize_t write_length;
@@ -232,6 +371,12 @@ int packet__write(struct mosquitto *mosq)
 	if(!mosq) return MOSQ_ERR_INVAL;
 	if(mosq->sock == INVALID_SOCKET) return MOSQ_ERR_NO_CONN;
 
+#if defined(WITH_BROKER) && defined(WITH_IO_URING)
+	if(mosq->uring_io){
+		return mux__write(mosq);
+	}
+#endif
+
 	pthread_mutex_lock(&mosq->current_out_packet_mutex);
 	pthread_mutex_lock(&mosq->out_packet_mutex);
 	if(mosq->out_packet && !mosq->current_out_packet){
@@ -260,7 +405,20 @@ int packet__write(struct mosquitto *mosq)
 		packet = mosq->current_out_packet;
 
 		while(packet->to_process > 0){
+#if defined(WITH_BROKER) && !defined(WIN32)
+			if(packet__write_can_gather(mosq)){
+				write_length = packet__write_gather(mosq);
+			}else{
+				write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+			}
+			if(write_length > (ssize_t)packet->to_process){
+				G_BYTES_SENT_INC(write_length - (ssize_t)packet->to_process);
+				packet__write_gather_advance(mosq, (uint32_t)write_length - packet->to_process);
+				write_length = (ssize_t)packet->to_process;
+			}
+#else
 			write_length = net__write(mosq, &(packet->payload[packet->pos]), packet->to_process);
+#endif
 			if(write_length > 0){
 				G_BYTES_SENT_INC(write_length);
 				packet->to_process -= (uint32_t)write_length;
@@ -353,11 +511,28 @@ int packet__write(struct mosquitto *mosq)
 }
 
 
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+static ssize_t packet__net_read(struct mosquitto *mosq, void *buf, size_t count)
+{
+	if(mosq->transport == mosq_t_ws){
+		return net__read_ws(mosq, buf, count);
+	}else{
+		return net__read(mosq, buf, count);
+	}
+}
+#else
+#  define packet__net_read(A, B, C) net__read((A), (B), (C))
+#endif
+
+
 int packet__read(struct mosquitto *mosq)
 {
 	uint8_t byte;
 	ssize_t read_length;
 	int rc = 0;
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE)
+	int rc2;
+#endif
 	enum mosquitto_client_state state;
 
 	if(!mosq){
@@ -371,6 +546,14 @@ int packet__read(struct mosquitto *mosq)
 	if(state == mosq_cs_connect_pending){
 		return MOSQ_ERR_SUCCESS;
 	}
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+	if(mosq->transport == mosq_t_ws && mosq->ws.state == ws_s_http){
+		rc = http__read(mosq);
+		if(rc || mosq->ws.state == ws_s_http){
+			return rc;
+		}
+	}
+#endif
 
 	/* This gets called if pselect() indicates that there is network data
 	 * available - ie. at least one byte.  What we do depends on what data we
@@ -387,7 +570,7 @@ int packet__read(struct mosquitto *mosq)
 	 * Finally, free the memory and reset everything to starting conditions.
 	 */
 	if(!mosq->in_packet.command){
-		read_length = net__read(mosq, &byte, 1);
+		read_length = packet__net_read(mosq, &byte, 1);
 		if(read_length == 1){
 			mosq->in_packet.command = byte;
 #ifdef WITH_BROKER
@@ -429,7 +612,7 @@ int packet__read(struct mosquitto *mosq)
 	 */
 	if(mosq->in_packet.remaining_count <= 0){
 		do{
-			read_length = net__read(mosq, &byte, 1);
+			read_length = packet__net_read(mosq, &byte, 1);
 			if(read_length == 1){
 				mosq->in_packet.remaining_count--;
 				/* Max 4 bytes length for remaining length as defined by protocol.
@@ -517,7 +700,7 @@ int packet__read(struct mosquitto *mosq)
 		}
 	}
 	while(mosq->in_packet.to_process>0){
-		read_length = net__read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
+		read_length = packet__net_read(mosq, &(mosq->in_packet.payload[mosq->in_packet.pos]), mosq->in_packet.to_process);
 		if(read_length > 0){
 			G_BYTES_RECEIVED_INC(read_length);
 			mosq->in_packet.to_process -= (uint32_t)read_length;
@@ -563,7 +746,21 @@ int packet__read(struct mosquitto *mosq)
 		G_PUB_MSGS_RECEIVED_INC(1);
 	}
 #endif
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE)
+	if(mosq->bridge){
+		/* Acknowledgements and any messages released by them are sent together */
+		packet__write_hold(mosq);
+		rc = handle__packet(mosq);
+		rc2 = packet__write_release(mosq);
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = rc2;
+		}
+	}else{
+		rc = handle__packet(mosq);
+	}
+#else
 	rc = handle__packet(mosq);
+#endif
 
 	/* Free data and reset values */
 	packet__cleanup(&mosq->in_packet);
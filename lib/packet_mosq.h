@@ -21,6 +21,15 @@ Contributors:
 #include "mosquitto_internal.h"
 #include "mosquitto.h"
 
+#if defined(WITH_BROKER) && defined(WITH_WEBSOCKETS_BUILTIN)
+/* Space reserved at the start of each outgoing packet for the largest
+ * unmasked websockets frame header, so frames can be written without
+ * copying the packet. */
+#  define WS_PACKET_OFFSET 10
+#else
+#  define WS_PACKET_OFFSET 0
+#endif
+
 int packet__alloc(struct mosquitto__packet *packet);
 void packet__cleanup(struct mosquitto__packet *packet);
 void packet__cleanup_all(struct mosquitto *mosq);
@@ -49,4 +58,15 @@ unsigned int packet__varint_bytes(uint32_t word);
 int packet__write(struct mosquitto *mosq);
 int packet__read(struct mosquitto *mosq);
 
+#ifdef WITH_BROKER
+/* Maximum number of packets held back by packet__write_hold(), and the
+ * maximum number written with a single system call. */
+#define PACKET_WRITE_BATCH 64
+
+bool packet__queue_full(struct mosquitto *mosq);
+void packet__write_hold(struct mosquitto *mosq);
+int packet__write_release(struct mosquitto *mosq);
+void packet__write_undefer(struct mosquitto *mosq);
+#endif
+
 #endif
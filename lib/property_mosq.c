@@ -33,7 +33,41 @@ Contributors:
 #include "property_mosq.h"
 
 
-static int property__read(struct mosquitto__packet *packet, uint32_t *len, mosquitto_property *property)
+/* Read a string or binary value. Without a data area, only the space it needs
+ * is counted. */
+static int property__read_value(struct mosquitto__packet *packet, struct mqtt__string *value, bool utf8, char **data, size_t *datalen)
+{
+	const uint8_t *src;
+	uint16_t slen;
+	int rc;
+
+	rc = packet__read_uint16(packet, &slen);
+	if(rc) return rc;
+	if(packet->pos+slen > packet->remaining_length) return MOSQ_ERR_MALFORMED_PACKET;
+
+	src = &(packet->payload[packet->pos]);
+	packet->pos += slen;
+
+	value->len = slen;
+	if(data == NULL){
+		*datalen += (size_t)slen+1;
+	}else if(slen == 0){
+		value->v = NULL;
+	}else{
+		if(utf8 && mosquitto_validate_utf8((const char *)src, slen)){
+			return MOSQ_ERR_MALFORMED_UTF8;
+		}
+		memcpy(*data, src, slen);
+		(*data)[slen] = '\0';
+		value->v = *data;
+		(*data) += slen+1;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int property__read(struct mosquitto__packet *packet, uint32_t *len, mosquitto_property *property, char **data, size_t *datalen)
 {
 	int rc;
 	uint32_t property_identifier;
@@ -42,8 +76,6 @@ static int property__read(struct mosquitto__packet *packet, uint32_t *len, mosqu
 	uint16_t uint16;
 	uint32_t uint32;
 	uint32_t varint;
-	char *str1, *str2;
-	uint16_t slen1, slen2;
 
 	if(!property) return MOSQ_ERR_INVAL;
 
@@ -106,38 +138,26 @@ static int property__read(struct mosquitto__packet *packet, uint32_t *len, mosqu
 		case MQTT_PROP_RESPONSE_INFORMATION:
 		case MQTT_PROP_SERVER_REFERENCE:
 		case MQTT_PROP_REASON_STRING:
-			rc = packet__read_string(packet, &str1, &slen1);
+			rc = property__read_value(packet, &property->value.s, true, data, datalen);
 			if(rc) return rc;
-			*len = (*len) - 2 - slen1; /* uint16, string len */
-			property->value.s.v = str1;
-			property->value.s.len = slen1;
+			*len = (*len) - 2 - property->value.s.len; /* uint16, string len */
 			break;
 
 		case MQTT_PROP_AUTHENTICATION_DATA:
 		case MQTT_PROP_CORRELATION_DATA:
-			rc = packet__read_binary(packet, (uint8_t **)&str1, &slen1);
+			rc = property__read_value(packet, &property->value.bin, false, data, datalen);
 			if(rc) return rc;
-			*len = (*len) - 2 - slen1; /* uint16, binary len */
-			property->value.bin.v = str1;
-			property->value.bin.len = slen1;
+			*len = (*len) - 2 - property->value.bin.len; /* uint16, binary len */
 			break;
 
 		case MQTT_PROP_USER_PROPERTY:
-			rc = packet__read_string(packet, &str1, &slen1);
+			rc = property__read_value(packet, &property->name, true, data, datalen);
 			if(rc) return rc;
-			*len = (*len) - 2 - slen1; /* uint16, string len */
-
-			rc = packet__read_string(packet, &str2, &slen2);
-			if(rc){
-				mosquitto__free(str1);
-				return rc;
-			}
-			*len = (*len) - 2 - slen2; /* uint16, string len */
+			*len = (*len) - 2 - property->name.len; /* uint16, string len */
 
-			property->name.v = str1;
-			property->name.len = slen1;
-			property->value.s.v = str2;
-			property->value.s.len = slen2;
+			rc = property__read_value(packet, &property->value.s, true, data, datalen);
+			if(rc) return rc;
+			*len = (*len) - 2 - property->value.s.len; /* uint16, string len */
 			break;
 
 		default:
@@ -151,40 +171,74 @@ static int property__read(struct mosquitto__packet *packet, uint32_t *len, mosqu
 }
 
 
+static struct property__arena *property__arena_new(int count, size_t datalen, char **data)
+{
+	struct property__arena *arena;
+	int i;
+
+	arena = mosquitto__calloc(1, sizeof(struct property__arena) + (size_t)count*sizeof(mosquitto_property) + datalen);
+	if(!arena) return NULL;
+
+	arena->refs = count;
+	for(i=0; i<count; i++){
+		arena->props[i].arena = arena;
+		if(i+1 < count){
+			arena->props[i].next = &arena->props[i+1];
+		}
+	}
+	*data = (char *)&arena->props[count];
+
+	return arena;
+}
+
+
 int property__read_all(int command, struct mosquitto__packet *packet, mosquitto_property **properties)
 {
 	int rc;
-	uint32_t proplen;
-	mosquitto_property *p, *tail = NULL;
+	uint32_t proplen, len;
+	uint32_t start_pos;
+	mosquitto_property scratch;
+	mosquitto_property *next;
+	struct property__arena *arena;
+	char *data;
+	size_t datalen = 0;
+	int count = 0;
+	int i;
 
 	rc = packet__read_varint(packet, &proplen, NULL);
 	if(rc) return rc;
 
 	*properties = NULL;
 
-	/* The order of properties must be preserved for some types, so keep the
-	 * same order for all */
-	while(proplen > 0){
-		p = mosquitto__calloc(1, sizeof(mosquitto_property));
-		if(!p){
-			mosquitto_property_free_all(properties);
-			return MOSQ_ERR_NOMEM;
-		}
-
-		rc = property__read(packet, &proplen, p);
-		if(rc){
-			mosquitto__free(p);
-			mosquitto_property_free_all(properties);
-			return rc;
-		}
+	/* Count the properties and the space their values need first, so the
+	 * whole list can be read into a single allocation. */
+	start_pos = packet->pos;
+	len = proplen;
+	while(len > 0){
+		rc = property__read(packet, &len, &scratch, NULL, &datalen);
+		if(rc) return rc;
+		count++;
+	}
 
-		if(!(*properties)){
-			*properties = p;
-		}else{
-			tail->next = p;
+	if(count > 0){
+		packet->pos = start_pos;
+		arena = property__arena_new(count, datalen, &data);
+		if(!arena) return MOSQ_ERR_NOMEM;
+
+		/* The order of properties must be preserved for some types, so keep the
+		 * same order for all */
+		len = proplen;
+		for(i=0; i<count; i++){
+			next = arena->props[i].next;
+			rc = property__read(packet, &len, &arena->props[i], &data, NULL);
+			if(rc){
+				mosquitto__free(arena);
+				return rc;
+			}
+			arena->props[i].next = next;
+			arena->props[i].arena = arena;
 		}
-		tail = p;
-
+		*properties = &arena->props[0];
 	}
 
 	rc = mosquitto_property_check_all(command, *properties);
@@ -198,8 +252,21 @@ int property__read_all(int command, struct mosquitto__packet *packet, mosquitto_
 
 void property__free(mosquitto_property **property)
 {
+	struct property__arena *arena;
+
 	if(!property || !(*property)) return;
 
+	arena = (*property)->arena;
+	if(arena){
+		/* Values are part of the same block */
+		arena->refs--;
+		if(arena->refs == 0){
+			mosquitto__free(arena);
+		}
+		*property = NULL;
+		return;
+	}
+
 	switch((*property)->identifier){
 		case MQTT_PROP_CONTENT_TYPE:
 		case MQTT_PROP_RESPONSE_TOPIC:
@@ -1190,28 +1257,79 @@ const mosquitto_property *mosquitto_property_read_string_pair(const mosquitto_pr
 }
 
 
+static void property__copy_value(struct mqtt__string *dest, const struct mqtt__string *src, char **data)
+{
+	dest->len = src->len;
+	dest->v = *data;
+	if(src->v){
+		memcpy(*data, src->v, src->len);
+	}
+	(*data) += src->len+1;
+}
+
+
 int mosquitto_property_copy_all(mosquitto_property **dest, const mosquitto_property *src)
 {
-	mosquitto_property *pnew, *plast = NULL;
+	const mosquitto_property *p;
+	mosquitto_property *pnew;
+	struct property__arena *arena;
+	char *data;
+	size_t datalen = 0;
+	int count = 0;
 
 	if(!src) return MOSQ_ERR_SUCCESS;
 	if(!dest) return MOSQ_ERR_INVAL;
 
 	*dest = NULL;
 
-	while(src){
-		pnew = calloc(1, sizeof(mosquitto_property));
-		if(!pnew){
-			mosquitto_property_free_all(dest);
-			return MOSQ_ERR_NOMEM;
-		}
-		if(plast){
-			plast->next = pnew;
-		}else{
-			*dest = pnew;
+	/* Size everything first so the copy is a single allocation */
+	for(p=src; p; p=p->next){
+		switch(p->identifier){
+			case MQTT_PROP_PAYLOAD_FORMAT_INDICATOR:
+			case MQTT_PROP_REQUEST_PROBLEM_INFORMATION:
+			case MQTT_PROP_REQUEST_RESPONSE_INFORMATION:
+			case MQTT_PROP_MAXIMUM_QOS:
+			case MQTT_PROP_RETAIN_AVAILABLE:
+			case MQTT_PROP_WILDCARD_SUB_AVAILABLE:
+			case MQTT_PROP_SUBSCRIPTION_ID_AVAILABLE:
+			case MQTT_PROP_SHARED_SUB_AVAILABLE:
+			case MQTT_PROP_SERVER_KEEP_ALIVE:
+			case MQTT_PROP_RECEIVE_MAXIMUM:
+			case MQTT_PROP_TOPIC_ALIAS_MAXIMUM:
+			case MQTT_PROP_TOPIC_ALIAS:
+			case MQTT_PROP_MESSAGE_EXPIRY_INTERVAL:
+			case MQTT_PROP_SESSION_EXPIRY_INTERVAL:
+			case MQTT_PROP_WILL_DELAY_INTERVAL:
+			case MQTT_PROP_MAXIMUM_PACKET_SIZE:
+			case MQTT_PROP_SUBSCRIPTION_IDENTIFIER:
+				break;
+
+			case MQTT_PROP_CONTENT_TYPE:
+			case MQTT_PROP_RESPONSE_TOPIC:
+			case MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER:
+			case MQTT_PROP_AUTHENTICATION_METHOD:
+			case MQTT_PROP_RESPONSE_INFORMATION:
+			case MQTT_PROP_SERVER_REFERENCE:
+			case MQTT_PROP_REASON_STRING:
+			case MQTT_PROP_AUTHENTICATION_DATA:
+			case MQTT_PROP_CORRELATION_DATA:
+				datalen += (size_t)p->value.s.len+1;
+				break;
+
+			case MQTT_PROP_USER_PROPERTY:
+				datalen += (size_t)p->name.len+1 + (size_t)p->value.s.len+1;
+				break;
+
+			default:
+				return MOSQ_ERR_INVAL;
 		}
-		plast = pnew;
+		count++;
+	}
+
+	arena = property__arena_new(count, datalen, &data);
+	if(!arena) return MOSQ_ERR_NOMEM;
 
+	for(pnew=&arena->props[0]; src; src=src->next, pnew=pnew->next){
 		pnew->client_generated = src->client_generated;
 		pnew->identifier = src->identifier;
 		switch(pnew->identifier){
@@ -1251,48 +1369,21 @@ int mosquitto_property_copy_all(mosquitto_property **dest, const mosquitto_prope
 			case MQTT_PROP_RESPONSE_INFORMATION:
 			case MQTT_PROP_SERVER_REFERENCE:
 			case MQTT_PROP_REASON_STRING:
-				pnew->value.s.len = src->value.s.len;
-				pnew->value.s.v = src->value.s.v ? strdup(src->value.s.v) : (char*)calloc(1,1);
-				if(!pnew->value.s.v){
-					mosquitto_property_free_all(dest);
-					return MOSQ_ERR_NOMEM;
-				}
+				property__copy_value(&pnew->value.s, &src->value.s, &data);
 				break;
 
 			case MQTT_PROP_AUTHENTICATION_DATA:
 			case MQTT_PROP_CORRELATION_DATA:
-				pnew->value.bin.len = src->value.bin.len;
-				pnew->value.bin.v = malloc(pnew->value.bin.len);
-				if(!pnew->value.bin.v){
-					mosquitto_property_free_all(dest);
-					return MOSQ_ERR_NOMEM;
-				}
-				memcpy(pnew->value.bin.v, src->value.bin.v, pnew->value.bin.len);
+				property__copy_value(&pnew->value.bin, &src->value.bin, &data);
 				break;
 
 			case MQTT_PROP_USER_PROPERTY:
-				pnew->value.s.len = src->value.s.len;
-				pnew->value.s.v = src->value.s.v ? strdup(src->value.s.v) : (char*)calloc(1,1);
-				if(!pnew->value.s.v){
-					mosquitto_property_free_all(dest);
-					return MOSQ_ERR_NOMEM;
-				}
-
-				pnew->name.len = src->name.len;
-				pnew->name.v = src->name.v ? strdup(src->name.v) : (char*)calloc(1,1);
-				if(!pnew->name.v){
-					mosquitto_property_free_all(dest);
-					return MOSQ_ERR_NOMEM;
-				}
+				property__copy_value(&pnew->value.s, &src->value.s, &data);
+				property__copy_value(&pnew->name, &src->name, &data);
 				break;
-
-			default:
-				mosquitto_property_free_all(dest);
-				return MOSQ_ERR_INVAL;
 		}
-
-		src = src->next;
 	}
+	*dest = &arena->props[0];
 
 	return MOSQ_ERR_SUCCESS;
 }
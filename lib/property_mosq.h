@@ -39,6 +39,16 @@ struct mqtt5__property {
 	struct mqtt__string name;
 	int32_t identifier;
 	bool client_generated;
+	struct property__arena *arena; /* set if part of a property__arena block */
+};
+
+/* A complete property list held in a single allocation, with the string and
+ * binary values stored after the properties. The block is freed once every
+ * property in it has been freed, so properties can be moved to other lists
+ * and outlive the rest of the list. */
+struct property__arena {
+	int refs;
+	struct mqtt5__property props[];
 };
 
 
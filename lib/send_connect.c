@@ -77,6 +77,15 @@ int send__connect(struct mosquitto *mosq, uint16_t keepalive, bool clean_session
 			mosq->msgs_in.inflight_maximum = receive_maximum;
 			mosq->msgs_in.inflight_quota = receive_maximum;
 		}
+#if defined(WITH_BROKER) && defined(WITH_BRIDGE) && defined(WITH_ZLIB)
+		if(mosq->bridge){
+			rc = compress__add_property(&local_props, mosq->bridge->compression);
+			if(rc){
+				mosquitto_property_free_all(&local_props);
+				return rc;
+			}
+		}
+#endif
 
 		version = MQTT_PROTOCOL_V5;
 		headerlen = 10;
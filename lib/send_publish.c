@@ -30,6 +30,7 @@ Contributors:
 
 #include "mosquitto.h"
 #include "mosquitto_internal.h"
+#include "alias_mosq.h"
 #include "logging_mosq.h"
 #include "mqtt_protocol.h"
 #include "memory_mosq.h"
@@ -44,12 +45,12 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 #ifdef WITH_BROKER
 	size_t len;
 #ifdef WITH_BRIDGE
-	int i;
-	struct mosquitto__bridge_topic *cur_topic;
-	bool match;
 	int rc;
-	char *mapped_topic = NULL;
-	char *topic_temp = NULL;
+#  ifdef WITH_ZLIB
+	const void *compressed;
+	uint32_t compressed_len;
+	mosquitto_property compress_prop;
+#  endif
 #endif
 #endif
 	assert(mosq);
@@ -75,53 +76,34 @@ int send__publish(struct mosquitto *mosq, uint16_t mid, const char *topic, uint3
 		}
 	}
 #ifdef WITH_BRIDGE
-	if(mosq->bridge && mosq->bridge->topics && mosq->bridge->topic_remapping){
-		for(i=0; i<mosq->bridge->topic_count; i++){
-			cur_topic = &mosq->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_out)
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->local_topic, topic, &match);
-				if(rc){
-					return rc;
-				}
-				if(match){
-					mapped_topic = mosquitto__strdup(topic);
-					if(!mapped_topic) return MOSQ_ERR_NOMEM;
-					if(cur_topic->local_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->local_prefix, mapped_topic, strlen(cur_topic->local_prefix))){
-							topic_temp = mosquitto__strdup(mapped_topic+strlen(cur_topic->local_prefix));
-							mosquitto__free(mapped_topic);
-							if(!topic_temp){
-								return MOSQ_ERR_NOMEM;
-							}
-							mapped_topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->remote_prefix){
-						/* This prefix needs adding. */
-						len = strlen(mapped_topic) + strlen(cur_topic->remote_prefix)+1;
-						topic_temp = mosquitto__malloc(len+1);
-						if(!topic_temp){
-							mosquitto__free(mapped_topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->remote_prefix, mapped_topic);
-						topic_temp[len] = '\0';
-						mosquitto__free(mapped_topic);
-						mapped_topic = topic_temp;
-					}
-					log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", SAFE_PRINT(mosq->id), dup, qos, retain, mid, mapped_topic, (long)payloadlen);
-					G_PUB_BYTES_SENT_INC(payloadlen);
-					rc =  send__real_publish(mosq, mid, mapped_topic, payloadlen, payload, qos, retain, dup, cmsg_props, store_props, expiry_interval);
-					mosquitto__free(mapped_topic);
-					return rc;
-				}
+	if(mosq->bridge){
+		rc = bridge__remap_topic_out(mosq, topic, &topic);
+		if(rc) return rc;
+		mosq->bridge->stats.pub_msgs_sent++;
+		mosq->bridge->stats.pub_bytes_sent += payloadlen;
+#  ifdef WITH_ZLIB
+		if(mosq->compression == mosq_cmp_deflate && payloadlen >= mosq->bridge->compression_threshold){
+			rc = compress__deflate(mosq->bridge, payload, payloadlen, &compressed, &compressed_len);
+			if(rc) return rc;
+
+			mosq->bridge->stats.compress_bytes_in += payloadlen;
+			if(compressed){
+				/* Marks the payload as compressed, the remote broker removes it */
+				memset(&compress_prop, 0, sizeof(mosquitto_property));
+				compress_prop.next = (mosquitto_property *)store_props;
+				compress_prop.identifier = MQTT_PROP_USER_PROPERTY;
+				compress_prop.name.v = (char *)MOSQ_COMPRESSION_PROPERTY;
+				compress_prop.name.len = (uint16_t)strlen(MOSQ_COMPRESSION_PROPERTY);
+				compress_prop.value.s.v = (char *)"deflate";
+				compress_prop.value.s.len = (uint16_t)strlen("deflate");
+				store_props = &compress_prop;
+
+				payload = compressed;
+				payloadlen = compressed_len;
 			}
+			mosq->bridge->stats.compress_bytes_out += payloadlen;
 		}
+#  endif
 	}
 #endif
 	log__printf(NULL, MOSQ_LOG_DEBUG, "Sending PUBLISH to %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", SAFE_PRINT(mosq->id), dup, qos, retain, mid, topic, (long)payloadlen);
@@ -141,9 +123,29 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 	unsigned int proplen = 0, varbytes;
 	int rc;
 	mosquitto_property expiry_prop;
+#ifdef WITH_BROKER
+	mosquitto_property alias_prop;
+	struct mosquitto__alias_out *alias = NULL;
+	bool use_alias = false;
+#endif
 
 	assert(mosq);
 
+#ifdef WITH_BROKER
+	/* A packet that packet__queue() is going to drop must not change the
+	 * aliases, or the client would be sent aliases it has never seen. */
+	if(topic && mosq->alias_out_max > 0 && mosq->protocol == mosq_p_mqtt5
+			&& packet__queue_full(mosq) == false){
+
+		use_alias = true;
+		alias = alias__out_find(mosq, topic);
+		if(alias){
+			/* The client already knows this topic, send only the alias */
+			topic = NULL;
+		}
+	}
+#endif
+
 	if(topic){
 		packetlen = 2+(unsigned int)strlen(topic) + payloadlen;
 	}else{
@@ -162,6 +164,13 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 
 			proplen += property__get_length_all(&expiry_prop);
 		}
+#ifdef WITH_BROKER
+		if(use_alias){
+			memset(&alias_prop, 0, sizeof(mosquitto_property));
+			alias_prop.identifier = MQTT_PROP_TOPIC_ALIAS;
+			proplen += property__get_length_all(&alias_prop);
+		}
+#endif
 
 		varbytes = packet__varint_bytes(proplen);
 		if(varbytes > 4){
@@ -193,6 +202,23 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		mosquitto__free(packet);
 		return rc;
 	}
+#ifdef WITH_BROKER
+	/* Only update the aliases once the packet can no longer fail before
+	 * being queued. */
+	if(use_alias){
+		if(alias){
+			alias__out_touch(mosq, alias);
+			alias_prop.value.i16 = alias->alias;
+		}else{
+			rc = alias__out_add(mosq, topic, &alias_prop.value.i16);
+			if(rc){
+				packet__cleanup(packet);
+				mosquitto__free(packet);
+				return rc;
+			}
+		}
+	}
+#endif
 	/* Variable header (topic string) */
 	if(topic){
 		packet__write_string(packet, topic, (uint16_t)strlen(topic));
@@ -210,6 +236,11 @@ int send__real_publish(struct mosquitto *mosq, uint16_t mid, const char *topic,
 		if(expiry_interval > 0){
 			property__write_all(packet, &expiry_prop, false);
 		}
+#ifdef WITH_BROKER
+		if(use_alias){
+			property__write_all(packet, &alias_prop, false);
+		}
+#endif
 	}
 
 	/* Payload */
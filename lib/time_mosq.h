@@ -20,5 +20,6 @@ Contributors:
 #define TIME_MOSQ_H
 
 time_t mosquitto_time(void);
+uint64_t mosquitto_time_ms(void);
 
 #endif
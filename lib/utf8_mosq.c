@@ -19,8 +19,46 @@ Contributors:
 #include "config.h"
 
 #include <stdio.h>
+#ifdef HAVE_SSE2
+#  include <emmintrin.h>
+#endif
 #include "mosquitto.h"
 
+/* Returns the number of bytes at the start of str, in blocks of 16, that are
+ * printable ASCII and so need no further checks. */
+static int utf8__ascii_prefix(const unsigned char *str, int len)
+{
+#ifdef HAVE_SSE2
+	const __m128i lo = _mm_set1_epi8(0x1F);
+	const __m128i hi = _mm_set1_epi8(0x7F);
+	__m128i v;
+	int i;
+
+	/* Bytes >= 0x80 are negative as signed values, so fail the first test */
+	for(i=0; i+16<=len; i+=16){
+		v = _mm_loadu_si128((const __m128i *)&str[i]);
+		v = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		if(_mm_movemask_epi8(v) != 0xFFFF){
+			return i;
+		}
+	}
+	if(i < len && len >= 16){
+		/* Check the remainder as the last 16 bytes, overlapping those
+		 * already checked. */
+		v = _mm_loadu_si128((const __m128i *)&str[len-16]);
+		v = _mm_and_si128(_mm_cmpgt_epi8(v, lo), _mm_cmplt_epi8(v, hi));
+		if(_mm_movemask_epi8(v) == 0xFFFF){
+			return len;
+		}
+	}
+	return i;
+#else
+	UNUSED(str);
+	UNUSED(len);
+	return 0;
+#endif
+}
+
 int mosquitto_validate_utf8(const char *str, int len)
 {
 	int i;
@@ -33,6 +71,14 @@ int mosquitto_validate_utf8(const char *str, int len)
 	if(len < 0 || len > 65536) return MOSQ_ERR_INVAL;
 
 	for(i=0; i<len; i++){
+		/* Only try the block check at the start and after an ASCII
+		 * character, so text that is mostly multi-byte characters doesn't
+		 * pay for a failed block check after each one. */
+		if(len-i >= 16 && (i == 0 || ustr[i-1] < 0x80)){
+			i += utf8__ascii_prefix(&ustr[i], len-i);
+			if(i == len) break;
+		}
+
 		if(ustr[i] == 0){
 			return MOSQ_ERR_MALFORMED_UTF8;
 		}else if(ustr[i] <= 0x7f){
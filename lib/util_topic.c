@@ -29,6 +29,9 @@ Contributors:
 #else
 #  include <sys/stat.h>
 #endif
+#ifdef HAVE_SSE2
+#  include <emmintrin.h>
+#endif
 
 
 #ifdef WITH_BROKER
@@ -43,6 +46,54 @@ Contributors:
 #include "tls_mosq.h"
 #include "util_mosq.h"
 
+/* Returns the number of bytes at the start of str, in blocks of 16, that
+ * contain no '+' or '#' and so need no further checks. The number of
+ * '/' in those bytes is added to hier_count. */
+static size_t topic__plain_prefix(const char *str, size_t len, int *hier_count)
+{
+#ifdef HAVE_SSE2
+	const __m128i plus = _mm_set1_epi8('+');
+	const __m128i hash = _mm_set1_epi8('#');
+	const __m128i slash = _mm_set1_epi8('/');
+	__m128i v;
+	unsigned int mask;
+	size_t i;
+
+	for(i=0; i+16<=len; i+=16){
+		v = _mm_loadu_si128((const __m128i *)&str[i]);
+		if(_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, plus), _mm_cmpeq_epi8(v, hash)))){
+			return i;
+		}
+		mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash));
+		while(mask){
+			(*hier_count)++;
+			mask &= mask-1;
+		}
+	}
+	if(i < len && len >= 16){
+		/* Check the remainder as the last 16 bytes, ignoring those that
+		 * overlap the bytes already checked. */
+		v = _mm_loadu_si128((const __m128i *)&str[len-16]);
+		mask = (unsigned int)_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, plus), _mm_cmpeq_epi8(v, hash)));
+		if(mask >> (16-(len-i))){
+			return i;
+		}
+		mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, slash)) >> (16-(len-i));
+		while(mask){
+			(*hier_count)++;
+			mask &= mask-1;
+		}
+		return len;
+	}
+	return i;
+#else
+	UNUSED(str);
+	UNUSED(len);
+	UNUSED(hier_count);
+	return 0;
+#endif
+}
+
 /* Check that a topic used for publishing is valid.
  * Search for + or # in a topic. Return MOSQ_ERR_INVAL if found.
  * Also returns MOSQ_ERR_INVAL if the topic string is too long.
@@ -50,55 +101,27 @@ Contributors:
  */
 int mosquitto_pub_topic_check(const char *str)
 {
-	int len = 0;
-#ifdef WITH_BROKER
-	int hier_count = 0;
-#endif
-
 	if(str == NULL){
 		return MOSQ_ERR_INVAL;
 	}
-
-	while(str && str[0]){
-		if(str[0] == '+' || str[0] == '#'){
-			return MOSQ_ERR_INVAL;
-		}
-#ifdef WITH_BROKER
-		else if(str[0] == '/'){
-			hier_count++;
-		}
-#endif
-		len++;
-		str = &str[1];
-	}
-	if(len > 65535) return MOSQ_ERR_INVAL;
-#ifdef WITH_BROKER
-	if(hier_count > TOPIC_HIERARCHY_LIMIT) return MOSQ_ERR_INVAL;
-#endif
-
-	return MOSQ_ERR_SUCCESS;
+	return mosquitto_pub_topic_check2(str, strlen(str));
 }
 
 int mosquitto_pub_topic_check2(const char *str, size_t len)
 {
 	size_t i;
-#ifdef WITH_BROKER
 	int hier_count = 0;
-#endif
 
 	if(str == NULL || len > 65535){
 		return MOSQ_ERR_INVAL;
 	}
 
-	for(i=0; i<len; i++){
+	for(i=topic__plain_prefix(str, len, &hier_count); i<len; i++){
 		if(str[i] == '+' || str[i] == '#'){
 			return MOSQ_ERR_INVAL;
-		}
-#ifdef WITH_BROKER
-		else if(str[i] == '/'){
+		}else if(str[i] == '/'){
 			hier_count++;
 		}
-#endif
 	}
 #ifdef WITH_BROKER
 	if(hier_count > TOPIC_HIERARCHY_LIMIT) return MOSQ_ERR_INVAL;
@@ -116,56 +139,25 @@ int mosquitto_pub_topic_check2(const char *str, size_t len)
  */
 int mosquitto_sub_topic_check(const char *str)
 {
-	char c = '\0';
-	int len = 0;
-#ifdef WITH_BROKER
-	int hier_count = 0;
-#endif
-
 	if(str == NULL){
 		return MOSQ_ERR_INVAL;
 	}
-
-	while(str[0]){
-		if(str[0] == '+'){
-			if((c != '\0' && c != '/') || (str[1] != '\0' && str[1] != '/')){
-				return MOSQ_ERR_INVAL;
-			}
-		}else if(str[0] == '#'){
-			if((c != '\0' && c != '/')  || str[1] != '\0'){
-				return MOSQ_ERR_INVAL;
-			}
-		}
-#ifdef WITH_BROKER
-		else if(str[0] == '/'){
-			hier_count++;
-		}
-#endif
-		len++;
-		c = str[0];
-		str = &str[1];
-	}
-	if(len > 65535) return MOSQ_ERR_INVAL;
-#ifdef WITH_BROKER
-	if(hier_count > TOPIC_HIERARCHY_LIMIT) return MOSQ_ERR_INVAL;
-#endif
-
-	return MOSQ_ERR_SUCCESS;
+	return mosquitto_sub_topic_check2(str, strlen(str));
 }
 
 int mosquitto_sub_topic_check2(const char *str, size_t len)
 {
-	char c = '\0';
+	char c;
 	size_t i;
-#ifdef WITH_BROKER
 	int hier_count = 0;
-#endif
 
 	if(str == NULL || len > 65535){
 		return MOSQ_ERR_INVAL;
 	}
 
-	for(i=0; i<len; i++){
+	i = topic__plain_prefix(str, len, &hier_count);
+	c = i > 0 ? str[i-1] : '\0';
+	for(; i<len; i++){
 		if(str[i] == '+'){
 			if((c != '\0' && c != '/') || (i<len-1 && str[i+1] != '/')){
 				return MOSQ_ERR_INVAL;
@@ -174,12 +166,9 @@ int mosquitto_sub_topic_check2(const char *str, size_t len)
 			if((c != '\0' && c != '/')  || i<len-1){
 				return MOSQ_ERR_INVAL;
 			}
-		}
-#ifdef WITH_BROKER
-		else if(str[i] == '/'){
+		}else if(str[i] == '/'){
 			hier_count++;
 		}
-#endif
 		c = str[i];
 	}
 #ifdef WITH_BROKER
@@ -444,3 +433,139 @@ int mosquitto_topic_matches_sub2(const char *sub, size_t sublen, const char *top
 
 	return MOSQ_ERR_SUCCESS;
 }
+
+/* A subscription filter split into levels once, so it can be matched against
+ * many topics without parsing it again. The levels point into the copy of the
+ * filter held after them. */
+#define TOPIC_FILTER_LITERAL 0
+#define TOPIC_FILTER_PLUS 1
+#define TOPIC_FILTER_HASH 2
+
+struct mosquitto__topic_filter_level{
+	const char *str;
+	uint16_t len;
+	uint8_t type;
+};
+
+struct mosquitto_topic_filter{
+	int level_count;
+	struct mosquitto__topic_filter_level levels[];
+};
+
+int mosquitto_topic_filter_compile(const char *sub, struct mosquitto_topic_filter **filter)
+{
+	struct mosquitto_topic_filter *f;
+	struct mosquitto__topic_filter_level *level;
+	size_t len;
+	int level_count;
+	char *copy;
+	const char *start, *end;
+	size_t i;
+
+	if(!filter) return MOSQ_ERR_INVAL;
+	*filter = NULL;
+	if(!sub || sub[0] == 0) return MOSQ_ERR_INVAL;
+
+	len = strlen(sub);
+	if(mosquitto_sub_topic_check2(sub, len)) return MOSQ_ERR_INVAL;
+
+	level_count = 1;
+	for(i=0; i<len; i++){
+		if(sub[i] == '/') level_count++;
+	}
+
+	f = mosquitto__malloc(sizeof(struct mosquitto_topic_filter)
+			+ (size_t)level_count*sizeof(struct mosquitto__topic_filter_level)
+			+ len + 1);
+	if(!f) return MOSQ_ERR_NOMEM;
+
+	f->level_count = level_count;
+	copy = (char *)&f->levels[level_count];
+	memcpy(copy, sub, len+1);
+
+	start = copy;
+	for(level=f->levels; level<&f->levels[level_count]; level++){
+		end = strchr(start, '/');
+		if(!end) end = &copy[len];
+
+		level->str = start;
+		level->len = (uint16_t)(end - start);
+		if(level->len == 1 && start[0] == '+'){
+			level->type = TOPIC_FILTER_PLUS;
+		}else if(level->len == 1 && start[0] == '#'){
+			level->type = TOPIC_FILTER_HASH;
+		}else{
+			level->type = TOPIC_FILTER_LITERAL;
+		}
+		start = end+1;
+	}
+
+	*filter = f;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Does a topic match a compiled subscription filter? */
+int mosquitto_topic_matches_compiled(const struct mosquitto_topic_filter *filter, const char *topic, bool *result)
+{
+	const struct mosquitto__topic_filter_level *level;
+	const char *end;
+	size_t len;
+	bool matched = true;
+
+	if(!result) return MOSQ_ERR_INVAL;
+	*result = false;
+
+	if(!filter || !topic || topic[0] == 0){
+		return MOSQ_ERR_INVAL;
+	}
+
+	/* Wildcards at the start of a filter do not match topics beginning with
+	 * '$'. A literal first level must match the '$' itself. */
+	if(topic[0] == '$' && filter->levels[0].type != TOPIC_FILTER_LITERAL){
+		matched = false;
+	}
+
+	for(level=filter->levels; level<&filter->levels[filter->level_count]; level++){
+		if(level->type == TOPIC_FILTER_HASH){
+			/* Matches the parent level and everything below it */
+			break;
+		}
+		if(topic == NULL){
+			/* Topic has fewer levels than the filter */
+			matched = false;
+			break;
+		}
+
+		len = strcspn(topic, "/+#");
+		end = &topic[len];
+		if(end[0] == '+' || end[0] == '#'){
+			return MOSQ_ERR_INVAL;
+		}
+		if(level->type == TOPIC_FILTER_LITERAL
+				&& (len != level->len || memcmp(topic, level->str, len))){
+
+			matched = false;
+			break;
+		}
+		topic = end[0] == '/' ? &end[1] : NULL;
+	}
+	if(level == &filter->levels[filter->level_count] && topic != NULL){
+		/* Topic has more levels than the filter */
+		matched = false;
+	}
+
+	/* Finish checking the topic for wildcards, as mosquitto_topic_matches_sub() does */
+	if(topic && strpbrk(topic, "+#")){
+		return MOSQ_ERR_INVAL;
+	}
+
+	*result = matched;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void mosquitto_topic_filter_free(struct mosquitto_topic_filter *filter)
+{
+	mosquitto__free(filter);
+}
@@ -41,7 +41,11 @@ static int acl_check_publish_c_recv(struct mosquitto_evt_acl_check *ed, struct d
 
 	HASH_ITER(hh, base_rolelist, rolelist, rolelist_tmp){
 		HASH_ITER(hh, rolelist->role->acls.publish_c_recv, acl, acl_tmp){
-			mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
+			if(acl->filter){
+				mosquitto_topic_matches_compiled(acl->filter, ed->topic, &result);
+			}else{
+				mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
+			}
 			if(result){
 				if(acl->allow){
 					return MOSQ_ERR_SUCCESS;
@@ -69,7 +73,11 @@ static int acl_check_publish_c_send(struct mosquitto_evt_acl_check *ed, struct d
 
 	HASH_ITER(hh, base_rolelist, rolelist, rolelist_tmp){
 		HASH_ITER(hh, rolelist->role->acls.publish_c_send, acl, acl_tmp){
-			mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
+			if(acl->filter){
+				mosquitto_topic_matches_compiled(acl->filter, ed->topic, &result);
+			}else{
+				mosquitto_topic_matches_sub(acl->topic, ed->topic, &result);
+			}
 			if(result){
 				if(acl->allow){
 					return MOSQ_ERR_SUCCESS;
@@ -98,6 +98,7 @@ struct dynsec__group{
 struct dynsec__acl{
 	UT_hash_handle hh;
 	char *topic;
+	struct mosquitto_topic_filter *filter;
 	int priority;
 	bool allow;
 };
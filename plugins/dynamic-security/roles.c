@@ -65,6 +65,7 @@ static void role__free_acl(struct dynsec__acl **acl, struct dynsec__acl *item)
 {
 	HASH_DELETE(hh, *acl, item);
 	mosquitto_free(item->topic);
+	mosquitto_topic_filter_free(item->filter);
 	mosquitto_free(item);
 }
 
@@ -251,6 +252,7 @@ static int dynsec_roles__acl_load(cJSON *j_acls, const char *key, struct dynsec_
 			mosquitto_free(acl);
 			continue;
 		}
+		mosquitto_topic_filter_compile(acl->topic, &acl->filter);
 
 		HASH_ADD_KEYPTR_INORDER(hh, *acllist, acl->topic, strlen(acl->topic), acl, insert_acl_cmp);
 	}
@@ -677,6 +679,12 @@ int dynsec_roles__process_add_acl(cJSON *j_responses, struct mosquitto *context,
 		dynsec__command_reply(j_responses, context, "addRoleACL", "Internal error", correlation_data);
 		return MOSQ_ERR_SUCCESS;
 	}
+	if(mosquitto_topic_filter_compile(acl->topic, &acl->filter) == MOSQ_ERR_NOMEM){
+		mosquitto_free(acl->topic);
+		mosquitto_free(acl);
+		dynsec__command_reply(j_responses, context, "addRoleACL", "Internal error", correlation_data);
+		return MOSQ_ERR_SUCCESS;
+	}
 
 	json_get_int(command, "priority", &acl->priority, true, 0);
 	json_get_bool(command, "allow", &acl->allow, true, false);
@@ -56,15 +56,108 @@ Contributors:
 
 static void bridge__backoff_step(struct mosquitto *context);
 static void bridge__backoff_reset(struct mosquitto *context);
+static void bridge__flow_control_reset(struct mosquitto *context);
 
-void bridge__start_all(void)
+static char *bridge__connection_id(const char *id, int index)
+{
+	char *conn_id;
+	size_t len;
+
+	len = strlen(id) + 12;
+	conn_id = mosquitto__malloc(len);
+	if(conn_id){
+		snprintf(conn_id, len, "%s.%d", id, index);
+	}
+	return conn_id;
+}
+
+
+static int bridge__connection_strdup(char **dest, const char *src)
+{
+	if(src){
+		*dest = mosquitto__strdup(src);
+		if(*dest == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Create the extra connections for a bridge with bridge_connections > 1. They
+ * share the topics and settings of the primary connection, but have their own
+ * client ids, connection state and statistics. */
+static int bridge__connections_init(struct mosquitto__bridge *bridge)
 {
+	struct mosquitto__bridge *conn;
 	int i;
 
+	bridge->primary = bridge;
+	bridge->connection_index = 0;
+	if(bridge->connection_count < 2){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	bridge->connections = mosquitto__calloc((size_t)bridge->connection_count-1, sizeof(struct mosquitto__bridge));
+	if(bridge->connections == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	for(i=1; i<bridge->connection_count; i++){
+		conn = &bridge->connections[i-1];
+		memcpy(conn, bridge, sizeof(struct mosquitto__bridge));
+		conn->connection_index = i;
+		conn->connections = NULL;
+		conn->remap_buf = NULL;
+		conn->remap_buf_len = 0;
+		conn->compress_buf = NULL;
+		conn->compress_buf_len = 0;
+		memset(&conn->stats, 0, sizeof(struct mosquitto__bridge_stats));
+		/* Only the primary connection reports the bridge state and
+		 * subscribes on the remote broker. */
+		conn->notifications = false;
+
+		conn->remote_clientid = NULL;
+		conn->remote_username = NULL;
+		conn->remote_password = NULL;
+		conn->local_clientid = NULL;
+		conn->local_username = NULL;
+		conn->local_password = NULL;
+
+		conn->remote_clientid = bridge__connection_id(bridge->remote_clientid, i);
+		conn->local_clientid = bridge__connection_id(bridge->local_clientid, i);
+		if(conn->remote_clientid == NULL || conn->local_clientid == NULL
+				|| bridge__connection_strdup(&conn->remote_username, bridge->remote_username)
+				|| bridge__connection_strdup(&conn->remote_password, bridge->remote_password)
+				|| bridge__connection_strdup(&conn->local_username, bridge->local_username)
+				|| bridge__connection_strdup(&conn->local_password, bridge->local_password)){
+
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+void bridge__start_all(void)
+{
+	struct mosquitto__bridge *bridge;
+	int i, j;
+
 	for(i=0; i<db.config->bridge_count; i++){
-		if(bridge__new(&(db.config->bridges[i])) > 0){
+		bridge = &db.config->bridges[i];
+		if(bridge__connections_init(bridge)){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			continue;
+		}
+		if(bridge__new(bridge) > 0){
 			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to connect to bridge %s.",
-					db.config->bridges[i].name);
+					bridge->name);
+		}
+		for(j=1; j<bridge->connection_count; j++){
+			if(bridge__new(&bridge->connections[j-1]) > 0){
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to connect to bridge %s (connection %d).",
+						bridge->name, j);
+			}
 		}
 	}
 }
@@ -169,6 +262,7 @@ int bridge__connect_step1(struct mosquitto *context)
 	context->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
 	context->maximum_packet_size = context->bridge->maximum_packet_size;
+	bridge__flow_control_reset(context);
 	bridge__packet_cleanup(context);
 	db__message_reconnect_reset(context);
 
@@ -360,6 +454,7 @@ int bridge__connect(struct mosquitto *context)
 	context->ping_t = 0;
 	context->bridge->lazy_reconnect = false;
 	context->maximum_packet_size = context->bridge->maximum_packet_size;
+	bridge__flow_control_reset(context);
 	bridge__packet_cleanup(context);
 	db__message_reconnect_reset(context);
 
@@ -530,7 +625,7 @@ int bridge__on_connect(struct mosquitto *context)
 			mosquitto__free(notification_topic);
 		}
 	}
-	for(i=0; i<context->bridge->topic_count; i++){
+	for(i=0; i<context->bridge->topic_count && context->bridge->connection_index == 0; i++){
 		if(context->bridge->topics[i].direction == bd_in || context->bridge->topics[i].direction == bd_both){
 			if(context->bridge->topics[i].qos > context->max_qos){
 				sub_opts = context->max_qos;
@@ -873,4 +968,55 @@ void bridge_check(void)
 	}
 }
 
+/* Apply the configured inflight windows before a (re)connect. The outgoing
+ * window may be reduced again by the receive-maximum in an MQTT v5 CONNACK. */
+static void bridge__flow_control_reset(struct mosquitto *context)
+{
+	if(context->bridge->max_inflight_messages){
+		context->msgs_out.inflight_maximum = context->bridge->max_inflight_messages;
+	}
+	if(context->bridge->receive_maximum && context->protocol == mosq_p_mqtt5){
+		context->msgs_in.inflight_maximum = context->bridge->receive_maximum;
+	}
+	context->bridge->stats.rtt_sampling = false;
+}
+
+
+/* Round trip time is sampled on one message at a time, so no per-message
+ * timestamps are needed. */
+void bridge__rtt_sample_start(struct mosquitto *context, uint16_t mid)
+{
+	struct mosquitto__bridge_stats *stats;
+
+	if(context->bridge == NULL) return;
+	stats = &context->bridge->stats;
+
+	if(stats->rtt_sampling == false){
+		stats->rtt_sampling = true;
+		stats->rtt_sample_mid = mid;
+		stats->rtt_sample_start = mosquitto_time_ms();
+	}
+}
+
+
+void bridge__rtt_sample_end(struct mosquitto *context, uint16_t mid)
+{
+	struct mosquitto__bridge_stats *stats;
+	uint32_t rtt;
+
+	if(context->bridge == NULL) return;
+	stats = &context->bridge->stats;
+
+	if(stats->rtt_sampling && stats->rtt_sample_mid == mid){
+		stats->rtt_sampling = false;
+		rtt = (uint32_t)(mosquitto_time_ms() - stats->rtt_sample_start);
+		if(stats->rtt == 0){
+			stats->rtt = rtt;
+		}else{
+			/* Exponentially weighted, as for TCP srtt */
+			stats->rtt = (7*stats->rtt + rtt)/8;
+		}
+	}
+}
+
 #endif
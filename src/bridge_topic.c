@@ -97,6 +97,169 @@ static int bridge__create_prefix(char **full_prefix, const char *topic, const ch
 }
 
 
+static struct mosquitto__bridge_topic_node *bridge__topic_node_new(const char *level, uint16_t level_len)
+{
+	struct mosquitto__bridge_topic_node *node;
+
+	node = mosquitto__calloc(1, sizeof(struct mosquitto__bridge_topic_node));
+	if(!node) return NULL;
+
+	node->leaf_index = -1;
+	node->hash_index = -1;
+	node->level_len = level_len;
+	node->level = mosquitto__malloc((size_t)level_len+1);
+	if(!node->level){
+		mosquitto__free(node);
+		return NULL;
+	}
+	memcpy(node->level, level, level_len);
+	node->level[level_len] = '\0';
+
+	return node;
+}
+
+
+static void bridge__topic_node_free(struct mosquitto__bridge_topic_node *node)
+{
+	struct mosquitto__bridge_topic_node *child, *child_tmp;
+
+	if(!node) return;
+
+	HASH_ITER(hh, node->children, child, child_tmp){
+		HASH_DELETE(hh, node->children, child);
+		bridge__topic_node_free(child);
+	}
+	bridge__topic_node_free(node->plus);
+	mosquitto__free(node->level);
+	mosquitto__free(node);
+}
+
+
+/* Add the subscription pattern `pattern` to the remap tree `root`, recording
+ * `index` as the bridge topic it belongs to. Earlier patterns keep priority
+ * over later ones that end at the same node. */
+static int bridge__topic_tree_add(struct mosquitto__bridge_topic_node **root, const char *pattern, int index)
+{
+	struct mosquitto__bridge_topic_node *node, *child;
+	const char *level, *end;
+	size_t len;
+
+	if(*root == NULL){
+		*root = bridge__topic_node_new("", 0);
+		if(*root == NULL) return MOSQ_ERR_NOMEM;
+	}
+	node = *root;
+
+	level = pattern;
+	while(level){
+		end = strchr(level, '/');
+		if(end){
+			len = (size_t)(end - level);
+		}else{
+			len = strlen(level);
+		}
+		if(len > UINT16_MAX) return MOSQ_ERR_INVAL;
+
+		if(len == 1 && level[0] == '#'){
+			if(node->hash_index == -1){
+				node->hash_index = index;
+			}
+			return MOSQ_ERR_SUCCESS;
+		}else if(len == 1 && level[0] == '+'){
+			if(node->plus == NULL){
+				node->plus = bridge__topic_node_new(level, 1);
+				if(node->plus == NULL) return MOSQ_ERR_NOMEM;
+			}
+			node = node->plus;
+		}else{
+			HASH_FIND(hh, node->children, level, len, child);
+			if(child == NULL){
+				child = bridge__topic_node_new(level, (uint16_t)len);
+				if(child == NULL) return MOSQ_ERR_NOMEM;
+				HASH_ADD_KEYPTR(hh, node->children, child->level, child->level_len, child);
+			}
+			node = child;
+		}
+		level = end?end+1:NULL;
+	}
+	if(node->leaf_index == -1){
+		node->leaf_index = index;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Find the lowest pattern index in the tree below `node` that matches the
+ * remainder of the topic starting at `level`. `level` is NULL once every
+ * level of the topic has been consumed. Wildcards at the first level never
+ * match topics beginning with '$', as with mosquitto_topic_matches_sub(). */
+static void bridge__topic_tree_match(const struct mosquitto__bridge_topic_node *node, const char *level, bool dollar, int *best)
+{
+	struct mosquitto__bridge_topic_node *child;
+	const char *end;
+	size_t len;
+
+	if(node->hash_index != -1 && !dollar){
+		if(*best == -1 || node->hash_index < *best){
+			*best = node->hash_index;
+		}
+	}
+	if(level == NULL){
+		if(node->leaf_index != -1){
+			if(*best == -1 || node->leaf_index < *best){
+				*best = node->leaf_index;
+			}
+		}
+		return;
+	}
+
+	end = strchr(level, '/');
+	if(end){
+		len = (size_t)(end - level);
+	}else{
+		len = strlen(level);
+	}
+
+	HASH_FIND(hh, node->children, level, len, child);
+	if(child){
+		bridge__topic_tree_match(child, end?end+1:NULL, false, best);
+	}
+	if(node->plus && !dollar){
+		bridge__topic_tree_match(node->plus, end?end+1:NULL, false, best);
+	}
+}
+
+
+static struct mosquitto__bridge_topic *bridge__topic_tree_find(struct mosquitto__bridge *bridge, const struct mosquitto__bridge_topic_node *root, const char *topic)
+{
+	int best = -1;
+
+	if(root == NULL || topic == NULL || topic[0] == '\0') return NULL;
+
+	bridge__topic_tree_match(root, topic, topic[0] == '$', &best);
+	if(best == -1){
+		return NULL;
+	}else{
+		return &bridge->topics[best];
+	}
+}
+
+
+void bridge__topics_cleanup(struct mosquitto__bridge *bridge)
+{
+	if(bridge == NULL) return;
+
+	bridge__topic_node_free(bridge->remap_in);
+	bridge->remap_in = NULL;
+	bridge__topic_node_free(bridge->remap_out);
+	bridge->remap_out = NULL;
+	mosquitto__free(bridge->remap_buf);
+	bridge->remap_buf = NULL;
+	bridge->remap_buf_len = 0;
+}
+
+
 /* topic <topic> [[[out | in | both] qos-level] local-prefix remote-prefix] */
 int bridge__add_topic(struct mosquitto__bridge *bridge, const char *topic, enum mosquitto__bridge_direction direction, uint8_t qos, const char *local_prefix, const char *remote_prefix)
 {
@@ -181,67 +344,139 @@ int bridge__add_topic(struct mosquitto__bridge *bridge, const char *topic, enum
 		return MOSQ_ERR_INVAL;
 	}
 
+	if(cur_topic->local_prefix || cur_topic->remote_prefix){
+		if(direction == bd_in || direction == bd_both){
+			if(bridge__topic_tree_add(&bridge->remap_in, cur_topic->remote_topic, bridge->topic_count-1)){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+		if(direction == bd_out || direction == bd_both){
+			if(bridge__topic_tree_add(&bridge->remap_out, cur_topic->local_topic, bridge->topic_count-1)){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+				return MOSQ_ERR_NOMEM;
+			}
+		}
+	}
+
 	return MOSQ_ERR_SUCCESS;
 }
 
 
+/* Remap an incoming topic in place. The topic is only reallocated if the
+ * local prefix is longer than the remote prefix it replaces. */
 int bridge__remap_topic_in(struct mosquitto *context, char **topic)
 {
 	struct mosquitto__bridge_topic *cur_topic;
 	char *topic_temp;
-	int i;
-	size_t len;
-	int rc;
-	bool match;
+	size_t topic_len, strip_len = 0, prefix_len = 0;
 
 	if(context->bridge && context->bridge->topics && context->bridge->topic_remapping){
-		for(i=0; i<context->bridge->topic_count; i++){
-			cur_topic = &context->bridge->topics[i];
-			if((cur_topic->direction == bd_both || cur_topic->direction == bd_in)
-					&& (cur_topic->remote_prefix || cur_topic->local_prefix)){
-
-				/* Topic mapping required on this topic if the message matches */
-
-				rc = mosquitto_topic_matches_sub(cur_topic->remote_topic, *topic, &match);
-				if(rc){
-					mosquitto__free(*topic);
-					return rc;
-				}
-				if(match){
-					if(cur_topic->remote_prefix){
-						/* This prefix needs removing. */
-						if(!strncmp(cur_topic->remote_prefix, *topic, strlen(cur_topic->remote_prefix))){
-							topic_temp = mosquitto__strdup((*topic)+strlen(cur_topic->remote_prefix));
-							if(!topic_temp){
-								mosquitto__free(*topic);
-								return MOSQ_ERR_NOMEM;
-							}
-							mosquitto__free(*topic);
-							*topic = topic_temp;
-						}
-					}
-
-					if(cur_topic->local_prefix){
-						/* This prefix needs adding. */
-						len = strlen(*topic) + strlen(cur_topic->local_prefix)+1;
-						topic_temp = mosquitto__malloc(len+1);
-						if(!topic_temp){
-							mosquitto__free(*topic);
-							return MOSQ_ERR_NOMEM;
-						}
-						snprintf(topic_temp, len, "%s%s", cur_topic->local_prefix, *topic);
-						topic_temp[len] = '\0';
-
-						mosquitto__free(*topic);
-						*topic = topic_temp;
-					}
-					break;
-				}
+		cur_topic = bridge__topic_tree_find(context->bridge, context->bridge->remap_in, *topic);
+		if(cur_topic == NULL){
+			return MOSQ_ERR_SUCCESS;
+		}
+
+		topic_len = strlen(*topic);
+		if(cur_topic->remote_prefix){
+			/* This prefix needs removing. */
+			strip_len = strlen(cur_topic->remote_prefix);
+			if(strncmp(cur_topic->remote_prefix, *topic, strip_len)){
+				strip_len = 0;
+			}
+		}
+		if(cur_topic->local_prefix){
+			/* This prefix needs adding. */
+			prefix_len = strlen(cur_topic->local_prefix);
+		}
+
+		if(prefix_len > strip_len){
+			topic_temp = mosquitto__realloc(*topic, topic_len - strip_len + prefix_len + 1);
+			if(!topic_temp){
+				mosquitto__free(*topic);
+				*topic = NULL;
+				return MOSQ_ERR_NOMEM;
+			}
+			*topic = topic_temp;
+		}
+		memmove((*topic)+prefix_len, (*topic)+strip_len, topic_len - strip_len + 1);
+		if(prefix_len){
+			memcpy(*topic, cur_topic->local_prefix, prefix_len);
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Remap an outgoing topic. If the topic matches a remapped pattern,
+ * `mapped_topic` points at the bridge's remap buffer, which remains valid
+ * until the next call. Otherwise it is set to `topic`. */
+int bridge__remap_topic_out(struct mosquitto *context, const char *topic, const char **mapped_topic)
+{
+	struct mosquitto__bridge *bridge = context->bridge;
+	struct mosquitto__bridge_topic *cur_topic;
+	char *buf;
+	size_t topic_len, strip_len = 0, prefix_len = 0, len;
+
+	*mapped_topic = topic;
+
+	if(bridge && bridge->topics && bridge->topic_remapping){
+		cur_topic = bridge__topic_tree_find(bridge, bridge->remap_out, topic);
+		if(cur_topic == NULL){
+			return MOSQ_ERR_SUCCESS;
+		}
+
+		topic_len = strlen(topic);
+		if(cur_topic->local_prefix){
+			/* This prefix needs removing. */
+			strip_len = strlen(cur_topic->local_prefix);
+			if(strncmp(cur_topic->local_prefix, topic, strip_len)){
+				strip_len = 0;
 			}
 		}
+		if(cur_topic->remote_prefix){
+			/* This prefix needs adding. */
+			prefix_len = strlen(cur_topic->remote_prefix);
+		}
+
+		len = topic_len - strip_len + prefix_len + 1;
+		if(len > bridge->remap_buf_len){
+			buf = mosquitto__realloc(bridge->remap_buf, len);
+			if(!buf){
+				return MOSQ_ERR_NOMEM;
+			}
+			bridge->remap_buf = buf;
+			bridge->remap_buf_len = len;
+		}
+		if(prefix_len){
+			memcpy(bridge->remap_buf, cur_topic->remote_prefix, prefix_len);
+		}
+		memcpy(bridge->remap_buf+prefix_len, topic+strip_len, topic_len - strip_len + 1);
+		*mapped_topic = bridge->remap_buf;
 	}
 
 	return MOSQ_ERR_SUCCESS;
 }
 
+
+/* Outgoing messages are spread over the connections of a bridge by a hash of
+ * their topic, so all messages on one topic use the same connection and stay
+ * in order. */
+bool bridge__connection_owns_topic(const struct mosquitto__bridge *bridge, const char *topic)
+{
+	uint32_t hash = 2166136261U;
+
+	if(bridge->connection_count < 2){
+		return true;
+	}
+	/* FNV-1a */
+	while(*topic){
+		hash ^= (uint8_t)(*topic);
+		hash *= 16777619U;
+		topic++;
+	}
+	return (int)(hash % (uint32_t)bridge->connection_count) == bridge->connection_index;
+}
+
 #endif
@@ -0,0 +1,221 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "mqtt_protocol.h"
+#include "memory_mosq.h"
+#include "property_mosq.h"
+
+#ifdef WITH_ZLIB
+#include <zlib.h>
+
+static bool compress__is_property(const mosquitto_property *p)
+{
+	size_t len = strlen(MOSQ_COMPRESSION_PROPERTY);
+
+	return p->identifier == MQTT_PROP_USER_PROPERTY
+			&& p->name.len == len
+			&& !memcmp(p->name.v, MOSQ_COMPRESSION_PROPERTY, len);
+}
+
+
+/* Return the compression method requested by a compression user property in
+ * a CONNECT, CONNACK or PUBLISH property list. */
+uint8_t compress__find_method(const mosquitto_property *props)
+{
+	const mosquitto_property *p;
+
+	for(p=props; p; p=p->next){
+		if(compress__is_property(p)
+				&& p->value.s.len == strlen("deflate")
+				&& !memcmp(p->value.s.v, "deflate", strlen("deflate"))){
+
+			return mosq_cmp_deflate;
+		}
+	}
+	return mosq_cmp_none;
+}
+
+
+int compress__add_property(mosquitto_property **props, uint8_t method)
+{
+	if(method == mosq_cmp_deflate){
+		return mosquitto_property_add_string_pair(props, MQTT_PROP_USER_PROPERTY, MOSQ_COMPRESSION_PROPERTY, "deflate");
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Compress an outgoing bridge payload into the bridge compression buffer.
+ * Returns MOSQ_ERR_SUCCESS and sets *out only if the result is smaller than
+ * the original. */
+int compress__deflate(struct mosquitto__bridge *bridge, const void *payload, uint32_t payloadlen, const void **out, uint32_t *outlen)
+{
+	uLongf len;
+	uint8_t *buf;
+
+	*out = NULL;
+	*outlen = 0;
+
+	len = compressBound(payloadlen);
+	if(len > bridge->compress_buf_len){
+		buf = mosquitto__realloc(bridge->compress_buf, len);
+		if(buf == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		bridge->compress_buf = buf;
+		bridge->compress_buf_len = len;
+	}
+
+	if(compress2(bridge->compress_buf, &len, payload, payloadlen, Z_DEFAULT_COMPRESSION) != Z_OK){
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(len < payloadlen){
+		*out = bridge->compress_buf;
+		*outlen = (uint32_t)len;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int compress__inflate(const void *in, uint32_t inlen, uint32_t limit, void **out, uint32_t *outlen)
+{
+	z_stream strm;
+	uint8_t *buf = NULL, *tmp;
+	size_t buflen;
+	int rc;
+
+	memset(&strm, 0, sizeof(z_stream));
+	if(inflateInit(&strm) != Z_OK){
+		return MOSQ_ERR_NOMEM;
+	}
+	strm.next_in = (Bytef *)in;
+	strm.avail_in = (uInt)inlen;
+
+	buflen = (size_t)inlen*4;
+	do{
+		if(buflen > (size_t)limit+1){
+			buflen = (size_t)limit+1;
+		}
+		tmp = mosquitto__realloc(buf, buflen);
+		if(tmp == NULL){
+			inflateEnd(&strm);
+			mosquitto__free(buf);
+			return MOSQ_ERR_NOMEM;
+		}
+		buf = tmp;
+		strm.next_out = &buf[strm.total_out];
+		strm.avail_out = (uInt)(buflen - strm.total_out);
+
+		rc = inflate(&strm, Z_NO_FLUSH);
+		if(rc == Z_STREAM_END){
+			break;
+		}else if(rc != Z_OK && rc != Z_BUF_ERROR){
+			inflateEnd(&strm);
+			mosquitto__free(buf);
+			return MOSQ_ERR_MALFORMED_PACKET;
+		}else if(strm.avail_in == 0 && strm.avail_out != 0){
+			/* Truncated stream */
+			inflateEnd(&strm);
+			mosquitto__free(buf);
+			return MOSQ_ERR_MALFORMED_PACKET;
+		}
+		if(strm.total_out > limit){
+			inflateEnd(&strm);
+			mosquitto__free(buf);
+			return MOSQ_ERR_PAYLOAD_SIZE;
+		}
+		buflen *= 2;
+	}while(1);
+
+	*outlen = (uint32_t)strm.total_out;
+	inflateEnd(&strm);
+
+	if(strm.total_out == buflen){
+		tmp = mosquitto__realloc(buf, buflen+1);
+		if(tmp == NULL){
+			mosquitto__free(buf);
+			return MOSQ_ERR_NOMEM;
+		}
+		buf = tmp;
+	}
+	/* Payloads are always zero terminated */
+	buf[*outlen] = 0;
+	*out = buf;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Decompress the payload of an incoming PUBLISH that carries the compression
+ * user property, and remove the property so it is not passed on. Returns
+ * MOSQ_ERR_PAYLOAD_SIZE if the payload inflates to more than the listener
+ * allows. */
+int compress__handle_publish(struct mosquitto *context, struct mosquitto_msg_store *msg)
+{
+	mosquitto_property *p, *p_prev = NULL;
+	void *payload;
+	uint32_t payloadlen;
+	uint32_t limit;
+	int rc;
+
+	for(p=msg->properties; p; p=p->next){
+		if(compress__is_property(p)){
+			break;
+		}
+		p_prev = p;
+	}
+	if(p == NULL){
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(compress__find_method(p) != mosq_cmp_deflate){
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	if(p_prev){
+		p_prev->next = p->next;
+	}else{
+		msg->properties = p->next;
+	}
+	p->next = NULL;
+	mosquitto_property_free_all(&p);
+
+	if(msg->payloadlen == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	limit = context->listener->max_inflated_size;
+	if(db.config->max_packet_size && limit > db.config->max_packet_size){
+		limit = db.config->max_packet_size;
+	}
+	if(db.config->message_size_limit && limit > db.config->message_size_limit){
+		limit = db.config->message_size_limit;
+	}
+	rc = compress__inflate(msg->payload, msg->payloadlen, limit, &payload, &payloadlen);
+	if(rc) return rc;
+
+	mosquitto__free(msg->payload);
+	msg->payload = payload;
+	msg->payloadlen = payloadlen;
+
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
@@ -202,8 +202,13 @@ static void config__init_reload(struct mosquitto__config *config)
 	config->queue_qos0_messages = false;
 	config->retain_available = true;
 	config->set_tcp_nodelay = false;
+	config->shared_subscription_mode = shared_sm_round_robin;
+	mosquitto__free(config->shared_subscription_hash_property);
+	config->shared_subscription_hash_property = NULL;
+	config->shared_subscription_max_queued = 0;
 	config->sys_interval = 10;
 	config->upgrade_outgoing_qos = false;
+	config->write_coalescing = false;
 
 	config__cleanup_plugins(config);
 }
@@ -242,6 +247,7 @@ void config__init(struct mosquitto__config *config)
 	config__init_reload(config);
 
 	config->daemon = false;
+	config->max_tls_handshakes = 1000;
 	memset(&config->default_listener, 0, sizeof(struct mosquitto__listener));
 	listener__set_defaults(&config->default_listener);
 }
@@ -264,6 +270,7 @@ void config__cleanup(struct mosquitto__config *config)
 	mosquitto__free(config->pid_file);
 	mosquitto__free(config->user);
 	mosquitto__free(config->log_timestamp_format);
+	mosquitto__free(config->shared_subscription_hash_property);
 	if(config->listeners){
 		for(i=0; i<config->listener_count; i++){
 			mosquitto__free(config->listeners[i].host);
@@ -287,6 +294,8 @@ void config__cleanup(struct mosquitto__config *config)
 			mosquitto__free(config->listeners[i].tls_version);
 			mosquitto__free(config->listeners[i].tls_engine);
 			mosquitto__free(config->listeners[i].tls_engine_kpass_sha1);
+			mosquitto__free(config->listeners[i].tls_ticket_key_file);
+			tls_session__cleanup(&config->listeners[i]);
 #ifdef WITH_WEBSOCKETS
 			if(!config->listeners[i].ws_context) /* libwebsockets frees its own SSL_CTX */
 #endif
@@ -329,6 +338,22 @@ void config__cleanup(struct mosquitto__config *config)
 				}
 				mosquitto__free(config->bridges[i].topics);
 			}
+			bridge__topics_cleanup(&config->bridges[i]);
+			mosquitto__free(config->bridges[i].compress_buf);
+			mosquitto__free(config->bridges[i].stats.sys_topic);
+			if(config->bridges[i].connections){
+				for(j=0; j<config->bridges[i].connection_count-1; j++){
+					mosquitto__free(config->bridges[i].connections[j].remote_clientid);
+					mosquitto__free(config->bridges[i].connections[j].remote_username);
+					mosquitto__free(config->bridges[i].connections[j].remote_password);
+					mosquitto__free(config->bridges[i].connections[j].local_clientid);
+					mosquitto__free(config->bridges[i].connections[j].local_username);
+					mosquitto__free(config->bridges[i].connections[j].local_password);
+					mosquitto__free(config->bridges[i].connections[j].remap_buf);
+					mosquitto__free(config->bridges[i].connections[j].compress_buf);
+				}
+				mosquitto__free(config->bridges[i].connections);
+			}
 			mosquitto__free(config->bridges[i].notification_topic);
 #ifdef WITH_TLS
 			mosquitto__free(config->bridges[i].tls_version);
@@ -438,8 +463,16 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 			|| config->default_listener.crlfile
 			|| config->default_listener.use_identity_as_username
 			|| config->default_listener.use_subject_as_username
+			|| config->default_listener.ktls
+			|| config->default_listener.tls_session_cache_size != -1
+			|| config->default_listener.tls_session_timeout != -1
+			|| config->default_listener.tls_session_tickets != true
+			|| config->default_listener.tls_ticket_key_file
 #endif
 			|| config->default_listener.use_username_as_clientid
+			|| config->default_listener.conflate_queued_messages
+			|| config->default_listener.accept_compression
+			|| config->default_listener.max_inflated_size != 65536
 			|| config->default_listener.host
 			|| config->default_listener.port
 			|| config->default_listener.max_connections != -1
@@ -483,8 +516,12 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].sock_count = 0;
 		config->listeners[config->listener_count-1].client_count = 0;
 		config->listeners[config->listener_count-1].use_username_as_clientid = config->default_listener.use_username_as_clientid;
+		config->listeners[config->listener_count-1].conflate_queued_messages = config->default_listener.conflate_queued_messages;
 		config->listeners[config->listener_count-1].max_qos = config->default_listener.max_qos;
 		config->listeners[config->listener_count-1].max_topic_alias = config->default_listener.max_topic_alias;
+		config->listeners[config->listener_count-1].max_topic_alias_broker = config->default_listener.max_topic_alias_broker;
+		config->listeners[config->listener_count-1].accept_compression = config->default_listener.accept_compression;
+		config->listeners[config->listener_count-1].max_inflated_size = config->default_listener.max_inflated_size;
 #ifdef WITH_TLS
 		config->listeners[config->listener_count-1].tls_version = config->default_listener.tls_version;
 		config->listeners[config->listener_count-1].tls_engine = config->default_listener.tls_engine;
@@ -503,6 +540,11 @@ int config__parse_args(struct mosquitto__config *config, int argc, char *argv[])
 		config->listeners[config->listener_count-1].crlfile = config->default_listener.crlfile;
 		config->listeners[config->listener_count-1].use_identity_as_username = config->default_listener.use_identity_as_username;
 		config->listeners[config->listener_count-1].use_subject_as_username = config->default_listener.use_subject_as_username;
+		config->listeners[config->listener_count-1].ktls = config->default_listener.ktls;
+		config->listeners[config->listener_count-1].tls_session_cache_size = config->default_listener.tls_session_cache_size;
+		config->listeners[config->listener_count-1].tls_session_timeout = config->default_listener.tls_session_timeout;
+		config->listeners[config->listener_count-1].tls_session_tickets = config->default_listener.tls_session_tickets;
+		config->listeners[config->listener_count-1].tls_ticket_key_file = config->default_listener.tls_ticket_key_file;
 #endif
 		config->listeners[config->listener_count-1].security_options.acl_file = config->default_listener.security_options.acl_file;
 		config->listeners[config->listener_count-1].security_options.password_file = config->default_listener.security_options.password_file;
@@ -583,8 +625,15 @@ static void config__copy(struct mosquitto__config *src, struct mosquitto__config
 
 
 	dest->queue_qos0_messages = src->queue_qos0_messages;
+
+	dest->shared_subscription_mode = src->shared_subscription_mode;
+	mosquitto__free(dest->shared_subscription_hash_property);
+	dest->shared_subscription_hash_property = src->shared_subscription_hash_property;
+	dest->shared_subscription_max_queued = src->shared_subscription_max_queued;
+
 	dest->sys_interval = src->sys_interval;
 	dest->upgrade_outgoing_qos = src->upgrade_outgoing_qos;
+	dest->write_coalescing = src->write_coalescing;
 
 #ifdef WITH_WEBSOCKETS
 	dest->websockets_log_level = src->websockets_log_level;
@@ -695,6 +744,10 @@ int config__read(struct mosquitto__config *config, bool reload)
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: no topics defined.");
 			return MOSQ_ERR_INVAL;
 		}
+		if(config->bridges[i].compression != mosq_cmp_none && config->bridges[i].protocol_version != mosq_p_mqtt5){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: bridge_compression requires bridge_protocol_version mqttv50.");
+			return MOSQ_ERR_INVAL;
+		}
 #ifdef FINAL_WITH_TLS_PSK
 		if(config->bridges[i].tls_psk && !config->bridges[i].tls_psk_identity){
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration: missing bridge_identity.");
@@ -764,7 +817,15 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 			}
 			token = strtok_r((*buf), " ", &saveptr);
 			if(token){
-				if(!strcmp(token, "acl_file")){
+				if(!strcmp(token, "accept_compression")){
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "accept_compression", &cur_listener->accept_compression, saveptr)) return MOSQ_ERR_INVAL;
+#ifndef WITH_ZLIB
+					if(cur_listener->accept_compression){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Compression support not available.");
+					}
+#endif
+				}else if(!strcmp(token, "acl_file")){
 					conf__set_cur_security_options(config, cur_listener, &cur_security_options);
 					if(reload){
 						mosquitto__free(cur_security_options->acl_file);
@@ -1018,6 +1079,63 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					if(conf__parse_string(&token, "bridge_certfile", &cur_bridge->tls_certfile, saveptr)) return MOSQ_ERR_INVAL;
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_compression")){
+#if defined(WITH_BRIDGE)
+					if(reload) continue; /* Bridges not valid for reloading. */
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "none")){
+							cur_bridge->compression = mosq_cmp_none;
+						}else if(!strcmp(token, "deflate")){
+#ifdef WITH_ZLIB
+							cur_bridge->compression = mosq_cmp_deflate;
+#else
+							log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Compression support not available.");
+#endif
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_compression value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty bridge_compression value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_compression_threshold")){
+#if defined(WITH_BRIDGE)
+					if(reload) continue; /* Bridges not valid for reloading. */
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_compression_threshold", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
+					if(tmp_int < 0) tmp_int = 0;
+					cur_bridge->compression_threshold = (uint32_t)tmp_int;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_connections")){
+#if defined(WITH_BRIDGE)
+					if(reload) continue; /* Bridges not valid for reloading. */
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_connections", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
+					if(tmp_int < 1 || tmp_int > 1000){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_connections value (%d).", tmp_int);
+						return MOSQ_ERR_INVAL;
+					}
+					cur_bridge->connection_count = tmp_int;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_identity")){
 #if defined(WITH_BRIDGE) && defined(FINAL_WITH_TLS_PSK)
@@ -1047,6 +1165,22 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					}
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge and/or TLS-PSK support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_receive_maximum")){
+#if defined(WITH_BRIDGE)
+					if(reload) continue; /* Bridges not valid for reloading. */
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_receive_maximum", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
+					if(tmp_int < 1 || tmp_int > UINT16_MAX){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_receive_maximum value (%d).", tmp_int);
+						return MOSQ_ERR_INVAL;
+					}
+					cur_bridge->receive_maximum = (uint16_t)tmp_int;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_require_ocsp")){
 #if defined(WITH_BRIDGE) && defined(WITH_TLS)
@@ -1058,6 +1192,22 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					if(conf__parse_bool(&token, "bridge_require_ocsp", &cur_bridge->tls_ocsp_required, saveptr)) return MOSQ_ERR_INVAL;
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "bridge_max_inflight_messages")){
+#if defined(WITH_BRIDGE)
+					if(reload) continue; /* Bridges not valid for reloading. */
+					if(!cur_bridge){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge configuration.");
+						return MOSQ_ERR_INVAL;
+					}
+					if(conf__parse_int(&token, "bridge_max_inflight_messages", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
+					if(tmp_int < 0 || tmp_int > UINT16_MAX){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid bridge_max_inflight_messages value (%d).", tmp_int);
+						return MOSQ_ERR_INVAL;
+					}
+					cur_bridge->max_inflight_messages = (uint16_t)tmp_int;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
 				}else if(!strcmp(token, "bridge_max_packet_size")){
 #if defined(WITH_BRIDGE)
@@ -1238,6 +1388,9 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						config->clientid_prefixes = NULL;
 					}
 					if(conf__parse_string(&token, "clientid_prefixes", &config->clientid_prefixes, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "conflate_queued_messages")){
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "conflate_queued_messages", &cur_listener->conflate_queued_messages, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "connection")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -1279,6 +1432,8 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						cur_bridge->primary_retry_sock = INVALID_SOCKET;
 						cur_bridge->outgoing_retain = true;
 						cur_bridge->clean_start_local = -1;
+						cur_bridge->connection_count = 1;
+						cur_bridge->compression_threshold = 128;
 					}else{
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty connection value in configuration.");
 						return MOSQ_ERR_INVAL;
@@ -1306,6 +1461,8 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 #ifdef WITH_WEBSOCKETS
 					if(reload) continue; /* Listeners not valid for reloading. */
 					if(conf__parse_string(&token, "http_dir", &cur_listener->http_dir, saveptr)) return MOSQ_ERR_INVAL;
+#elif defined(WITH_WEBSOCKETS_BUILTIN)
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: http_dir is not supported by the built in websockets support.");
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Websockets support not available.");
 #endif
@@ -1662,6 +1819,14 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						return MOSQ_ERR_INVAL;
 					}
 					cur_listener->max_qos = (uint8_t)tmp_int;
+				}else if(!strcmp(token, "max_inflated_size")){
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_int(&token, "max_inflated_size", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
+					if(tmp_int <= 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid max_inflated_size value (%d).", tmp_int);
+						return MOSQ_ERR_INVAL;
+					}
+					cur_listener->max_inflated_size = (uint32_t)tmp_int;
 				}else if(!strcmp(token, "max_inflight_bytes")){
 					if(conf__parse_int(&token, "max_inflight_bytes", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
 					if(tmp_int < 0) tmp_int = 0;
@@ -1697,6 +1862,17 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					if(conf__parse_int(&token, "max_queued_messages", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
 					if(tmp_int < 0) tmp_int = 0;
 					config->max_queued_messages = tmp_int;
+				}else if(!strcmp(token, "max_tls_handshakes")){
+#ifdef WITH_TLS_POOL
+					if(reload) continue; /* Not valid for reloading. */
+					if(conf__parse_int(&token, "max_tls_handshakes", &config->max_tls_handshakes, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->max_tls_handshakes < 1){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: max_tls_handshakes must be at least 1.");
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS handshake thread support not available.");
+#endif
 				}else if(!strcmp(token, "memory_limit")){
 					ssize_t lim;
 					if(conf__parse_ssize_t(&token, "memory_limit", &lim, saveptr)) return MOSQ_ERR_INVAL;
@@ -1725,6 +1901,26 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 								cur_listener->mount_point);
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "mux_backend")){
+					if(reload) continue; /* Not valid for reloading. */
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "epoll")){
+							config->mux_backend = mux_b_default;
+						}else if(!strcmp(token, "io_uring")){
+#ifdef WITH_IO_URING
+							config->mux_backend = mux_b_io_uring;
+#else
+							log__printf(NULL, MOSQ_LOG_WARNING, "Warning: io_uring support not available.");
+#endif
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid mux_backend value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty mux_backend value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "notifications")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -1846,7 +2042,7 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 							cur_listener->protocol = mp_mqttsn;
 						*/
 						}else if(!strcmp(token, "websockets")){
-#ifdef WITH_WEBSOCKETS
+#if defined(WITH_WEBSOCKETS) || defined(WITH_WEBSOCKETS_BUILTIN)
 							cur_listener->protocol = mp_websockets;
 #else
 							log__printf(NULL, MOSQ_LOG_ERR, "Error: Websockets support not available.");
@@ -1963,6 +2159,37 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "shared_subscription_hash_property")){
+					if(reload){
+						mosquitto__free(config->shared_subscription_hash_property);
+						config->shared_subscription_hash_property = NULL;
+					}
+					if(conf__parse_string(&token, "shared_subscription_hash_property", &config->shared_subscription_hash_property, saveptr)) return MOSQ_ERR_INVAL;
+				}else if(!strcmp(token, "shared_subscription_max_queued")){
+					if(conf__parse_int(&token, "shared_subscription_max_queued", &config->shared_subscription_max_queued, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->shared_subscription_max_queued < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid shared_subscription_max_queued value (%d).", config->shared_subscription_max_queued);
+						return MOSQ_ERR_INVAL;
+					}
+				}else if(!strcmp(token, "shared_subscription_mode")){
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						if(!strcmp(token, "round_robin")){
+							config->shared_subscription_mode = shared_sm_round_robin;
+						}else if(!strcmp(token, "least_loaded")){
+							config->shared_subscription_mode = shared_sm_least_loaded;
+						}else if(!strcmp(token, "hash_topic")){
+							config->shared_subscription_mode = shared_sm_hash_topic;
+						}else if(!strcmp(token, "hash_property")){
+							config->shared_subscription_mode = shared_sm_hash_property;
+						}else{
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid shared_subscription_mode value (%s).", token);
+							return MOSQ_ERR_INVAL;
+						}
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty shared_subscription_mode value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "socket_domain")){
 					if(reload) continue; /* Listeners not valid for reloading. */
 					token = strtok_r(NULL, " ", &saveptr);
@@ -2030,6 +2257,65 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					mosquitto__free(keyform);
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_handshake_threads")){
+#ifdef WITH_TLS_POOL
+					if(reload) continue; /* Not valid for reloading. */
+					if(conf__parse_int(&token, "tls_handshake_threads", &config->tls_handshake_threads, saveptr)) return MOSQ_ERR_INVAL;
+					if(config->tls_handshake_threads < 0 || config->tls_handshake_threads > 1024){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_handshake_threads value (%d).", config->tls_handshake_threads);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS handshake thread support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ktls")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "tls_ktls", &cur_listener->ktls, saveptr)) return MOSQ_ERR_INVAL;
+#  ifndef SSL_OP_ENABLE_KTLS
+					if(cur_listener->ktls){
+						log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Kernel TLS not supported by this version of OpenSSL.");
+					}
+#  endif
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_cache_size")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_int(&token, "tls_session_cache_size", &cur_listener->tls_session_cache_size, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_cache_size < 0){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_cache_size value (%d).", cur_listener->tls_session_cache_size);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_tickets")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_bool(&token, "tls_session_tickets", &cur_listener->tls_session_tickets, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_session_timeout")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_int(&token, "tls_session_timeout", &cur_listener->tls_session_timeout, saveptr)) return MOSQ_ERR_INVAL;
+					if(cur_listener->tls_session_timeout < 1){
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid tls_session_timeout value (%d).", cur_listener->tls_session_timeout);
+						return MOSQ_ERR_INVAL;
+					}
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
+#endif
+				}else if(!strcmp(token, "tls_ticket_key_file")){
+#ifdef WITH_TLS
+					if(reload) continue; /* Listeners not valid for reloading. */
+					if(conf__parse_string(&token, "tls_ticket_key_file", &cur_listener->tls_ticket_key_file, saveptr)) return MOSQ_ERR_INVAL;
+#else
+					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: TLS support not available.");
 #endif
 				}else if(!strcmp(token, "tls_version")){
 #if defined(WITH_TLS)
@@ -2124,6 +2410,20 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_topic_alias value in configuration.");
 						return MOSQ_ERR_INVAL;
 					}
+				}else if(!strcmp(token, "max_topic_alias_broker")){
+					if(reload) continue; /* Listeners not valid for reloading. */
+					token = strtok_r(NULL, " ", &saveptr);
+					if(token){
+						tmp_int = atoi(token);
+						if(tmp_int < 0 || tmp_int > UINT16_MAX){
+							log__printf(NULL, MOSQ_LOG_ERR, "Error: Invalid max_topic_alias_broker value in configuration.");
+							return MOSQ_ERR_INVAL;
+						}
+						cur_listener->max_topic_alias_broker = (uint16_t)tmp_int;
+					}else{
+						log__printf(NULL, MOSQ_LOG_ERR, "Error: Empty max_topic_alias_broker value in configuration.");
+						return MOSQ_ERR_INVAL;
+					}
 				}else if(!strcmp(token, "try_private")){
 #ifdef WITH_BRIDGE
 					if(reload) continue; /* FIXME */
@@ -2169,6 +2469,8 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 #else
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Bridge support not available.");
 #endif
+				}else if(!strcmp(token, "write_coalescing")){
+					if(conf__parse_bool(&token, "write_coalescing", &config->write_coalescing, saveptr)) return MOSQ_ERR_INVAL;
 				}else if(!strcmp(token, "websockets_log_level")){
 #ifdef WITH_WEBSOCKETS
 					if(conf__parse_int(&token, "websockets_log_level", &config->websockets_log_level, saveptr)) return MOSQ_ERR_INVAL;
@@ -2176,7 +2478,7 @@ static int config__read_file_core(struct mosquitto__config *config, bool reload,
 					log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Websockets support not available.");
 #endif
 				}else if(!strcmp(token, "websockets_headers_size")){
-#ifdef WITH_WEBSOCKETS
+#if defined(WITH_WEBSOCKETS) || defined(WITH_WEBSOCKETS_BUILTIN)
 					if(conf__parse_int(&token, "websockets_headers_size", &tmp_int, saveptr)) return MOSQ_ERR_INVAL;
 					if(tmp_int < 0 || tmp_int > UINT16_MAX){
 						log__printf(NULL, MOSQ_LOG_WARNING, "Error: Websockets headers size must be between 0 and 65535 inclusive.");
@@ -2243,6 +2545,13 @@ static int config__check(struct mosquitto__config *config)
 
 	int i;
 
+	if(config->shared_subscription_mode == shared_sm_hash_property
+			&& config->shared_subscription_hash_property == NULL){
+
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: shared_subscription_mode hash_property requires shared_subscription_hash_property to be set.");
+		return MOSQ_ERR_INVAL;
+	}
+
 #ifdef WITH_BRIDGE
 	int j;
 	struct mosquitto__bridge *bridge1, *bridge2;
@@ -140,6 +140,7 @@ void context__cleanup(struct mosquitto *context, bool force_free)
 #endif
 
 	alias__free_all(context);
+	alias__out_free_all(context);
 	context__cleanup_out_packets(context);
 
 	mosquitto__free(context->auth_method);
@@ -169,6 +170,10 @@ void context__cleanup(struct mosquitto *context, bool force_free)
 	}
 	packet__cleanup(&(context->in_packet));
 	context__cleanup_out_packets(context);
+#ifdef WITH_WEBSOCKETS_BUILTIN
+	mosquitto__free(context->ws.http_buf);
+	context->ws.http_buf = NULL;
+#endif
 #if defined(WITH_BROKER) && defined(__GLIBC__) && defined(WITH_ADNS)
 	if(context->adns){
 		gai_cancel(context->adns);
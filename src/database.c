@@ -24,11 +24,22 @@ Contributors:
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "packet_mosq.h"
+#include "property_mosq.h"
 #include "send_mosq.h"
 #include "sys_tree.h"
 #include "time_mosq.h"
 #include "util_mosq.h"
 
+/* Payloads no longer than this are interned along with the topic, so that
+ * identical small payloads, like status messages, share a single copy. */
+#define MSG_STORE_INTERN_PAYLOAD_MAX 1024
+
+/* Topics, source ids and usernames of messages in db.msg_store, and small
+ * payloads. Backlogs of queued messages mostly repeat the same few values. */
+static struct intern__table msg_strings;
+
 /**
  * Is this context ready to take more in flight messages right now?
  * @param context the client context of interest
@@ -180,6 +191,131 @@ static void db__msg_remove_from_queued_stats(struct mosquitto_msg_data *msg_data
 }
 
 
+/* Inflight messages are indexed by mid so that PUBACK/PUBREC/PUBREL/PUBCOMP
+ * don't have to walk the inflight list. QoS 0 messages all have mid 0 and are
+ * never acknowledged, so are left out. */
+void db__msg_add_to_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg)
+{
+	if(msg->mid != 0){
+		HASH_ADD(hh_mid, msg_data->inflight_by_mid, mid, sizeof(msg->mid), msg);
+	}
+}
+
+
+void db__msg_remove_from_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg)
+{
+	if(msg->mid != 0){
+		HASH_DELETE(hh_mid, msg_data->inflight_by_mid, msg);
+	}
+}
+
+
+static struct mosquitto_client_msg *db__msg_find_inflight(struct mosquitto_msg_data *msg_data, uint16_t mid)
+{
+	struct mosquitto_client_msg *msg;
+
+	if(mid == 0){
+		return NULL;
+	}
+	HASH_FIND(hh_mid, msg_data->inflight_by_mid, &mid, sizeof(mid), msg);
+	return msg;
+}
+
+
+/* Queued messages are held in a ring buffer rather than a list, so draining
+ * or expiring a large offline backlog walks memory in order and doesn't need
+ * an allocation per message. The buffer size is always a power of two.
+ * Pointers into the queue are only valid until it is next modified. */
+struct mosquitto_client_msg *db__msg_queue_get(struct mosquitto_msg_data *msg_data, int index)
+{
+	return &msg_data->queued[(msg_data->queue_first + index) & (msg_data->queue_size - 1)];
+}
+
+
+/* Add an empty message to the end of the queue. */
+struct mosquitto_client_msg *db__msg_queue_push(struct mosquitto_msg_data *msg_data)
+{
+	struct mosquitto_client_msg *queued;
+	struct mosquitto_client_msg *msg;
+	int size;
+	int wrapped;
+
+	if(msg_data->queue_len == msg_data->queue_size){
+		size = msg_data->queue_size ? msg_data->queue_size*2 : 16;
+		queued = mosquitto__realloc(msg_data->queued, sizeof(struct mosquitto_client_msg)*(size_t)size);
+		if(queued == NULL){
+			return NULL;
+		}
+		/* Unwrap anything before queue_first to after the old end */
+		wrapped = msg_data->queue_first + msg_data->queue_len - msg_data->queue_size;
+		if(wrapped > 0){
+			memcpy(&queued[msg_data->queue_size], queued, sizeof(struct mosquitto_client_msg)*(size_t)wrapped);
+		}
+		msg_data->queued = queued;
+		msg_data->queue_size = size;
+	}
+	msg_data->queue_len++;
+	msg = db__msg_queue_get(msg_data, msg_data->queue_len-1);
+	memset(msg, 0, sizeof(struct mosquitto_client_msg));
+	return msg;
+}
+
+
+static void db__msg_queue_free_if_empty(struct mosquitto_msg_data *msg_data)
+{
+	if(msg_data->queue_len == 0){
+		mosquitto__free(msg_data->queued);
+		msg_data->queued = NULL;
+		msg_data->queue_first = 0;
+		msg_data->queue_size = 0;
+	}
+}
+
+
+static void db__msg_queue_pop(struct mosquitto_msg_data *msg_data)
+{
+	msg_data->queue_first = (msg_data->queue_first + 1) & (msg_data->queue_size - 1);
+	msg_data->queue_len--;
+	db__msg_queue_free_if_empty(msg_data);
+}
+
+
+/* Remove messages whose store has been released from the queue, keeping the
+ * order of the remaining messages. */
+void db__msg_queue_compact(struct mosquitto_msg_data *msg_data)
+{
+	struct mosquitto_client_msg *msg;
+	int i, len = 0;
+
+	for(i=0; i<msg_data->queue_len; i++){
+		msg = db__msg_queue_get(msg_data, i);
+		if(msg->store){
+			if(i != len){
+				*db__msg_queue_get(msg_data, len) = *msg;
+			}
+			len++;
+		}
+	}
+	msg_data->queue_len = len;
+	db__msg_queue_free_if_empty(msg_data);
+}
+
+
+static void db__msg_queue_clear(struct mosquitto_msg_data *msg_data)
+{
+	struct mosquitto_client_msg *msg;
+	int i;
+
+	for(i=0; i<msg_data->queue_len; i++){
+		msg = db__msg_queue_get(msg_data, i);
+		db__msg_store_ref_dec(&msg->store);
+		mosquitto_property_free_all(&msg->properties);
+	}
+	msg_data->queue_len = 0;
+	db__msg_queue_free_if_empty(msg_data);
+}
+
+
 int db__open(struct mosquitto__config *config)
 {
 	struct mosquitto__subhier *subhier;
@@ -199,12 +335,14 @@ int db__open(struct mosquitto__config *config)
 	/* Initialize the hashtable */
 	db.clientid_index_hash = NULL;
 
-	db.subs = NULL;
+	/* db.subs is an unnamed holder, its children are the "" and "$SYS" roots */
+	db.subs = sub__add_hier_entry(NULL, "", 0);
+	if(!db.subs) return MOSQ_ERR_NOMEM;
 
-	subhier = sub__add_hier_entry(NULL, &db.subs, "", 0);
+	subhier = sub__add_hier_entry(db.subs, "", 0);
 	if(!subhier) return MOSQ_ERR_NOMEM;
 
-	subhier = sub__add_hier_entry(NULL, &db.subs, "$SYS", (uint16_t)strlen("$SYS"));
+	subhier = sub__add_hier_entry(db.subs, "$SYS", (uint16_t)strlen("$SYS"));
 	if(!subhier) return MOSQ_ERR_NOMEM;
 
 	retain__init();
@@ -218,31 +356,61 @@ int db__open(struct mosquitto__config *config)
 	return MOSQ_ERR_SUCCESS;
 }
 
-static void subhier_clean(struct mosquitto__subhier **subhier)
+int db__close(void)
 {
-	struct mosquitto__subhier *peer, *subhier_tmp;
-	struct mosquitto__subleaf *leaf, *nextleaf;
+	sub__tree_clean(&db.subs);
+	retain__clean(&db.retains);
+	db__msg_store_clean();
+
+	return MOSQ_ERR_SUCCESS;
+}
 
-	HASH_ITER(hh, *subhier, peer, subhier_tmp){
-		leaf = peer->subs;
-		while(leaf){
-			nextleaf = leaf->next;
-			mosquitto__free(leaf);
-			leaf = nextleaf;
-		}
-		subhier_clean(&peer->children);
-		mosquitto__free(peer->topic);
 
-		HASH_DELETE(hh, *subhier, peer);
-		mosquitto__free(peer);
+static int db__msg_store_intern_source(struct mosquitto_msg_store *store, const struct mosquitto *source)
+{
+	if(source && source->id){
+		store->source_id = intern__get(&msg_strings, source->id, strlen(source->id));
+	}else{
+		store->source_id = intern__get(&msg_strings, "", 0);
+	}
+	if(!store->source_id){
+		return MOSQ_ERR_NOMEM;
+	}
+	if(source && source->username){
+		store->source_username = intern__get(&msg_strings, source->username, strlen(source->username));
+		if(!store->source_username){
+			return MOSQ_ERR_NOMEM;
+		}
 	}
+	return MOSQ_ERR_SUCCESS;
 }
 
-int db__close(void)
+
+/* Replace the topic and small payloads with interned copies. This must not be
+ * done while anything else may still hold pointers to the originals. */
+static int db__msg_store_intern_data(struct mosquitto_msg_store *store)
 {
-	subhier_clean(&db.subs);
-	retain__clean(&db.retains);
-	db__msg_store_clean();
+	char *topic = NULL;
+	void *payload;
+
+	if(store->topic){
+		topic = intern__get(&msg_strings, store->topic, strlen(store->topic));
+		if(!topic){
+			return MOSQ_ERR_NOMEM;
+		}
+	}
+	if(store->payload && store->payloadlen <= MSG_STORE_INTERN_PAYLOAD_MAX){
+		payload = intern__get(&msg_strings, store->payload, store->payloadlen);
+		if(!payload){
+			intern__release(&msg_strings, topic);
+			return MOSQ_ERR_NOMEM;
+		}
+		mosquitto__free(store->payload);
+		store->payload = payload;
+	}
+	mosquitto__free(store->topic);
+	store->topic = topic;
+	store->interned = true;
 
 	return MOSQ_ERR_SUCCESS;
 }
@@ -259,26 +427,57 @@ void db__msg_store_add(struct mosquitto_msg_store *store)
 }
 
 
+/* Add a message from db__message_store_transient() to db.msg_store, because a
+ * client needs to keep a reference to it. */
+static int db__msg_store_register(struct mosquitto_msg_store *store)
+{
+	const struct mosquitto *source = store->transient_source;
+
+	store->transient = false;
+	store->transient_source = NULL;
+	db.msg_store_count++;
+	db.msg_store_bytes += store->payloadlen;
+	db__msg_store_add(store);
+
+	/* The topic and payload are in use by sub__messages_queue(), so are left
+	 * as they are. */
+	return db__msg_store_intern_source(store, source);
+}
+
+
 void db__msg_store_free(struct mosquitto_msg_store *store)
 {
 	int i;
 
-	mosquitto__free(store->source_id);
-	mosquitto__free(store->source_username);
+	intern__release(&msg_strings, store->source_id);
+	intern__release(&msg_strings, store->source_username);
 	if(store->dest_ids){
 		for(i=0; i<store->dest_id_count; i++){
 			mosquitto__free(store->dest_ids[i]);
 		}
 		mosquitto__free(store->dest_ids);
 	}
-	mosquitto__free(store->topic);
 	mosquitto_property_free_all(&store->properties);
-	mosquitto__free(store->payload);
+	if(store->interned){
+		intern__release(&msg_strings, store->topic);
+		if(store->payloadlen <= MSG_STORE_INTERN_PAYLOAD_MAX){
+			intern__release(&msg_strings, store->payload);
+		}else{
+			mosquitto__free(store->payload);
+		}
+	}else{
+		mosquitto__free(store->topic);
+		mosquitto__free(store->payload);
+	}
 	mosquitto__free(store);
 }
 
 void db__msg_store_remove(struct mosquitto_msg_store *store)
 {
+	if(store->transient){
+		db__msg_store_free(store);
+		return;
+	}
 	if(store->prev){
 		store->prev->next = store->next;
 		if(store->next){
@@ -346,6 +545,7 @@ static void db__message_remove_from_inflight(struct mosquitto_msg_data *msg_data
 	}
 
 	DL_DELETE(msg_data->inflight, item);
+	db__msg_remove_from_inflight_index(msg_data, item);
 	if(item->store){
 		db__msg_remove_from_inflight_stats(msg_data, item);
 		db__msg_store_ref_dec(&item->store);
@@ -356,67 +556,70 @@ static void db__message_remove_from_inflight(struct mosquitto_msg_data *msg_data
 }
 
 
-static void db__message_remove_from_queued(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *item)
+/* Release a queued message, it is removed by the next db__msg_queue_compact() */
+static void db__message_remove_from_queued(struct mosquitto_client_msg *item)
 {
-	if(!msg_data || !item){
-		return;
-	}
-
-	DL_DELETE(msg_data->queued, item);
 	if(item->store){
 		db__msg_store_ref_dec(&item->store);
+		item->store = NULL;
 	}
-
 	mosquitto_property_free_all(&item->properties);
-	mosquitto__free(item);
 }
 
 
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
+/* Move the first queued message to the end of the inflight list, returning
+ * the inflight copy. */
+struct mosquitto_client_msg *db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
 {
 	struct mosquitto_client_msg *msg;
 
 	UNUSED(context);
 
-	msg = msg_data->queued;
-	DL_DELETE(msg_data->queued, msg);
+	msg = mosquitto__malloc(sizeof(struct mosquitto_client_msg));
+	if(msg == NULL){
+		return NULL;
+	}
+	*msg = *db__msg_queue_get(msg_data, 0);
+	db__msg_queue_pop(msg_data);
 	DL_APPEND(msg_data->inflight, msg);
+	db__msg_add_to_inflight_index(msg_data, msg);
 	if(msg_data->inflight_quota > 0){
 		msg_data->inflight_quota--;
 	}
 
 	db__msg_remove_from_queued_stats(msg_data, msg);
 	db__msg_add_to_inflight_stats(msg_data, msg);
+	return msg;
 }
 
 
 int db__message_delete_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos)
 {
-	struct mosquitto_client_msg *tail, *tmp;
-	int msg_index = 0;
+	struct mosquitto_client_msg *tail;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
-	DL_FOREACH_SAFE(context->msgs_out.inflight, tail, tmp){
-		msg_index++;
-		if(tail->mid == mid){
-			if(tail->qos != qos){
-				return MOSQ_ERR_PROTOCOL;
-			}else if(qos == 2 && tail->state != expect_state){
-				return MOSQ_ERR_PROTOCOL;
-			}
-			msg_index--;
-			db__message_remove_from_inflight(&context->msgs_out, tail);
-			break;
+	tail = db__msg_find_inflight(&context->msgs_out, mid);
+	if(tail){
+		if(tail->qos != qos){
+			return MOSQ_ERR_PROTOCOL;
+		}else if(qos == 2 && tail->state != expect_state){
+			return MOSQ_ERR_PROTOCOL;
 		}
+#ifdef WITH_BRIDGE
+		if(qos == 1){
+			bridge__rtt_sample_end(context, mid);
+		}
+#endif
+		db__message_remove_from_inflight(&context->msgs_out, tail);
 	}
 
-	DL_FOREACH_SAFE(context->msgs_out.queued, tail, tmp){
+	while(context->msgs_out.queue_len > 0){
+		tail = db__msg_queue_get(&context->msgs_out, 0);
 		if(!db__ready_for_flight(context, mosq_md_out, tail->qos)){
 			break;
 		}
 
-		msg_index++;
 		tail->timestamp = db.now_s;
 		switch(tail->qos){
 			case 0:
@@ -429,7 +632,9 @@ int db__message_delete_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 				tail->state = mosq_ms_publish_qos2;
 				break;
 		}
-		db__message_dequeue_first(context, &context->msgs_out);
+		if(db__message_dequeue_first(context, &context->msgs_out) == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
 	}
 #ifdef WITH_PERSISTENCE
 	db.persistence_changes++;
@@ -438,7 +643,131 @@ int db__message_delete_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 	return db__message_write_inflight_out_latest(context);
 }
 
-int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties, bool update)
+/* A QoS 0 message can be written straight to a connected client, unless that
+ * would overtake messages that are still waiting to be sent. */
+static bool db__message_can_send_direct(struct mosquitto *context)
+{
+	struct mosquitto_client_msg *tail;
+
+	if(context->sock == INVALID_SOCKET
+			|| context->state != mosq_cs_active
+			|| db__ready_for_flight(context, mosq_md_out, 0) == false){
+
+		return false;
+	}
+	if(context->msgs_out.inflight){
+		tail = context->msgs_out.inflight->prev;
+		if(tail->state == mosq_ms_publish_qos0
+				|| tail->state == mosq_ms_publish_qos1
+				|| tail->state == mosq_ms_publish_qos2){
+
+			return false;
+		}
+	}
+	return true;
+}
+
+
+/* Subscription identifiers are sent from a property on the caller's stack,
+ * ahead of any other client message properties, rather than allocating a
+ * property list for every message delivered to a subscription. */
+const mosquitto_property *db__subscription_identifier_property(mosquitto_property *prop, uint32_t subscription_identifier, const mosquitto_property *next)
+{
+	if(subscription_identifier == 0){
+		return next;
+	}
+	memset(prop, 0, sizeof(mosquitto_property));
+	prop->identifier = MQTT_PROP_SUBSCRIPTION_IDENTIFIER;
+	prop->value.varint = subscription_identifier;
+	prop->next = (mosquitto_property *)next;
+	return prop;
+}
+
+
+/* Send a QoS 0 message to a client without creating a client message, which
+ * would only be removed again as soon as the message had been written. */
+static int db__message_send_direct(struct mosquitto *context, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties)
+{
+	uint32_t expiry_interval = 0;
+	mosquitto_property subid_prop;
+	int rc;
+
+	if(stored->message_expiry_time){
+		if(db.now_real_s > stored->message_expiry_time){
+			/* Message is expired, must not send. */
+			mosquitto_property_free_all(&properties);
+			return MOSQ_ERR_SUCCESS;
+		}
+		expiry_interval = (uint32_t)(stored->message_expiry_time - db.now_real_s);
+	}
+	if(retain == false){
+		/* Stands in for dest_ids when checking for duplicates */
+		context->last_direct_db_id = stored->db_id;
+	}
+
+	rc = send__publish(context, 0, stored->topic, stored->payloadlen, stored->payload, 0, retain, 0,
+			db__subscription_identifier_property(&subid_prop, subscription_identifier, properties),
+			stored->properties, expiry_interval);
+	mosquitto_property_free_all(&properties);
+	if(rc == MOSQ_ERR_OVERSIZE_PACKET){
+		return MOSQ_ERR_SUCCESS;
+	}
+	return rc;
+}
+
+
+/* For listeners with conflate_queued_messages set, replace a message for the
+ * same topic that is already waiting in the queue of an outgoing message
+ * instead of queuing another one. The client then only receives the latest
+ * value of each topic, and the queue can't grow beyond the number of topics
+ * the client is subscribed to. Returns true if the message was conflated. */
+static bool db__message_conflate(struct mosquitto *context, struct mosquitto_msg_data *msg_data, uint16_t mid, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties)
+{
+	struct mosquitto_client_msg *msg;
+	int i;
+
+	if(stored->topic == NULL){
+		return false;
+	}
+
+	/* The most recently queued messages are the most likely to match */
+	for(i=msg_data->queue_len-1; i>=0; i--){
+		msg = db__msg_queue_get(msg_data, i);
+		if(msg->store->topic == NULL || strcmp(msg->store->topic, stored->topic)){
+			continue;
+		}
+
+		if(stored->transient && db__msg_store_register(stored)){
+			return false;
+		}
+		db__msg_remove_from_queued_stats(msg_data, msg);
+		db__msg_store_ref_inc(stored);
+		db__msg_store_ref_dec(&msg->store);
+		mosquitto_property_free_all(&msg->properties);
+
+		msg->store = stored;
+		msg->subscription_identifier = subscription_identifier;
+		msg->properties = properties;
+		msg->mid = mid;
+		msg->timestamp = db.now_s;
+		msg->dup = 0;
+		if(qos > context->max_qos){
+			msg->qos = context->max_qos;
+		}else{
+			msg->qos = qos;
+		}
+		msg->retain = retain;
+		db__msg_add_to_queued_stats(msg_data, msg);
+#ifdef WITH_PERSISTENCE
+		db.persistence_changes++;
+#endif
+		return true;
+	}
+	return false;
+}
+
+
+int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties, bool update)
 {
 	struct mosquitto_client_msg *msg;
 	struct mosquitto_msg_data *msg_data;
@@ -446,6 +775,7 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	int rc = 0;
 	int i;
 	char **dest_ids;
+	bool conflate;
 
 	assert(stored);
 	if(!context) return MOSQ_ERR_INVAL;
@@ -466,8 +796,13 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	 */
 	if(context->protocol != mosq_p_mqtt5
 			&& db.config->allow_duplicate_messages == false
-			&& dir == mosq_md_out && retain == false && stored->dest_ids){
+			&& dir == mosq_md_out && retain == false){
 
+		if(context->last_direct_db_id == stored->db_id){
+			/* We have already sent this message to this client. */
+			mosquitto_property_free_all(&properties);
+			return MOSQ_ERR_SUCCESS;
+		}
 		for(i=0; i<stored->dest_id_count; i++){
 			if(stored->dest_ids[i] && !strcmp(stored->dest_ids[i], context->id)){
 				/* We have already sent this message to this client. */
@@ -495,6 +830,12 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 		}
 	}
 
+	if(dir == mosq_md_out && qos == 0 && update && db__message_can_send_direct(context)){
+		return db__message_send_direct(context, retain, stored, subscription_identifier, properties);
+	}
+
+	conflate = (dir == mosq_md_out && context->conflate_queued);
+
 	if(context->sock != INVALID_SOCKET){
 		if(db__ready_for_flight(context, dir, qos)){
 			if(dir == mosq_md_out){
@@ -517,6 +858,8 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 					return 1;
 				}
 			}
+		}else if(qos != 0 && conflate && db__message_conflate(context, msg_data, mid, qos, retain, stored, subscription_identifier, properties)){
+			return 2;
 		}else if(qos != 0 && db__ready_for_queue(context, qos, msg_data)){
 			state = mosq_ms_queued;
 			rc = 2;
@@ -533,7 +876,9 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 			return 2;
 		}
 	}else{
-		if (db__ready_for_queue(context, qos, msg_data)){
+		if(conflate && db__message_conflate(context, msg_data, mid, qos, retain, stored, subscription_identifier, properties)){
+			return MOSQ_ERR_SUCCESS;
+		}else if (db__ready_for_queue(context, qos, msg_data)){
 			state = mosq_ms_queued;
 		}else{
 			G_MSGS_DROPPED_INC();
@@ -555,10 +900,20 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	}
 #endif
 
-	msg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
-	if(!msg) return MOSQ_ERR_NOMEM;
-	msg->prev = NULL;
-	msg->next = NULL;
+	if(stored->transient && db__msg_store_register(stored)){
+		mosquitto_property_free_all(&properties);
+		return MOSQ_ERR_NOMEM;
+	}
+
+	if(state == mosq_ms_queued){
+		msg = db__msg_queue_push(msg_data);
+	}else{
+		msg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	}
+	if(!msg){
+		mosquitto_property_free_all(&properties);
+		return MOSQ_ERR_NOMEM;
+	}
 	msg->store = stored;
 	db__msg_store_ref_inc(msg->store);
 	msg->mid = mid;
@@ -572,13 +927,14 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 		msg->qos = qos;
 	}
 	msg->retain = retain;
+	msg->subscription_identifier = subscription_identifier;
 	msg->properties = properties;
 
 	if(state == mosq_ms_queued){
-		DL_APPEND(msg_data->queued, msg);
 		db__msg_add_to_queued_stats(msg_data, msg);
 	}else{
 		DL_APPEND(msg_data->inflight, msg);
+		db__msg_add_to_inflight_index(msg_data, msg);
 		db__msg_add_to_inflight_stats(msg_data, msg);
 	}
 
@@ -631,17 +987,21 @@ int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mo
 {
 	struct mosquitto_client_msg *tail;
 
-	DL_FOREACH(context->msgs_out.inflight, tail){
-		if(tail->mid == mid){
-			if(tail->qos != qos){
-				return MOSQ_ERR_PROTOCOL;
-			}
-			tail->state = state;
-			tail->timestamp = db.now_s;
-			return MOSQ_ERR_SUCCESS;
-		}
+	tail = db__msg_find_inflight(&context->msgs_out, mid);
+	if(tail == NULL){
+		return MOSQ_ERR_NOT_FOUND;
+	}
+	if(tail->qos != qos){
+		return MOSQ_ERR_PROTOCOL;
+	}
+#ifdef WITH_BRIDGE
+	if(state == mosq_ms_wait_for_pubcomp){
+		bridge__rtt_sample_end(context, mid);
 	}
-	return MOSQ_ERR_NOT_FOUND;
+#endif
+	tail->state = state;
+	tail->timestamp = db.now_s;
+	return MOSQ_ERR_SUCCESS;
 }
 
 
@@ -664,8 +1024,9 @@ int db__messages_delete(struct mosquitto *context, bool force_free)
 	if(!context) return MOSQ_ERR_INVAL;
 
 	if(force_free || context->clean_start || (context->bridge && context->bridge->clean_start)){
+		HASH_CLEAR(hh_mid, context->msgs_in.inflight_by_mid);
 		db__messages_delete_list(&context->msgs_in.inflight);
-		db__messages_delete_list(&context->msgs_in.queued);
+		db__msg_queue_clear(&context->msgs_in);
 		context->msgs_in.inflight_bytes = 0;
 		context->msgs_in.inflight_bytes12 = 0;
 		context->msgs_in.inflight_count = 0;
@@ -679,8 +1040,9 @@ int db__messages_delete(struct mosquitto *context, bool force_free)
 	if(force_free || (context->bridge && context->bridge->clean_start_local)
 			|| (context->bridge == NULL && context->clean_start)){
 
+		HASH_CLEAR(hh_mid, context->msgs_out.inflight_by_mid);
 		db__messages_delete_list(&context->msgs_out.inflight);
-		db__messages_delete_list(&context->msgs_out.queued);
+		db__msg_queue_clear(&context->msgs_out);
 		context->msgs_out.inflight_bytes = 0;
 		context->msgs_out.inflight_bytes12 = 0;
 		context->msgs_out.inflight_count = 0;
@@ -743,34 +1105,28 @@ int db__messages_easy_queue(struct mosquitto *context, const char *topic, uint8_
 	}else{
 		origin = mosq_mo_broker;
 	}
-	if(db__message_store(context, stored, message_expiry_interval, 0, origin)) return 1;
+	if(stored->qos == 0 && stored->retain == 0){
+		db__message_store_transient(context, stored, message_expiry_interval, origin);
+	}else if(db__message_store(context, stored, message_expiry_interval, 0, origin)){
+		return 1;
+	}
 
 	return sub__messages_queue(source_id, stored->topic, stored->qos, stored->retain, &stored);
 }
 
-/* This function requires topic to be allocated on the heap. Once called, it owns topic and will free it on error. Likewise payload and properties. */
+/* This function requires topic to be allocated on the heap. Once called, it owns topic and will free it on error. Likewise payload and properties.
+ * On success the topic and payload may have been replaced by interned copies, so must not be modified. */
 int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store *stored, uint32_t message_expiry_interval, dbid_t store_id, enum mosquitto_msg_origin origin)
 {
 	assert(stored);
 
-	if(source && source->id){
-		stored->source_id = mosquitto__strdup(source->id);
-	}else{
-		stored->source_id = mosquitto__strdup("");
-	}
-	if(!stored->source_id){
+	if(db__msg_store_intern_source(stored, source)
+			|| db__msg_store_intern_data(stored)){
+
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		db__msg_store_free(stored);
 		return MOSQ_ERR_NOMEM;
 	}
-
-	if(source && source->username){
-		stored->source_username = mosquitto__strdup(source->username);
-		if(!stored->source_username){
-			db__msg_store_free(stored);
-			return MOSQ_ERR_NOMEM;
-		}
-	}
 	if(source){
 		stored->source_listener = source->listener;
 	}
@@ -798,22 +1154,51 @@ int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store
 	return MOSQ_ERR_SUCCESS;
 }
 
+/* Set up a message that may only ever be sent directly to clients. It is not
+ * added to db.msg_store until something needs to keep a reference to it, see
+ * db__msg_store_register(). The source must remain valid until the message
+ * has been passed to sub__messages_queue(). */
+void db__message_store_transient(const struct mosquitto *source, struct mosquitto_msg_store *stored, uint32_t message_expiry_interval, enum mosquitto_msg_origin origin)
+{
+	assert(stored);
+
+	stored->transient = true;
+	stored->transient_source = source;
+	if(source){
+		stored->source_listener = source->listener;
+	}
+	stored->mid = 0;
+	stored->origin = origin;
+	if(message_expiry_interval > 0){
+		stored->message_expiry_time = db.now_real_s + message_expiry_interval;
+	}else{
+		stored->message_expiry_time = 0;
+	}
+	stored->dest_ids = NULL;
+	stored->dest_id_count = 0;
+	stored->db_id = ++db.last_db_id;
+}
+
+
 int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_client_msg **client_msg)
 {
 	struct mosquitto_client_msg *cmsg;
+	int i;
 
 	*client_msg = NULL;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
-	DL_FOREACH(context->msgs_in.inflight, cmsg){
-		if(cmsg->store->source_mid == mid){
-			*client_msg = cmsg;
-			return MOSQ_ERR_SUCCESS;
-		}
+	cmsg = db__msg_find_inflight(&context->msgs_in, mid);
+	if(cmsg){
+		*client_msg = cmsg;
+		return MOSQ_ERR_SUCCESS;
 	}
 
-	DL_FOREACH(context->msgs_in.queued, cmsg){
+	/* Incoming messages are only queued when the inflight quota has been
+	 * exceeded, so this list is normally empty. */
+	for(i=0; i<context->msgs_in.queue_len; i++){
+		cmsg = db__msg_queue_get(&context->msgs_in, i);
 		if(cmsg->store->source_mid == mid){
 			*client_msg = cmsg;
 			return MOSQ_ERR_SUCCESS;
@@ -828,6 +1213,7 @@ int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosqu
 static int db__message_reconnect_reset_outgoing(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg, *tmp;
+	int i;
 
 	context->msgs_out.inflight_bytes = 0;
 	context->msgs_out.inflight_bytes12 = 0;
@@ -867,21 +1253,27 @@ static int db__message_reconnect_reset_outgoing(struct mosquitto *context)
 	 * get sent until the client next receives a message - and they
 	 * will be sent out of order.
 	 */
-	DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
-		db__msg_add_to_queued_stats(&context->msgs_out, msg);
-		if(db__ready_for_flight(context, mosq_md_out, msg->qos)){
-			switch(msg->qos){
-				case 0:
-					msg->state = mosq_ms_publish_qos0;
-					break;
-				case 1:
-					msg->state = mosq_ms_publish_qos1;
-					break;
-				case 2:
-					msg->state = mosq_ms_publish_qos2;
-					break;
-			}
-			db__message_dequeue_first(context, &context->msgs_out);
+	for(i=0; i<context->msgs_out.queue_len; i++){
+		db__msg_add_to_queued_stats(&context->msgs_out, db__msg_queue_get(&context->msgs_out, i));
+	}
+	while(context->msgs_out.queue_len > 0){
+		msg = db__msg_queue_get(&context->msgs_out, 0);
+		if(!db__ready_for_flight(context, mosq_md_out, msg->qos)){
+			break;
+		}
+		switch(msg->qos){
+			case 0:
+				msg->state = mosq_ms_publish_qos0;
+				break;
+			case 1:
+				msg->state = mosq_ms_publish_qos1;
+				break;
+			case 2:
+				msg->state = mosq_ms_publish_qos2;
+				break;
+		}
+		if(db__message_dequeue_first(context, &context->msgs_out) == NULL){
+			return MOSQ_ERR_NOMEM;
 		}
 	}
 
@@ -893,6 +1285,7 @@ static int db__message_reconnect_reset_outgoing(struct mosquitto *context)
 static int db__message_reconnect_reset_incoming(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg, *tmp;
+	int i;
 
 	context->msgs_in.inflight_bytes = 0;
 	context->msgs_in.inflight_bytes12 = 0;
@@ -927,22 +1320,29 @@ static int db__message_reconnect_reset_incoming(struct mosquitto *context)
 	 * get sent until the client next receives a message - and they
 	 * will be sent out of order.
 	 */
-	DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
+	for(i=0; i<context->msgs_in.queue_len; i++){
+		msg = db__msg_queue_get(&context->msgs_in, i);
 		msg->dup = 0;
 		db__msg_add_to_queued_stats(&context->msgs_in, msg);
-		if(db__ready_for_flight(context, mosq_md_in, msg->qos)){
-			switch(msg->qos){
-				case 0:
-					msg->state = mosq_ms_publish_qos0;
-					break;
-				case 1:
-					msg->state = mosq_ms_publish_qos1;
-					break;
-				case 2:
-					msg->state = mosq_ms_publish_qos2;
-					break;
-			}
-			db__message_dequeue_first(context, &context->msgs_in);
+	}
+	while(context->msgs_in.queue_len > 0){
+		msg = db__msg_queue_get(&context->msgs_in, 0);
+		if(!db__ready_for_flight(context, mosq_md_in, msg->qos)){
+			break;
+		}
+		switch(msg->qos){
+			case 0:
+				msg->state = mosq_ms_publish_qos0;
+				break;
+			case 1:
+				msg->state = mosq_ms_publish_qos1;
+				break;
+			case 2:
+				msg->state = mosq_ms_publish_qos2;
+				break;
+		}
+		if(db__message_dequeue_first(context, &context->msgs_in) == NULL){
+			return MOSQ_ERR_NOMEM;
 		}
 	}
 
@@ -962,77 +1362,75 @@ int db__message_reconnect_reset(struct mosquitto *context)
 
 int db__message_remove_incoming(struct mosquitto* context, uint16_t mid)
 {
-	struct mosquitto_client_msg *tail, *tmp;
+	struct mosquitto_client_msg *tail;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
-	DL_FOREACH_SAFE(context->msgs_in.inflight, tail, tmp){
-		if(tail->mid == mid) {
-			if(tail->store->qos != 2){
-				return MOSQ_ERR_PROTOCOL;
-			}
-			db__message_remove_from_inflight(&context->msgs_in, tail);
-			return MOSQ_ERR_SUCCESS;
-		}
+	tail = db__msg_find_inflight(&context->msgs_in, mid);
+	if(tail == NULL){
+		return MOSQ_ERR_NOT_FOUND;
 	}
-
-	return MOSQ_ERR_NOT_FOUND;
+	if(tail->store->qos != 2){
+		return MOSQ_ERR_PROTOCOL;
+	}
+	db__message_remove_from_inflight(&context->msgs_in, tail);
+	return MOSQ_ERR_SUCCESS;
 }
 
 
 int db__message_release_incoming(struct mosquitto *context, uint16_t mid)
 {
-	struct mosquitto_client_msg *tail, *tmp;
+	struct mosquitto_client_msg *tail;
 	int retain;
 	char *topic;
 	char *source_id;
-	int msg_index = 0;
 	bool deleted = false;
 	int rc;
 
 	if(!context) return MOSQ_ERR_INVAL;
 
-	DL_FOREACH_SAFE(context->msgs_in.inflight, tail, tmp){
-		msg_index++;
-		if(tail->mid == mid){
-			if(tail->store->qos != 2){
-				return MOSQ_ERR_PROTOCOL;
-			}
-			topic = tail->store->topic;
-			retain = tail->retain;
-			source_id = tail->store->source_id;
-
-			/* topic==NULL should be a QoS 2 message that was
-			 * denied/dropped and is being processed so the client doesn't
-			 * keep resending it. That means we don't send it to other
-			 * clients. */
-			if(topic == NULL){
+	tail = db__msg_find_inflight(&context->msgs_in, mid);
+	if(tail){
+		if(tail->store->qos != 2){
+			return MOSQ_ERR_PROTOCOL;
+		}
+		topic = tail->store->topic;
+		retain = tail->retain;
+		source_id = tail->store->source_id;
+
+		/* topic==NULL should be a QoS 2 message that was
+		 * denied/dropped and is being processed so the client doesn't
+		 * keep resending it. That means we don't send it to other
+		 * clients. */
+		if(topic == NULL){
+			db__message_remove_from_inflight(&context->msgs_in, tail);
+			deleted = true;
+		}else{
+			rc = sub__messages_queue(source_id, topic, 2, retain, &tail->store);
+			if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
 				db__message_remove_from_inflight(&context->msgs_in, tail);
 				deleted = true;
 			}else{
-				rc = sub__messages_queue(source_id, topic, 2, retain, &tail->store);
-				if(rc == MOSQ_ERR_SUCCESS || rc == MOSQ_ERR_NO_SUBSCRIBERS){
-					db__message_remove_from_inflight(&context->msgs_in, tail);
-					deleted = true;
-				}else{
-					return 1;
-				}
+				return 1;
 			}
 		}
 	}
 
-	DL_FOREACH_SAFE(context->msgs_in.queued, tail, tmp){
+	while(context->msgs_in.queue_len > 0){
+		tail = db__msg_queue_get(&context->msgs_in, 0);
 		if(db__ready_for_flight(context, mosq_md_in, tail->qos)){
 			break;
 		}
 
-		msg_index++;
 		tail->timestamp = db.now_s;
 
-		if(tail->qos == 2){
-			send__pubrec(context, tail->mid, 0, NULL);
-			tail->state = mosq_ms_wait_for_pubrel;
-			db__message_dequeue_first(context, &context->msgs_in);
+		if(tail->qos != 2){
+			break;
+		}
+		send__pubrec(context, tail->mid, 0, NULL);
+		tail->state = mosq_ms_wait_for_pubrel;
+		if(db__message_dequeue_first(context, &context->msgs_in) == NULL){
+			return MOSQ_ERR_NOMEM;
 		}
 	}
 	if(deleted){
@@ -1046,6 +1444,7 @@ int db__message_release_incoming(struct mosquitto *context, uint16_t mid)
 void db__expire_all_messages(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *msg, *tmp;
+	int i;
 
 	DL_FOREACH_SAFE(context->msgs_out.inflight, msg, tmp){
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
@@ -1055,11 +1454,13 @@ void db__expire_all_messages(struct mosquitto *context)
 			db__message_remove_from_inflight(&context->msgs_out, msg);
 		}
 	}
-	DL_FOREACH_SAFE(context->msgs_out.queued, msg, tmp){
+	for(i=0; i<context->msgs_out.queue_len; i++){
+		msg = db__msg_queue_get(&context->msgs_out, i);
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
-			db__message_remove_from_queued(&context->msgs_out, msg);
+			db__message_remove_from_queued(msg);
 		}
 	}
+	db__msg_queue_compact(&context->msgs_out);
 	DL_FOREACH_SAFE(context->msgs_in.inflight, msg, tmp){
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
 			if(msg->qos > 0){
@@ -1068,17 +1469,21 @@ void db__expire_all_messages(struct mosquitto *context)
 			db__message_remove_from_inflight(&context->msgs_in, msg);
 		}
 	}
-	DL_FOREACH_SAFE(context->msgs_in.queued, msg, tmp){
+	for(i=0; i<context->msgs_in.queue_len; i++){
+		msg = db__msg_queue_get(&context->msgs_in, i);
 		if(msg->store->message_expiry_time && db.now_real_s > msg->store->message_expiry_time){
-			db__message_remove_from_queued(&context->msgs_in, msg);
+			db__message_remove_from_queued(msg);
 		}
 	}
+	db__msg_queue_compact(&context->msgs_in);
 }
 
 
 static int db__message_write_inflight_out_single(struct mosquitto *context, struct mosquitto_client_msg *msg)
 {
-	mosquitto_property *cmsg_props = NULL, *store_props = NULL;
+	const mosquitto_property *cmsg_props = NULL;
+	mosquitto_property *store_props = NULL;
+	mosquitto_property subid_prop;
 	int rc;
 	uint16_t mid;
 	int retries;
@@ -1109,7 +1514,7 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 	qos = (uint8_t)msg->qos;
 	payloadlen = msg->store->payloadlen;
 	payload = msg->store->payload;
-	cmsg_props = msg->properties;
+	cmsg_props = db__subscription_identifier_property(&subid_prop, msg->subscription_identifier, msg->properties);
 	store_props = msg->store->properties;
 
 	switch(msg->state){
@@ -1125,6 +1530,11 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 		case mosq_ms_publish_qos1:
 			rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
 			if(rc == MOSQ_ERR_SUCCESS){
+#ifdef WITH_BRIDGE
+				if(retries == 0){
+					bridge__rtt_sample_start(context, mid);
+				}
+#endif
 				msg->timestamp = db.now_s;
 				msg->dup = 1; /* Any retry attempts are a duplicate. */
 				msg->state = mosq_ms_wait_for_puback;
@@ -1138,6 +1548,11 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 		case mosq_ms_publish_qos2:
 			rc = send__publish(context, mid, topic, payloadlen, payload, qos, retain, retries, cmsg_props, store_props, expiry_interval);
 			if(rc == MOSQ_ERR_SUCCESS){
+#ifdef WITH_BRIDGE
+				if(retries == 0){
+					bridge__rtt_sample_start(context, mid);
+				}
+#endif
 				msg->timestamp = db.now_s;
 				msg->dup = 1; /* Any retry attempts are a duplicate. */
 				msg->state = mosq_ms_wait_for_pubrec;
@@ -1174,24 +1589,35 @@ static int db__message_write_inflight_out_single(struct mosquitto *context, stru
 int db__message_write_inflight_out_all(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *tail, *tmp;
-	int rc;
+	int rc = MOSQ_ERR_SUCCESS;
+	int rc2;
 
 	if(context->state != mosq_cs_active || context->sock == INVALID_SOCKET){
 		return MOSQ_ERR_SUCCESS;
 	}
 
+	if(context->bridge){
+		/* Send the whole window with as few writes as possible */
+		packet__write_hold(context);
+	}
 	DL_FOREACH_SAFE(context->msgs_out.inflight, tail, tmp){
 		rc = db__message_write_inflight_out_single(context, tail);
-		if(rc) return rc;
+		if(rc) break;
 	}
-	return MOSQ_ERR_SUCCESS;
+	if(context->bridge){
+		rc2 = packet__write_release(context);
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = rc2;
+		}
+	}
+	return rc;
 }
 
 
 int db__message_write_inflight_out_latest(struct mosquitto *context)
 {
 	struct mosquitto_client_msg *tail, *next;
-	int rc;
+	int rc, rc2;
 
 	if(context->state != mosq_cs_active
 			|| context->sock == INVALID_SOCKET
@@ -1223,39 +1649,54 @@ int db__message_write_inflight_out_latest(struct mosquitto *context)
 		tail = tail->next;
 	}
 
+	if(context->bridge){
+		packet__write_hold(context);
+	}
+	rc = MOSQ_ERR_SUCCESS;
 	while(tail){
 		next = tail->next;
 		rc = db__message_write_inflight_out_single(context, tail);
-		if(rc) return rc;
+		if(rc) break;
 		tail = next;
 	}
-	return MOSQ_ERR_SUCCESS;
+	if(context->bridge){
+		rc2 = packet__write_release(context);
+		if(rc == MOSQ_ERR_SUCCESS){
+			rc = rc2;
+		}
+	}
+	return rc;
 }
 
 
 int db__message_write_queued_in(struct mosquitto *context)
 {
-	struct mosquitto_client_msg *tail, *tmp;
+	struct mosquitto_client_msg *tail;
 	int rc;
 
 	if(context->state != mosq_cs_active){
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	DL_FOREACH_SAFE(context->msgs_in.queued, tail, tmp){
+	while(context->msgs_in.queue_len > 0){
 		if(context->msgs_in.inflight_maximum != 0 && context->msgs_in.inflight_quota == 0){
 			break;
 		}
 
-		if(tail->qos == 2){
-			tail->state = mosq_ms_send_pubrec;
-			db__message_dequeue_first(context, &context->msgs_in);
-			rc = send__pubrec(context, tail->mid, 0, NULL);
-			if(!rc){
-				tail->state = mosq_ms_wait_for_pubrel;
-			}else{
-				return rc;
-			}
+		tail = db__msg_queue_get(&context->msgs_in, 0);
+		if(tail->qos != 2){
+			break;
+		}
+		tail->state = mosq_ms_send_pubrec;
+		tail = db__message_dequeue_first(context, &context->msgs_in);
+		if(tail == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		rc = send__pubrec(context, tail->mid, 0, NULL);
+		if(!rc){
+			tail->state = mosq_ms_wait_for_pubrel;
+		}else{
+			return rc;
 		}
 	}
 	return MOSQ_ERR_SUCCESS;
@@ -1264,13 +1705,14 @@ int db__message_write_queued_in(struct mosquitto *context)
 
 int db__message_write_queued_out(struct mosquitto *context)
 {
-	struct mosquitto_client_msg *tail, *tmp;
+	struct mosquitto_client_msg *tail;
 
 	if(context->state != mosq_cs_active){
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	DL_FOREACH_SAFE(context->msgs_out.queued, tail, tmp){
+	while(context->msgs_out.queue_len > 0){
+		tail = db__msg_queue_get(&context->msgs_out, 0);
 		if(!db__ready_for_flight(context, mosq_md_out, tail->qos)){
 			break;
 		}
@@ -1286,7 +1728,9 @@ int db__message_write_queued_out(struct mosquitto *context)
 				tail->state = mosq_ms_publish_qos2;
 				break;
 		}
-		db__message_dequeue_first(context, &context->msgs_out);
+		if(db__message_dequeue_first(context, &context->msgs_out) == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
 	}
 	return MOSQ_ERR_SUCCESS;
 }
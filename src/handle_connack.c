@@ -38,6 +38,7 @@ int handle__connack(struct mosquitto *context)
 	uint8_t retain_available;
 	uint16_t server_keepalive;
 	uint16_t inflight_maximum;
+	uint16_t receive_maximum;
 	uint8_t max_qos = 255;
 
 	if(context == NULL){
@@ -50,6 +51,9 @@ int handle__connack(struct mosquitto *context)
 		return MOSQ_ERR_MALFORMED_PACKET;
 	}
 	log__printf(NULL, MOSQ_LOG_DEBUG, "Received CONNACK on connection %s.", context->id);
+#ifdef WITH_ZLIB
+	context->compression = mosq_cmp_none;
+#endif
 	if(packet__read_byte(&context->in_packet, &connect_acknowledge)) return MOSQ_ERR_MALFORMED_PACKET;
 	if(packet__read_byte(&context->in_packet, &reason_code)) return MOSQ_ERR_MALFORMED_PACKET;
 
@@ -85,7 +89,18 @@ int handle__connack(struct mosquitto *context)
 
 		/* receive-maximum */
 		inflight_maximum = context->msgs_out.inflight_maximum;
-		mosquitto_property_read_int16(properties, MQTT_PROP_RECEIVE_MAXIMUM, &inflight_maximum, false);
+		if(mosquitto_property_read_int16(properties, MQTT_PROP_RECEIVE_MAXIMUM, &receive_maximum, false)){
+#ifdef WITH_BRIDGE
+			/* A configured bridge window can only be reduced by the remote broker */
+			if(context->bridge->max_inflight_messages == 0
+					|| receive_maximum < context->bridge->max_inflight_messages){
+
+				inflight_maximum = receive_maximum;
+			}
+#else
+			inflight_maximum = receive_maximum;
+#endif
+		}
 		if(context->msgs_out.inflight_maximum != inflight_maximum){
 			context->msgs_out.inflight_maximum = inflight_maximum;
 			db__message_reconnect_reset(context);
@@ -108,6 +123,19 @@ int handle__connack(struct mosquitto *context)
 			context->keepalive = server_keepalive;
 		}
 
+#ifdef WITH_ZLIB
+		/* compression */
+		if(context->bridge->compression != mosq_cmp_none){
+			if(compress__find_method(properties) == context->bridge->compression){
+				context->compression = context->bridge->compression;
+			}else{
+				log__printf(NULL, MOSQ_LOG_NOTICE,
+						"Warning: Remote broker for bridge %s does not support compression.",
+						context->bridge->name);
+			}
+		}
+#endif
+
 		mosquitto_property_free_all(&properties);
 	}
 	mosquitto_property_free_all(&properties); /* FIXME - TEMPORARY UNTIL PROPERTIES PROCESSED */
@@ -81,35 +81,52 @@ static char *client_id_gen(uint16_t *idlen, const char *auto_id_prefix, uint16_t
 	return client_id;
 }
 
+static bool connection_acl_denied(struct mosquitto *context, struct mosquitto_client_msg *msg)
+{
+	int access;
+
+	if(msg->direction == mosq_md_out){
+		access = MOSQ_ACL_READ;
+	}else{
+		access = MOSQ_ACL_WRITE;
+	}
+	return mosquitto_acl_check(context, msg->store->topic,
+						   msg->store->payloadlen, msg->store->payload,
+						   msg->store->qos, msg->store->retain, access) != MOSQ_ERR_SUCCESS;
+}
+
+
 /* Remove any queued messages that are no longer allowed through ACL,
  * assuming a possible change of username. */
-static void connection_check_acl(struct mosquitto *context, struct mosquitto_client_msg **head)
+static void connection_check_acl(struct mosquitto *context, struct mosquitto_msg_data *msg_data)
 {
 	struct mosquitto_client_msg *msg_tail, *tmp;
-	int access;
+	int i;
 
-	DL_FOREACH_SAFE((*head), msg_tail, tmp){
-		if(msg_tail->direction == mosq_md_out){
-			access = MOSQ_ACL_READ;
-		}else{
-			access = MOSQ_ACL_WRITE;
+	DL_FOREACH_SAFE(msg_data->inflight, msg_tail, tmp){
+		if(connection_acl_denied(context, msg_tail)){
+			DL_DELETE(msg_data->inflight, msg_tail);
+			db__msg_remove_from_inflight_index(msg_data, msg_tail);
+			db__msg_store_ref_dec(&msg_tail->store);
+			mosquitto_property_free_all(&msg_tail->properties);
+			mosquitto__free(msg_tail);
 		}
-		if(mosquitto_acl_check(context, msg_tail->store->topic,
-							   msg_tail->store->payloadlen, msg_tail->store->payload,
-							   msg_tail->store->qos, msg_tail->store->retain, access) != MOSQ_ERR_SUCCESS){
+	}
 
-			DL_DELETE((*head), msg_tail);
+	for(i=0; i<msg_data->queue_len; i++){
+		msg_tail = db__msg_queue_get(msg_data, i);
+		if(connection_acl_denied(context, msg_tail)){
 			db__msg_store_ref_dec(&msg_tail->store);
+			msg_tail->store = NULL;
 			mosquitto_property_free_all(&msg_tail->properties);
-			mosquitto__free(msg_tail);
 		}
 	}
+	db__msg_queue_compact(msg_data);
 }
 
 int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint16_t auth_data_out_len)
 {
 	struct mosquitto *found_context;
-	struct mosquitto__subleaf *leaf;
 	mosquitto_property *connack_props = NULL;
 	uint8_t connect_ack = 0;
 	int i;
@@ -137,8 +154,8 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 				connect_ack |= 0x01;
 			}
 
-			if(found_context->msgs_in.inflight || found_context->msgs_in.queued
-					|| found_context->msgs_out.inflight || found_context->msgs_out.queued){
+			if(found_context->msgs_in.inflight || found_context->msgs_in.queue_len
+					|| found_context->msgs_out.inflight || found_context->msgs_out.queue_len){
 
 				in_quota = context->msgs_in.inflight_quota;
 				out_quota = context->msgs_out.inflight_quota;
@@ -166,23 +183,7 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 
 			for(i=0; i<context->sub_count; i++){
 				if(context->subs[i]){
-					leaf = context->subs[i]->hier->subs;
-					while(leaf){
-						if(leaf->context == found_context){
-							leaf->context = context;
-						}
-						leaf = leaf->next;
-					}
-
-					if(context->subs[i]->shared){
-						leaf = context->subs[i]->shared->subs;
-						while(leaf){
-							if(leaf->context == found_context){
-								leaf->context = context;
-							}
-							leaf = leaf->next;
-						}
-					}
+					context->subs[i]->leaf->context = context;
 				}
 			}
 		}
@@ -252,10 +253,8 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 	context->ping_t = 0;
 	context->is_dropping = false;
 
-	connection_check_acl(context, &context->msgs_in.inflight);
-	connection_check_acl(context, &context->msgs_in.queued);
-	connection_check_acl(context, &context->msgs_out.inflight);
-	connection_check_acl(context, &context->msgs_out.queued);
+	connection_check_acl(context, &context->msgs_in);
+	connection_check_acl(context, &context->msgs_out);
 
 	context__add_to_by_id(context);
 
@@ -265,6 +264,10 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 	}
 #endif
 	context->max_qos = context->listener->max_qos;
+	context->conflate_queued = context->listener->conflate_queued_messages;
+	if(context->alias_out_max > context->listener->max_topic_alias_broker){
+		context->alias_out_max = context->listener->max_topic_alias_broker;
+	}
 
 	if(db.config->max_keepalive &&
 			(context->keepalive > db.config->max_keepalive || context->keepalive == 0)){
@@ -289,6 +292,13 @@ int connect__on_authorised(struct mosquitto *context, void *auth_data_out, uint1
 				goto error;
 			}
 		}
+#ifdef WITH_ZLIB
+		/* Confirm that compressed payloads will be accepted */
+		if(compress__add_property(&connack_props, context->compression)){
+			rc = MOSQ_ERR_NOMEM;
+			goto error;
+		}
+#endif
 		if(context->assigned_id){
 			if(mosquitto_property_add_string(&connack_props, MQTT_PROP_ASSIGNED_CLIENT_IDENTIFIER, context->id)){
 				rc = MOSQ_ERR_NOMEM;
@@ -467,6 +477,9 @@ int handle__connect(struct mosquitto *context)
 		rc = MOSQ_ERR_PROTOCOL;
 		goto handle_connect_error;
 	}
+#ifdef WITH_TLS
+	net__tls_session_check(context);
+#endif
 
 	/* Read protocol name as length then bytes rather than with read_string
 	 * because the length is fixed and we can check that. Removes the need
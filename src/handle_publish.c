@@ -210,6 +210,12 @@ int handle__publish(struct mosquitto *context)
 
 	msg->payloadlen = context->in_packet.remaining_length - context->in_packet.pos;
 	G_PUB_BYTES_RECEIVED_INC(msg->payloadlen);
+#ifdef WITH_BRIDGE
+	if(context->bridge){
+		context->bridge->stats.pub_msgs_received++;
+		context->bridge->stats.pub_bytes_received += msg->payloadlen;
+	}
+#endif
 	if(context->listener && context->listener->mount_point){
 		len = strlen(context->listener->mount_point) + strlen(msg->topic) + 1;
 		topic_mount = mosquitto__malloc(len+1);
@@ -243,6 +249,25 @@ int handle__publish(struct mosquitto *context)
 			return MOSQ_ERR_MALFORMED_PACKET;
 		}
 	}
+#ifdef WITH_ZLIB
+	/* Only payloads from a bridge that negotiated compression with us are
+	 * compressed, never those arriving on our own bridges. */
+	if(context->compression != mosq_cmp_none && context->bridge == NULL){
+		rc = compress__handle_publish(context, msg);
+		if(rc == MOSQ_ERR_PAYLOAD_SIZE){
+			/* Treated like an oversize packet, so a client can't use small
+			 * packets to make the broker inflate large payloads over and
+			 * over. */
+			log__printf(NULL, MOSQ_LOG_DEBUG, "Too large compressed PUBLISH from %s (d%d, q%d, r%d, m%d, '%s', ... (%ld bytes))", context->id, dup, msg->qos, msg->retain, msg->source_mid, msg->topic, (long)msg->payloadlen);
+			db__msg_store_free(msg);
+			send__disconnect(context, MQTT_RC_PACKET_TOO_LARGE, NULL);
+			return MOSQ_ERR_PAYLOAD_SIZE;
+		}else if(rc){
+			db__msg_store_free(msg);
+			return rc;
+		}
+	}
+#endif
 
 	/* Check for topic access */
 	rc = mosquitto_acl_check(context, msg->topic, msg->payloadlen, msg->payload, msg->qos, msg->retain, MOSQ_ACL_WRITE);
@@ -308,8 +333,12 @@ int handle__publish(struct mosquitto *context)
 				){
 
 			dup = 0;
-			rc = db__message_store(context, msg, message_expiry_interval, 0, mosq_mo_client);
-			if(rc) return rc;
+			if(msg->qos == 0 && msg->retain == 0){
+				db__message_store_transient(context, msg, message_expiry_interval, mosq_mo_client);
+			}else{
+				rc = db__message_store(context, msg, message_expiry_interval, 0, mosq_mo_client);
+				if(rc) return rc;
+			}
 		}else{
 			/* Client isn't allowed any more incoming messages, so fail early */
 			reason_code = MQTT_RC_QUOTA_EXCEEDED;
@@ -345,7 +374,7 @@ int handle__publish(struct mosquitto *context)
 			break;
 		case 2:
 			if(dup == 0){
-				res = db__message_insert(context, stored->source_mid, mosq_md_in, stored->qos, stored->retain, stored, NULL, false);
+				res = db__message_insert(context, stored->source_mid, mosq_md_in, stored->qos, stored->retain, stored, 0, NULL, false);
 			}else{
 				res = 0;
 			}
@@ -0,0 +1,252 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_WEBSOCKETS_BUILTIN
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "net_mosq.h"
+#include "packet_mosq.h"
+#include "sys_tree.h"
+
+#define WS_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define HTTP_HEADERS_SIZE_DEFAULT 4096
+
+/* Handling of the HTTP upgrade request that starts a connection on a listener
+ * using the built in websockets support. */
+
+static char *http__header_value(char *line, const char *name)
+{
+	size_t len = strlen(name);
+
+	if(strncasecmp(line, name, len) || line[len] != ':'){
+		return NULL;
+	}
+	line += len+1;
+	while(*line == ' ' || *line == '\t'){
+		line++;
+	}
+	return line;
+}
+
+
+/* Is token present in a comma separated header value */
+static bool http__has_token(const char *value, const char *token)
+{
+	size_t len = strlen(token);
+
+	while(*value){
+		while(*value == ' ' || *value == '\t' || *value == ','){
+			value++;
+		}
+		if(!strncasecmp(value, token, len)
+				&& (value[len] == '\0' || value[len] == ',' || value[len] == ' ' || value[len] == '\t')){
+
+			return true;
+		}
+		while(*value && *value != ','){
+			value++;
+		}
+	}
+	return false;
+}
+
+
+static int http__send(struct mosquitto *mosq, const char *response)
+{
+	struct mosquitto__packet *packet;
+	uint32_t len = (uint32_t)strlen(response);
+
+	packet = mosquitto__calloc(1, sizeof(struct mosquitto__packet));
+	if(!packet) return MOSQ_ERR_NOMEM;
+
+	packet->packet_length = WS_PACKET_OFFSET + len;
+	packet->payload = mosquitto__malloc(packet->packet_length);
+	if(!packet->payload){
+		mosquitto__free(packet);
+		return MOSQ_ERR_NOMEM;
+	}
+	memcpy(&packet->payload[WS_PACKET_OFFSET], response, len);
+
+	/* Sent before the connection switches to websockets framing */
+	return packet__queue(mosq, packet);
+}
+
+
+static int http__bad_request(struct mosquitto *mosq)
+{
+	if(db.config->connection_messages == true){
+		log__printf(NULL, MOSQ_LOG_NOTICE, "Bad websockets upgrade request from %s.", mosq->address);
+	}
+	http__send(mosq, "HTTP/1.1 400 Bad Request\r\n"
+			"Sec-WebSocket-Version: 13\r\n"
+			"Content-Length: 0\r\n"
+			"Connection: close\r\n\r\n");
+	return MOSQ_ERR_PROTOCOL;
+}
+
+
+static int http__handle_request(struct mosquitto *mosq)
+{
+	char *line, *saveptr = NULL, *value, *end;
+	const char *key = NULL, *protocol = NULL;
+	bool upgrade = false, connection = false, version = false;
+	unsigned char hash[SHA_DIGEST_LENGTH];
+	char accept_key[4*((SHA_DIGEST_LENGTH+2)/3)+1];
+	char accept_src[24+sizeof(WS_GUID)];
+	char response[300];
+	size_t len;
+	int rc;
+
+	line = strtok_r(mosq->ws.http_buf, "\r\n", &saveptr);
+	len = line ? strlen(line) : 0;
+	if(len < strlen("GET / HTTP/1.1") || strncmp(line, "GET ", 4) || strcmp(&line[len-9], " HTTP/1.1")){
+		return http__bad_request(mosq);
+	}
+
+	while((line = strtok_r(NULL, "\r\n", &saveptr))){
+		end = &line[strlen(line)];
+		while(end > line && (end[-1] == ' ' || end[-1] == '\t')){
+			end--;
+		}
+		*end = '\0';
+
+		if((value = http__header_value(line, "Upgrade"))){
+			upgrade = http__has_token(value, "websocket");
+		}else if((value = http__header_value(line, "Connection"))){
+			connection = http__has_token(value, "upgrade");
+		}else if((value = http__header_value(line, "Sec-WebSocket-Key"))){
+			key = value;
+		}else if((value = http__header_value(line, "Sec-WebSocket-Version"))){
+			version = !strcmp(value, "13");
+		}else if((value = http__header_value(line, "Sec-WebSocket-Protocol"))){
+			if(http__has_token(value, "mqtt")){
+				protocol = "mqtt";
+			}else if(http__has_token(value, "mqttv3.1")){
+				protocol = "mqttv3.1";
+			}
+		}
+	}
+	if(!upgrade || !connection || !version || key == NULL || strlen(key) != 24){
+		return http__bad_request(mosq);
+	}
+
+	snprintf(accept_src, sizeof(accept_src), "%s%s", key, WS_GUID);
+	SHA1((const unsigned char *)accept_src, strlen(accept_src), hash);
+	EVP_EncodeBlock((unsigned char *)accept_key, hash, SHA_DIGEST_LENGTH);
+
+	snprintf(response, sizeof(response),
+			"HTTP/1.1 101 Switching Protocols\r\n"
+			"Upgrade: websocket\r\n"
+			"Connection: Upgrade\r\n"
+			"Sec-WebSocket-Accept: %s\r\n"
+			"%s%s%s"
+			"\r\n",
+			accept_key,
+			protocol ? "Sec-WebSocket-Protocol: " : "",
+			protocol ? protocol : "",
+			protocol ? "\r\n" : "");
+
+	rc = http__send(mosq, response);
+	if(rc) return rc;
+
+	mosq->ws.state = ws_s_open;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Read the HTTP upgrade request of a new websockets connection, and reply to
+ * it once complete. */
+int http__read(struct mosquitto *mosq)
+{
+	ssize_t read_length;
+	uint32_t buflen, request_len;
+	char *end;
+	int rc;
+
+	buflen = db.config->websockets_headers_size ? db.config->websockets_headers_size : HTTP_HEADERS_SIZE_DEFAULT;
+	if(mosq->ws.http_buf == NULL){
+		mosq->ws.http_buf = mosquitto__malloc(buflen+1);
+		if(mosq->ws.http_buf == NULL){
+			return MOSQ_ERR_NOMEM;
+		}
+		mosq->ws.http_len = 0;
+	}
+
+	while(1){
+		read_length = net__read(mosq, &mosq->ws.http_buf[mosq->ws.http_len], buflen - mosq->ws.http_len);
+		if(read_length > 0){
+			mosq->ws.http_len += (uint32_t)read_length;
+			mosq->ws.http_buf[mosq->ws.http_len] = '\0';
+
+			end = strstr(mosq->ws.http_buf, "\r\n\r\n");
+			if(end){
+				/* Terminate the request without touching anything after it */
+				end += 4;
+				end[-1] = '\0';
+				request_len = (uint32_t)(end - mosq->ws.http_buf);
+				G_BYTES_RECEIVED_INC(request_len);
+
+				rc = http__handle_request(mosq);
+
+				/* Clients may send websockets frames without waiting for the
+				 * response. Those bytes are kept for net__read_ws(). */
+				mosq->ws.http_len -= request_len;
+				if(rc == MOSQ_ERR_SUCCESS && mosq->ws.http_len > 0){
+					memmove(mosq->ws.http_buf, end, mosq->ws.http_len);
+					mosq->ws.http_pos = 0;
+				}else{
+					mosquitto__free(mosq->ws.http_buf);
+					mosq->ws.http_buf = NULL;
+					mosq->ws.http_len = 0;
+				}
+				return rc;
+			}else if(mosq->ws.http_len == buflen){
+				G_BYTES_RECEIVED_INC(buflen);
+				return http__bad_request(mosq);
+			}
+		}else{
+			if(read_length == 0){
+				return MOSQ_ERR_CONN_LOST; /* EOF */
+			}
+			if(errno == EAGAIN || errno == COMPAT_EWOULDBLOCK){
+				return MOSQ_ERR_SUCCESS;
+			}else{
+				switch(errno){
+					case COMPAT_ECONNRESET:
+						return MOSQ_ERR_CONN_LOST;
+					case COMPAT_EINTR:
+						return MOSQ_ERR_SUCCESS;
+					default:
+						return MOSQ_ERR_ERRNO;
+				}
+			}
+		}
+	}
+}
+#endif
@@ -0,0 +1,170 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#include <stddef.h>
+#include <string.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "uthash.h"
+
+/* Reference counted tables of immutable strings or binary data, so that data
+ * repeated across many objects, like topic level names or the topics and
+ * client ids of queued messages, is only held once.
+ *
+ * Each table is an open addressing hash table using linear probing. The
+ * returned pointers point at the data inside each entry, so intern__release()
+ * can find the entry without a lookup. */
+
+struct intern__entry{
+	uint32_t refs;
+	uint32_t hash;
+	size_t len;
+	char data[];
+};
+
+#define INTERN_MIN_SLOTS 64
+
+
+static uint32_t intern__hash(const void *data, size_t len)
+{
+	unsigned int hashv;
+
+	HASH_VALUE(data, len, hashv);
+	return hashv;
+}
+
+
+/* When removing an entry at slot i, can the entry at slot j, which hashes to
+ * slot home, move into the hole without becoming unreachable? */
+bool intern__probe_can_move(uint32_t i, uint32_t j, uint32_t home)
+{
+	if(i <= j){
+		return home <= i || home > j;
+	}else{
+		return home <= i && home > j;
+	}
+}
+
+
+static int intern__resize(struct intern__table *table, uint32_t slot_count)
+{
+	struct intern__entry **slots;
+	uint32_t i, j;
+
+	slots = mosquitto__calloc(slot_count, sizeof(struct intern__entry *));
+	if(!slots) return MOSQ_ERR_NOMEM;
+
+	for(i=0; i<table->slot_count; i++){
+		if(table->slots[i]){
+			j = table->slots[i]->hash & (slot_count-1);
+			while(slots[j]){
+				j = (j+1) & (slot_count-1);
+			}
+			slots[j] = table->slots[i];
+		}
+	}
+	table->bytes -= table->slot_count*sizeof(struct intern__entry *);
+	table->bytes += slot_count*sizeof(struct intern__entry *);
+	mosquitto__free(table->slots);
+	table->slots = slots;
+	table->slot_count = slot_count;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Return a reference to a copy of data, which is always followed by a zero
+ * byte. The copy must not be modified and must be released with
+ * intern__release(). Returns NULL if out of memory. */
+void *intern__get(struct intern__table *table, const void *data, size_t len)
+{
+	struct intern__entry *entry;
+	uint32_t i, mask, hash;
+
+	if((table->count+1)*4 > table->slot_count*3){
+		if(intern__resize(table, table->slot_count ? table->slot_count*2 : INTERN_MIN_SLOTS)){
+			return NULL;
+		}
+	}
+
+	hash = intern__hash(data, len);
+	mask = table->slot_count-1;
+	for(i = hash & mask; table->slots[i]; i = (i+1) & mask){
+		entry = table->slots[i];
+		if(entry->hash == hash && entry->len == len && !memcmp(entry->data, data, len)){
+			entry->refs++;
+			return entry->data;
+		}
+	}
+
+	entry = mosquitto__malloc(sizeof(struct intern__entry) + len + 1);
+	if(!entry) return NULL;
+	entry->refs = 1;
+	entry->hash = hash;
+	entry->len = len;
+	memcpy(entry->data, data, len);
+	entry->data[len] = '\0';
+
+	table->slots[i] = entry;
+	table->count++;
+	table->bytes += sizeof(struct intern__entry) + len + 1;
+
+	return entry->data;
+}
+
+
+void intern__release(struct intern__table *table, const void *data)
+{
+	struct intern__entry *entry;
+	uint32_t i, j, mask;
+
+	if(data == NULL) return;
+
+	entry = (struct intern__entry *)(void *)((const char *)data - offsetof(struct intern__entry, data));
+	entry->refs--;
+	if(entry->refs > 0) return;
+
+	mask = table->slot_count-1;
+	i = entry->hash & mask;
+	while(table->slots[i] != entry){
+		i = (i+1) & mask;
+	}
+	for(j = (i+1) & mask; table->slots[j]; j = (j+1) & mask){
+		if(intern__probe_can_move(i, j, table->slots[j]->hash & mask)){
+			table->slots[i] = table->slots[j];
+			i = j;
+		}
+	}
+	table->slots[i] = NULL;
+	table->count--;
+	table->bytes -= sizeof(struct intern__entry) + entry->len + 1;
+	mosquitto__free(entry);
+
+	if(table->count == 0){
+		table->bytes -= table->slot_count*sizeof(struct intern__entry *);
+		mosquitto__free(table->slots);
+		table->slots = NULL;
+		table->slot_count = 0;
+	}else if(table->slot_count > INTERN_MIN_SLOTS && table->count*8 < table->slot_count){
+		/* On failure the larger table is still usable */
+		intern__resize(table, table->slot_count/2);
+	}
+}
@@ -103,7 +103,7 @@ static int single_publish(struct mosquitto *context, struct mosquitto_message_v5
 	}else{
 		mid = 0;
 	}
-	return db__message_insert(context, mid, mosq_md_out, (uint8_t)msg->qos, 0, stored, msg->properties, true);
+	return db__message_insert(context, mid, mosq_md_out, (uint8_t)msg->qos, 0, stored, 0, msg->properties, true);
 }
 
 
@@ -161,6 +161,23 @@ static void queue_plugin_msgs(void)
 }
 
 
+/* Write out clients with packets held back by write_coalescing. */
+static void write_deferred_packets(void)
+{
+	struct mosquitto *context;
+	int rc;
+
+	while(db.ll_write_deferred){
+		context = db.ll_write_deferred;
+		packet__write_undefer(context);
+		rc = packet__write(context);
+		if(rc){
+			do_disconnect(context, rc);
+		}
+	}
+}
+
+
 int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
 #ifdef WITH_SYS_TREE
@@ -202,11 +219,20 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 		bridge_check();
 #endif
 
+		write_deferred_packets();
 		rc = mux__handle(listensock, listensock_count);
 		if(rc) return rc;
+#ifdef WITH_TLS_POOL
+		tls_pool__process();
+#endif
+		write_deferred_packets();
 
 		session_expiry__check();
 		will_delay__check();
+#ifdef WITH_TLS
+		tls_session__keys_check(false);
+		tls_reload__check();
+#endif
 #ifdef WITH_PERSISTENCE
 		if(db.config->persistence && db.config->autosave_interval){
 			if(db.config->autosave_on_changes){
@@ -232,7 +258,10 @@ int mosquitto_main_loop(struct mosquitto__listener_sock *listensock, int listens
 		if(flag_reload){
 			log__printf(NULL, MOSQ_LOG_INFO, "Reloading config.");
 			config__read(db.config, true);
-			listeners__reload_all_certificates();
+#ifdef WITH_TLS
+			tls_reload__start();
+			tls_session__keys_check(true);
+#endif
 			mosquitto_security_cleanup(true);
 			mosquitto_security_init(true);
 			mosquitto_security_apply();
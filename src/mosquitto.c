@@ -186,26 +186,12 @@ void listener__set_defaults(struct mosquitto__listener *listener)
 	listener->max_connections = -1;
 	listener->max_qos = 2;
 	listener->max_topic_alias = 10;
-}
-
-
-void listeners__reload_all_certificates(void)
-{
+	listener->max_topic_alias_broker = 10;
+	listener->max_inflated_size = 65536;
 #ifdef WITH_TLS
-	int i;
-	int rc;
-	struct mosquitto__listener *listener;
-
-	for(i=0; i<db.config->listener_count; i++){
-		listener = &db.config->listeners[i];
-		if(listener->ssl_ctx && listener->certfile && listener->keyfile){
-			rc = net__load_certificates(listener);
-			if(rc){
-				log__printf(NULL, MOSQ_LOG_ERR, "Error when reloading certificate '%s' or key '%s'.",
-						listener->certfile, listener->keyfile);
-			}
-		}
-	}
+	listener->tls_session_cache_size = -1;
+	listener->tls_session_timeout = -1;
+	listener->tls_session_tickets = true;
 #endif
 }
 
@@ -277,6 +263,37 @@ void listeners__add_websockets(struct lws_context *ws_context, mosq_sock_t fd)
 }
 #endif
 
+#ifdef WITH_TLS_POOL
+/* Watch the TLS handshake pool's wakeup pipe along with the listeners. */
+static int listeners__add_tls_pool(void)
+{
+	struct mosquitto__listener_sock *listensock_new;
+
+	if(tls_pool__init()){
+		return 1;
+	}
+	if(tls_pool__sock() == INVALID_SOCKET){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	listensock_count++;
+	listensock_new = mosquitto__realloc(listensock, sizeof(struct mosquitto__listener_sock)*(size_t)listensock_count);
+	if(!listensock_new){
+		return 1;
+	}
+	listensock = listensock_new;
+
+	listensock[listensock_index].sock = tls_pool__sock();
+	listensock[listensock_index].listener = NULL;
+#ifdef WITH_EPOLL
+	listensock[listensock_index].ident = id_tls_pool;
+#endif
+	listensock_index++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
 static int listeners__add_local(const char *host, uint16_t port)
 {
 	struct mosquitto__listener *listeners;
@@ -371,6 +388,16 @@ static int listeners__start(void)
 				log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create websockets listener on port %d.", db.config->listeners[i].port);
 				return 1;
 			}
+#elif defined(WITH_WEBSOCKETS_BUILTIN)
+			/* Accepted like any other listener, the upgrade request is
+			 * handled in packet__read() */
+			if(listeners__start_single_mqtt(&db.config->listeners[i])){
+				db__close();
+				if(db.config->pid_file){
+					(void)remove(db.config->pid_file);
+				}
+				return 1;
+			}
 #endif
 		}
 	}
@@ -378,6 +405,11 @@ static int listeners__start(void)
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start any listening sockets, exiting.");
 		return 1;
 	}
+#ifdef WITH_TLS_POOL
+	if(listeners__add_tls_pool()){
+		return 1;
+	}
+#endif
 	return MOSQ_ERR_SUCCESS;
 }
 
@@ -590,6 +622,12 @@ int main(int argc, char *argv[])
 #endif
 	session_expiry__remove_all();
 
+#ifdef WITH_TLS_POOL
+	tls_pool__cleanup();
+#endif
+#ifdef WITH_TLS
+	tls_reload__cleanup();
+#endif
 	listeners__stop();
 
 	HASH_ITER(hh_id, db.contexts_by_id, ctxt, ctxt_tmp){
@@ -29,6 +29,14 @@ Contributors:
 #    warning "libwebsockets is not compiled with LWS_WITH_EXTERNAL_POLL support. Websocket performance will be unusable."
 #  endif
 #endif
+#if defined(WITH_WEBSOCKETS_BUILTIN)
+#  if defined(WITH_WEBSOCKETS)
+#    error "WITH_WEBSOCKETS and WITH_WEBSOCKETS_BUILTIN cannot be used together."
+#  endif
+#  if !defined(WITH_TLS)
+#    error "WITH_WEBSOCKETS_BUILTIN requires WITH_TLS."
+#  endif
+#endif
 
 #include "mosquitto_internal.h"
 #include "mosquitto_broker.h"
@@ -191,9 +199,60 @@ enum struct_ident{
 	id_listener = 1,
 	id_client = 2,
 	id_listener_ws = 3,
+	id_tls_pool = 4,
 };
 #endif
 
+enum mosquitto__mux_backend{
+	mux_b_default = 0, /* epoll, or poll */
+	mux_b_io_uring = 1,
+};
+
+/* How the member of a shared subscription that receives a message is chosen */
+enum mosquitto__shared_sub_mode{
+	shared_sm_round_robin = 0,
+	shared_sm_least_loaded = 1,
+	shared_sm_hash_topic = 2,
+	shared_sm_hash_property = 3,
+};
+
+#ifdef WITH_TLS_POOL
+#define TLS_POOL_LATENCY_BUCKETS 13
+
+struct mosquitto__tls_pool_stats {
+	uint64_t completed;
+	uint64_t failed;
+	uint64_t latency[TLS_POOL_LATENCY_BUCKETS];
+	int pending; /* waiting for a worker, or in progress */
+	int in_progress;
+};
+#endif
+
+#ifdef WITH_TLS
+/* Counts of the TLS sessions on a listener with tls_ktls enabled, by whether
+ * the kernel took over record encryption (tx) and decryption (rx). */
+struct mosquitto__ktls_stats {
+	uint64_t sessions;
+	uint64_t tx;
+	uint64_t rx;
+	uint64_t sys_sessions;
+	uint64_t sys_tx;
+	uint64_t sys_rx;
+};
+
+/* Counts of the TLS sessions established on a listener, and how many of those
+ * resumed an earlier session instead of carrying out a full handshake. */
+struct mosquitto__tls_stats {
+	uint64_t sessions;
+	uint64_t resumed;
+	uint64_t sys_sessions;
+	uint64_t sys_resumed;
+	uint64_t sys_cache_entries;
+};
+
+struct mosquitto__tls_ticket_keys;
+#endif
+
 struct mosquitto__listener {
 	uint16_t port;
 	char *host;
@@ -206,8 +265,12 @@ struct mosquitto__listener {
 	enum mosquitto_protocol protocol;
 	int socket_domain;
 	bool use_username_as_clientid;
+	bool conflate_queued_messages;
 	uint8_t max_qos;
 	uint16_t max_topic_alias;
+	uint16_t max_topic_alias_broker;
+	bool accept_compression;
+	uint32_t max_inflated_size;
 #ifdef WITH_TLS
 	char *cafile;
 	char *capath;
@@ -226,6 +289,14 @@ struct mosquitto__listener {
 	bool use_subject_as_username;
 	bool require_certificate;
 	enum mosquitto__keyform tls_keyform;
+	bool ktls;
+	struct mosquitto__ktls_stats ktls_stats;
+	int tls_session_cache_size;
+	int tls_session_timeout;
+	bool tls_session_tickets;
+	char *tls_ticket_key_file;
+	struct mosquitto__tls_ticket_keys *ticket_keys;
+	struct mosquitto__tls_stats tls_stats;
 #endif
 #ifdef WITH_WEBSOCKETS
 	struct lws_context *ws_context;
@@ -277,6 +348,8 @@ struct mosquitto__config {
 	size_t max_inflight_bytes;
 	size_t max_queued_bytes;
 	int max_queued_messages;
+	int max_tls_handshakes;
+	enum mosquitto__mux_backend mux_backend;
 	uint32_t max_packet_size;
 	uint32_t message_size_limit;
 	uint16_t max_inflight_messages;
@@ -292,11 +365,18 @@ struct mosquitto__config {
 	bool per_listener_settings;
 	bool retain_available;
 	bool set_tcp_nodelay;
+	enum mosquitto__shared_sub_mode shared_subscription_mode;
+	char *shared_subscription_hash_property;
+	int shared_subscription_max_queued;
 	int sys_interval;
+	int tls_handshake_threads;
 	bool upgrade_outgoing_qos;
 	char *user;
+	bool write_coalescing;
 #ifdef WITH_WEBSOCKETS
 	int websockets_log_level;
+#endif
+#if defined(WITH_WEBSOCKETS) || defined(WITH_WEBSOCKETS_BUILTIN)
 	uint16_t websockets_headers_size;
 #endif
 #ifdef WITH_BRIDGE
@@ -324,28 +404,60 @@ struct mosquitto__subshared {
 	struct mosquitto__subleaf *subs;
 };
 
+/* A table of reference counted, immutable copies of data, see intern.c */
+struct intern__entry;
+struct intern__table{
+	struct intern__entry **slots;
+	uint32_t slot_count;
+	uint32_t count;
+	size_t bytes;
+};
+
+/* Level names shorter than this are held in the node itself, longer names
+ * are interned and shared between all nodes with the same name. */
+#define SUBHIER_INLINE_LEN 24
+
+/* Nodes with up to 1<<SUBHIER_SMALL_BITS children keep them in an unordered
+ * array, nodes with more use an open addressing hash table. */
+#define SUBHIER_SMALL_BITS 3
+
 struct mosquitto__subhier {
-	UT_hash_handle hh;
 	struct mosquitto__subhier *parent;
-	struct mosquitto__subhier *children;
+	struct mosquitto__subhier **children; /* NULL when there are no children */
 	struct mosquitto__subleaf *subs;
 	struct mosquitto__subshared *shared;
-	char *topic;
+	uint32_t child_count;
+	uint8_t child_bits; /* children has 1<<child_bits slots */
 	uint16_t topic_len;
+	union {
+		char str[SUBHIER_INLINE_LEN];
+		const char *interned;
+	} topic;
 };
 
 struct mosquitto__client_sub {
 	struct mosquitto__subhier *hier;
 	struct mosquitto__subshared *shared;
+	struct mosquitto__subleaf *leaf;
 	char topic_filter[];
 };
 
+/* A single topic level, pointing into the topic that was tokenised. Not
+ * NULL terminated. */
 struct sub__token {
-	struct sub__token *next;
-	char *topic;
+	const char *topic;
 	uint16_t topic_len;
 };
 
+#define SUB__TOKENS_STACK 32
+
+struct sub__tokens {
+	struct sub__token *tokens; /* stack_tokens, or allocated for very deep topics */
+	int count;
+	struct sub__token sharename; /* topic is NULL if not a shared subscription */
+	struct sub__token stack_tokens[SUB__TOKENS_STACK];
+};
+
 struct mosquitto__retainhier {
 	UT_hash_handle hh;
 	struct mosquitto__retainhier *parent;
@@ -368,6 +480,7 @@ struct mosquitto_msg_store{
 	char *source_id;
 	char *source_username;
 	struct mosquitto__listener *source_listener;
+	const struct mosquitto *transient_source; /* Only valid while transient is set */
 	char **dest_ids;
 	int dest_id_count;
 	int ref_count;
@@ -381,14 +494,18 @@ struct mosquitto_msg_store{
 	uint16_t mid;
 	uint8_t qos;
 	bool retain;
+	bool transient; /* Not yet added to db.msg_store */
+	bool interned; /* topic, and payload if small, are shared copies, see db__message_store() */
 };
 
 struct mosquitto_client_msg{
+	UT_hash_handle hh_mid;
 	struct mosquitto_client_msg *prev;
 	struct mosquitto_client_msg *next;
 	struct mosquitto_msg_store *store;
 	mosquitto_property *properties;
 	time_t timestamp;
+	uint32_t subscription_identifier; /* kept out of properties to avoid an allocation per message */
 	uint16_t mid;
 	uint8_t qos;
 	bool retain;
@@ -415,6 +532,7 @@ struct mosquitto__unpwd{
 struct mosquitto__acl{
 	struct mosquitto__acl *next;
 	char *topic;
+	struct mosquitto_topic_filter *filter; /* NULL for patterns with substitutions */
 	int access;
 	int ucount;
 	int ccount;
@@ -468,9 +586,12 @@ struct mosquitto_db{
 	int subscription_count;
 	int shared_subscription_count;
 	int retained_count;
+	int subhier_count;
+	unsigned long subhier_bytes;
 #endif
 	int persistence_changes;
 	struct mosquitto *ll_for_free;
+	struct mosquitto *ll_write_deferred;
 #ifdef WITH_EPOLL
 	int epollfd;
 #endif
@@ -490,6 +611,15 @@ enum mosquitto_bridge_start_type{
 	bst_once = 3
 };
 
+/* User property used to negotiate compression in CONNECT/CONNACK and to mark
+ * compressed PUBLISH payloads. */
+#define MOSQ_COMPRESSION_PROPERTY "mosquitto-compression"
+
+enum mosquitto__compression{
+	mosq_cmp_none = 0,
+	mosq_cmp_deflate = 1
+};
+
 struct mosquitto__bridge_topic{
 	char *topic;
 	char *local_prefix;
@@ -500,6 +630,47 @@ struct mosquitto__bridge_topic{
 	uint8_t qos;
 };
 
+/* One level of the compiled bridge topic remapping tree. Each pattern that
+ * needs remapping is inserted at bridge__add_topic() time, with its index in
+ * bridge->topics recorded at the node where the pattern ends. The lowest index
+ * of all matching patterns wins, preserving the order of the config file. */
+struct mosquitto__bridge_topic_node{
+	UT_hash_handle hh;
+	struct mosquitto__bridge_topic_node *children;
+	struct mosquitto__bridge_topic_node *plus;
+	char *level;
+	int leaf_index; /* pattern ends at this level, or -1 */
+	int hash_index; /* pattern ends with '#' after this level, or -1 */
+	uint16_t level_len;
+};
+
+struct mosquitto__bridge_stats{
+	uint64_t pub_msgs_sent;
+	uint64_t pub_msgs_received;
+	uint64_t pub_bytes_sent;
+	uint64_t pub_bytes_received;
+	uint64_t compress_bytes_in; /* payload bytes considered for compression */
+	uint64_t compress_bytes_out; /* the same payloads, as sent */
+	uint64_t rtt_sample_start; /* ms */
+	uint32_t rtt; /* smoothed round trip time of PUBLISH to PUBACK/PUBREC, ms */
+	uint16_t rtt_sample_mid;
+	bool rtt_sampling;
+	/* Last values published to $SYS */
+	uint64_t sys_pub_msgs_sent;
+	uint64_t sys_pub_msgs_received;
+	uint64_t sys_pub_bytes_sent;
+	uint64_t sys_pub_bytes_received;
+	double sys_load_sent;
+	double sys_load_received;
+	uint64_t sys_inflight;
+	uint64_t sys_rtt;
+	uint64_t sys_compress_bytes_in;
+	uint64_t sys_compress_bytes_out;
+	double sys_compress_ratio;
+	char *sys_topic; /* "$SYS/broker/bridges/<name>/", with room for a suffix */
+	size_t sys_topic_len;
+};
+
 struct bridge_address{
 	char *address;
 	uint16_t port;
@@ -521,6 +692,10 @@ struct mosquitto__bridge{
 	struct mosquitto__bridge_topic *topics;
 	int topic_count;
 	bool topic_remapping;
+	struct mosquitto__bridge_topic_node *remap_in;
+	struct mosquitto__bridge_topic_node *remap_out;
+	char *remap_buf;
+	size_t remap_buf_len;
 	enum mosquitto__protocol protocol_version;
 	time_t restart_t;
 	char *remote_clientid;
@@ -544,6 +719,17 @@ struct mosquitto__bridge{
 	bool attempt_unsubscribe;
 	bool initial_notification_done;
 	bool outgoing_retain;
+	uint16_t max_inflight_messages;
+	uint16_t receive_maximum;
+	struct mosquitto__bridge_stats stats;
+	uint8_t compression;
+	uint32_t compression_threshold;
+	uint8_t *compress_buf;
+	size_t compress_buf_len;
+	int connection_count;
+	int connection_index;
+	struct mosquitto__bridge *primary;
+	struct mosquitto__bridge *connections; /* connection_count-1 extra connections, sharing the primary's configuration */
 #ifdef WITH_TLS
 	bool tls_insecure;
 	bool tls_ocsp_required;
@@ -613,10 +799,16 @@ int send__auth(struct mosquitto *context, uint8_t reason_code, const void *auth_
 void net__broker_init(void);
 void net__broker_cleanup(void);
 struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock);
+struct mosquitto *net__socket_accepted(struct mosquitto__listener_sock *listensock, mosq_sock_t new_sock);
 int net__socket_listen(struct mosquitto__listener *listener);
 int net__socket_get_address(mosq_sock_t sock, char *buf, size_t len, uint16_t *remote_address);
 int net__tls_load_verify(struct mosquitto__listener *listener);
 int net__tls_server_ctx(struct mosquitto__listener *listener);
+void net__tls_session_check(struct mosquitto *context);
+#ifdef WITH_TLS
+struct mosquitto *net__socket_handshake_done(struct mosquitto__listener *listener, mosq_sock_t sock, SSL *ssl);
+int net__tls_ctx_replace(struct mosquitto__listener *listener, X509 *cert, STACK_OF(X509) *chain, EVP_PKEY *pkey, X509_STORE *store);
+#endif
 int net__load_certificates(struct mosquitto__listener *listener);
 
 /* ============================================================
@@ -643,14 +835,16 @@ int persist__restore(void);
 /* Return the number of in-flight messages in count. */
 int db__message_count(int *count);
 int db__message_delete_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state expect_state, int qos);
-int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties, bool update);
+int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties, bool update);
+const mosquitto_property *db__subscription_identifier_property(mosquitto_property *prop, uint32_t subscription_identifier, const mosquitto_property *next);
 int db__message_remove_incoming(struct mosquitto* context, uint16_t mid);
 int db__message_release_incoming(struct mosquitto *context, uint16_t mid);
 int db__message_update_outgoing(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_state state, int qos);
-void db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
+struct mosquitto_client_msg *db__message_dequeue_first(struct mosquitto *context, struct mosquitto_msg_data *msg_data);
 int db__messages_delete(struct mosquitto *context, bool force_free);
 int db__messages_easy_queue(struct mosquitto *context, const char *topic, uint8_t qos, uint32_t payloadlen, const void *payload, int retain, uint32_t message_expiry_interval, mosquitto_property **properties);
 int db__message_store(const struct mosquitto *source, struct mosquitto_msg_store *stored, uint32_t message_expiry_interval, dbid_t store_id, enum mosquitto_msg_origin origin);
+void db__message_store_transient(const struct mosquitto *source, struct mosquitto_msg_store *stored, uint32_t message_expiry_interval, enum mosquitto_msg_origin origin);
 int db__message_store_find(struct mosquitto *context, uint16_t mid, struct mosquitto_client_msg **client_msg);
 void db__msg_store_add(struct mosquitto_msg_store *store);
 void db__msg_store_remove(struct mosquitto_msg_store *store);
@@ -669,20 +863,34 @@ int db__message_write_inflight_out_latest(struct mosquitto *context);
 int db__message_write_queued_out(struct mosquitto *context);
 int db__message_write_queued_in(struct mosquitto *context);
 void db__msg_add_to_inflight_stats(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
+void db__msg_add_to_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
+void db__msg_remove_from_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
+struct mosquitto_client_msg *db__msg_queue_get(struct mosquitto_msg_data *msg_data, int index);
+struct mosquitto_client_msg *db__msg_queue_push(struct mosquitto_msg_data *msg_data);
+void db__msg_queue_compact(struct mosquitto_msg_data *msg_data);
 void db__msg_add_to_queued_stats(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg);
 void db__expire_all_messages(struct mosquitto *context);
 
+/* ============================================================
+ * Interned data functions
+ * ============================================================ */
+void *intern__get(struct intern__table *table, const void *data, size_t len);
+void intern__release(struct intern__table *table, const void *data);
+bool intern__probe_can_move(uint32_t i, uint32_t j, uint32_t home);
+
 /* ============================================================
  * Subscription functions
  * ============================================================ */
 int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier **root);
-struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, uint16_t len);
+struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, const char *topic, uint16_t len);
+const char *sub__hier_topic(const struct mosquitto__subhier *hier);
+void sub__tree_clean(struct mosquitto__subhier **root);
 int sub__remove(struct mosquitto *context, const char *sub, struct mosquitto__subhier *root, uint8_t *reason);
 void sub__tree_print(struct mosquitto__subhier *root, int level);
 int sub__clean_session(struct mosquitto *context);
 int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store **stored);
-int sub__topic_tokenise(const char *subtopic, char **local_sub, char ***topics, const char **sharename);
-void sub__topic_tokens_free(struct sub__token *tokens);
+int sub__topic_tokenise(const char *subtopic, struct sub__tokens *tokens);
+void sub__topic_tokens_free(struct sub__tokens *tokens);
 
 /* ============================================================
  * Context functions
@@ -717,6 +925,16 @@ int log__init(struct mosquitto__config *config);
 int log__close(struct mosquitto__config *config);
 void log__internal(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
 
+/* ============================================================
+ * Compression functions
+ * ============================================================ */
+#ifdef WITH_ZLIB
+uint8_t compress__find_method(const mosquitto_property *props);
+int compress__add_property(mosquitto_property **props, uint8_t method);
+int compress__deflate(struct mosquitto__bridge *bridge, const void *payload, uint32_t payloadlen, const void **out, uint32_t *outlen);
+int compress__handle_publish(struct mosquitto *context, struct mosquitto_msg_store *msg);
+#endif
+
 /* ============================================================
  * Bridge functions
  * ============================================================ */
@@ -734,6 +952,11 @@ void bridge_check(void);
 int bridge__register_local_connections(void);
 int bridge__add_topic(struct mosquitto__bridge *bridge, const char *topic, enum mosquitto__bridge_direction direction, uint8_t qos, const char *local_prefix, const char *remote_prefix);
 int bridge__remap_topic_in(struct mosquitto *context, char **topic);
+int bridge__remap_topic_out(struct mosquitto *context, const char *topic, const char **mapped_topic);
+void bridge__topics_cleanup(struct mosquitto__bridge *bridge);
+bool bridge__connection_owns_topic(const struct mosquitto__bridge *bridge, const char *topic);
+void bridge__rtt_sample_start(struct mosquitto *context, uint16_t mid);
+void bridge__rtt_sample_end(struct mosquitto *context, uint16_t mid);
 #endif
 
 /* ============================================================
@@ -748,16 +971,46 @@ int mux__delete(struct mosquitto *context);
 int mux__wait(void);
 int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_count);
 int mux__cleanup(void);
+bool mux__read_more(struct mosquitto *context, int count);
+#ifdef WITH_IO_URING
+int mux__write(struct mosquitto *context);
+#endif
 
 /* ============================================================
  * Listener related functions
  * ============================================================ */
 void listener__set_defaults(struct mosquitto__listener *listener);
-void listeners__reload_all_certificates(void);
 #ifdef WITH_WEBSOCKETS
 void listeners__add_websockets(struct lws_context *ws_context, mosq_sock_t fd);
 #endif
 
+/* ============================================================
+ * TLS handshake pool related functions
+ * ============================================================ */
+#ifdef WITH_TLS_POOL
+int tls_pool__init(void);
+mosq_sock_t tls_pool__sock(void);
+bool tls_pool__wanted(struct mosquitto__listener *listener);
+void tls_pool__add(struct mosquitto__listener *listener, mosq_sock_t sock);
+void tls_pool__process(void);
+const struct mosquitto__tls_pool_stats *tls_pool__stats(void);
+void tls_pool__lock(void);
+void tls_pool__unlock(void);
+void tls_pool__cleanup(void);
+#endif
+
+/* ============================================================
+ * TLS session resumption related functions
+ * ============================================================ */
+#ifdef WITH_TLS
+int tls_session__ctx_init(struct mosquitto__listener *listener);
+void tls_session__keys_check(bool force);
+void tls_session__cleanup(struct mosquitto__listener *listener);
+void tls_reload__start(void);
+void tls_reload__check(void);
+void tls_reload__cleanup(void);
+#endif
+
 /* ============================================================
  * Plugin related functions
  * ============================================================ */
@@ -789,7 +1042,7 @@ int property__process_disconnect(struct mosquitto *context, mosquitto_property *
 int retain__init(void);
 void retain__clean(struct mosquitto__retainhier **retainhier);
 int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier);
-int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics);
+int retain__store(const char *topic, struct mosquitto_msg_store *stored, const struct sub__token *tokens, int token_count);
 
 /* ============================================================
  * Security related functions
@@ -852,6 +1105,14 @@ DWORD WINAPI SigThreadProc(void* data);
 #ifdef WITH_WEBSOCKETS
 void mosq_websockets_init(struct mosquitto__listener *listener, const struct mosquitto__config *conf);
 #endif
+#ifdef WITH_WEBSOCKETS_BUILTIN
+int http__read(struct mosquitto *mosq);
+/* Websockets data that arrived with the HTTP upgrade request and has not been
+ * read yet. The socket will not report it as readable again. */
+#  define WS_DATA_PENDING(A) ((A)->sock != INVALID_SOCKET && (A)->ws.state == ws_s_open && (A)->ws.http_buf != NULL)
+#else
+#  define WS_DATA_PENDING(A) 0
+#endif
 void do_disconnect(struct mosquitto *context, int reason);
 
 /* ============================================================
@@ -17,10 +17,35 @@ Contributors:
    Tatsuzo Osawa - Add epoll.
 */
 
+#include "config.h"
+
+#ifndef WIN32
+#  include <sys/ioctl.h>
+#else
+#  include <winsock2.h>
+#endif
+
 #include "mux.h"
+#include "packet_mosq.h"
+#include "util_mosq.h"
+
+#ifdef WITH_IO_URING
+static bool use_uring = false;
+#endif
 
 int mux__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
+#ifdef WITH_IO_URING
+	use_uring = false;
+	if(db.config->mux_backend == mux_b_io_uring){
+		if(mux_io_uring__init(listensock, listensock_count) == MOSQ_ERR_SUCCESS){
+			log__printf(NULL, MOSQ_LOG_INFO, "Using io_uring for socket multiplexing.");
+			use_uring = true;
+			return MOSQ_ERR_SUCCESS;
+		}
+		log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to use io_uring, falling back to epoll.");
+	}
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__init(listensock, listensock_count);
 #else
@@ -30,6 +55,9 @@ int mux__init(struct mosquitto__listener_sock *listensock, int listensock_count)
 
 int mux__add_out(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_uring) return mux_io_uring__add_out(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__add_out(context);
 #else
@@ -40,6 +68,9 @@ int mux__add_out(struct mosquitto *context)
 
 int mux__remove_out(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_uring) return mux_io_uring__remove_out(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__remove_out(context);
 #else
@@ -50,6 +81,9 @@ int mux__remove_out(struct mosquitto *context)
 
 int mux__add_in(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_uring) return mux_io_uring__add_in(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__add_in(context);
 #else
@@ -60,6 +94,9 @@ int mux__add_in(struct mosquitto *context)
 
 int mux__delete(struct mosquitto *context)
 {
+#ifdef WITH_IO_URING
+	if(use_uring) return mux_io_uring__delete(context);
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__delete(context);
 #else
@@ -68,11 +105,23 @@ int mux__delete(struct mosquitto *context)
 }
 
 
+#ifdef WITH_IO_URING
+/* Only used for clients that io_uring has taken on, see mux_io_uring.c */
+int mux__write(struct mosquitto *context)
+{
+	return mux_io_uring__write(context);
+}
+#endif
+
+
 int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_count)
 {
 #ifdef WITH_EPOLL
 	UNUSED(listensock);
 	UNUSED(listensock_count);
+#  ifdef WITH_IO_URING
+	if(use_uring) return mux_io_uring__handle();
+#  endif
 	return mux_epoll__handle();
 #else
 	return mux_poll__handle(listensock, listensock_count);
@@ -82,9 +131,43 @@ int mux__handle(struct mosquitto__listener_sock *listensock, int listensock_coun
 
 int mux__cleanup(void)
 {
+#ifdef WITH_IO_URING
+	if(use_uring){
+		use_uring = false;
+		return mux_io_uring__cleanup();
+	}
+#endif
 #ifdef WITH_EPOLL
 	return mux_epoll__cleanup();
 #else
 	return mux_poll__cleanup();
 #endif
 }
+
+
+/* With write_coalescing, carry on reading packets from a client that have
+ * already arrived, rather than one packet per loop iteration, so that the
+ * replies to a burst of packets are written together. Limited to
+ * PACKET_WRITE_BATCH packets so one client can't starve the others. */
+bool mux__read_more(struct mosquitto *context, int count)
+{
+#ifdef WIN32
+	u_long avail = 0;
+#else
+	int avail = 0;
+#endif
+
+	if(db.config->write_coalescing == false
+			|| count >= PACKET_WRITE_BATCH
+			|| context->sock == INVALID_SOCKET
+			|| mosquitto__get_state(context) != mosq_cs_active){
+
+		return false;
+	}
+#ifdef WIN32
+	if(ioctlsocket(context->sock, FIONREAD, &avail)) return false;
+#else
+	if(ioctl(context->sock, FIONREAD, &avail)) return false;
+#endif
+	return avail > 0;
+}
@@ -28,6 +28,16 @@ int mux_epoll__add_in(struct mosquitto *context);
 int mux_epoll__delete(struct mosquitto *context);
 int mux_epoll__handle(void);
 int mux_epoll__cleanup(void);
+void mux_epoll__handle_reads_writes(struct mosquitto *context, uint32_t events);
+
+int mux_io_uring__init(struct mosquitto__listener_sock *listensock, int listensock_count);
+int mux_io_uring__add_out(struct mosquitto *context);
+int mux_io_uring__remove_out(struct mosquitto *context);
+int mux_io_uring__add_in(struct mosquitto *context);
+int mux_io_uring__delete(struct mosquitto *context);
+int mux_io_uring__write(struct mosquitto *context);
+int mux_io_uring__handle(void);
+int mux_io_uring__cleanup(void);
 
 int mux_poll__init(struct mosquitto__listener_sock *listensock, int listensock_count);
 int mux_poll__add_out(struct mosquitto *context);
@@ -65,8 +65,6 @@ Contributors:
 #  error "epoll not supported on WIN32"
 #endif
 
-static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events);
-
 static sigset_t my_sigblock;
 static struct epoll_event ep_events[MAX_EVENTS];
 
@@ -204,7 +202,7 @@ int mux_epoll__handle(void)
 		for(i=0; i<event_count; i++){
 			context = ep_events[i].data.ptr;
 			if(context->ident == id_client){
-				loop_handle_reads_writes(context, ep_events[i].events);
+				mux_epoll__handle_reads_writes(context, ep_events[i].events);
 			}else if(context->ident == id_listener){
 				listensock = ep_events[i].data.ptr;
 
@@ -218,6 +216,10 @@ int mux_epoll__handle(void)
 			}else if(context->ident == id_listener_ws){
 				/* Nothing needs to happen here, because we always call lws_service in the loop.
 				 * The important point is we've been woken up for this listener. */
+#endif
+#ifdef WITH_TLS_POOL
+			}else if(context->ident == id_tls_pool){
+				/* Completed handshakes are collected by tls_pool__process() in the loop. */
 #endif
 			}
 		}
@@ -234,11 +236,13 @@ int mux_epoll__cleanup(void)
 }
 
 
-static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events)
+/* Also used by mux_io_uring, the poll event values are the same. */
+void mux_epoll__handle_reads_writes(struct mosquitto *context, uint32_t events)
 {
 	int err;
 	socklen_t len;
 	int rc;
+	int count;
 
 	if(context->sock == INVALID_SOCKET){
 		return;
@@ -291,13 +295,14 @@ static void loop_handle_reads_writes(struct mosquitto *context, uint32_t events)
 #endif
 			){
 
+		count = 0;
 		do{
 			rc = packet__read(context);
 			if(rc){
 				do_disconnect(context, rc);
 				return;
 			}
-		}while(SSL_DATA_PENDING(context));
+		}while(SSL_DATA_PENDING(context) || WS_DATA_PENDING(context) || mux__read_more(context, ++count));
 	}else{
 		if(events & (EPOLLERR | EPOLLHUP)){
 			do_disconnect(context, MOSQ_ERR_CONN_LOST);
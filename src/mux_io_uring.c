@@ -0,0 +1,1039 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_IO_URING
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mqtt_protocol.h"
+#include "mux.h"
+#include "packet_mosq.h"
+#include "sys_tree.h"
+#include "time_mosq.h"
+#include "utlist.h"
+
+/* io_uring based multiplexer. Requests are only recorded when they are made,
+ * and are submitted in one go along with the wait at the start of the next
+ * loop iteration.
+ *
+ * Plain TCP clients have their data received by a multishot recv request,
+ * into buffers provided to the kernel from a buffer ring. packet__read() is
+ * run over each buffer as it completes, with net__read() copying from the
+ * buffer rather than calling read(). Packets are sent with a single send
+ * request per client at a time, covering as many queued packets as
+ * possible. The packets are owned by the request until it completes, and
+ * anything not sent is put back at the front of the queue. A client that is
+ * exchanging packets therefore needs no system calls of its own at all.
+ *
+ * TLS clients are read and written by OpenSSL, and bridges need to see their
+ * connection complete, so those use a single shot poll request that is
+ * re-armed after it completes. This gives the same level triggered behaviour
+ * as epoll. The same is used for reading if the kernel does not support
+ * multishot recv. Listeners use multishot accept where the kernel supports
+ * it. */
+
+#define URING_SQ_ENTRIES 1024
+#define URING_CQ_ENTRIES 8192
+
+/* Provided receive buffers, URING_BUF_COUNT must be a power of two */
+#define URING_BUF_GROUP 0
+#define URING_BUF_COUNT 256
+#define URING_BUF_SIZE 4096
+
+/* user_data layout: | kind:2 | op:2 | generation:28 | fd or listener index:32 |
+ * Send requests use the address of their struct mux_uring_send instead, the
+ * top bits of which are always zero for user space addresses. */
+#define URING_KIND_SEND 0ULL
+#define URING_KIND_CLIENT 1ULL
+#define URING_KIND_LISTENER 2ULL
+#define URING_KIND_IGNORE 3ULL
+#define URING_KIND(id) ((id) >> 62)
+#define URING_OP_POLL 0ULL
+#define URING_OP_RECV 1ULL
+#define URING_OP(id) (((id) >> 60) & 0x3)
+#define URING_CLIENT_ID(id) ((id) & ~(0x3ULL << 60))
+#define URING_FD(id) ((int)((id) & 0xFFFFFFFF))
+
+struct mux_uring_send{
+	struct mux_uring_send *prev, *next;
+	uint64_t owner; /* uring_id of the client, or 0 once it has gone */
+	struct mosquitto__packet *packets;
+	struct msghdr msg;
+	struct iovec iov[];
+};
+
+struct mux_uring{
+	int fd;
+	void *sq_ptr;
+	size_t sq_size;
+	void *cq_ptr;
+	size_t cq_size;
+	struct io_uring_sqe *sqes;
+	size_t sqes_size;
+	uint32_t *sq_head;
+	uint32_t *sq_tail;
+	uint32_t sq_mask;
+	uint32_t sq_entries;
+	uint32_t *sq_array;
+	uint32_t *cq_head;
+	uint32_t *cq_tail;
+	uint32_t cq_mask;
+	struct io_uring_cqe *cqes;
+	uint32_t to_submit;
+};
+
+static struct mux_uring ring = {.fd = -1};
+static sigset_t my_sigblock;
+static uint32_t generation = 0;
+static uint64_t *dirty = NULL;
+static size_t dirty_count = 0;
+static size_t dirty_max = 0;
+static struct mosquitto__listener_sock *listeners = NULL;
+static int listener_count = 0;
+static bool accept_multishot = true;
+static bool recv_multishot = false;
+static struct io_uring_buf_ring *buf_ring = NULL;
+static uint8_t *bufs = NULL;
+static uint16_t buf_tail = 0;
+static struct mux_uring_send *sends = NULL;
+
+
+static int uring_setup(unsigned entries, struct io_uring_params *p)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+
+static int uring_enter(unsigned to_submit, unsigned min_complete, unsigned flags, void *arg, size_t argsz)
+{
+	return (int)syscall(__NR_io_uring_enter, ring.fd, to_submit, min_complete, flags, arg, argsz);
+}
+
+
+static int uring_register(unsigned opcode, void *arg, unsigned nr_args)
+{
+	return (int)syscall(__NR_io_uring_register, ring.fd, opcode, arg, nr_args);
+}
+
+
+static int uring_submit(void)
+{
+	int rc;
+
+	while(ring.to_submit > 0){
+		rc = uring_enter(ring.to_submit, 0, 0, NULL, 0);
+		if(rc < 0){
+			if(errno == EINTR) continue;
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring submitting: %s.", strerror(errno));
+			return MOSQ_ERR_UNKNOWN;
+		}
+		ring.to_submit -= (uint32_t)rc;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static struct io_uring_sqe *uring_get_sqe(void)
+{
+	struct io_uring_sqe *sqe;
+	uint32_t tail, head;
+
+	tail = *ring.sq_tail;
+	head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+	if(tail - head >= ring.sq_entries){
+		/* Submission queue is full, hand what we have to the kernel now */
+		if(uring_submit()) return NULL;
+		head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+		if(tail - head >= ring.sq_entries) return NULL;
+	}
+	sqe = &ring.sqes[tail & ring.sq_mask];
+	memset(sqe, 0, sizeof(struct io_uring_sqe));
+	ring.sq_array[tail & ring.sq_mask] = tail & ring.sq_mask;
+	__atomic_store_n(ring.sq_tail, tail+1, __ATOMIC_RELEASE);
+	ring.to_submit++;
+
+	return sqe;
+}
+
+
+static int uring_arm_listener(int index)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if(sqe == NULL) return MOSQ_ERR_NOMEM;
+
+	sqe->fd = listeners[index].sock;
+	sqe->user_data = (URING_KIND_LISTENER << 62) | (uint64_t)index;
+	if(accept_multishot && listeners[index].ident == id_listener){
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+	}else{
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->poll32_events = POLLIN;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Give a receive buffer back to the kernel */
+static void uring_buf_recycle(uint16_t bid)
+{
+	struct io_uring_buf *buf;
+
+	buf = &buf_ring->bufs[buf_tail & (URING_BUF_COUNT-1)];
+	buf->addr = (uint64_t)(uintptr_t)&bufs[(size_t)bid*URING_BUF_SIZE];
+	buf->len = URING_BUF_SIZE;
+	buf->bid = bid;
+	buf_tail++;
+	__atomic_store_n(&buf_ring->tail, buf_tail, __ATOMIC_RELEASE);
+}
+
+
+static int uring_buf_init(void)
+{
+	struct io_uring_buf_reg reg;
+	uint16_t i;
+
+	buf_ring = mmap(NULL, URING_BUF_COUNT*sizeof(struct io_uring_buf), PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+	if(buf_ring == MAP_FAILED){
+		buf_ring = NULL;
+		return MOSQ_ERR_NOMEM;
+	}
+	bufs = mosquitto__malloc((size_t)URING_BUF_COUNT*URING_BUF_SIZE);
+	if(bufs == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+
+	memset(&reg, 0, sizeof(reg));
+	reg.ring_addr = (uint64_t)(uintptr_t)buf_ring;
+	reg.ring_entries = URING_BUF_COUNT;
+	reg.bgid = URING_BUF_GROUP;
+	if(uring_register(IORING_REGISTER_PBUF_RING, &reg, 1) < 0){
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	buf_tail = 0;
+	for(i=0; i<URING_BUF_COUNT; i++){
+		uring_buf_recycle(i);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void uring_buf_cleanup(void)
+{
+	if(buf_ring){
+		munmap(buf_ring, URING_BUF_COUNT*sizeof(struct io_uring_buf));
+		buf_ring = NULL;
+	}
+	mosquitto__free(bufs);
+	bufs = NULL;
+}
+
+
+/* Find the client a request was made for, if it is still connected */
+static void uring_rx_kept_free(struct mosquitto *context)
+{
+	mosquitto__free(context->uring_rx_kept);
+	context->uring_rx_kept = NULL;
+	context->uring_rx_kept_len = 0;
+}
+
+
+static struct mosquitto *uring_find_client(uint64_t user_data)
+{
+	struct mosquitto *context;
+	int sock = URING_FD(user_data);
+
+	HASH_FIND(hh_sock, db.contexts_by_sock, &sock, sizeof(sock), context);
+	if(context && context->uring_id == URING_CLIENT_ID(user_data)){
+		return context;
+	}
+	return NULL;
+}
+
+
+static void uring_arm_recv(struct mosquitto *context)
+{
+	struct io_uring_sqe *sqe;
+
+	sqe = uring_get_sqe();
+	if(sqe == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring receiving: submission queue full.");
+		return;
+	}
+	sqe->opcode = IORING_OP_RECV;
+	sqe->fd = context->sock;
+	sqe->ioprio = IORING_RECV_MULTISHOT;
+	sqe->flags = IOSQE_BUFFER_SELECT;
+	sqe->buf_group = URING_BUF_GROUP;
+	sqe->user_data = context->uring_id | (URING_OP_RECV << 60);
+	context->uring_recv = true;
+	context->uring_recv_armed = true;
+}
+
+
+static void uring_arm_client(struct mosquitto *context)
+{
+	struct io_uring_sqe *sqe;
+
+	if(context->uring_io && recv_multishot){
+		if(context->uring_recv_armed == false){
+			uring_arm_recv(context);
+		}
+		return;
+	}
+	if(context->uring_armed == context->events){
+		return;
+	}
+	sqe = uring_get_sqe();
+	if(sqe == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring polling: submission queue full.");
+		return;
+	}
+	if(context->uring_armed == 0){
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = context->sock;
+		sqe->poll32_events = context->events;
+		sqe->user_data = context->uring_id;
+	}else{
+		/* If the poll completes before the update is processed, the update
+		 * fails with ENOENT and the completion re-arms with the new events. */
+		sqe->opcode = IORING_OP_POLL_REMOVE;
+		sqe->fd = -1;
+		sqe->addr = context->uring_id;
+		sqe->len = IORING_POLL_UPDATE_EVENTS;
+		sqe->poll32_events = context->events;
+		sqe->user_data = URING_KIND_IGNORE << 62;
+	}
+	context->uring_armed = context->events;
+}
+
+
+static void uring_mark_dirty(struct mosquitto *context)
+{
+	uint64_t *tmp;
+
+	if(context->uring_dirty) return;
+
+	if(dirty_count == dirty_max){
+		tmp = mosquitto__realloc(dirty, sizeof(uint64_t)*(dirty_max ? dirty_max*2 : 64));
+		if(tmp == NULL){
+			/* Arm now rather than later */
+			uring_arm_client(context);
+			return;
+		}
+		dirty = tmp;
+		dirty_max = dirty_max ? dirty_max*2 : 64;
+	}
+	dirty[dirty_count++] = context->uring_id;
+	context->uring_dirty = true;
+}
+
+
+static void uring_flush_dirty(void)
+{
+	struct mosquitto *context;
+	size_t i;
+
+	for(i=0; i<dirty_count; i++){
+		context = uring_find_client(dirty[i]);
+		if(context && context->uring_dirty){
+			context->uring_dirty = false;
+			uring_arm_client(context);
+		}
+	}
+	dirty_count = 0;
+}
+
+
+/* TLS connections are read and written by OpenSSL, and bridges need POLLOUT
+ * to see their connection complete. */
+static bool uring_can_do_io(struct mosquitto *context)
+{
+#ifdef WITH_TLS
+	if(context->ssl) return false;
+#endif
+#ifdef WITH_WEBSOCKETS
+	if(context->wsi) return false;
+#endif
+#ifdef WITH_BRIDGE
+	if(context->bridge) return false;
+#endif
+	return true;
+}
+
+
+static void uring_set_events(struct mosquitto *context, uint32_t events)
+{
+	if(context->sock == INVALID_SOCKET){
+		return;
+	}
+	if(context->uring_id == 0 || URING_FD(context->uring_id) != context->sock){
+		generation = (generation+1) & 0x0FFFFFFF;
+		context->uring_id = (URING_KIND_CLIENT << 62) | ((uint64_t)generation << 32) | (uint32_t)context->sock;
+		context->uring_armed = 0;
+		context->uring_dirty = false;
+		context->uring_io = uring_can_do_io(context);
+		context->uring_recv = false;
+		context->uring_recv_armed = false;
+	}
+	if(context->uring_io){
+		/* Sends complete through the ring, there is no need to poll */
+		events &= ~(uint32_t)POLLOUT;
+	}
+	context->events = events;
+	uring_mark_dirty(context);
+}
+
+
+int mux_io_uring__init(struct mosquitto__listener_sock *listensock, int listensock_count)
+{
+	struct io_uring_params p;
+	int i;
+
+	sigemptyset(&my_sigblock);
+	sigaddset(&my_sigblock, SIGINT);
+	sigaddset(&my_sigblock, SIGTERM);
+	sigaddset(&my_sigblock, SIGUSR1);
+	sigaddset(&my_sigblock, SIGUSR2);
+	sigaddset(&my_sigblock, SIGHUP);
+
+	memset(&p, 0, sizeof(p));
+	p.flags = IORING_SETUP_CQSIZE;
+	p.cq_entries = URING_CQ_ENTRIES;
+	ring.fd = uring_setup(URING_SQ_ENTRIES, &p);
+	if(ring.fd < 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring creating: %s.", strerror(errno));
+		ring.fd = -1;
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(!(p.features & IORING_FEAT_EXT_ARG) || !(p.features & IORING_FEAT_NODROP)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring creating: kernel is too old.");
+		mux_io_uring__cleanup();
+		return MOSQ_ERR_NOT_SUPPORTED;
+	}
+
+	ring.sq_size = p.sq_off.array + p.sq_entries*sizeof(uint32_t);
+	ring.cq_size = p.cq_off.cqes + p.cq_entries*sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		if(ring.cq_size > ring.sq_size) ring.sq_size = ring.cq_size;
+		ring.cq_size = ring.sq_size;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if(ring.sq_ptr == MAP_FAILED){
+		ring.sq_ptr = NULL;
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring mapping: %s.", strerror(errno));
+		mux_io_uring__cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+	if(p.features & IORING_FEAT_SINGLE_MMAP){
+		ring.cq_ptr = ring.sq_ptr;
+	}else{
+		ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if(ring.cq_ptr == MAP_FAILED){
+			ring.cq_ptr = NULL;
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring mapping: %s.", strerror(errno));
+			mux_io_uring__cleanup();
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
+	ring.sqes_size = p.sq_entries*sizeof(struct io_uring_sqe);
+	ring.sqes = mmap(NULL, ring.sqes_size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if(ring.sqes == MAP_FAILED){
+		ring.sqes = NULL;
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring mapping: %s.", strerror(errno));
+		mux_io_uring__cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	ring.sq_head = (uint32_t *)((char *)ring.sq_ptr + p.sq_off.head);
+	ring.sq_tail = (uint32_t *)((char *)ring.sq_ptr + p.sq_off.tail);
+	ring.sq_mask = *(uint32_t *)((char *)ring.sq_ptr + p.sq_off.ring_mask);
+	ring.sq_entries = *(uint32_t *)((char *)ring.sq_ptr + p.sq_off.ring_entries);
+	ring.sq_array = (uint32_t *)((char *)ring.sq_ptr + p.sq_off.array);
+	ring.cq_head = (uint32_t *)((char *)ring.cq_ptr + p.cq_off.head);
+	ring.cq_tail = (uint32_t *)((char *)ring.cq_ptr + p.cq_off.tail);
+	ring.cq_mask = *(uint32_t *)((char *)ring.cq_ptr + p.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((char *)ring.cq_ptr + p.cq_off.cqes);
+	ring.to_submit = 0;
+
+	if(uring_buf_init() == MOSQ_ERR_SUCCESS){
+		recv_multishot = true;
+	}else{
+		log__printf(NULL, MOSQ_LOG_INFO, "io_uring provided buffers not supported, using poll for receiving.");
+		recv_multishot = false;
+		uring_buf_cleanup();
+	}
+
+	listeners = listensock;
+	listener_count = listensock_count;
+	accept_multishot = true;
+	for(i=0; i<listensock_count; i++){
+		if(uring_arm_listener(i)){
+			mux_io_uring__cleanup();
+			return MOSQ_ERR_UNKNOWN;
+		}
+	}
+	if(uring_submit()){
+		mux_io_uring__cleanup();
+		return MOSQ_ERR_UNKNOWN;
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__add_out(struct mosquitto *context)
+{
+	if(!(context->events & POLLOUT) || context->uring_id == 0){
+		uring_set_events(context, POLLIN | POLLOUT);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__remove_out(struct mosquitto *context)
+{
+	if((context->events & POLLOUT) || context->uring_id == 0){
+		uring_set_events(context, POLLIN);
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__add_in(struct mosquitto *context)
+{
+	uring_set_events(context, POLLIN);
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__delete(struct mosquitto *context)
+{
+	struct io_uring_sqe *sqe;
+	bool submit = false;
+
+	if(context->uring_id && context->uring_armed){
+		sqe = uring_get_sqe();
+		if(sqe){
+			sqe->opcode = IORING_OP_POLL_REMOVE;
+			sqe->fd = -1;
+			sqe->addr = context->uring_id;
+			sqe->user_data = URING_KIND_IGNORE << 62;
+		}
+	}
+	if(context->uring_id && context->uring_recv_armed){
+		sqe = uring_get_sqe();
+		if(sqe){
+			sqe->opcode = IORING_OP_ASYNC_CANCEL;
+			sqe->fd = -1;
+			sqe->addr = context->uring_id | (URING_OP_RECV << 60);
+			sqe->user_data = URING_KIND_IGNORE << 62;
+		}
+		submit = true;
+	}
+	if(context->uring_send){
+		/* Freed when it completes */
+		context->uring_send->owner = 0;
+		context->uring_send = NULL;
+		submit = true;
+	}
+	if(submit){
+		/* Requests that refer to the socket by number must reach the kernel
+		 * before it is closed, because the number can be reused straight
+		 * away. This also lets a final packet, like a DISCONNECT, be sent. */
+		uring_submit();
+	}
+	context->uring_id = 0;
+	context->uring_armed = 0;
+	context->uring_dirty = false;
+	context->uring_io = false;
+	context->uring_recv = false;
+	context->uring_recv_armed = false;
+	uring_rx_kept_free(context);
+	return 0;
+}
+
+
+static void uring_send_free(struct mux_uring_send *s)
+{
+	struct mosquitto__packet *packet;
+
+	while(s->packets){
+		packet = s->packets;
+		s->packets = packet->next;
+		packet__cleanup(packet);
+		mosquitto__free(packet);
+	}
+	DL_DELETE(sends, s);
+	mosquitto__free(s);
+}
+
+
+static int uring_write(struct mosquitto *context, bool poll_first)
+{
+	struct mux_uring_send *s;
+	struct mosquitto__packet *packet, *last = NULL;
+	struct io_uring_sqe *sqe;
+	int count, i;
+
+	if(context->uring_send){
+		/* Carried on when the send in progress completes */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	count = context->current_out_packet ? 1 : 0;
+	for(packet = context->out_packet; packet && count < PACKET_WRITE_BATCH; packet = packet->next){
+		count++;
+	}
+	if(count == 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	s = mosquitto__malloc(sizeof(struct mux_uring_send) + (size_t)count*sizeof(struct iovec));
+	if(s == NULL){
+		return MOSQ_ERR_NOMEM;
+	}
+	sqe = uring_get_sqe();
+	if(sqe == NULL){
+		mosquitto__free(s);
+		log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring sending: submission queue full.");
+		return MOSQ_ERR_NOMEM;
+	}
+
+	s->owner = context->uring_id;
+	s->packets = NULL;
+	for(i=0; i<count; i++){
+		if(context->current_out_packet){
+			packet = context->current_out_packet;
+			context->current_out_packet = NULL;
+		}else{
+			packet = context->out_packet;
+			context->out_packet = packet->next;
+			if(context->out_packet == NULL){
+				context->out_packet_last = NULL;
+			}
+			context->out_packet_count--;
+		}
+		packet->next = NULL;
+		if(last){
+			last->next = packet;
+		}else{
+			s->packets = packet;
+		}
+		last = packet;
+		s->iov[i].iov_base = &packet->payload[packet->pos];
+		s->iov[i].iov_len = packet->to_process;
+	}
+	DL_APPEND(sends, s);
+	context->uring_send = s;
+
+	sqe->fd = context->sock;
+	sqe->msg_flags = MSG_NOSIGNAL;
+	if(poll_first){
+		sqe->ioprio = IORING_RECVSEND_POLL_FIRST;
+	}
+	sqe->user_data = (uint64_t)(uintptr_t)s;
+	if(count == 1){
+		sqe->opcode = IORING_OP_SEND;
+		sqe->addr = (uint64_t)(uintptr_t)s->iov[0].iov_base;
+		sqe->len = (uint32_t)s->iov[0].iov_len;
+	}else{
+		memset(&s->msg, 0, sizeof(s->msg));
+		s->msg.msg_iov = s->iov;
+		s->msg.msg_iovlen = (size_t)count;
+		sqe->opcode = IORING_OP_SENDMSG;
+		sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+		sqe->len = 1;
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Called by packet__write() for clients with uring_io set. */
+int mux_io_uring__write(struct mosquitto *context)
+{
+	return uring_write(context, false);
+}
+
+
+static void uring_handle_send(struct mux_uring_send *s, int res)
+{
+	struct mosquitto *context = NULL;
+	struct mosquitto__packet *packet, *last;
+	uint32_t len, n;
+	int rc;
+
+	if(s->owner){
+		context = uring_find_client(s->owner);
+	}
+	if(context == NULL){
+		uring_send_free(s);
+		return;
+	}
+	context->uring_send = NULL;
+
+	if(res < 0 && res != -EAGAIN && res != -EINTR){
+		uring_send_free(s);
+		errno = -res;
+		do_disconnect(context, (res == -ECONNRESET || res == -EPIPE) ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_ERRNO);
+		return;
+	}
+
+	len = res > 0 ? (uint32_t)res : 0;
+	G_BYTES_SENT_INC(len);
+	while(s->packets){
+		packet = s->packets;
+		n = len < packet->to_process ? len : packet->to_process;
+		packet->pos += n;
+		packet->to_process -= n;
+		len -= n;
+		if(packet->to_process > 0){
+			break;
+		}
+		s->packets = packet->next;
+		G_MSGS_SENT_INC(1);
+		if((packet->command & 0xF0) == CMD_PUBLISH){
+			G_PUB_MSGS_SENT_INC(1);
+		}
+		packet__cleanup(packet);
+		mosquitto__free(packet);
+	}
+	if(res > 0){
+		context->next_msg_out = db.now_s + context->keepalive;
+	}
+
+	if(s->packets){
+		/* Put what is left back in front of the queue */
+		for(last = s->packets; ; last = last->next){
+			context->out_packet_count++;
+			if(last->next == NULL) break;
+		}
+		last->next = context->out_packet;
+		if(context->out_packet == NULL){
+			context->out_packet_last = last;
+		}
+		context->out_packet = s->packets;
+		s->packets = NULL;
+	}
+	uring_send_free(s);
+
+	rc = uring_write(context, res == -EAGAIN);
+	if(rc){
+		do_disconnect(context, rc);
+	}
+}
+
+
+/* Run packet__read() over newly received data for as long as it takes any.
+ * Whatever it leaves is kept, and read first when more data arrives. */
+static void uring_read(struct mosquitto *context, const uint8_t *data, size_t len)
+{
+	uint8_t *joined = NULL;
+	size_t before;
+	int rc;
+
+	if(context->uring_rx_kept){
+		joined = mosquitto__realloc(context->uring_rx_kept, context->uring_rx_kept_len + len);
+		if(joined == NULL){
+			do_disconnect(context, MOSQ_ERR_NOMEM);
+			return;
+		}
+		memcpy(&joined[context->uring_rx_kept_len], data, len);
+		data = joined;
+		len += context->uring_rx_kept_len;
+		context->uring_rx_kept = NULL;
+		context->uring_rx_kept_len = 0;
+	}
+
+	context->uring_rx = data;
+	context->uring_rx_len = len;
+	do{
+		before = context->uring_rx_len;
+		rc = packet__read(context);
+		if(rc){
+			context->uring_rx = NULL;
+			context->uring_rx_len = 0;
+			mosquitto__free(joined);
+			do_disconnect(context, rc);
+			return;
+		}
+	}while((context->uring_rx_len > 0 && context->uring_rx_len < before) || WS_DATA_PENDING(context));
+
+	if(context->uring_rx_len > 0){
+		context->uring_rx_kept = mosquitto__malloc(context->uring_rx_len);
+		if(context->uring_rx_kept == NULL){
+			context->uring_rx = NULL;
+			context->uring_rx_len = 0;
+			mosquitto__free(joined);
+			do_disconnect(context, MOSQ_ERR_NOMEM);
+			return;
+		}
+		memcpy(context->uring_rx_kept, context->uring_rx, context->uring_rx_len);
+		context->uring_rx_kept_len = context->uring_rx_len;
+	}
+	context->uring_rx = NULL;
+	context->uring_rx_len = 0;
+	mosquitto__free(joined);
+}
+
+
+static void uring_handle_recv(struct io_uring_cqe *cqe)
+{
+	struct mosquitto *context;
+	uint16_t bid;
+
+	context = uring_find_client(cqe->user_data);
+	if(context && !(cqe->flags & IORING_CQE_F_MORE)){
+		context->uring_recv_armed = false;
+	}
+
+	if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)){
+		bid = (uint16_t)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+		if(context){
+			uring_read(context, &bufs[(size_t)bid*URING_BUF_SIZE], (size_t)cqe->res);
+		}
+		uring_buf_recycle(bid);
+		/* Handling the data may have disconnected the client */
+		context = uring_find_client(cqe->user_data);
+	}else if(context){
+		switch(cqe->res){
+			case 0:
+				do_disconnect(context, MOSQ_ERR_CONN_LOST);
+				return;
+			case -ENOBUFS:
+				/* Out of buffers, re-armed below once they have been returned */
+				break;
+			case -ECANCELED:
+				return;
+			case -EINVAL:
+				if(recv_multishot){
+					log__printf(NULL, MOSQ_LOG_INFO, "io_uring multishot recv not supported, using poll for receiving.");
+					recv_multishot = false;
+				}
+				context->uring_recv = false;
+				break;
+			default:
+				errno = -cqe->res;
+				do_disconnect(context, cqe->res == -ECONNRESET ? MOSQ_ERR_CONN_LOST : MOSQ_ERR_ERRNO);
+				return;
+		}
+	}
+
+	if(context && context->uring_recv_armed == false){
+		uring_mark_dirty(context);
+	}
+}
+
+
+static void uring_handle_listener(int index, struct io_uring_cqe *cqe)
+{
+	struct mosquitto__listener_sock *listensock = &listeners[index];
+	struct mosquitto *context;
+
+	if(listensock->ident == id_listener){
+		if(accept_multishot && cqe->res >= 0){
+			context = net__socket_accepted(listensock, cqe->res);
+			if(context){
+				mux__add_in(context);
+			}
+		}else{
+			if(accept_multishot && cqe->res == -EINVAL){
+				/* Multishot accept not supported, poll the listeners instead */
+				log__printf(NULL, MOSQ_LOG_INFO, "io_uring multishot accept not supported, using poll.");
+				accept_multishot = false;
+			}
+			/* Also deals with EMFILE and friends */
+			while((context = net__socket_accept(listensock)) != NULL){
+				mux__add_in(context);
+			}
+		}
+#ifdef WITH_WEBSOCKETS
+	}else if(listensock->ident == id_listener_ws){
+		/* Nothing needs to happen here, because we always call lws_service in the loop.
+		 * The important point is we've been woken up for this listener. */
+#endif
+#ifdef WITH_TLS_POOL
+	}else if(listensock->ident == id_tls_pool){
+		/* Completed handshakes are collected by tls_pool__process() in the loop. */
+#endif
+	}
+
+	if(!(cqe->flags & IORING_CQE_F_MORE)){
+		uring_arm_listener(index);
+	}
+}
+
+
+static void uring_handle_client(struct io_uring_cqe *cqe)
+{
+	struct mosquitto *context;
+	uint32_t events;
+
+	context = uring_find_client(cqe->user_data);
+	if(context == NULL){
+		return;
+	}
+	context->uring_armed = 0;
+	if(cqe->res == -ECANCELED){
+		return;
+	}else if(cqe->res < 0){
+		events = POLLERR;
+	}else{
+		events = (uint32_t)cqe->res;
+	}
+	/* Re-armed at the start of the next iteration unless it goes away */
+	uring_mark_dirty(context);
+	mux_epoll__handle_reads_writes(context, events);
+}
+
+
+int mux_io_uring__handle(void)
+{
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct io_uring_cqe cqe;
+	uint32_t head, tail;
+	unsigned submitted;
+	int rc;
+
+	uring_flush_dirty();
+
+	ts.tv_sec = 0;
+	ts.tv_nsec = 100000000;
+	memset(&arg, 0, sizeof(arg));
+	arg.sigmask = (uint64_t)(uintptr_t)&my_sigblock;
+	arg.sigmask_sz = _NSIG/8;
+	arg.ts = (uint64_t)(uintptr_t)&ts;
+
+	submitted = ring.to_submit;
+	rc = uring_enter(submitted, 1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+	if(rc < 0){
+		if(errno != EINTR && errno != ETIME && errno != EBUSY){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error in io_uring waiting: %s.", strerror(errno));
+		}
+	}else{
+		ring.to_submit -= (uint32_t)rc;
+	}
+
+	db.now_s = mosquitto_time();
+	db.now_real_s = time(NULL);
+
+	head = *ring.cq_head;
+	tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+	while(head != tail){
+		/* Take a copy, handling an event can queue further requests */
+		memcpy(&cqe, &ring.cqes[head & ring.cq_mask], sizeof(cqe));
+		head++;
+		__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+
+		switch(URING_KIND(cqe.user_data)){
+			case URING_KIND_SEND:
+				if(cqe.user_data){
+					uring_handle_send((struct mux_uring_send *)(uintptr_t)cqe.user_data, cqe.res);
+				}
+				break;
+			case URING_KIND_CLIENT:
+				if(URING_OP(cqe.user_data) == URING_OP_RECV){
+					uring_handle_recv(&cqe);
+				}else{
+					uring_handle_client(&cqe);
+				}
+				break;
+			case URING_KIND_LISTENER:
+				if((int)(cqe.user_data & 0xFFFFFFFF) < listener_count){
+					uring_handle_listener((int)(cqe.user_data & 0xFFFFFFFF), &cqe);
+				}
+				break;
+			default:
+				break;
+		}
+		if(head == tail){
+			tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+		}
+	}
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+int mux_io_uring__cleanup(void)
+{
+	struct mosquitto *context, *ctxt_tmp;
+	struct mux_uring_send *s, *s_tmp;
+
+	/* Anything sent from now on, like wills, is written directly */
+	HASH_ITER(hh_sock, db.contexts_by_sock, context, ctxt_tmp){
+		context->uring_id = 0;
+		context->uring_armed = 0;
+		context->uring_dirty = false;
+		context->uring_io = false;
+		context->uring_recv = false;
+		context->uring_recv_armed = false;
+		context->uring_send = NULL;
+		uring_rx_kept_free(context);
+	}
+
+	if(ring.sqes){
+		munmap(ring.sqes, ring.sqes_size);
+	}
+	if(ring.cq_ptr && ring.cq_ptr != ring.sq_ptr){
+		munmap(ring.cq_ptr, ring.cq_size);
+	}
+	if(ring.sq_ptr){
+		munmap(ring.sq_ptr, ring.sq_size);
+	}
+	if(ring.fd >= 0){
+		(void)close(ring.fd);
+	}
+	memset(&ring, 0, sizeof(ring));
+	ring.fd = -1;
+
+	DL_FOREACH_SAFE(sends, s, s_tmp){
+		uring_send_free(s);
+	}
+	uring_buf_cleanup();
+	recv_multishot = false;
+
+	mosquitto__free(dirty);
+	dirty = NULL;
+	dirty_count = 0;
+	dirty_max = 0;
+	listeners = NULL;
+	listener_count = 0;
+
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
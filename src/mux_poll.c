@@ -225,6 +225,9 @@ int mux_poll__handle(struct mosquitto__listener_sock *listensock, int listensock
 
 		for(i=0; i<listensock_count; i++){
 			if(pollfds[i].revents & POLLIN){
+				if(listensock[i].listener == NULL){
+					/* TLS handshake pool wakeup, dealt with in the main loop */
+				}else
 #ifdef WITH_WEBSOCKETS
 				if(listensock[i].listener->ws_context){
 					/* Nothing needs to happen here, because we always call lws_service in the loop.
@@ -259,6 +262,7 @@ static void loop_handle_reads_writes(void)
 	int err;
 	socklen_t len;
 	int rc;
+	int count;
 
 	HASH_ITER(hh_sock, db.contexts_by_sock, context, ctxt_tmp){
 		if(context->pollfd_index < 0){
@@ -331,13 +335,14 @@ static void loop_handle_reads_writes(void)
 #else
 		if(pollfds[context->pollfd_index].revents & POLLIN){
 #endif
+			count = 0;
 			do{
 				rc = packet__read(context);
 				if(rc){
 					do_disconnect(context, rc);
 					continue;
 				}
-			}while(SSL_DATA_PENDING(context));
+			}while(SSL_DATA_PENDING(context) || WS_DATA_PENDING(context) || mux__read_more(context, ++count));
 		}else{
 			if(context->pollfd_index >= 0 && pollfds[context->pollfd_index].revents & (POLLERR | POLLNVAL | POLLHUP)){
 				do_disconnect(context, MOSQ_ERR_CONN_LOST);
@@ -113,88 +113,84 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 {
 	mosq_sock_t new_sock = INVALID_SOCKET;
 	struct mosquitto *new_context;
-#ifdef WITH_TLS
-	BIO *bio;
-	int rc;
-	char ebuf[256];
-	unsigned long e;
-#endif
-#ifdef WITH_WRAP
-	struct request_info wrap_req;
-	char address[1024];
-#endif
 
-	new_sock = accept(listensock->sock, NULL, 0);
-	if(new_sock == INVALID_SOCKET){
+	while(1){
+		new_sock = accept(listensock->sock, NULL, 0);
+		if(new_sock == INVALID_SOCKET){
 #ifdef WIN32
-		errno = WSAGetLastError();
-		if(errno == WSAEMFILE){
+			errno = WSAGetLastError();
+			if(errno == WSAEMFILE){
 #else
-		if(errno == EMFILE || errno == ENFILE){
-#endif
-			/* Close the spare socket, which means we should be able to accept
-			 * this connection. Accept it, then close it immediately and create
-			 * a new spare_sock. This prevents the situation of ever properly
-			 * running out of sockets.
-			 * It would be nice to send a "server not available" connack here,
-			 * but there are lots of reasons why this would be tricky (TLS
-			 * being the big one). */
-			COMPAT_CLOSE(spare_sock);
-			new_sock = accept(listensock->sock, NULL, 0);
-			if(new_sock != INVALID_SOCKET){
-				COMPAT_CLOSE(new_sock);
+			if(errno == EMFILE || errno == ENFILE){
+#endif
+				/* Close the spare socket, which means we should be able to accept
+				 * this connection. Accept it, then close it immediately and create
+				 * a new spare_sock. This prevents the situation of ever properly
+				 * running out of sockets.
+				 * It would be nice to send a "server not available" connack here,
+				 * but there are lots of reasons why this would be tricky (TLS
+				 * being the big one). */
+				COMPAT_CLOSE(spare_sock);
+				new_sock = accept(listensock->sock, NULL, 0);
+				if(new_sock != INVALID_SOCKET){
+					COMPAT_CLOSE(new_sock);
+				}
+				spare_sock = socket(AF_INET, SOCK_STREAM, 0);
+				log__printf(NULL, MOSQ_LOG_WARNING,
+						"Unable to accept new connection, system socket count has been exceeded. Try increasing \"ulimit -n\" or equivalent.");
 			}
-			spare_sock = socket(AF_INET, SOCK_STREAM, 0);
-			log__printf(NULL, MOSQ_LOG_WARNING,
-					"Unable to accept new connection, system socket count has been exceeded. Try increasing \"ulimit -n\" or equivalent.");
+			return NULL;
 		}
-		return NULL;
-	}
-
-	G_SOCKET_CONNECTIONS_INC();
 
-	if(net__socket_nonblock(&new_sock)){
-		return NULL;
-	}
-
-#ifdef WITH_WRAP
-	/* Use tcpd / libwrap to determine whether a connection is allowed. */
-	request_init(&wrap_req, RQ_FILE, new_sock, RQ_DAEMON, "mosquitto", 0);
-	fromhost(&wrap_req);
-	if(!hosts_access(&wrap_req)){
-		/* Access is denied */
-		if(db.config->connection_messages == true){
-			if(!net__socket_get_address(new_sock, address, 1024, NULL)){
-				log__printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied access by tcpd.", address);
-			}
+		new_context = net__socket_accepted(listensock, new_sock);
+#ifdef WITH_TLS_POOL
+		if(new_context == NULL && tls_pool__wanted(listensock->listener)){
+			/* Handed to the TLS handshake pool, carry on accepting */
+			continue;
 		}
-		COMPAT_CLOSE(new_sock);
-		return NULL;
-	}
 #endif
+		return new_context;
+	}
+}
 
-	if(db.config->set_tcp_nodelay){
-		int flag = 1;
-#ifdef WIN32
-			if (setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int)) != 0) {
+
+/* Create the client for a new connection. If ssl is not NULL, it is a TLS
+ * session that has already completed its handshake on sock. */
+static struct mosquitto *net__socket_new_context(struct mosquitto__listener *listener, mosq_sock_t new_sock, void *ssl)
+{
+	struct mosquitto *new_context;
+#ifdef WITH_TLS
+	BIO *bio;
+	int rc;
+	char ebuf[256];
+	unsigned long e;
 #else
-		if(setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) != 0){
+	UNUSED(ssl);
 #endif
-			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to set TCP_NODELAY.");
-		}
-	}
 
 	new_context = context__init(new_sock);
 	if(!new_context){
 		COMPAT_CLOSE(new_sock);
+#ifdef WITH_TLS
+		SSL_free(ssl);
+#endif
 		return NULL;
 	}
-	new_context->listener = listensock->listener;
+#ifdef WITH_TLS
+	new_context->ssl = ssl;
+#endif
+	new_context->listener = listener;
 	if(!new_context->listener){
 		context__cleanup(new_context, true);
 		return NULL;
 	}
 	new_context->listener->client_count++;
+#ifdef WITH_WEBSOCKETS_BUILTIN
+	if(new_context->listener->protocol == mp_websockets){
+		new_context->transport = mosq_t_ws;
+		new_context->ws.state = ws_s_http;
+	}
+#endif
 
 	if(new_context->listener->max_connections > 0 && new_context->listener->client_count > new_context->listener->max_connections){
 		if(db.config->connection_messages == true){
@@ -205,8 +201,13 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 	}
 
 #ifdef WITH_TLS
-	/* TLS init */
-	if(new_context->listener->ssl_ctx){
+	if(new_context->ssl){
+		/* Handshake already complete */
+		SSL_set_ex_data(new_context->ssl, tls_ex_index_context, new_context);
+		SSL_set_ex_data(new_context->ssl, tls_ex_index_listener, new_context->listener);
+		ERR_clear_error();
+	}else if(new_context->listener->ssl_ctx){
+		/* TLS init */
 		new_context->ssl = SSL_new(new_context->listener->ssl_ctx);
 		if(!new_context->ssl){
 			context__cleanup(new_context, true);
@@ -250,6 +251,70 @@ struct mosquitto *net__socket_accept(struct mosquitto__listener_sock *listensock
 	return new_context;
 }
 
+
+/* Set up a client for a socket that has been accepted on listensock. Returns
+ * NULL if the connection was refused, or was handed to the TLS handshake
+ * pool. */
+struct mosquitto *net__socket_accepted(struct mosquitto__listener_sock *listensock, mosq_sock_t new_sock)
+{
+#ifdef WITH_WRAP
+	struct request_info wrap_req;
+	char address[1024];
+#endif
+
+	G_SOCKET_CONNECTIONS_INC();
+
+	if(net__socket_nonblock(&new_sock)){
+		return NULL;
+	}
+
+#ifdef WITH_WRAP
+	/* Use tcpd / libwrap to determine whether a connection is allowed. */
+	request_init(&wrap_req, RQ_FILE, new_sock, RQ_DAEMON, "mosquitto", 0);
+	fromhost(&wrap_req);
+	if(!hosts_access(&wrap_req)){
+		/* Access is denied */
+		if(db.config->connection_messages == true){
+			if(!net__socket_get_address(new_sock, address, 1024, NULL)){
+				log__printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s denied access by tcpd.", address);
+			}
+		}
+		COMPAT_CLOSE(new_sock);
+		return NULL;
+	}
+#endif
+
+	if(db.config->set_tcp_nodelay){
+		int flag = 1;
+#ifdef WIN32
+			if (setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, (char *)&flag, sizeof(int)) != 0) {
+#else
+		if(setsockopt(new_sock, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(int)) != 0){
+#endif
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to set TCP_NODELAY.");
+		}
+	}
+
+#ifdef WITH_TLS_POOL
+	if(tls_pool__wanted(listensock->listener)){
+		tls_pool__add(listensock->listener, new_sock);
+		return NULL;
+	}
+#endif
+
+	return net__socket_new_context(listensock->listener, new_sock, NULL);
+}
+
+
+#ifdef WITH_TLS
+/* Set up a client for a connection whose TLS handshake has been completed by
+ * the TLS handshake pool. Takes ownership of sock and ssl. */
+struct mosquitto *net__socket_handshake_done(struct mosquitto__listener *listener, mosq_sock_t sock, SSL *ssl)
+{
+	return net__socket_new_context(listener, sock, ssl);
+}
+#endif
+
 #ifdef WITH_TLS
 static int client_certificate_verify(int preverify_ok, X509_STORE_CTX *ctx)
 {
@@ -313,6 +378,25 @@ static unsigned int psk_server_callback(SSL *ssl, const char *identity, unsigned
 #endif
 
 #ifdef WITH_TLS
+#ifdef FINAL_WITH_TLS_PSK
+static int net__tls_server_psk(struct mosquitto__listener *listener)
+{
+	int rc;
+
+	SSL_CTX_set_psk_server_callback(listener->ssl_ctx, psk_server_callback);
+	if(listener->psk_hint){
+		rc = SSL_CTX_use_psk_identity_hint(listener->ssl_ctx, listener->psk_hint);
+		if(rc == 0){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to set TLS PSK hint.");
+			net__print_ssl_error(NULL);
+			return MOSQ_ERR_TLS;
+		}
+	}
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+
 int net__tls_server_ctx(struct mosquitto__listener *listener)
 {
 	char buf[256];
@@ -381,6 +465,13 @@ int net__tls_server_ctx(struct mosquitto__listener *listener)
 	SSL_CTX_set_mode(listener->ssl_ctx, SSL_MODE_RELEASE_BUFFERS);
 #endif
 
+#ifdef SSL_OP_ENABLE_KTLS
+	if(listener->ktls){
+		/* Hand record encryption to the kernel where the cipher allows it */
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_ENABLE_KTLS);
+	}
+#endif
+
 #ifdef WITH_EC
 #if OPENSSL_VERSION_NUMBER >= 0x10002000L && OPENSSL_VERSION_NUMBER < 0x10100000L
 	SSL_CTX_set_ecdh_auto(listener->ssl_ctx, 1);
@@ -435,7 +526,50 @@ int net__tls_server_ctx(struct mosquitto__listener *listener)
 			return MOSQ_ERR_TLS;
 		}
 	}
-	return MOSQ_ERR_SUCCESS;
+	return tls_session__ctx_init(listener);
+}
+
+
+/* Called once the TLS handshake with a client is complete, before anything
+ * has been sent over the session. Counts whether the session was resumed. If
+ * the kernel has taken over record encryption, the socket is written to
+ * directly from then on so gathered writes can be used. Reads still go
+ * through SSL_read(), which uses the kernel for decryption where it can. */
+void net__tls_session_check(struct mosquitto *context)
+{
+	struct mosquitto__listener *listener = context->listener;
+#ifdef SSL_OP_ENABLE_KTLS
+	bool rx;
+#endif
+
+	if(context->ssl == NULL || listener == NULL){
+		return;
+	}
+	listener->tls_stats.sessions++;
+	if(SSL_session_reused(context->ssl)){
+		listener->tls_stats.resumed++;
+	}
+
+	if(listener->ktls == false){
+		return;
+	}
+	listener->ktls_stats.sessions++;
+#ifdef SSL_OP_ENABLE_KTLS
+	if(!SSL_is_init_finished(context->ssl)){
+		return;
+	}
+	if(BIO_get_ktls_send(SSL_get_wbio(context->ssl))){
+		context->tls_ktls_send = true;
+		listener->ktls_stats.tx++;
+	}
+	rx = BIO_get_ktls_recv(SSL_get_rbio(context->ssl));
+	if(rx){
+		listener->ktls_stats.rx++;
+	}
+	log__printf(NULL, MOSQ_LOG_DEBUG, "Kernel TLS for client %s: send %s, receive %s.", context->address,
+			context->tls_ktls_send ? "offloaded" : "not offloaded",
+			rx ? "offloaded" : "not offloaded");
+#endif
 }
 #endif
 
@@ -617,6 +751,72 @@ int net__tls_load_verify(struct mosquitto__listener *listener)
 }
 
 
+#ifdef WITH_TLS
+/* Give a listener a new SSL_CTX, using a certificate, chain, key and
+ * verification store that have already been loaded. This is cheap, so can be
+ * done in the main loop once the files have been read elsewhere. Connections
+ * that are open, or part way through their handshake, hold their own
+ * reference to the old context and carry on using it. A NULL pkey keeps the
+ * current key, for keys that come from an engine. The loaded objects are
+ * always consumed. On failure the listener keeps its current context. */
+int net__tls_ctx_replace(struct mosquitto__listener *listener, X509 *cert, STACK_OF(X509) *chain, EVP_PKEY *pkey, X509_STORE *store)
+{
+	SSL_CTX *old_ctx = listener->ssl_ctx;
+	unsigned char ticket_keys[80];
+	int rc;
+
+	listener->ssl_ctx = NULL;
+	rc = net__tls_server_ctx(listener);
+	if(rc == MOSQ_ERR_SUCCESS){
+		SSL_CTX_set_cert_store(listener->ssl_ctx, store);
+		store = NULL;
+
+		if(listener->require_certificate){
+			SSL_CTX_set_verify(listener->ssl_ctx, SSL_VERIFY_PEER | SSL_VERIFY_FAIL_IF_NO_PEER_CERT, client_certificate_verify);
+		}else{
+			SSL_CTX_set_verify(listener->ssl_ctx, SSL_VERIFY_NONE, client_certificate_verify);
+		}
+		/* An empty chain would stop OpenSSL building the chain from the
+		 * store, as it does for a certfile holding only the certificate. */
+		if(SSL_CTX_use_certificate(listener->ssl_ctx, cert) != 1
+				|| (sk_X509_num(chain) > 0 && SSL_CTX_set1_chain(listener->ssl_ctx, chain) != 1)
+				|| SSL_CTX_use_PrivateKey(listener->ssl_ctx, pkey ? pkey : SSL_CTX_get0_privatekey(old_ctx)) != 1
+				|| SSL_CTX_check_private_key(listener->ssl_ctx) != 1){
+
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Server certificate/key are inconsistent.");
+			net__print_ssl_error(NULL);
+			rc = MOSQ_ERR_TLS;
+		}
+	}
+#ifdef FINAL_WITH_TLS_PSK
+	if(rc == MOSQ_ERR_SUCCESS && listener->psk_hint){
+		rc = net__tls_server_psk(listener);
+	}
+#endif
+	if(rc == MOSQ_ERR_SUCCESS && listener->tls_ticket_key_file == NULL){
+		/* Keep tickets issued with OpenSSL's own keys valid */
+		if(SSL_CTX_get_tlsext_ticket_keys(old_ctx, ticket_keys, sizeof(ticket_keys)) == 1){
+			SSL_CTX_set_tlsext_ticket_keys(listener->ssl_ctx, ticket_keys, sizeof(ticket_keys));
+		}
+		OPENSSL_cleanse(ticket_keys, sizeof(ticket_keys));
+	}
+
+	X509_STORE_free(store);
+	X509_free(cert);
+	sk_X509_pop_free(chain, X509_free);
+	EVP_PKEY_free(pkey);
+
+	if(rc){
+		SSL_CTX_free(listener->ssl_ctx);
+		listener->ssl_ctx = old_ctx;
+		return rc;
+	}
+	SSL_CTX_free(old_ctx);
+	return MOSQ_ERR_SUCCESS;
+}
+#endif
+
+
 #ifndef WIN32
 static int net__bind_interface(struct mosquitto__listener *listener, struct addrinfo *rp)
 {
@@ -926,14 +1126,8 @@ int net__socket_listen(struct mosquitto__listener *listener)
 					return 1;
 				}
 			}
-			SSL_CTX_set_psk_server_callback(listener->ssl_ctx, psk_server_callback);
-			if(listener->psk_hint){
-				rc = SSL_CTX_use_psk_identity_hint(listener->ssl_ctx, listener->psk_hint);
-				if(rc == 0){
-					log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to set TLS PSK hint.");
-					net__print_ssl_error(NULL);
-					return 1;
-				}
+			if(net__tls_server_psk(listener)){
+				return 1;
 			}
 		}
 #  endif /* FINAL_WITH_TLS_PSK */
@@ -34,7 +34,9 @@ Contributors:
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
+#include "mqtt_protocol.h"
 #include "persist.h"
+#include "property_mosq.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
 #include "util_mosq.h"
@@ -109,12 +111,36 @@ int persist__read_string(FILE *db_fptr, char **str)
 }
 
 
+/* Client messages keep their subscription identifier outside of the property
+ * list, but it is saved with the other properties. */
+static void persist__client_msg_take_subscription_identifier(struct mosquitto_client_msg *cmsg)
+{
+	mosquitto_property *p, *p_prev = NULL;
+
+	for(p=cmsg->properties; p; p=p->next){
+		if(p->identifier == MQTT_PROP_SUBSCRIPTION_IDENTIFIER){
+			cmsg->subscription_identifier = p->value.varint;
+			if(p_prev){
+				p_prev->next = p->next;
+			}else{
+				cmsg->properties = p->next;
+			}
+			p->next = NULL;
+			mosquitto_property_free_all(&p);
+			return;
+		}
+		p_prev = p;
+	}
+}
+
+
 static int persist__client_msg_restore(struct P_client_msg *chunk)
 {
 	struct mosquitto_client_msg *cmsg;
 	struct mosquitto_msg_store_load *load;
 	struct mosquitto *context;
 	struct mosquitto_msg_data *msg_data;
+	bool queued;
 
 	HASH_FIND(hh, db.msg_store_load, &chunk->F.store_id, sizeof(dbid_t), load);
 	if(!load){
@@ -128,14 +154,23 @@ static int persist__client_msg_restore(struct P_client_msg *chunk)
 		return 0;
 	}
 
-	cmsg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	if(chunk->F.direction == mosq_md_out){
+		msg_data = &context->msgs_out;
+	}else{
+		msg_data = &context->msgs_in;
+	}
+
+	queued = (chunk->F.state == mosq_ms_queued || (chunk->F.qos > 0 && msg_data->inflight_quota == 0));
+	if(queued){
+		cmsg = db__msg_queue_push(msg_data);
+	}else{
+		cmsg = mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+	}
 	if(!cmsg){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return MOSQ_ERR_NOMEM;
 	}
 
-	cmsg->next = NULL;
-	cmsg->store = NULL;
 	cmsg->mid = chunk->F.mid;
 	cmsg->qos = chunk->F.qos;
 	cmsg->retain = (chunk->F.retain_dup&0xF0)>>4;
@@ -144,21 +179,16 @@ static int persist__client_msg_restore(struct P_client_msg *chunk)
 	cmsg->state = chunk->F.state;
 	cmsg->dup = chunk->F.retain_dup&0x0F;
 	cmsg->properties = chunk->properties;
+	persist__client_msg_take_subscription_identifier(cmsg);
 
 	cmsg->store = load->store;
 	db__msg_store_ref_inc(cmsg->store);
 
-	if(cmsg->direction == mosq_md_out){
-		msg_data = &context->msgs_out;
-	}else{
-		msg_data = &context->msgs_in;
-	}
-
-	if(chunk->F.state == mosq_ms_queued || (chunk->F.qos > 0 && msg_data->inflight_quota == 0)){
-		DL_APPEND(msg_data->queued, cmsg);
+	if(queued){
 		db__msg_add_to_queued_stats(msg_data, cmsg);
 	}else{
 		DL_APPEND(msg_data->inflight, cmsg);
+		db__msg_add_to_inflight_index(msg_data, cmsg);
 		if(chunk->F.qos > 0 && msg_data->inflight_quota > 0){
 			msg_data->inflight_quota--;
 		}
@@ -345,8 +375,7 @@ static int persist__retain_chunk_restore(FILE *db_fptr)
 	struct mosquitto_msg_store_load *load;
 	struct P_retain chunk;
 	int rc;
-	char **split_topics;
-	char *local_topic;
+	struct sub__tokens tokens;
 
 	memset(&chunk, 0, sizeof(struct P_retain));
 
@@ -361,10 +390,9 @@ static int persist__retain_chunk_restore(FILE *db_fptr)
 
 	HASH_FIND(hh, db.msg_store_load, &chunk.F.store_id, sizeof(dbid_t), load);
 	if(load){
-		if(sub__topic_tokenise(load->store->topic, &local_topic, &split_topics, NULL)) return 1;
-		retain__store(load->store->topic, load->store, split_topics);
-		mosquitto__free(local_topic);
-		mosquitto__free(split_topics);
+		if(sub__topic_tokenise(load->store->topic, &tokens)) return 1;
+		retain__store(load->store->topic, load->store, tokens.tokens, tokens.count);
+		sub__topic_tokens_free(&tokens);
 	}else{
 		/* Can't find the message - probably expired */
 	}
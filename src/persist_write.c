@@ -30,53 +30,67 @@ Contributors:
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
+#include <utlist.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "persist.h"
+#include "property_mosq.h"
 #include "time_mosq.h"
 #include "misc_mosq.h"
 #include "util_mosq.h"
 
-static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *queue)
+static int persist__client_message_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_client_msg *cmsg)
 {
 	struct P_client_msg chunk;
+	mosquitto_property subid_prop;
+
+	if(!strncmp(cmsg->store->topic, "$SYS", 4)
+			&& cmsg->store->ref_count <= 1
+			&& cmsg->store->dest_id_count == 0){
+
+		/* This $SYS message won't have been persisted, so we can't persist
+		 * this client message. */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	memset(&chunk, 0, sizeof(struct P_client_msg));
+
+	chunk.F.store_id = cmsg->store->db_id;
+	chunk.F.mid = cmsg->mid;
+	chunk.F.id_len = (uint16_t)strlen(context->id);
+	chunk.F.qos = cmsg->qos;
+	chunk.F.retain_dup = (uint8_t)((cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F));
+	chunk.F.direction = (uint8_t)cmsg->direction;
+	chunk.F.state = (uint8_t)cmsg->state;
+	chunk.client_id = context->id;
+	/* Saved as a property so the file format is unchanged */
+	chunk.properties = (mosquitto_property *)db__subscription_identifier_property(&subid_prop, cmsg->subscription_identifier, cmsg->properties);
+
+	return persist__chunk_client_msg_write_v6(db_fptr, &chunk);
+}
+
+
+static int persist__client_messages_save(FILE *db_fptr, struct mosquitto *context, struct mosquitto_msg_data *msg_data)
+{
 	struct mosquitto_client_msg *cmsg;
+	int i;
 	int rc;
 
 	assert(db_fptr);
 	assert(context);
 
-	cmsg = queue;
-	while(cmsg){
-		if(!strncmp(cmsg->store->topic, "$SYS", 4)
-				&& cmsg->store->ref_count <= 1
-				&& cmsg->store->dest_id_count == 0){
-
-			/* This $SYS message won't have been persisted, so we can't persist
-			 * this client message. */
-			cmsg = cmsg->next;
-			continue;
+	DL_FOREACH(msg_data->inflight, cmsg){
+		rc = persist__client_message_save(db_fptr, context, cmsg);
+		if(rc){
+			return rc;
 		}
-
-		memset(&chunk, 0, sizeof(struct P_client_msg));
-
-		chunk.F.store_id = cmsg->store->db_id;
-		chunk.F.mid = cmsg->mid;
-		chunk.F.id_len = (uint16_t)strlen(context->id);
-		chunk.F.qos = cmsg->qos;
-		chunk.F.retain_dup = (uint8_t)((cmsg->retain&0x0F)<<4 | (cmsg->dup&0x0F));
-		chunk.F.direction = (uint8_t)cmsg->direction;
-		chunk.F.state = (uint8_t)cmsg->state;
-		chunk.client_id = context->id;
-		chunk.properties = cmsg->properties;
-
-		rc = persist__chunk_client_msg_write_v6(db_fptr, &chunk);
+	}
+	for(i=0; i<msg_data->queue_len; i++){
+		rc = persist__client_message_save(db_fptr, context, db__msg_queue_get(msg_data, i));
 		if(rc){
 			return rc;
 		}
-
-		cmsg = cmsg->next;
 	}
 
 	return MOSQ_ERR_SUCCESS;
@@ -204,10 +218,8 @@ static int persist__client_save(FILE *db_fptr)
 				return rc;
 			}
 
-			if(persist__client_messages_save(db_fptr, context, context->msgs_in.inflight)) return 1;
-			if(persist__client_messages_save(db_fptr, context, context->msgs_in.queued)) return 1;
-			if(persist__client_messages_save(db_fptr, context, context->msgs_out.inflight)) return 1;
-			if(persist__client_messages_save(db_fptr, context, context->msgs_out.queued)) return 1;
+			if(persist__client_messages_save(db_fptr, context, &context->msgs_in)) return 1;
+			if(persist__client_messages_save(db_fptr, context, &context->msgs_out)) return 1;
 		}
 	}
 
@@ -217,20 +229,20 @@ static int persist__client_save(FILE *db_fptr)
 
 static int persist__subs_save(FILE *db_fptr, struct mosquitto__subhier *node, const char *topic, int level)
 {
-	struct mosquitto__subhier *subhier, *subhier_tmp;
 	struct mosquitto__subleaf *sub;
 	struct P_sub sub_chunk;
 	char *thistopic;
 	size_t slen;
+	uint32_t i, slots;
 	int rc;
 
 	slen = strlen(topic) + node->topic_len + 2;
 	thistopic = mosquitto__malloc(sizeof(char)*slen);
 	if(!thistopic) return MOSQ_ERR_NOMEM;
 	if(level > 1 || strlen(topic)){
-		snprintf(thistopic, slen, "%s/%s", topic, node->topic);
+		snprintf(thistopic, slen, "%s/%s", topic, sub__hier_topic(node));
 	}else{
-		snprintf(thistopic, slen, "%s", node->topic);
+		snprintf(thistopic, slen, "%s", sub__hier_topic(node));
 	}
 
 	sub = node->subs;
@@ -255,8 +267,11 @@ static int persist__subs_save(FILE *db_fptr, struct mosquitto__subhier *node, co
 		sub = sub->next;
 	}
 
-	HASH_ITER(hh, node->children, subhier, subhier_tmp){
-		persist__subs_save(db_fptr, subhier, thistopic, level+1);
+	slots = node->children ? 1U<<node->child_bits : 0;
+	for(i=0; i<slots; i++){
+		if(node->children[i]){
+			persist__subs_save(db_fptr, node->children[i], thistopic, level+1);
+		}
 	}
 	mosquitto__free(thistopic);
 	return MOSQ_ERR_SUCCESS;
@@ -264,11 +279,18 @@ static int persist__subs_save(FILE *db_fptr, struct mosquitto__subhier *node, co
 
 static int persist__subs_save_all(FILE *db_fptr)
 {
-	struct mosquitto__subhier *subhier, *subhier_tmp;
+	struct mosquitto__subhier *root;
+	uint32_t i, j;
 
-	HASH_ITER(hh, db.subs, subhier, subhier_tmp){
-		if(subhier->children){
-			persist__subs_save(db_fptr, subhier->children, "", 0);
+	if(!db.subs) return MOSQ_ERR_SUCCESS;
+
+	/* The "" and "$SYS" roots are below the db.subs holder */
+	for(i=0; i<db.subs->child_count; i++){
+		root = db.subs->children[i];
+		for(j=0; root->children && j<1U<<root->child_bits; j++){
+			if(root->children[j]){
+				persist__subs_save(db_fptr, root->children[j], "", 0);
+			}
 		}
 	}
 
@@ -89,10 +89,14 @@ void *mosquitto_client_certificate(const struct mosquitto *client)
 
 int mosquitto_client_protocol(const struct mosquitto *client)
 {
-#ifdef WITH_WEBSOCKETS
+#if defined(WITH_WEBSOCKETS)
 	if(client && client->wsi){
 		return mp_websockets;
 	}else
+#elif defined(WITH_WEBSOCKETS_BUILTIN)
+	if(client && client->transport == mosq_t_ws){
+		return mp_websockets;
+	}else
 #else
 	UNUSED(client);
 #endif
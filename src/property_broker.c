@@ -49,9 +49,16 @@ int property__process_connect(struct mosquitto *context, mosquitto_property **pr
 				return MOSQ_ERR_PROTOCOL;
 			}
 			context->maximum_packet_size = p->value.i32;
+		}else if(p->identifier == MQTT_PROP_TOPIC_ALIAS_MAXIMUM){
+			context->alias_out_max = p->value.i16;
 		}
 		p = p->next;
 	}
+#ifdef WITH_ZLIB
+	if(context->listener && context->listener->accept_compression){
+		context->compression = compress__find_method(*props);
+	}
+#endif
 
 	return MOSQ_ERR_SUCCESS;
 }
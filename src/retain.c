@@ -48,9 +48,9 @@ static struct mosquitto__retainhier *retain__add_hier_entry(struct mosquitto__re
 		mosquitto__free(child);
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return NULL;
-	}else{
-		strncpy(child->topic, topic, (size_t)child->topic_len+1);
 	}
+	memcpy(child->topic, topic, len);
+	child->topic[len] = '\0';
 
 	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
 
@@ -91,27 +91,26 @@ void retain__clean_empty_hierarchy(struct mosquitto__retainhier *retainhier)
 }
 
 
-int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics)
+int retain__store(const char *topic, struct mosquitto_msg_store *stored, const struct sub__token *tokens, int token_count)
 {
 	struct mosquitto__retainhier *retainhier;
 	struct mosquitto__retainhier *branch;
 	int i;
-	size_t slen;
 
 	assert(stored);
-	assert(split_topics);
+	assert(tokens);
+	assert(token_count > 0);
 
-	HASH_FIND(hh, db.retains, split_topics[0], strlen(split_topics[0]), retainhier);
+	HASH_FIND(hh, db.retains, tokens[0].topic, tokens[0].topic_len, retainhier);
 	if(retainhier == NULL){
-		retainhier = retain__add_hier_entry(NULL, &db.retains, split_topics[0], (uint16_t)strlen(split_topics[0]));
+		retainhier = retain__add_hier_entry(NULL, &db.retains, tokens[0].topic, tokens[0].topic_len);
 		if(!retainhier) return MOSQ_ERR_NOMEM;
 	}
 
-	for(i=0; split_topics[i] != NULL; i++){
-		slen = strlen(split_topics[i]);
-		HASH_FIND(hh, retainhier->children, split_topics[i], slen, branch);
+	for(i=0; i<token_count; i++){
+		HASH_FIND(hh, retainhier->children, tokens[i].topic, tokens[i].topic_len, branch);
 		if(branch == NULL){
-			branch = retain__add_hier_entry(retainhier, &retainhier->children, split_topics[i], (uint16_t)slen);
+			branch = retain__add_hier_entry(retainhier, &retainhier->children, tokens[i].topic, tokens[i].topic_len);
 			if(branch == NULL){
 				return MOSQ_ERR_NOMEM;
 			}
@@ -155,7 +154,6 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 	int rc = 0;
 	uint8_t qos;
 	uint16_t mid;
-	mosquitto_property *properties = NULL;
 	struct mosquitto_msg_store *retained;
 
 	if(branch->retained->message_expiry_time > 0 && db.now_real_s >= branch->retained->message_expiry_time){
@@ -169,6 +167,12 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 
 	retained = branch->retained;
 
+#ifdef WITH_BRIDGE
+	if(context->bridge && !bridge__connection_owns_topic(context->bridge, retained->topic)){
+		return MOSQ_ERR_SUCCESS;
+	}
+#endif
+
 	rc = mosquitto_acl_check(context, retained->topic, retained->payloadlen, retained->payload,
 			retained->qos, retained->retain, MOSQ_ACL_READ);
 	if(rc == MOSQ_ERR_ACL_DENIED){
@@ -209,19 +213,22 @@ static int retain__process(struct mosquitto__retainhier *branch, struct mosquitt
 	}else{
 		mid = 0;
 	}
-	if(subscription_identifier > 0){
-		mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, subscription_identifier);
-	}
-	return db__message_insert(context, mid, mosq_md_out, qos, true, retained, properties, false);
+	return db__message_insert(context, mid, mosq_md_out, qos, true, retained, subscription_identifier, NULL, false);
+}
+
+
+static bool retain__token_is(const struct sub__token *token, char c)
+{
+	return token->topic_len == 1 && token->topic[0] == c;
 }
 
 
-static int retain__search(struct mosquitto__retainhier *retainhier, char **split_topics, struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier, int level)
+static int retain__search(struct mosquitto__retainhier *retainhier, const struct sub__token *tokens, int token_count, struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier, int level)
 {
 	struct mosquitto__retainhier *branch, *branch_tmp;
 	int flag = 0;
 
-	if(!strcmp(split_topics[0], "#") && split_topics[1] == NULL){
+	if(retain__token_is(&tokens[0], '#') && token_count == 1){
 		HASH_ITER(hh, retainhier->children, branch, branch_tmp){
 			/* Set flag to indicate that we should check for retained messages
 			 * on "foo" when we are subscribing to e.g. "foo/#" and then exit
@@ -232,15 +239,15 @@ static int retain__search(struct mosquitto__retainhier *retainhier, char **split
 				retain__process(branch, context, sub_qos, subscription_identifier);
 			}
 			if(branch->children){
-				retain__search(branch, split_topics, context, sub, sub_qos, subscription_identifier, level+1);
+				retain__search(branch, tokens, token_count, context, sub, sub_qos, subscription_identifier, level+1);
 			}
 		}
 	}else{
-		if(!strcmp(split_topics[0], "+")){
+		if(retain__token_is(&tokens[0], '+')){
 			HASH_ITER(hh, retainhier->children, branch, branch_tmp){
-				if(split_topics[1] != NULL){
-					if(retain__search(branch, &(split_topics[1]), context, sub, sub_qos, subscription_identifier, level+1) == -1
-							|| (split_topics[1] != NULL && !strcmp(split_topics[1], "#") && level>0)){
+				if(token_count > 1){
+					if(retain__search(branch, &tokens[1], token_count-1, context, sub, sub_qos, subscription_identifier, level+1) == -1
+							|| (retain__token_is(&tokens[1], '#') && level>0)){
 
 						if(branch->retained){
 							retain__process(branch, context, sub_qos, subscription_identifier);
@@ -253,11 +260,11 @@ static int retain__search(struct mosquitto__retainhier *retainhier, char **split
 				}
 			}
 		}else{
-			HASH_FIND(hh, retainhier->children, split_topics[0], strlen(split_topics[0]), branch);
+			HASH_FIND(hh, retainhier->children, tokens[0].topic, tokens[0].topic_len, branch);
 			if(branch){
-				if(split_topics[1] != NULL){
-					if(retain__search(branch, &(split_topics[1]), context, sub, sub_qos, subscription_identifier, level+1) == -1
-							|| (split_topics[1] != NULL && !strcmp(split_topics[1], "#") && level>0)){
+				if(token_count > 1){
+					if(retain__search(branch, &tokens[1], token_count-1, context, sub, sub_qos, subscription_identifier, level+1) == -1
+							|| (retain__token_is(&tokens[1], '#') && level>0)){
 
 						if(branch->retained){
 							retain__process(branch, context, sub_qos, subscription_identifier);
@@ -278,8 +285,7 @@ static int retain__search(struct mosquitto__retainhier *retainhier, char **split
 int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, uint32_t subscription_identifier)
 {
 	struct mosquitto__retainhier *retainhier;
-	char *local_sub;
-	char **split_topics;
+	struct sub__tokens tokens;
 	int rc;
 
 	assert(context);
@@ -289,16 +295,15 @@ int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, u
 		return MOSQ_ERR_SUCCESS;
 	}
 
-	rc = sub__topic_tokenise(sub, &local_sub, &split_topics, NULL);
+	rc = sub__topic_tokenise(sub, &tokens);
 	if(rc) return rc;
 
-	HASH_FIND(hh, db.retains, split_topics[0], strlen(split_topics[0]), retainhier);
+	HASH_FIND(hh, db.retains, tokens.tokens[0].topic, tokens.tokens[0].topic_len, retainhier);
 
 	if(retainhier){
-		retain__search(retainhier, split_topics, context, sub, sub_qos, subscription_identifier, 0);
+		retain__search(retainhier, tokens.tokens, tokens.count, context, sub, sub_qos, subscription_identifier, 0);
 	}
-	mosquitto__free(local_sub);
-	mosquitto__free(split_topics);
+	sub__topic_tokens_free(&tokens);
 
 	return MOSQ_ERR_SUCCESS;
 }
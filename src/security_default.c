@@ -264,6 +264,16 @@ static int add__acl(struct mosquitto__security_options *security_opts, const cha
 	acl->next = NULL;
 	acl->ccount = 0;
 	acl->ucount = 0;
+	/* An invalid topic is left uncompiled, and so never matches */
+	if(mosquitto_topic_filter_compile(local_topic, &acl->filter) == MOSQ_ERR_NOMEM){
+		mosquitto__free(local_topic);
+		mosquitto__free(acl);
+		if(new_user){
+			mosquitto__free(acl_user->username);
+			mosquitto__free(acl_user);
+		}
+		return MOSQ_ERR_NOMEM;
+	}
 
 	/* Add acl to user acl list */
 	if(acl_user->acl){
@@ -344,6 +354,13 @@ static int add__acl_pattern(struct mosquitto__security_options *security_opts, c
 		log__printf(NULL, MOSQ_LOG_WARNING,
 				"Warning: ACL pattern '%s' does not contain '%%c' or '%%u'.",
 				topic);
+		if(mosquitto_topic_filter_compile(local_topic, &acl->filter) == MOSQ_ERR_NOMEM){
+			mosquitto__free(local_topic);
+			mosquitto__free(acl);
+			return MOSQ_ERR_NOMEM;
+		}
+	}else{
+		acl->filter = NULL;
 	}
 
 	if(security_opts->acl_patterns){
@@ -409,7 +426,10 @@ static int mosquitto_acl_check_default(int event, void *event_data, void *userda
 			acl_root = acl_root->next;
 			continue;
 		}
-		mosquitto_topic_matches_sub(acl_root->topic, ed->topic, &result);
+		result = false;
+		if(acl_root->filter){
+			mosquitto_topic_matches_compiled(acl_root->filter, ed->topic, &result);
+		}
 		if(result){
 			if(acl_root->access == MOSQ_ACL_NONE){
 				/* Access was explicitly denied for this topic. */
@@ -449,13 +469,31 @@ static int mosquitto_acl_check_default(int event, void *event_data, void *userda
 	clen = strlen(ed->client->id);
 
 	while(acl_root){
-		tlen = strlen(acl_root->topic);
-
 		if(acl_root->ucount && !ed->client->username){
 			acl_root = acl_root->next;
 			continue;
 		}
 
+		if(acl_root->ccount == 0 && acl_root->ucount == 0){
+			/* Nothing to substitute */
+			result = false;
+			if(acl_root->filter){
+				mosquitto_topic_matches_compiled(acl_root->filter, ed->topic, &result);
+			}
+			if(result){
+				if(acl_root->access == MOSQ_ACL_NONE){
+					return MOSQ_ERR_ACL_DENIED;
+				}
+				if(ed->access & acl_root->access){
+					return MOSQ_ERR_SUCCESS;
+				}
+			}
+			acl_root = acl_root->next;
+			continue;
+		}
+
+		tlen = strlen(acl_root->topic);
+
 		if(ed->client->username){
 			ulen = strlen(ed->client->username);
 			len = tlen + (size_t)acl_root->ccount*(clen-2) + (size_t)acl_root->ucount*(ulen-2);
@@ -647,6 +685,7 @@ static void free__acl(struct mosquitto__acl *acl)
 		free__acl(acl->next);
 	}
 	mosquitto__free(acl->topic);
+	mosquitto_topic_filter_free(acl->filter);
 	mosquitto__free(acl);
 }
 
@@ -1097,28 +1136,12 @@ int mosquitto_security_apply_default(void)
 	X509_NAME *name;
 	X509_NAME_ENTRY *name_entry;
 	ASN1_STRING *name_asn1 = NULL;
-	struct mosquitto__listener *listener;
 	BIO *subject_bio;
 	char *data_start;
 	size_t name_length;
 	char *subject;
 #endif
 
-#ifdef WITH_TLS
-	for(i=0; i<db.config->listener_count; i++){
-		listener = &db.config->listeners[i];
-		if(listener && listener->ssl_ctx && listener->certfile && listener->keyfile && listener->crlfile && listener->require_certificate){
-			if(net__tls_server_ctx(listener)){
-				return MOSQ_ERR_TLS;
-			}
-
-			if(net__tls_load_verify(listener)){
-				return MOSQ_ERR_TLS;
-			}
-		}
-	}
-#endif
-
 	HASH_ITER(hh_id, db.contexts_by_id, context, ctxt_tmp){
 		if(context->bridge){
 			continue;
@@ -50,24 +50,240 @@ Contributors:
 #include "config.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "mosquitto_broker_internal.h"
 #include "memory_mosq.h"
 #include "mqtt_protocol.h"
+#include "property_mosq.h"
 #include "util_mosq.h"
 
 #include "utlist.h"
 
+/* Level names too long to be held in a node */
+static struct intern__table hier_names;
+
+#ifdef WITH_SYS_TREE
+#  define SUBHIER_BYTES_ADD(A) db.subhier_bytes += (unsigned long)(A)
+#  define SUBHIER_BYTES_SUB(A) db.subhier_bytes -= (unsigned long)(A)
+#else
+#  define SUBHIER_BYTES_ADD(A)
+#  define SUBHIER_BYTES_SUB(A)
+#endif
+
+
+static uint32_t sub__hash(const char *topic, uint16_t len)
+{
+	unsigned int hashv;
+
+	HASH_VALUE(topic, len, hashv);
+	return hashv;
+}
+
+
+static const char *sub__intern_get(const char *topic, uint16_t len)
+{
+	const char *str;
+
+	SUBHIER_BYTES_SUB(hier_names.bytes);
+	str = intern__get(&hier_names, topic, len);
+	SUBHIER_BYTES_ADD(hier_names.bytes);
+
+	return str;
+}
+
+
+static void sub__intern_release(const char *str)
+{
+	SUBHIER_BYTES_SUB(hier_names.bytes);
+	intern__release(&hier_names, str);
+	SUBHIER_BYTES_ADD(hier_names.bytes);
+}
+
+
+const char *sub__hier_topic(const struct mosquitto__subhier *hier)
+{
+	if(hier->topic_len < SUBHIER_INLINE_LEN){
+		return hier->topic.str;
+	}else{
+		return hier->topic.interned;
+	}
+}
+
+
+static bool sub__hier_is(const struct mosquitto__subhier *hier, const char *topic, uint16_t len)
+{
+	return hier->topic_len == len && !memcmp(sub__hier_topic(hier), topic, len);
+}
+
+
+static struct mosquitto__subhier *sub__hier_find(const struct mosquitto__subhier *parent, const char *topic, uint16_t len)
+{
+	struct mosquitto__subhier *child;
+	uint32_t i, mask;
+
+	if(parent->children == NULL) return NULL;
+
+	if(parent->child_bits <= SUBHIER_SMALL_BITS){
+		for(i=0; i<parent->child_count; i++){
+			if(sub__hier_is(parent->children[i], topic, len)){
+				return parent->children[i];
+			}
+		}
+		return NULL;
+	}
+
+	mask = (1U<<parent->child_bits)-1;
+	for(i = sub__hash(topic, len) & mask; (child = parent->children[i]) != NULL; i = (i+1) & mask){
+		if(sub__hier_is(child, topic, len)){
+			return child;
+		}
+	}
+	return NULL;
+}
+
+
+static int sub__hier_children_resize(struct mosquitto__subhier *parent, uint8_t bits)
+{
+	struct mosquitto__subhier **children, *child;
+	uint32_t slots, old_slots;
+	uint32_t i, j, n = 0;
+
+	slots = 1U<<bits;
+	children = mosquitto__calloc(slots, sizeof(struct mosquitto__subhier *));
+	if(!children) return MOSQ_ERR_NOMEM;
+
+	old_slots = parent->children ? 1U<<parent->child_bits : 0;
+	for(i=0; i<old_slots; i++){
+		child = parent->children[i];
+		if(child == NULL) continue;
+
+		if(bits <= SUBHIER_SMALL_BITS){
+			children[n++] = child;
+		}else{
+			j = sub__hash(sub__hier_topic(child), child->topic_len) & (slots-1);
+			while(children[j]){
+				j = (j+1) & (slots-1);
+			}
+			children[j] = child;
+		}
+	}
+	SUBHIER_BYTES_SUB(old_slots*sizeof(struct mosquitto__subhier *));
+	SUBHIER_BYTES_ADD(slots*sizeof(struct mosquitto__subhier *));
+	mosquitto__free(parent->children);
+	parent->children = children;
+	parent->child_bits = bits;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static int sub__hier_child_add(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+	uint32_t i, mask;
+	uint8_t bits;
+
+	if(parent->children == NULL){
+		if(sub__hier_children_resize(parent, 0)) return MOSQ_ERR_NOMEM;
+	}else if(parent->child_bits <= SUBHIER_SMALL_BITS){
+		if(parent->child_count == 1U<<parent->child_bits){
+			if(parent->child_bits < SUBHIER_SMALL_BITS){
+				bits = (uint8_t)(parent->child_bits+1);
+			}else{
+				bits = SUBHIER_SMALL_BITS+2;
+			}
+			if(sub__hier_children_resize(parent, bits)) return MOSQ_ERR_NOMEM;
+		}
+	}else if((parent->child_count+1)*4 > (1U<<parent->child_bits)*3){
+		if(sub__hier_children_resize(parent, (uint8_t)(parent->child_bits+1))) return MOSQ_ERR_NOMEM;
+	}
+
+	if(parent->child_bits <= SUBHIER_SMALL_BITS){
+		parent->children[parent->child_count] = child;
+	}else{
+		mask = (1U<<parent->child_bits)-1;
+		i = sub__hash(sub__hier_topic(child), child->topic_len) & mask;
+		while(parent->children[i]){
+			i = (i+1) & mask;
+		}
+		parent->children[i] = child;
+	}
+	parent->child_count++;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+static void sub__hier_child_remove(struct mosquitto__subhier *parent, struct mosquitto__subhier *child)
+{
+	struct mosquitto__subhier **children = parent->children;
+	uint32_t i, j, mask;
+
+	if(parent->child_bits <= SUBHIER_SMALL_BITS){
+		for(i=0; children[i] != child; i++){
+		}
+		parent->child_count--;
+		children[i] = children[parent->child_count];
+		children[parent->child_count] = NULL;
+	}else{
+		mask = (1U<<parent->child_bits)-1;
+		i = sub__hash(sub__hier_topic(child), child->topic_len) & mask;
+		while(children[i] != child){
+			i = (i+1) & mask;
+		}
+		for(j = (i+1) & mask; children[j]; j = (j+1) & mask){
+			if(intern__probe_can_move(i, j, sub__hash(sub__hier_topic(children[j]), children[j]->topic_len) & mask)){
+				children[i] = children[j];
+				i = j;
+			}
+		}
+		children[i] = NULL;
+		parent->child_count--;
+
+		if(parent->child_count <= (1U<<SUBHIER_SMALL_BITS)/2){
+			/* On failure the larger table is still usable */
+			sub__hier_children_resize(parent, SUBHIER_SMALL_BITS);
+		}
+	}
+
+	if(parent->child_count == 0){
+		SUBHIER_BYTES_SUB((1U<<parent->child_bits)*sizeof(struct mosquitto__subhier *));
+		mosquitto__free(parent->children);
+		parent->children = NULL;
+		parent->child_bits = 0;
+	}
+}
+
+
+/* Free a node that has already been removed from its parent. */
+static void sub__hier_free(struct mosquitto__subhier *hier)
+{
+	if(hier->topic_len >= SUBHIER_INLINE_LEN){
+		sub__intern_release(hier->topic.interned);
+	}
+#ifdef WITH_SYS_TREE
+	db.subhier_count--;
+#endif
+	SUBHIER_BYTES_SUB(sizeof(struct mosquitto__subhier));
+	mosquitto__free(hier);
+}
+
+
 static int subs__send(struct mosquitto__subleaf *leaf, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
 {
 	bool client_retain;
 	uint16_t mid;
 	uint8_t client_qos, msg_qos;
-	mosquitto_property *properties = NULL;
 	int rc2;
 
+#ifdef WITH_BRIDGE
+	if(leaf->context->bridge && !bridge__connection_owns_topic(leaf->context->bridge, topic)){
+		return MOSQ_ERR_SUCCESS;
+	}
+#endif
+
 	/* Check for ACL topic access. */
 	rc2 = mosquitto_acl_check(leaf->context, topic, stored->payloadlen, stored->payload, stored->qos, stored->retain, MOSQ_ACL_READ);
 	if(rc2 == MOSQ_ERR_ACL_DENIED){
@@ -94,10 +310,7 @@ static int subs__send(struct mosquitto__subleaf *leaf, const char *topic, uint8_
 		}else{
 			client_retain = false;
 		}
-		if(leaf->identifier){
-			mosquitto_property_add_varint(&properties, MQTT_PROP_SUBSCRIPTION_IDENTIFIER, leaf->identifier);
-		}
-		if(db__message_insert(leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, properties, true) == 1){
+		if(db__message_insert(leaf->context, mid, mosq_md_out, msg_qos, client_retain, stored, leaf->identifier, NULL, true) == 1){
 			return 1;
 		}
 	}else{
@@ -107,16 +320,134 @@ static int subs__send(struct mosquitto__subleaf *leaf, const char *topic, uint8_
 }
 
 
+/* Number of messages waiting for a shared subscription member. Members
+ * that are disconnected are treated as being as busy as possible. */
+static int subs__shared_load(struct mosquitto__subleaf *leaf)
+{
+	if(leaf->context->sock == INVALID_SOCKET){
+		return INT_MAX;
+	}
+	return leaf->context->msgs_out.inflight_count + leaf->context->msgs_out.queue_len;
+}
+
+
+/* The member with the fewest messages waiting. Ties go to the member that is
+ * earliest in round robin order. */
+static struct mosquitto__subleaf *subs__shared_least_loaded(struct mosquitto__subshared *shared)
+{
+	struct mosquitto__subleaf *leaf, *best = NULL;
+	int load, best_load = 0;
+
+	DL_FOREACH(shared->subs, leaf){
+		load = subs__shared_load(leaf);
+		if(best == NULL || load < best_load){
+			best = leaf;
+			best_load = load;
+			if(load == 0) break;
+		}
+	}
+	return best;
+}
+
+
+/* The first member in round robin order, skipping any that have reached
+ * shared_subscription_max_queued. If all of them have, the least loaded
+ * member is used instead. */
+static struct mosquitto__subleaf *subs__shared_round_robin(struct mosquitto__subshared *shared)
+{
+	struct mosquitto__subleaf *leaf;
+
+	if(db.config->shared_subscription_max_queued == 0){
+		return shared->subs;
+	}
+	DL_FOREACH(shared->subs, leaf){
+		if(leaf->context->msgs_out.queue_len < db.config->shared_subscription_max_queued){
+			return leaf;
+		}
+	}
+	return subs__shared_least_loaded(shared);
+}
+
+
+/* Always choose the same member for the same key, for as long as the members
+ * of the group don't change. */
+static struct mosquitto__subleaf *subs__shared_hash(struct mosquitto__subshared *shared, const void *key, size_t keylen)
+{
+	struct mosquitto__subleaf *leaf;
+	unsigned int hashv;
+	unsigned int count;
+
+	HASH_VALUE(key, keylen, hashv);
+	DL_COUNT(shared->subs, leaf, count);
+	hashv %= count;
+	leaf = shared->subs;
+	while(hashv > 0){
+		leaf = leaf->next;
+		hashv--;
+	}
+	return leaf;
+}
+
+
+static const struct mqtt__string *subs__user_property(const mosquitto_property *proplist, const char *name)
+{
+	const mosquitto_property *p;
+	size_t len = strlen(name);
+
+	for(p=proplist; p; p=p->next){
+		if(p->identifier == MQTT_PROP_USER_PROPERTY
+				&& p->name.len == len
+				&& !memcmp(p->name.v, name, len)){
+
+			return &p->value.s;
+		}
+	}
+	return NULL;
+}
+
+
 static int subs__shared_process(struct mosquitto__subhier *hier, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
 {
 	int rc = 0, rc2;
 	struct mosquitto__subshared *shared, *shared_tmp;
 	struct mosquitto__subleaf *leaf;
+	const struct mqtt__string *value;
 
 	HASH_ITER(hh, hier->shared, shared, shared_tmp){
-		leaf = shared->subs;
+		switch(db.config->shared_subscription_mode){
+			case shared_sm_hash_topic:
+				leaf = subs__shared_hash(shared, topic, strlen(topic));
+				rc2 = subs__send(leaf, topic, qos, retain, stored);
+				if(rc2) rc = 1;
+				continue;
+
+			case shared_sm_hash_property:
+				value = NULL;
+				if(db.config->shared_subscription_hash_property){
+					value = subs__user_property(stored->properties, db.config->shared_subscription_hash_property);
+				}
+				if(value){
+					leaf = subs__shared_hash(shared, value->v, value->len);
+					rc2 = subs__send(leaf, topic, qos, retain, stored);
+					if(rc2) rc = 1;
+					continue;
+				}
+				/* Messages without the property are shared out in turn */
+				leaf = subs__shared_round_robin(shared);
+				break;
+
+			case shared_sm_least_loaded:
+				leaf = subs__shared_least_loaded(shared);
+				break;
+
+			case shared_sm_round_robin:
+			default:
+				leaf = subs__shared_round_robin(shared);
+				break;
+		}
+
 		rc2 = subs__send(leaf, topic, qos, retain, stored);
-		/* Remove current from the top, add back to the bottom */
+		/* Move the chosen member to the bottom, so the others get their turn */
 		DL_DELETE(shared->subs, leaf);
 		DL_APPEND(shared->subs, leaf);
 
@@ -154,24 +485,30 @@ static int subs__process(struct mosquitto__subhier *hier, const char *source_id,
 }
 
 
+/* Find the index of the client's own reference to its subscription at a
+ * hierarchy node, or -1 if it has none. */
+static int sub__client_sub_index(struct mosquitto *context, struct mosquitto__subhier *subhier, struct mosquitto__subshared *shared)
+{
+	int i;
+
+	for(i=0; i<context->sub_count; i++){
+		if(context->subs[i]
+				&& context->subs[i]->hier == subhier
+				&& context->subs[i]->shared == shared){
+
+			return i;
+		}
+	}
+	return -1;
+}
+
+
 static int sub__add_leaf(struct mosquitto *context, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subleaf **head, struct mosquitto__subleaf **newleaf)
 {
 	struct mosquitto__subleaf *leaf;
 
 	*newleaf = NULL;
-	leaf = *head;
 
-	while(leaf){
-		if(leaf->context && leaf->context->id && !strcmp(leaf->context->id, context->id)){
-			/* Client making a second subscription to same topic. Only
-			 * need to update QoS. Return MOSQ_ERR_SUB_EXISTS to
-			 * indicate this to the calling function. */
-			leaf->qos = qos;
-			leaf->identifier = identifier;
-			return MOSQ_ERR_SUB_EXISTS;
-		}
-		leaf = leaf->next;
-	}
 	leaf = mosquitto__calloc(1, sizeof(struct mosquitto__subleaf));
 	if(!leaf) return MOSQ_ERR_NOMEM;
 	leaf->context = context;
@@ -187,6 +524,42 @@ static int sub__add_leaf(struct mosquitto *context, uint8_t qos, uint32_t identi
 }
 
 
+/* Add the client's own reference to a new subscription, which lets the
+ * subscription be removed without searching the leaves of other clients. */
+static int sub__add_client_sub(struct mosquitto *context, const char *sub, struct mosquitto__subhier *subhier, struct mosquitto__subshared *shared, struct mosquitto__subleaf *leaf)
+{
+	struct mosquitto__client_sub **subs;
+	struct mosquitto__client_sub *csub;
+	int i;
+	size_t slen;
+
+	slen = strlen(sub);
+	csub = mosquitto__calloc(1, sizeof(struct mosquitto__client_sub) + slen + 1);
+	if(csub == NULL) return MOSQ_ERR_NOMEM;
+	memcpy(csub->topic_filter, sub, slen);
+	csub->hier = subhier;
+	csub->shared = shared;
+	csub->leaf = leaf;
+
+	for(i=0; i<context->sub_count; i++){
+		if(!context->subs[i]){
+			context->subs[i] = csub;
+			return MOSQ_ERR_SUCCESS;
+		}
+	}
+	subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__client_sub *)*(size_t)(context->sub_count + 1));
+	if(!subs){
+		mosquitto__free(csub);
+		return MOSQ_ERR_NOMEM;
+	}
+	context->subs = subs;
+	context->sub_count++;
+	context->subs[context->sub_count-1] = csub;
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
 static void sub__remove_shared_leaf(struct mosquitto__subhier *subhier, struct mosquitto__subshared *shared, struct mosquitto__subleaf *leaf)
 {
 	DL_DELETE(shared->subs, leaf);
@@ -199,35 +572,45 @@ static void sub__remove_shared_leaf(struct mosquitto__subhier *subhier, struct m
 }
 
 
-static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, const char *sharename)
+static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, const struct sub__token *sharename)
 {
 	struct mosquitto__subleaf *newleaf;
 	struct mosquitto__subshared *shared = NULL;
-	struct mosquitto__client_sub **subs;
-	struct mosquitto__client_sub *csub;
-	int i;
 	size_t slen;
+	int i;
 	int rc;
 
-	slen = strlen(sharename);
+	slen = sharename->topic_len;
 
-	HASH_FIND(hh, subhier->shared, sharename, slen, shared);
-	if(shared == NULL){
+	HASH_FIND(hh, subhier->shared, sharename->topic, slen, shared);
+	if(shared){
+		i = sub__client_sub_index(context, subhier, shared);
+		if(i != -1){
+			/* Client making a second subscription to same topic. Only
+			 * need to update QoS. */
+			context->subs[i]->leaf->qos = qos;
+			context->subs[i]->leaf->identifier = identifier;
+			rc = MOSQ_ERR_SUB_EXISTS;
+			goto done;
+		}
+	}else{
 		shared = mosquitto__calloc(1, sizeof(struct mosquitto__subshared));
 		if(!shared){
 			return MOSQ_ERR_NOMEM;
 		}
-		shared->name = mosquitto__strdup(sharename);
+		shared->name = mosquitto__malloc(slen+1);
 		if(shared->name == NULL){
 			mosquitto__free(shared);
 			return MOSQ_ERR_NOMEM;
 		}
+		memcpy(shared->name, sharename->topic, slen);
+		shared->name[slen] = '\0';
 
 		HASH_ADD_KEYPTR(hh, subhier->shared, shared->name, slen, shared);
 	}
 
 	rc = sub__add_leaf(context, qos, identifier, options, &shared->subs, &newleaf);
-	if(rc > 0){
+	if(rc){
 		if(shared->subs == NULL){
 			HASH_DELETE(hh, subhier->shared, shared);
 			mosquitto__free(shared->name);
@@ -235,38 +618,16 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 		}
 		return rc;
 	}
-
-	if(rc != MOSQ_ERR_SUB_EXISTS){
-		slen = strlen(sub);
-		csub = mosquitto__calloc(1, sizeof(struct mosquitto__client_sub) + slen + 1);
-		if(csub == NULL) return MOSQ_ERR_NOMEM;
-		memcpy(csub->topic_filter, sub, slen);
-		csub->hier = subhier;
-		csub->shared = shared;
-
-		for(i=0; i<context->sub_count; i++){
-			if(!context->subs[i]){
-				context->subs[i] = csub;
-				break;
-			}
-		}
-		if(i == context->sub_count){
-			subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__client_sub *)*(size_t)(context->sub_count + 1));
-			if(!subs){
-				sub__remove_shared_leaf(subhier, shared, newleaf);
-				mosquitto__free(newleaf);
-				mosquitto__free(csub);
-				return MOSQ_ERR_NOMEM;
-			}
-			context->subs = subs;
-			context->sub_count++;
-			context->subs[context->sub_count-1] = csub;
-		}
+	rc = sub__add_client_sub(context, sub, subhier, shared, newleaf);
+	if(rc){
+		sub__remove_shared_leaf(subhier, shared, newleaf);
+		return rc;
+	}
 #ifdef WITH_SYS_TREE
-		db.shared_subscription_count++;
+	db.shared_subscription_count++;
 #endif
-	}
 
+done:
 	if(context->protocol == mosq_p_mqtt31 || context->protocol == mosq_p_mqtt5){
 		return rc;
 	}else{
@@ -280,42 +641,26 @@ static int sub__add_shared(struct mosquitto *context, const char *sub, uint8_t q
 static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier)
 {
 	struct mosquitto__subleaf *newleaf = NULL;
-	struct mosquitto__client_sub **subs;
-	struct mosquitto__client_sub *csub;
 	int i;
 	int rc;
-	size_t slen;
-
-	rc = sub__add_leaf(context, qos, identifier, options, &subhier->subs, &newleaf);
-	if(rc > 0){
-		return rc;
-	}
-
-	if(rc != MOSQ_ERR_SUB_EXISTS){
-		slen = strlen(sub);
-		csub = mosquitto__calloc(1, sizeof(struct mosquitto__client_sub) + slen + 1);
-		if(csub == NULL) return MOSQ_ERR_NOMEM;
-		memcpy(csub->topic_filter, sub, slen);
-		csub->hier = subhier;
-		csub->shared = NULL;
 
-		for(i=0; i<context->sub_count; i++){
-			if(!context->subs[i]){
-				context->subs[i] = csub;
-				break;
-			}
+	i = sub__client_sub_index(context, subhier, NULL);
+	if(i != -1){
+		/* Client making a second subscription to same topic. Only
+		 * need to update QoS. */
+		context->subs[i]->leaf->qos = qos;
+		context->subs[i]->leaf->identifier = identifier;
+		rc = MOSQ_ERR_SUB_EXISTS;
+	}else{
+		rc = sub__add_leaf(context, qos, identifier, options, &subhier->subs, &newleaf);
+		if(rc){
+			return rc;
 		}
-		if(i == context->sub_count){
-			subs = mosquitto__realloc(context->subs, sizeof(struct mosquitto__client_sub *)*(size_t)(context->sub_count + 1));
-			if(!subs){
-				DL_DELETE(subhier->subs, newleaf);
-				mosquitto__free(newleaf);
-				mosquitto__free(csub);
-				return MOSQ_ERR_NOMEM;
-			}
-			context->subs = subs;
-			context->sub_count++;
-			context->subs[context->sub_count-1] = csub;
+		rc = sub__add_client_sub(context, sub, subhier, NULL, newleaf);
+		if(rc){
+			DL_DELETE(subhier->subs, newleaf);
+			mosquitto__free(newleaf);
+			return rc;
 		}
 #ifdef WITH_SYS_TREE
 		db.subscription_count++;
@@ -332,26 +677,20 @@ static int sub__add_normal(struct mosquitto *context, const char *sub, uint8_t q
 }
 
 
-static int sub__add_context(struct mosquitto *context, const char *topic_filter, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, char *const *const topics, const char *sharename)
+static int sub__add_context(struct mosquitto *context, const char *topic_filter, uint8_t qos, uint32_t identifier, int options, struct mosquitto__subhier *subhier, const struct sub__token *tokens, int token_count, const struct sub__token *sharename)
 {
 	struct mosquitto__subhier *branch;
-	int topic_index = 0;
-	size_t topiclen;
+	int topic_index;
 
 	/* Find leaf node */
-	while(topics && topics[topic_index] != NULL){
-		topiclen = strlen(topics[topic_index]);
-		if(topiclen > UINT16_MAX){
-			return MOSQ_ERR_INVAL;
-		}
-		HASH_FIND(hh, subhier->children, topics[topic_index], topiclen, branch);
+	for(topic_index=0; topic_index<token_count; topic_index++){
+		branch = sub__hier_find(subhier, tokens[topic_index].topic, tokens[topic_index].topic_len);
 		if(!branch){
 			/* Not found */
-			branch = sub__add_hier_entry(subhier, &subhier->children, topics[topic_index], (uint16_t)topiclen);
+			branch = sub__add_hier_entry(subhier, tokens[topic_index].topic, tokens[topic_index].topic_len);
 			if(!branch) return MOSQ_ERR_NOMEM;
 		}
 		subhier = branch;
-		topic_index++;
 	}
 
 	/* Add add our context */
@@ -369,93 +708,57 @@ static int sub__add_context(struct mosquitto *context, const char *topic_filter,
 
 static int sub__remove_normal(struct mosquitto *context, struct mosquitto__subhier *subhier, uint8_t *reason)
 {
-	struct mosquitto__subleaf *leaf;
 	int i;
 
-	leaf = subhier->subs;
-	while(leaf){
-		if(leaf->context==context){
+	i = sub__client_sub_index(context, subhier, NULL);
+	if(i == -1){
+		return MOSQ_ERR_NO_SUBSCRIBERS;
+	}
+
 #ifdef WITH_SYS_TREE
-			db.subscription_count--;
+	db.subscription_count--;
 #endif
-			DL_DELETE(subhier->subs, leaf);
-			mosquitto__free(leaf);
+	DL_DELETE(subhier->subs, context->subs[i]->leaf);
+	mosquitto__free(context->subs[i]->leaf);
+	mosquitto__free(context->subs[i]);
+	context->subs[i] = NULL;
 
-			/* Remove the reference to the sub that the client is keeping.
-			 * It would be nice to be able to use the reference directly,
-			 * but that would involve keeping a copy of the topic string in
-			 * each subleaf. Might be worth considering though. */
-			for(i=0; i<context->sub_count; i++){
-				if(context->subs[i] && context->subs[i]->hier == subhier){
-					mosquitto__free(context->subs[i]);
-					context->subs[i] = NULL;
-					break;
-				}
-			}
-			*reason = 0;
-			return MOSQ_ERR_SUCCESS;
-		}
-		leaf = leaf->next;
-	}
-	return MOSQ_ERR_NO_SUBSCRIBERS;
+	*reason = 0;
+	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int sub__remove_shared(struct mosquitto *context, struct mosquitto__subhier *subhier, uint8_t *reason, const char *sharename)
+static int sub__remove_shared(struct mosquitto *context, struct mosquitto__subhier *subhier, uint8_t *reason, const struct sub__token *sharename)
 {
 	struct mosquitto__subshared *shared;
-	struct mosquitto__subleaf *leaf;
 	int i;
 
-	HASH_FIND(hh, subhier->shared, sharename, strlen(sharename), shared);
-	if(shared){
-		leaf = shared->subs;
-		while(leaf){
-			if(leaf->context==context){
-#ifdef WITH_SYS_TREE
-				db.shared_subscription_count--;
-#endif
-				DL_DELETE(shared->subs, leaf);
-				mosquitto__free(leaf);
-
-				/* Remove the reference to the sub that the client is keeping.
-				* It would be nice to be able to use the reference directly,
-				* but that would involve keeping a copy of the topic string in
-				* each subleaf. Might be worth considering though. */
-				for(i=0; i<context->sub_count; i++){
-					if(context->subs[i]
-							&& context->subs[i]->hier == subhier
-							&& context->subs[i]->shared == shared){
-
-						mosquitto__free(context->subs[i]);
-						context->subs[i] = NULL;
-						break;
-					}
-				}
-
-				if(shared->subs == NULL){
-					HASH_DELETE(hh, subhier->shared, shared);
-					mosquitto__free(shared->name);
-					mosquitto__free(shared);
-				}
-
-				*reason = 0;
-				return MOSQ_ERR_SUCCESS;
-			}
-			leaf = leaf->next;
-		}
+	HASH_FIND(hh, subhier->shared, sharename->topic, sharename->topic_len, shared);
+	if(!shared){
 		return MOSQ_ERR_NO_SUBSCRIBERS;
-	}else{
+	}
+	i = sub__client_sub_index(context, subhier, shared);
+	if(i == -1){
 		return MOSQ_ERR_NO_SUBSCRIBERS;
 	}
+
+#ifdef WITH_SYS_TREE
+	db.shared_subscription_count--;
+#endif
+	sub__remove_shared_leaf(subhier, shared, context->subs[i]->leaf);
+	mosquitto__free(context->subs[i]);
+	context->subs[i] = NULL;
+
+	*reason = 0;
+	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int sub__remove_recurse(struct mosquitto *context, struct mosquitto__subhier *subhier, char **topics, uint8_t *reason, const char *sharename)
+static int sub__remove_recurse(struct mosquitto *context, struct mosquitto__subhier *subhier, const struct sub__token *tokens, int token_count, uint8_t *reason, const struct sub__token *sharename)
 {
 	struct mosquitto__subhier *branch;
 
-	if(topics == NULL || topics[0] == NULL){
+	if(token_count == 0){
 		if(sharename){
 			return sub__remove_shared(context, subhier, reason, sharename);
 		}else{
@@ -463,38 +766,37 @@ static int sub__remove_recurse(struct mosquitto *context, struct mosquitto__subh
 		}
 	}
 
-	HASH_FIND(hh, subhier->children, topics[0], strlen(topics[0]), branch);
+	branch = sub__hier_find(subhier, tokens[0].topic, tokens[0].topic_len);
 	if(branch){
-		sub__remove_recurse(context, branch, &(topics[1]), reason, sharename);
+		sub__remove_recurse(context, branch, &tokens[1], token_count-1, reason, sharename);
 		if(!branch->children && !branch->subs && !branch->shared){
-			HASH_DELETE(hh, subhier->children, branch);
-			mosquitto__free(branch->topic);
-			mosquitto__free(branch);
+			sub__hier_child_remove(subhier, branch);
+			sub__hier_free(branch);
 		}
 	}
 	return MOSQ_ERR_SUCCESS;
 }
 
 
-static int sub__search(struct mosquitto__subhier *subhier, char **split_topics, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
+static int sub__search(struct mosquitto__subhier *subhier, const struct sub__token *tokens, int token_count, const char *source_id, const char *topic, uint8_t qos, int retain, struct mosquitto_msg_store *stored)
 {
 	/* FIXME - need to take into account source_id if the client is a bridge */
 	struct mosquitto__subhier *branch;
 	int rc;
 	bool have_subscribers = false;
 
-	if(split_topics && split_topics[0]){
+	if(token_count > 0){
 		/* Check for literal match */
-		HASH_FIND(hh, subhier->children, split_topics[0], strlen(split_topics[0]), branch);
+		branch = sub__hier_find(subhier, tokens[0].topic, tokens[0].topic_len);
 
 		if(branch){
-			rc = sub__search(branch, &(split_topics[1]), source_id, topic, qos, retain, stored);
+			rc = sub__search(branch, &tokens[1], token_count-1, source_id, topic, qos, retain, stored);
 			if(rc == MOSQ_ERR_SUCCESS){
 				have_subscribers = true;
 			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
 				return rc;
 			}
-			if(split_topics[1] == NULL){ /* End of list */
+			if(token_count == 1){ /* End of list */
 				rc = subs__process(branch, source_id, topic, qos, retain, stored);
 				if(rc == MOSQ_ERR_SUCCESS){
 					have_subscribers = true;
@@ -505,16 +807,16 @@ static int sub__search(struct mosquitto__subhier *subhier, char **split_topics,
 		}
 
 		/* Check for + match */
-		HASH_FIND(hh, subhier->children, "+", 1, branch);
+		branch = sub__hier_find(subhier, "+", 1);
 
 		if(branch){
-			rc = sub__search(branch, &(split_topics[1]), source_id, topic, qos, retain, stored);
+			rc = sub__search(branch, &tokens[1], token_count-1, source_id, topic, qos, retain, stored);
 			if(rc == MOSQ_ERR_SUCCESS){
 				have_subscribers = true;
 			}else if(rc != MOSQ_ERR_NO_SUBSCRIBERS){
 				return rc;
 			}
-			if(split_topics[1] == NULL){ /* End of list */
+			if(token_count == 1){ /* End of list */
 				rc = subs__process(branch, source_id, topic, qos, retain, stored);
 				if(rc == MOSQ_ERR_SUCCESS){
 					have_subscribers = true;
@@ -526,7 +828,7 @@ static int sub__search(struct mosquitto__subhier *subhier, char **split_topics,
 	}
 
 	/* Check for # match */
-	HASH_FIND(hh, subhier->children, "#", 1, branch);
+	branch = sub__hier_find(subhier, "#", 1);
 	if(branch && !branch->children){
 		/* The topic matches due to a # wildcard - process the
 		 * subscriptions but *don't* return. Although this branch has ended
@@ -548,12 +850,10 @@ static int sub__search(struct mosquitto__subhier *subhier, char **split_topics,
 }
 
 
-struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, struct mosquitto__subhier **sibling, const char *topic, uint16_t len)
+struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent, const char *topic, uint16_t len)
 {
 	struct mosquitto__subhier *child;
 
-	assert(sibling);
-
 	child = mosquitto__calloc(1, sizeof(struct mosquitto__subhier));
 	if(!child){
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
@@ -561,16 +861,28 @@ struct mosquitto__subhier *sub__add_hier_entry(struct mosquitto__subhier *parent
 	}
 	child->parent = parent;
 	child->topic_len = len;
-	child->topic = mosquitto__strdup(topic);
-	if(!child->topic){
-		child->topic_len = 0;
-		mosquitto__free(child);
+	if(len < SUBHIER_INLINE_LEN){
+		memcpy(child->topic.str, topic, len);
+		child->topic.str[len] = '\0';
+	}else{
+		child->topic.interned = sub__intern_get(topic, len);
+		if(!child->topic.interned){
+			mosquitto__free(child);
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+			return NULL;
+		}
+	}
+#ifdef WITH_SYS_TREE
+	db.subhier_count++;
+#endif
+	SUBHIER_BYTES_ADD(sizeof(struct mosquitto__subhier));
+
+	if(parent && sub__hier_child_add(parent, child)){
+		sub__hier_free(child);
 		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 		return NULL;
 	}
 
-	HASH_ADD_KEYPTR(hh, *sibling, child->topic, child->topic_len, child);
-
 	return child;
 }
 
@@ -579,39 +891,29 @@ int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t i
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
-	const char *sharename = NULL;
-	char *local_sub;
-	char **topics;
-	size_t topiclen;
+	struct sub__tokens tokens;
 
 	assert(root);
 	assert(*root);
 	assert(sub);
 
-	rc = sub__topic_tokenise(sub, &local_sub, &topics, &sharename);
+	rc = sub__topic_tokenise(sub, &tokens);
 	if(rc) return rc;
 
-	topiclen = strlen(topics[0]);
-	if(topiclen > UINT16_MAX){
-		mosquitto__free(local_sub);
-		mosquitto__free(topics);
-		return MOSQ_ERR_INVAL;
-	}
-	HASH_FIND(hh, *root, topics[0], topiclen, subhier);
+	subhier = sub__hier_find(*root, tokens.tokens[0].topic, tokens.tokens[0].topic_len);
 	if(!subhier){
-		subhier = sub__add_hier_entry(NULL, root, topics[0], (uint16_t)topiclen);
+		subhier = sub__add_hier_entry(*root, tokens.tokens[0].topic, tokens.tokens[0].topic_len);
 		if(!subhier){
-			mosquitto__free(local_sub);
-			mosquitto__free(topics);
+			sub__topic_tokens_free(&tokens);
 			log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
 			return MOSQ_ERR_NOMEM;
 		}
 
 	}
-	rc = sub__add_context(context, sub, qos, identifier, options, subhier, topics, sharename);
+	rc = sub__add_context(context, sub, qos, identifier, options, subhier,
+			tokens.tokens, tokens.count, tokens.sharename.topic ? &tokens.sharename : NULL);
 
-	mosquitto__free(local_sub);
-	mosquitto__free(topics);
+	sub__topic_tokens_free(&tokens);
 
 	return rc;
 }
@@ -620,24 +922,22 @@ int sub__remove(struct mosquitto *context, const char *sub, struct mosquitto__su
 {
 	int rc = 0;
 	struct mosquitto__subhier *subhier;
-	const char *sharename = NULL;
-	char *local_sub = NULL;
-	char **topics = NULL;
+	struct sub__tokens tokens;
 
 	assert(root);
 	assert(sub);
 
-	rc = sub__topic_tokenise(sub, &local_sub, &topics, &sharename);
+	rc = sub__topic_tokenise(sub, &tokens);
 	if(rc) return rc;
 
-	HASH_FIND(hh, root, topics[0], strlen(topics[0]), subhier);
+	subhier = sub__hier_find(root, tokens.tokens[0].topic, tokens.tokens[0].topic_len);
 	if(subhier){
 		*reason = MQTT_RC_NO_SUBSCRIPTION_EXISTED;
-		rc = sub__remove_recurse(context, subhier, topics, reason, sharename);
+		rc = sub__remove_recurse(context, subhier, tokens.tokens, tokens.count, reason,
+				tokens.sharename.topic ? &tokens.sharename : NULL);
 	}
 
-	mosquitto__free(local_sub);
-	mosquitto__free(topics);
+	sub__topic_tokens_free(&tokens);
 
 	return rc;
 }
@@ -646,12 +946,11 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 {
 	int rc = MOSQ_ERR_SUCCESS, rc2;
 	struct mosquitto__subhier *subhier;
-	char **split_topics = NULL;
-	char *local_topic = NULL;
+	struct sub__tokens tokens;
 
 	assert(topic);
 
-	if(sub__topic_tokenise(topic, &local_topic, &split_topics, NULL)) return 1;
+	if(sub__topic_tokenise(topic, &tokens)) return 1;
 
 	/* Protect this message until we have sent it to all
 	clients - this is required because websockets client calls
@@ -659,18 +958,17 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 	*/
 	db__msg_store_ref_inc(*stored);
 
-	HASH_FIND(hh, db.subs, split_topics[0], strlen(split_topics[0]), subhier);
+	subhier = sub__hier_find(db.subs, tokens.tokens[0].topic, tokens.tokens[0].topic_len);
 	if(subhier){
-		rc = sub__search(subhier, split_topics, source_id, topic, qos, retain, *stored);
+		rc = sub__search(subhier, tokens.tokens, tokens.count, source_id, topic, qos, retain, *stored);
 	}
 
 	if(retain){
-		rc2 = retain__store(topic, *stored, split_topics);
+		rc2 = retain__store(topic, *stored, tokens.tokens, tokens.count);
 		if(rc2) rc = rc2;
 	}
 
-	mosquitto__free(split_topics);
-	mosquitto__free(local_topic);
+	sub__topic_tokens_free(&tokens);
 	/* Remove our reference and free if needed. */
 	db__msg_store_ref_dec(stored);
 
@@ -678,12 +976,14 @@ int sub__messages_queue(const char *source_id, const char *topic, uint8_t qos, i
 }
 
 
-/* Remove a subhier element, and return its parent if that needs freeing as well. */
+/* Remove a subhier element, and return its parent if that needs freeing as well.
+ * The "" and "$SYS" roots, whose parent is the db.subs holder, are never
+ * removed. */
 static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub)
 {
 	struct mosquitto__subhier *parent;
 
-	if(!sub || !sub->parent){
+	if(!sub || !sub->parent || !sub->parent->parent){
 		return NULL;
 	}
 
@@ -692,14 +992,14 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 	}
 
 	parent = sub->parent;
-	HASH_DELETE(hh, parent->children, sub);
-	mosquitto__free(sub->topic);
-	mosquitto__free(sub);
+	sub__hier_child_remove(parent, sub);
+	sub__hier_free(sub);
 
 	if(parent->subs == NULL
 			&& parent->children == NULL
 			&& parent->shared == NULL
-			&& parent->parent){
+			&& parent->parent
+			&& parent->parent->parent){
 
 		return parent;
 	}else{
@@ -713,7 +1013,6 @@ static struct mosquitto__subhier *tmp_remove_subs(struct mosquitto__subhier *sub
 int sub__clean_session(struct mosquitto *context)
 {
 	int i;
-	struct mosquitto__subleaf *leaf;
 	struct mosquitto__subhier *hier;
 
 	for(i=0; i<context->sub_count; i++){
@@ -724,30 +1023,16 @@ int sub__clean_session(struct mosquitto *context)
 		hier = context->subs[i]->hier;
 
 		if(context->subs[i]->shared){
-			leaf = context->subs[i]->shared->subs;
-			while(leaf){
-				if(leaf->context==context){
 #ifdef WITH_SYS_TREE
-					db.shared_subscription_count--;
+			db.shared_subscription_count--;
 #endif
-					sub__remove_shared_leaf(context->subs[i]->hier, context->subs[i]->shared, leaf);
-					break;
-				}
-				leaf = leaf->next;
-			}
+			sub__remove_shared_leaf(hier, context->subs[i]->shared, context->subs[i]->leaf);
 		}else{
-			leaf = hier->subs;
-			while(leaf){
-				if(leaf->context==context){
 #ifdef WITH_SYS_TREE
-					db.subscription_count--;
+			db.subscription_count--;
 #endif
-					DL_DELETE(hier->subs, leaf);
-					mosquitto__free(leaf);
-					break;
-				}
-				leaf = leaf->next;
-			}
+			DL_DELETE(hier->subs, context->subs[i]->leaf);
+			mosquitto__free(context->subs[i]->leaf);
 		}
 		mosquitto__free(context->subs[i]);
 		context->subs[i] = NULL;
@@ -772,15 +1057,20 @@ int sub__clean_session(struct mosquitto *context)
 void sub__tree_print(struct mosquitto__subhier *root, int level)
 {
 	int i;
-	struct mosquitto__subhier *branch, *branch_tmp;
+	uint32_t j, slots;
+	struct mosquitto__subhier *branch;
 	struct mosquitto__subleaf *leaf;
 
-	HASH_ITER(hh, root, branch, branch_tmp){
+	slots = root->children ? 1U<<root->child_bits : 0;
+	for(j=0; j<slots; j++){
+		branch = root->children[j];
+		if(branch == NULL) continue;
+
 	if(level > -1){
 		for(i=0; i<(level+2)*2; i++){
 			printf(" ");
 		}
-		printf("%s", branch->topic);
+		printf("%s", sub__hier_topic(branch));
 		leaf = branch->subs;
 		while(leaf){
 			if(leaf->context){
@@ -793,6 +1083,50 @@ void sub__tree_print(struct mosquitto__subhier *root, int level)
 		printf("\n");
 	}
 
-		sub__tree_print(branch->children, level+1);
+		sub__tree_print(branch, level+1);
 	}
 }
+
+
+/* Free the whole tree below and including *root. Only used on shutdown. */
+void sub__tree_clean(struct mosquitto__subhier **root)
+{
+	struct mosquitto__subhier *hier = *root;
+	struct mosquitto__subhier *child;
+	struct mosquitto__subleaf *leaf, *leaf_next;
+	struct mosquitto__subshared *shared, *shared_tmp;
+	uint32_t i, slots;
+
+	if(hier == NULL) return;
+
+	slots = hier->children ? 1U<<hier->child_bits : 0;
+	for(i=0; i<slots; i++){
+		child = hier->children[i];
+		if(child){
+			sub__tree_clean(&child);
+		}
+	}
+	SUBHIER_BYTES_SUB(slots*sizeof(struct mosquitto__subhier *));
+	mosquitto__free(hier->children);
+
+	leaf = hier->subs;
+	while(leaf){
+		leaf_next = leaf->next;
+		mosquitto__free(leaf);
+		leaf = leaf_next;
+	}
+	HASH_ITER(hh, hier->shared, shared, shared_tmp){
+		leaf = shared->subs;
+		while(leaf){
+			leaf_next = leaf->next;
+			mosquitto__free(leaf);
+			leaf = leaf_next;
+		}
+		HASH_DELETE(hh, hier->shared, shared);
+		mosquitto__free(shared->name);
+		mosquitto__free(shared);
+	}
+
+	sub__hier_free(hier);
+	*root = NULL;
+}
@@ -147,6 +147,168 @@ static void calc_load(char *buf, const char *topic, bool initial, double exponen
 	(*current) = new_value;
 }
 
+#if defined(WITH_BRIDGE) || defined(WITH_TLS)
+static void sys_tree__publish_u64(char *buf, char *topic, size_t prefix_len, const char *suffix, uint64_t value, uint64_t *last, bool initial)
+{
+	uint32_t len;
+
+	if(initial || value != *last){
+		*last = value;
+		snprintf(&topic[prefix_len], 50, "%s", suffix);
+		len = (uint32_t)snprintf(buf, BUFLEN, "%" PRIu64, value);
+		db__messages_easy_queue(NULL, topic, SYS_TREE_QOS, len, buf, 1, 0, NULL);
+	}
+}
+#endif
+
+
+#ifdef WITH_TLS
+static void sys_tree__update_listeners(char *buf, bool initial)
+{
+	struct mosquitto__listener *listener;
+	struct mosquitto__ktls_stats *stats;
+	struct mosquitto__tls_stats *tls_stats;
+	char topic[100];
+	size_t prefix_len;
+	int i;
+
+	for(i=0; i<db.config->listener_count; i++){
+		listener = &db.config->listeners[i];
+		if(listener->ssl_ctx == NULL) continue;
+
+		snprintf(topic, sizeof(topic) - 50, "$SYS/broker/listeners/%d/", listener->port);
+		prefix_len = strlen(topic);
+
+		tls_stats = &listener->tls_stats;
+		sys_tree__publish_u64(buf, topic, prefix_len, "tls/sessions", tls_stats->sessions, &tls_stats->sys_sessions, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "tls/resumed", tls_stats->resumed, &tls_stats->sys_resumed, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "tls/session cache/entries",
+				(uint64_t)SSL_CTX_sess_number(listener->ssl_ctx), &tls_stats->sys_cache_entries, initial);
+
+		if(listener->ktls == false) continue;
+		stats = &listener->ktls_stats;
+		sys_tree__publish_u64(buf, topic, prefix_len, "ktls/sessions", stats->sessions, &stats->sys_sessions, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "ktls/offloaded/send", stats->tx, &stats->sys_tx, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "ktls/offloaded/receive", stats->rx, &stats->sys_rx, initial);
+	}
+}
+#endif
+
+
+#ifdef WITH_TLS_POOL
+static void sys_tree__update_tls_pool(char *buf, bool initial)
+{
+	static const char *buckets[TLS_POOL_LATENCY_BUCKETS] = {
+		"1ms", "2ms", "5ms", "10ms", "20ms", "50ms", "100ms",
+		"200ms", "500ms", "1000ms", "2000ms", "5000ms", "inf"};
+	static uint64_t last_completed, last_failed, last_pending, last_in_progress;
+	static uint64_t last_latency[TLS_POOL_LATENCY_BUCKETS];
+	const struct mosquitto__tls_pool_stats *stats;
+	char topic[100];
+	char suffix[50];
+	size_t prefix_len;
+	int i;
+
+	stats = tls_pool__stats();
+	if(stats == NULL) return;
+
+	snprintf(topic, sizeof(topic), "$SYS/broker/tls/handshakes/");
+	prefix_len = strlen(topic);
+
+	sys_tree__publish_u64(buf, topic, prefix_len, "completed", stats->completed, &last_completed, initial);
+	sys_tree__publish_u64(buf, topic, prefix_len, "failed", stats->failed, &last_failed, initial);
+	sys_tree__publish_u64(buf, topic, prefix_len, "pending", (uint64_t)stats->pending, &last_pending, initial);
+	sys_tree__publish_u64(buf, topic, prefix_len, "in progress", (uint64_t)stats->in_progress, &last_in_progress, initial);
+	for(i=0; i<TLS_POOL_LATENCY_BUCKETS; i++){
+		snprintf(suffix, sizeof(suffix), "latency/%s", buckets[i]);
+		sys_tree__publish_u64(buf, topic, prefix_len, suffix, stats->latency[i], &last_latency[i], initial);
+	}
+}
+#endif
+
+
+#ifdef WITH_BRIDGE
+static void sys_tree__update_bridges(char *buf, bool initial, double exponent, double i_mult)
+{
+	struct mosquitto__bridge *bridge, *conn;
+	struct mosquitto__bridge_stats *stats;
+	char *topic;
+	size_t prefix_len;
+	uint64_t msgs_sent, msgs_received, bytes_sent, bytes_received, inflight, rtt;
+	uint64_t compress_in, compress_out;
+	double interval, ratio;
+	uint32_t len;
+	int i, j;
+
+	for(i=0; i<db.bridge_count; i++){
+		if(db.bridges[i] == NULL || db.bridges[i]->bridge == NULL) continue;
+
+		bridge = db.bridges[i]->bridge;
+		if(bridge->primary != bridge) continue;
+		stats = &bridge->stats;
+
+		/* Report the totals over all connections of the bridge, with the
+		 * round trip time of the slowest. */
+		msgs_sent = msgs_received = bytes_sent = bytes_received = inflight = rtt = 0;
+		compress_in = compress_out = 0;
+		for(j=0; j<db.bridge_count; j++){
+			if(db.bridges[j] == NULL || db.bridges[j]->bridge == NULL) continue;
+
+			conn = db.bridges[j]->bridge;
+			if(conn->primary != bridge) continue;
+
+			msgs_sent += conn->stats.pub_msgs_sent;
+			msgs_received += conn->stats.pub_msgs_received;
+			bytes_sent += conn->stats.pub_bytes_sent;
+			bytes_received += conn->stats.pub_bytes_received;
+			compress_in += conn->stats.compress_bytes_in;
+			compress_out += conn->stats.compress_bytes_out;
+			inflight += (uint64_t)db.bridges[j]->msgs_out.inflight_count;
+			if(conn->stats.rtt > rtt){
+				rtt = conn->stats.rtt;
+			}
+		}
+
+		if(stats->sys_topic == NULL){
+			stats->sys_topic_len = strlen("$SYS/broker/bridges//") + strlen(bridge->name);
+			stats->sys_topic = mosquitto__malloc(stats->sys_topic_len + 50);
+			if(stats->sys_topic == NULL) return;
+			snprintf(stats->sys_topic, stats->sys_topic_len+1, "$SYS/broker/bridges/%s/", bridge->name);
+		}
+		topic = stats->sys_topic;
+		prefix_len = stats->sys_topic_len;
+
+		interval = (double)(msgs_sent - stats->sys_pub_msgs_sent)*i_mult;
+		snprintf(&topic[prefix_len], 50, "load/messages/sent/1min");
+		calc_load(buf, topic, initial, exponent, interval, &stats->sys_load_sent);
+
+		interval = (double)(msgs_received - stats->sys_pub_msgs_received)*i_mult;
+		snprintf(&topic[prefix_len], 50, "load/messages/received/1min");
+		calc_load(buf, topic, initial, exponent, interval, &stats->sys_load_received);
+
+		sys_tree__publish_u64(buf, topic, prefix_len, "messages/sent", msgs_sent, &stats->sys_pub_msgs_sent, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "messages/received", msgs_received, &stats->sys_pub_msgs_received, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "bytes/sent", bytes_sent, &stats->sys_pub_bytes_sent, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "bytes/received", bytes_received, &stats->sys_pub_bytes_received, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "messages/inflight", inflight, &stats->sys_inflight, initial);
+		sys_tree__publish_u64(buf, topic, prefix_len, "rtt", rtt, &stats->sys_rtt, initial);
+
+		if(bridge->compression != mosq_cmp_none){
+			sys_tree__publish_u64(buf, topic, prefix_len, "compression/bytes/uncompressed", compress_in, &stats->sys_compress_bytes_in, initial);
+			sys_tree__publish_u64(buf, topic, prefix_len, "compression/bytes/compressed", compress_out, &stats->sys_compress_bytes_out, initial);
+
+			ratio = compress_out ? (double)compress_in/(double)compress_out : 1.0;
+			if(initial || fabs(ratio - stats->sys_compress_ratio) >= 0.01){
+				stats->sys_compress_ratio = ratio;
+				snprintf(&topic[prefix_len], 50, "compression/ratio");
+				len = (uint32_t)snprintf(buf, BUFLEN, "%.2f", ratio);
+				db__messages_easy_queue(NULL, topic, SYS_TREE_QOS, len, buf, 1, 0, NULL);
+			}
+		}
+	}
+}
+#endif
+
 /* Send messages for the $SYS hierarchy if the last update is longer than
  * 'interval' seconds ago.
  * 'interval' is the amount of seconds between updates. If 0, then no periodic
@@ -172,6 +334,8 @@ void sys_tree__update(int interval, time_t start_time)
 	static unsigned long long pub_bytes_sent = ULLONG_MAX;
 	static int subscription_count = INT_MAX;
 	static int shared_subscription_count = INT_MAX;
+	static int subhier_count = INT_MAX;
+	static unsigned long subhier_bytes = ULONG_MAX;
 	static int retained_count = INT_MAX;
 
 	static double msgs_received_load1 = 0;
@@ -257,6 +421,15 @@ void sys_tree__update(int interval, time_t start_time)
 			calc_load(buf, "$SYS/broker/load/bytes/sent/1min", initial_publish, exponent, bytes_sent_interval, &bytes_sent_load1);
 			calc_load(buf, "$SYS/broker/load/sockets/1min", initial_publish, exponent, socket_interval, &socket_load1);
 			calc_load(buf, "$SYS/broker/load/connections/1min", initial_publish, exponent, connection_interval, &connection_load1);
+#ifdef WITH_BRIDGE
+			sys_tree__update_bridges(buf, initial_publish, exponent, i_mult);
+#endif
+#ifdef WITH_TLS
+			sys_tree__update_listeners(buf, initial_publish);
+#endif
+#ifdef WITH_TLS_POOL
+			sys_tree__update_tls_pool(buf, initial_publish);
+#endif
 
 			/* 5 minute load */
 			exponent = exp(-1.0*(double)(db.now_s-last_update)/300.0);
@@ -310,6 +483,18 @@ void sys_tree__update(int interval, time_t start_time)
 			db__messages_easy_queue(NULL, "$SYS/broker/shared_subscriptions/count", SYS_TREE_QOS, len, buf, 1, 0, NULL);
 		}
 
+		if(db.subhier_count != subhier_count){
+			subhier_count = db.subhier_count;
+			len = (uint32_t)snprintf(buf, BUFLEN, "%d", subhier_count);
+			db__messages_easy_queue(NULL, "$SYS/broker/subscriptions/tree/nodes", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+		}
+
+		if(db.subhier_bytes != subhier_bytes){
+			subhier_bytes = db.subhier_bytes;
+			len = (uint32_t)snprintf(buf, BUFLEN, "%lu", subhier_bytes);
+			db__messages_easy_queue(NULL, "$SYS/broker/subscriptions/tree/bytes", SYS_TREE_QOS, len, buf, 1, 0, NULL);
+		}
+
 		if(db.retained_count != retained_count){
 			retained_count = db.retained_count;
 			len = (uint32_t)snprintf(buf, BUFLEN, "%d", retained_count);
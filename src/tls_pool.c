@@ -0,0 +1,613 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_TLS_POOL
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+#include <openssl/ssl.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "mux.h"
+#include "net_mosq.h"
+
+/* The rest of the broker is single threaded and gets the no-op versions of
+ * these from dummypthread.h, but the pool needs the real ones. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_cancel
+#undef pthread_testcancel
+#undef pthread_mutex_init
+#undef pthread_mutex_destroy
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+
+/* TLS handshakes for new connections, carried out on a pool of worker
+ * threads so that a burst of reconnecting clients doesn't hold up the main
+ * loop.
+ *
+ * Accepted sockets on suitable listeners are handed to tls_pool__add()
+ * before a client context exists. Each worker runs its own poll() loop over
+ * the handshakes it has been given, so a slow client only takes up a slot
+ * and not a thread. When a handshake finishes the job is passed back and
+ * the main loop is woken through a pipe that is watched alongside the
+ * listening sockets. tls_pool__process() then creates the client context
+ * with the established session and adds it to the mux.
+ *
+ * Workers only touch the job's socket and SSL object. Everything else,
+ * including logging and memory allocation, happens on the main thread. */
+
+#define TLS_POOL_HANDSHAKE_TIMEOUT 30
+
+struct tls_pool__job{
+	struct tls_pool__job *next;
+	struct mosquitto__listener *listener;
+	SSL *ssl;
+	mosq_sock_t sock;
+	int worker;
+	int64_t start_ms;
+	short events;
+	bool failed;
+	char address[INET6_ADDRSTRLEN];
+	char err[256];
+};
+
+struct tls_pool__worker{
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	struct tls_pool__job *incoming; /* protected by mutex */
+	struct tls_pool__job *incoming_tail; /* protected by mutex */
+	bool stop; /* protected by mutex */
+	int wake[2];
+	struct tls_pool__job **active;
+	struct pollfd *pollfds;
+	int active_count;
+	int capacity;
+	int assigned; /* main thread only */
+	bool started;
+};
+
+static const int latency_bounds[TLS_POOL_LATENCY_BUCKETS-1] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, 2000, 5000};
+
+static struct tls_pool__worker *workers = NULL;
+static int worker_count = 0;
+static int done_pipe[2] = {INVALID_SOCKET, INVALID_SOCKET};
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct tls_pool__job *done_head = NULL; /* protected by done_mutex */
+static struct tls_pool__job *done_tail = NULL; /* protected by done_mutex */
+static struct tls_pool__job *backlog_head = NULL;
+static struct tls_pool__job *backlog_tail = NULL;
+static struct mosquitto__tls_pool_stats stats;
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static int64_t tls_pool__now_ms(void)
+{
+	struct timespec tp;
+
+	clock_gettime(CLOCK_MONOTONIC, &tp);
+	return (int64_t)tp.tv_sec*1000 + tp.tv_nsec/1000000;
+}
+
+
+static int tls_pool__pipe(int fds[2])
+{
+	int i;
+
+	if(pipe(fds)){
+		return 1;
+	}
+	for(i=0; i<2; i++){
+		if(fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL, 0) | O_NONBLOCK)
+				|| fcntl(fds[i], F_SETFD, FD_CLOEXEC)){
+
+			close(fds[0]);
+			close(fds[1]);
+			fds[0] = fds[1] = INVALID_SOCKET;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+
+static void tls_pool__drain(int fd)
+{
+	char buf[64];
+
+	while(read(fd, buf, sizeof(buf)) > 0){
+	}
+}
+
+
+static void tls_pool__wake(int fd)
+{
+	char c = 0;
+	ssize_t rc;
+
+	/* Nothing to be done if the pipe is full, there is a wakeup pending */
+	rc = write(fd, &c, 1);
+	UNUSED(rc);
+}
+
+
+/* ================================================================
+ * Worker threads
+ * ================================================================ */
+
+/* Move a job on as far as it will go without blocking. Returns true once the
+ * handshake has finished, successfully or not. */
+static bool tls_pool__step(struct tls_pool__job *job)
+{
+	unsigned long e;
+	int rc;
+
+	ERR_clear_error();
+	rc = SSL_accept(job->ssl);
+	if(rc == 1){
+		return true;
+	}
+	switch(SSL_get_error(job->ssl, rc)){
+		case SSL_ERROR_WANT_READ:
+			job->events = POLLIN;
+			return false;
+		case SSL_ERROR_WANT_WRITE:
+			job->events = POLLOUT;
+			return false;
+		default:
+			job->failed = true;
+			e = ERR_get_error();
+			if(e){
+				ERR_error_string_n(e, job->err, sizeof(job->err));
+			}else{
+				snprintf(job->err, sizeof(job->err), "connection closed during handshake");
+			}
+			ERR_clear_error();
+			return true;
+	}
+}
+
+
+static void tls_pool__finish(struct tls_pool__job *job)
+{
+	bool wake;
+
+	job->next = NULL;
+	pthread_mutex_lock(&done_mutex);
+	wake = (done_head == NULL);
+	if(done_tail){
+		done_tail->next = job;
+	}else{
+		done_head = job;
+	}
+	done_tail = job;
+	pthread_mutex_unlock(&done_mutex);
+
+	if(wake){
+		tls_pool__wake(done_pipe[1]);
+	}
+}
+
+
+static void *tls_pool__worker_main(void *arg)
+{
+	struct tls_pool__worker *w = arg;
+	struct tls_pool__job *job, *incoming;
+	int64_t now;
+	int i, j, fdcount;
+	bool stop;
+
+	while(1){
+		pthread_mutex_lock(&w->mutex);
+		incoming = w->incoming;
+		w->incoming = NULL;
+		w->incoming_tail = NULL;
+		stop = w->stop;
+		pthread_mutex_unlock(&w->mutex);
+
+		/* New jobs get a first attempt straight away */
+		while(incoming){
+			job = incoming;
+			incoming = incoming->next;
+			if(stop || tls_pool__step(job)){
+				tls_pool__finish(job);
+			}else{
+				w->active[w->active_count++] = job;
+			}
+		}
+		if(stop){
+			break;
+		}
+
+		w->pollfds[0].fd = w->wake[0];
+		w->pollfds[0].events = POLLIN;
+		w->pollfds[0].revents = 0;
+		for(i=0; i<w->active_count; i++){
+			w->pollfds[i+1].fd = w->active[i]->sock;
+			w->pollfds[i+1].events = w->active[i]->events;
+			w->pollfds[i+1].revents = 0;
+		}
+		fdcount = poll(w->pollfds, (nfds_t)w->active_count+1, 1000);
+		if(fdcount > 0 && w->pollfds[0].revents){
+			tls_pool__drain(w->wake[0]);
+		}
+
+		now = tls_pool__now_ms();
+		j = 0;
+		for(i=0; i<w->active_count; i++){
+			job = w->active[i];
+			if(fdcount > 0 && w->pollfds[i+1].revents){
+				if(tls_pool__step(job)){
+					tls_pool__finish(job);
+					continue;
+				}
+			}
+			if(now - job->start_ms > TLS_POOL_HANDSHAKE_TIMEOUT*1000){
+				job->failed = true;
+				snprintf(job->err, sizeof(job->err), "handshake timed out");
+				tls_pool__finish(job);
+				continue;
+			}
+			w->active[j++] = job;
+		}
+		w->active_count = j;
+	}
+
+	for(i=0; i<w->active_count; i++){
+		w->active[i]->failed = true;
+		tls_pool__finish(w->active[i]);
+	}
+	w->active_count = 0;
+	return NULL;
+}
+
+
+/* ================================================================
+ * Main thread
+ * ================================================================ */
+
+static void tls_pool__dispatch(void)
+{
+	struct tls_pool__job *job;
+	struct tls_pool__worker *w;
+	bool wake;
+	int i, best;
+
+	while(backlog_head){
+		best = -1;
+		for(i=0; i<worker_count; i++){
+			if(workers[i].assigned < workers[i].capacity
+					&& (best == -1 || workers[i].assigned < workers[best].assigned)){
+
+				best = i;
+			}
+		}
+		if(best == -1){
+			/* All slots in use, wait for handshakes to finish */
+			return;
+		}
+
+		job = backlog_head;
+		backlog_head = job->next;
+		if(backlog_head == NULL){
+			backlog_tail = NULL;
+		}
+
+		w = &workers[best];
+		job->worker = best;
+		w->assigned++;
+		stats.in_progress++;
+
+		pthread_mutex_lock(&w->mutex);
+		/* Append, so handshakes are started in the order they arrived */
+		wake = (w->incoming == NULL);
+		job->next = NULL;
+		if(w->incoming_tail){
+			w->incoming_tail->next = job;
+		}else{
+			w->incoming = job;
+		}
+		w->incoming_tail = job;
+		pthread_mutex_unlock(&w->mutex);
+		if(wake){
+			tls_pool__wake(w->wake[1]);
+		}
+	}
+}
+
+
+static void tls_pool__job_free(struct tls_pool__job *job)
+{
+	if(job->ssl){
+		SSL_free(job->ssl);
+	}
+	if(job->sock != INVALID_SOCKET){
+		COMPAT_CLOSE(job->sock);
+	}
+	mosquitto__free(job);
+}
+
+
+static void tls_pool__record_latency(int64_t ms)
+{
+	int i;
+
+	for(i=0; i<TLS_POOL_LATENCY_BUCKETS-1; i++){
+		if(ms <= latency_bounds[i]){
+			break;
+		}
+	}
+	stats.latency[i]++;
+}
+
+
+static int tls_pool__init_failed(int rc)
+{
+	/* Not registered with the listening sockets yet */
+	if(done_pipe[0] != INVALID_SOCKET){
+		close(done_pipe[0]);
+	}
+	tls_pool__cleanup();
+	return rc;
+}
+
+
+static bool tls_pool__listener_suitable(struct mosquitto__listener *listener)
+{
+	/* PSK lookups call in to plugins, so must stay on the main thread */
+	return listener->ssl_ctx != NULL && listener->psk_hint == NULL;
+}
+
+
+int tls_pool__init(void)
+{
+	int i, per_worker, total;
+	bool needed = false;
+
+	if(db.config->tls_handshake_threads <= 0){
+		return MOSQ_ERR_SUCCESS;
+	}
+	for(i=0; i<db.config->listener_count; i++){
+		if(tls_pool__listener_suitable(&db.config->listeners[i])){
+			needed = true;
+			break;
+		}
+	}
+	if(!needed){
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	memset(&stats, 0, sizeof(stats));
+	if(tls_pool__pipe(done_pipe)){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS handshake pool: %s.", strerror(errno));
+		return MOSQ_ERR_ERRNO;
+	}
+
+	worker_count = db.config->tls_handshake_threads;
+	workers = mosquitto__calloc((size_t)worker_count, sizeof(struct tls_pool__worker));
+	if(workers == NULL){
+		worker_count = 0;
+		return tls_pool__init_failed(MOSQ_ERR_NOMEM);
+	}
+
+	total = db.config->max_tls_handshakes;
+	per_worker = (total + worker_count - 1)/worker_count;
+	if(per_worker < 1) per_worker = 1;
+
+	for(i=0; i<worker_count; i++){
+		workers[i].wake[0] = workers[i].wake[1] = INVALID_SOCKET;
+		workers[i].capacity = per_worker;
+		workers[i].active = mosquitto__calloc((size_t)per_worker, sizeof(struct tls_pool__job *));
+		workers[i].pollfds = mosquitto__calloc((size_t)per_worker+1, sizeof(struct pollfd));
+		if(workers[i].active == NULL || workers[i].pollfds == NULL){
+			return tls_pool__init_failed(MOSQ_ERR_NOMEM);
+		}
+		if(tls_pool__pipe(workers[i].wake)){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to create TLS handshake pool: %s.", strerror(errno));
+			return tls_pool__init_failed(MOSQ_ERR_ERRNO);
+		}
+		pthread_mutex_init(&workers[i].mutex, NULL);
+		if(pthread_create(&workers[i].thread, NULL, tls_pool__worker_main, &workers[i])){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to start TLS handshake thread.");
+			pthread_mutex_destroy(&workers[i].mutex);
+			return tls_pool__init_failed(MOSQ_ERR_UNKNOWN);
+		}
+		workers[i].started = true;
+	}
+	log__printf(NULL, MOSQ_LOG_INFO, "Using %d threads for TLS handshakes, with up to %d in progress.",
+			worker_count, per_worker*worker_count);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+mosq_sock_t tls_pool__sock(void)
+{
+	return done_pipe[0];
+}
+
+
+bool tls_pool__wanted(struct mosquitto__listener *listener)
+{
+	return worker_count > 0 && listener && tls_pool__listener_suitable(listener);
+}
+
+
+void tls_pool__add(struct mosquitto__listener *listener, mosq_sock_t sock)
+{
+	struct tls_pool__job *job;
+	BIO *bio;
+
+	job = mosquitto__calloc(1, sizeof(struct tls_pool__job));
+	if(job == NULL){
+		COMPAT_CLOSE(sock);
+		return;
+	}
+	job->listener = listener;
+	job->sock = sock;
+	job->start_ms = tls_pool__now_ms();
+	if(net__socket_get_address(sock, job->address, sizeof(job->address), NULL)){
+		snprintf(job->address, sizeof(job->address), "unknown");
+	}
+
+	job->ssl = SSL_new(listener->ssl_ctx);
+	if(job->ssl == NULL){
+		tls_pool__job_free(job);
+		return;
+	}
+	bio = BIO_new_socket(sock, BIO_NOCLOSE);
+	if(bio == NULL){
+		tls_pool__job_free(job);
+		return;
+	}
+	SSL_set_bio(job->ssl, bio, bio);
+
+	if(backlog_tail){
+		backlog_tail->next = job;
+	}else{
+		backlog_head = job;
+	}
+	backlog_tail = job;
+	stats.pending++;
+
+	tls_pool__dispatch();
+}
+
+
+void tls_pool__process(void)
+{
+	struct tls_pool__job *job, *next;
+	struct mosquitto *context;
+
+	if(worker_count == 0){
+		return;
+	}
+
+	tls_pool__drain(done_pipe[0]);
+	pthread_mutex_lock(&done_mutex);
+	job = done_head;
+	done_head = done_tail = NULL;
+	pthread_mutex_unlock(&done_mutex);
+
+	while(job){
+		next = job->next;
+		workers[job->worker].assigned--;
+		stats.in_progress--;
+		stats.pending--;
+
+		if(job->failed){
+			stats.failed++;
+			if(db.config->connection_messages == true && job->err[0]){
+				log__printf(NULL, MOSQ_LOG_NOTICE, "Client connection from %s failed: %s.", job->address, job->err);
+			}
+			tls_pool__job_free(job);
+		}else{
+			stats.completed++;
+			tls_pool__record_latency(tls_pool__now_ms() - job->start_ms);
+
+			context = net__socket_handshake_done(job->listener, job->sock, job->ssl);
+			if(context){
+				mux__add_in(context);
+			}
+			/* Owned by the context, or already cleaned up */
+			job->sock = INVALID_SOCKET;
+			job->ssl = NULL;
+			tls_pool__job_free(job);
+		}
+		job = next;
+	}
+
+	tls_pool__dispatch();
+}
+
+
+const struct mosquitto__tls_pool_stats *tls_pool__stats(void)
+{
+	return worker_count > 0 ? &stats : NULL;
+}
+
+
+/* Protects broker state that OpenSSL callbacks read during handshakes, and so
+ * may be read from the workers, such as session ticket keys. */
+void tls_pool__lock(void)
+{
+	pthread_mutex_lock(&shared_mutex);
+}
+
+
+void tls_pool__unlock(void)
+{
+	pthread_mutex_unlock(&shared_mutex);
+}
+
+
+/* Stop the workers and drop any handshakes that are still in progress. The
+ * read end of the wakeup pipe is closed along with the listening sockets. */
+void tls_pool__cleanup(void)
+{
+	struct tls_pool__job *job, *next;
+	int i;
+
+	for(i=0; i<worker_count; i++){
+		if(workers[i].started){
+			pthread_mutex_lock(&workers[i].mutex);
+			workers[i].stop = true;
+			pthread_mutex_unlock(&workers[i].mutex);
+			tls_pool__wake(workers[i].wake[1]);
+			pthread_join(workers[i].thread, NULL);
+			pthread_mutex_destroy(&workers[i].mutex);
+		}
+		if(workers[i].wake[0] != INVALID_SOCKET){
+			close(workers[i].wake[0]);
+			close(workers[i].wake[1]);
+		}
+		mosquitto__free(workers[i].active);
+		mosquitto__free(workers[i].pollfds);
+	}
+	mosquitto__free(workers);
+	workers = NULL;
+	worker_count = 0;
+
+	for(job = done_head; job; job = next){
+		next = job->next;
+		tls_pool__job_free(job);
+	}
+	done_head = done_tail = NULL;
+	for(job = backlog_head; job; job = next){
+		next = job->next;
+		tls_pool__job_free(job);
+	}
+	backlog_head = backlog_tail = NULL;
+
+	if(done_pipe[1] != INVALID_SOCKET){
+		close(done_pipe[1]);
+	}
+	done_pipe[0] = done_pipe[1] = INVALID_SOCKET;
+}
+#endif
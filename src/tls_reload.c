@@ -0,0 +1,370 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_TLS
+
+#include <stdio.h>
+#include <string.h>
+#ifdef WITH_TLS_POOL
+#  include <pthread.h>
+#endif
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+
+#ifdef WITH_TLS_POOL
+/* The rest of the broker gets the no-op versions of these from
+ * dummypthread.h. */
+#undef pthread_create
+#undef pthread_join
+#undef pthread_mutex_lock
+#undef pthread_mutex_unlock
+#endif
+
+/* Reloading of listener certificates on the reload signal.
+ *
+ * Reading certificate chains, and in particular large CRLs, can take a long
+ * time. The files are read on a separate thread into standalone OpenSSL
+ * objects, without touching any other broker state. Once the thread has
+ * finished, tls_reload__check() builds a new SSL_CTX for each listener from
+ * those objects in the main loop and swaps it in for new connections. If any
+ * file fails to load, that listener keeps its current certificates.
+ *
+ * Without thread support the files are read in the main loop instead. */
+
+struct tls_reload__item{
+	struct mosquitto__listener *listener;
+	bool load_key;
+	X509 *cert;
+	STACK_OF(X509) *chain;
+	EVP_PKEY *pkey;
+	X509_STORE *store;
+	char err[512];
+};
+
+static struct tls_reload__item *items = NULL;
+static int item_count = 0;
+static bool pending = false;
+#ifdef WITH_TLS_POOL
+static pthread_t thread;
+static pthread_mutex_t done_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool running = false;
+static bool done = false; /* protected by done_mutex */
+#endif
+
+
+static bool tls_reload__error(struct tls_reload__item *item, const char *msg, const char *path)
+{
+	char ssl_err[256];
+	unsigned long e;
+
+	e = ERR_peek_last_error();
+	if(e){
+		ERR_error_string_n(e, ssl_err, sizeof(ssl_err));
+		snprintf(item->err, sizeof(item->err), "%s \"%s\": %s.", msg, path, ssl_err);
+	}else{
+		snprintf(item->err, sizeof(item->err), "%s \"%s\".", msg, path);
+	}
+	ERR_clear_error();
+	return false;
+}
+
+
+static bool tls_reload__load_chain(struct tls_reload__item *item)
+{
+	const char *path = item->listener->certfile;
+	BIO *bio;
+	X509 *x;
+	unsigned long e;
+
+	bio = BIO_new_file(path, "r");
+	if(bio == NULL){
+		return tls_reload__error(item, "Unable to load server certificate", path);
+	}
+	item->cert = PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL);
+	if(item->cert == NULL){
+		BIO_free(bio);
+		return tls_reload__error(item, "Unable to load server certificate", path);
+	}
+	item->chain = sk_X509_new_null();
+	if(item->chain == NULL){
+		BIO_free(bio);
+		return tls_reload__error(item, "Out of memory loading server certificate", path);
+	}
+	while((x = PEM_read_bio_X509(bio, NULL, NULL, NULL)) != NULL){
+		if(!sk_X509_push(item->chain, x)){
+			X509_free(x);
+			BIO_free(bio);
+			return tls_reload__error(item, "Out of memory loading server certificate", path);
+		}
+	}
+	BIO_free(bio);
+
+	/* Reading stops with "no start line" at the end of the file, anything
+	 * else means the chain is damaged. */
+	e = ERR_peek_last_error();
+	if(ERR_GET_LIB(e) == ERR_LIB_PEM && ERR_GET_REASON(e) == PEM_R_NO_START_LINE){
+		ERR_clear_error();
+		return true;
+	}
+	return tls_reload__error(item, "Unable to load server certificate", path);
+}
+
+
+static bool tls_reload__load_key(struct tls_reload__item *item)
+{
+	const char *path = item->listener->keyfile;
+	BIO *bio;
+
+	bio = BIO_new_file(path, "r");
+	if(bio == NULL){
+		return tls_reload__error(item, "Unable to load server key file", path);
+	}
+	item->pkey = PEM_read_bio_PrivateKey(bio, NULL, NULL, NULL);
+	BIO_free(bio);
+	if(item->pkey == NULL){
+		return tls_reload__error(item, "Unable to load server key file", path);
+	}
+	return true;
+}
+
+
+static bool tls_reload__load_store(struct tls_reload__item *item)
+{
+	struct mosquitto__listener *listener = item->listener;
+	X509_LOOKUP *lookup;
+
+	item->store = X509_STORE_new();
+	if(item->store == NULL){
+		return tls_reload__error(item, "Out of memory loading certificates", listener->certfile);
+	}
+#if OPENSSL_VERSION_NUMBER < 0x30000000L
+	if(listener->cafile || listener->capath){
+		if(X509_STORE_load_locations(item->store, listener->cafile, listener->capath) != 1){
+			return tls_reload__error(item, "Unable to load CA certificates. Check cafile/capath",
+					listener->cafile ? listener->cafile : listener->capath);
+		}
+	}
+#else
+	if(listener->cafile){
+		if(X509_STORE_load_file(item->store, listener->cafile) != 1){
+			return tls_reload__error(item, "Unable to load CA certificates. Check cafile", listener->cafile);
+		}
+	}
+	if(listener->capath){
+		if(X509_STORE_load_path(item->store, listener->capath) != 1){
+			return tls_reload__error(item, "Unable to load CA certificates. Check capath", listener->capath);
+		}
+	}
+#endif
+
+	if(listener->crlfile){
+		lookup = X509_STORE_add_lookup(item->store, X509_LOOKUP_file());
+		if(lookup == NULL || X509_load_crl_file(lookup, listener->crlfile, X509_FILETYPE_PEM) < 1){
+			return tls_reload__error(item, "Unable to load certificate revocation file", listener->crlfile);
+		}
+		X509_STORE_set_flags(item->store, X509_V_FLAG_CRL_CHECK);
+	}
+	return true;
+}
+
+
+/* Only uses OpenSSL and the read only listener settings, so can run on the
+ * reload thread. */
+static void tls_reload__load_all(void)
+{
+	int i;
+
+	for(i=0; i<item_count; i++){
+		if(tls_reload__load_chain(&items[i])
+				&& (items[i].load_key == false || tls_reload__load_key(&items[i]))){
+
+			tls_reload__load_store(&items[i]);
+		}
+	}
+}
+
+
+static void tls_reload__free_items(void)
+{
+	int i;
+
+	for(i=0; i<item_count; i++){
+		X509_free(items[i].cert);
+		sk_X509_pop_free(items[i].chain, X509_free);
+		EVP_PKEY_free(items[i].pkey);
+		X509_STORE_free(items[i].store);
+	}
+	mosquitto__free(items);
+	items = NULL;
+	item_count = 0;
+}
+
+
+static void tls_reload__apply(void)
+{
+	struct tls_reload__item *item;
+	int i;
+	int rc;
+
+	for(i=0; i<item_count; i++){
+		item = &items[i];
+
+		if(item->err[0]){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error: %s", item->err);
+			rc = MOSQ_ERR_TLS;
+		}else{
+#if OPENSSL_VERSION_NUMBER >= 0x10100000L
+			if(X509_cmp_current_time(X509_get0_notAfter(item->cert)) < 0){
+				log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Server certificate \"%s\" has expired.",
+						item->listener->certfile);
+			}
+#endif
+			rc = net__tls_ctx_replace(item->listener, item->cert, item->chain, item->pkey, item->store);
+			item->cert = NULL;
+			item->chain = NULL;
+			item->pkey = NULL;
+			item->store = NULL;
+		}
+		if(rc){
+			log__printf(NULL, MOSQ_LOG_ERR, "Error when reloading certificate '%s' or key '%s'.",
+					item->listener->certfile, item->listener->keyfile);
+		}else{
+			log__printf(NULL, MOSQ_LOG_INFO, "Reloaded certificates for listener on port %d.", item->listener->port);
+		}
+	}
+	tls_reload__free_items();
+}
+
+
+#ifdef WITH_TLS_POOL
+static void *tls_reload__thread_main(void *arg)
+{
+	UNUSED(arg);
+
+	tls_reload__load_all();
+
+	pthread_mutex_lock(&done_mutex);
+	done = true;
+	pthread_mutex_unlock(&done_mutex);
+	return NULL;
+}
+#endif
+
+
+/* Start reloading the certificates of all TLS listeners. */
+void tls_reload__start(void)
+{
+	struct mosquitto__listener *listener;
+	int i;
+
+#ifdef WITH_TLS_POOL
+	if(running){
+		/* The files may have changed again since they were read */
+		pending = true;
+		return;
+	}
+#endif
+
+	items = mosquitto__calloc((size_t)db.config->listener_count, sizeof(struct tls_reload__item));
+	if(items == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Out of memory.");
+		return;
+	}
+	item_count = 0;
+	for(i=0; i<db.config->listener_count; i++){
+		listener = &db.config->listeners[i];
+		if(listener->ssl_ctx == NULL || listener->certfile == NULL || listener->keyfile == NULL){
+			continue;
+		}
+#ifdef WITH_WEBSOCKETS
+		if(listener->ws_context){
+			/* libwebsockets owns this SSL_CTX, so update it in place */
+			if(net__load_certificates(listener)){
+				log__printf(NULL, MOSQ_LOG_ERR, "Error when reloading certificate '%s' or key '%s'.",
+						listener->certfile, listener->keyfile);
+			}
+			continue;
+		}
+#endif
+		items[item_count].listener = listener;
+		items[item_count].load_key = (listener->tls_engine == NULL || listener->tls_keyform == mosq_k_pem);
+		item_count++;
+	}
+	if(item_count == 0){
+		tls_reload__free_items();
+		return;
+	}
+
+#ifdef WITH_TLS_POOL
+	done = false;
+	if(pthread_create(&thread, NULL, tls_reload__thread_main, NULL) == 0){
+		running = true;
+		return;
+	}
+	log__printf(NULL, MOSQ_LOG_WARNING, "Warning: Unable to start certificate reload thread, reloading in the main loop.");
+#endif
+	tls_reload__load_all();
+	tls_reload__apply();
+}
+
+
+/* Swap in the certificates once the reload thread has finished loading them. */
+void tls_reload__check(void)
+{
+#ifdef WITH_TLS_POOL
+	bool finished;
+
+	if(running == false) return;
+
+	pthread_mutex_lock(&done_mutex);
+	finished = done;
+	pthread_mutex_unlock(&done_mutex);
+	if(finished == false) return;
+
+	pthread_join(thread, NULL);
+	running = false;
+	tls_reload__apply();
+
+	if(pending){
+		pending = false;
+		tls_reload__start();
+	}
+#endif
+}
+
+
+void tls_reload__cleanup(void)
+{
+#ifdef WITH_TLS_POOL
+	if(running){
+		pthread_join(thread, NULL);
+		running = false;
+	}
+#endif
+	pending = false;
+	tls_reload__free_items();
+}
+#endif
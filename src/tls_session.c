@@ -0,0 +1,322 @@
+/*
+Copyright (c) 2023 Roger Light <roger@atchoo.org>
+
+All rights reserved. This program and the accompanying materials
+are made available under the terms of the Eclipse Public License 2.0
+and Eclipse Distribution License v1.0 which accompany this distribution.
+
+The Eclipse Public License is available at
+   https://www.eclipse.org/legal/epl-2.0/
+and the Eclipse Distribution License is available at
+  http://www.eclipse.org/org/documents/edl-v10.php.
+
+SPDX-License-Identifier: EPL-2.0 OR BSD-3-Clause
+
+Contributors:
+   Roger Light - initial implementation and documentation.
+*/
+
+#include "config.h"
+
+#ifdef WITH_TLS
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <openssl/rand.h>
+#include <openssl/ssl.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#  include <openssl/core_names.h>
+#endif
+
+#include "mosquitto_broker_internal.h"
+#include "memory_mosq.h"
+#include "misc_mosq.h"
+
+/* TLS session resumption for listeners.
+ *
+ * The server side session cache is sized and timed out per listener. Session
+ * tickets can be encrypted with keys read from tls_ticket_key_file, so that
+ * tickets stay valid across broker restarts and are accepted by every
+ * listener or broker that shares the file. The file holds one or more 80 byte
+ * keys, each made up of a 16 byte name, a 32 byte HMAC-SHA256 secret and a 32
+ * byte AES-256 key. New tickets are issued with the first key. Tickets issued
+ * with any of the other keys are still accepted, and the client is given a
+ * new ticket. Keys are rotated by rewriting the file, which is read again on
+ * the reload signal or when its modification time changes. */
+
+#define TICKET_KEY_NAME_LEN 16
+#define TICKET_KEY_SECRET_LEN 32
+#define TICKET_KEY_LEN (TICKET_KEY_NAME_LEN + 2*TICKET_KEY_SECRET_LEN)
+#define TICKET_KEY_MAX 16
+#define TICKET_KEY_CHECK_INTERVAL 60
+
+struct tls_session__key{
+	unsigned char name[TICKET_KEY_NAME_LEN];
+	unsigned char hmac_key[TICKET_KEY_SECRET_LEN];
+	unsigned char aes_key[TICKET_KEY_SECRET_LEN];
+};
+
+struct mosquitto__tls_ticket_keys{
+	struct tls_session__key keys[TICKET_KEY_MAX];
+	int count;
+	time_t mtime;
+};
+
+static int ctx_ex_index = -1;
+static time_t last_keys_check = 0;
+
+
+static void tls_session__keys_free(struct mosquitto__tls_ticket_keys *keys)
+{
+	if(keys){
+		OPENSSL_cleanse(keys, sizeof(struct mosquitto__tls_ticket_keys));
+		mosquitto__free(keys);
+	}
+}
+
+
+static int tls_session__keys_read(const char *path, struct mosquitto__tls_ticket_keys **keys_out)
+{
+	struct mosquitto__tls_ticket_keys *keys;
+	unsigned char buf[TICKET_KEY_LEN*TICKET_KEY_MAX + 1];
+	struct stat statbuf;
+	FILE *fptr;
+	size_t len;
+	int i;
+
+	fptr = mosquitto__fopen(path, "rb", true);
+	if(fptr == NULL){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to open tls_ticket_key_file \"%s\": %s.", path, strerror(errno));
+		return MOSQ_ERR_TLS;
+	}
+	if(fstat(fileno(fptr), &statbuf) < 0){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: Unable to read tls_ticket_key_file \"%s\": %s.", path, strerror(errno));
+		fclose(fptr);
+		return MOSQ_ERR_TLS;
+	}
+	len = fread(buf, 1, sizeof(buf), fptr);
+	fclose(fptr);
+
+	if(len == 0 || len % TICKET_KEY_LEN || len > TICKET_KEY_LEN*TICKET_KEY_MAX){
+		log__printf(NULL, MOSQ_LOG_ERR, "Error: tls_ticket_key_file \"%s\" must contain between 1 and %d keys of %d bytes each.",
+				path, TICKET_KEY_MAX, TICKET_KEY_LEN);
+		OPENSSL_cleanse(buf, sizeof(buf));
+		return MOSQ_ERR_TLS;
+	}
+
+	keys = mosquitto__calloc(1, sizeof(struct mosquitto__tls_ticket_keys));
+	if(keys == NULL){
+		OPENSSL_cleanse(buf, sizeof(buf));
+		return MOSQ_ERR_NOMEM;
+	}
+	keys->count = (int)(len / TICKET_KEY_LEN);
+	for(i=0; i<keys->count; i++){
+		memcpy(keys->keys[i].name, &buf[i*TICKET_KEY_LEN], TICKET_KEY_NAME_LEN);
+		memcpy(keys->keys[i].hmac_key, &buf[i*TICKET_KEY_LEN + TICKET_KEY_NAME_LEN], TICKET_KEY_SECRET_LEN);
+		memcpy(keys->keys[i].aes_key, &buf[i*TICKET_KEY_LEN + TICKET_KEY_NAME_LEN + TICKET_KEY_SECRET_LEN], TICKET_KEY_SECRET_LEN);
+	}
+	keys->mtime = statbuf.st_mtime;
+	OPENSSL_cleanse(buf, sizeof(buf));
+
+	*keys_out = keys;
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Copy out the key used for new tickets if name is NULL, or the key with the
+ * given name. May be called from TLS handshake threads. */
+static bool tls_session__key_get(SSL *ssl, const unsigned char *name, struct tls_session__key *key, bool *current)
+{
+	struct mosquitto__listener *listener;
+	struct mosquitto__tls_ticket_keys *keys;
+	bool found = false;
+	int i;
+
+	listener = SSL_CTX_get_ex_data(SSL_get_SSL_CTX(ssl), ctx_ex_index);
+	if(listener == NULL) return false;
+
+#ifdef WITH_TLS_POOL
+	tls_pool__lock();
+#endif
+	keys = listener->ticket_keys;
+	if(keys){
+		for(i=0; i<keys->count; i++){
+			if(name == NULL || !memcmp(name, keys->keys[i].name, TICKET_KEY_NAME_LEN)){
+				memcpy(key, &keys->keys[i], sizeof(struct tls_session__key));
+				*current = (i == 0);
+				found = true;
+				break;
+			}
+		}
+	}
+#ifdef WITH_TLS_POOL
+	tls_pool__unlock();
+#endif
+	return found;
+}
+
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int tls_session__ticket_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, EVP_MAC_CTX *hctx, int enc)
+#else
+static int tls_session__ticket_cb(SSL *ssl, unsigned char *key_name, unsigned char *iv,
+		EVP_CIPHER_CTX *cctx, HMAC_CTX *hctx, int enc)
+#endif
+{
+	struct tls_session__key key;
+	bool current = false;
+	int rc;
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	OSSL_PARAM params[3];
+#endif
+
+	if(enc){
+		if(!tls_session__key_get(ssl, NULL, &key, &current)){
+			return 0; /* Don't issue a ticket */
+		}
+		memcpy(key_name, key.name, TICKET_KEY_NAME_LEN);
+		if(RAND_bytes(iv, EVP_CIPHER_iv_length(EVP_aes_256_cbc())) != 1
+				|| EVP_EncryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1){
+
+			OPENSSL_cleanse(&key, sizeof(key));
+			return -1;
+		}
+		rc = 1;
+	}else{
+		if(!tls_session__key_get(ssl, key_name, &key, &current)){
+			return 0; /* Unknown or retired key, carry out a full handshake */
+		}
+		if(EVP_DecryptInit_ex(cctx, EVP_aes_256_cbc(), NULL, key.aes_key, iv) != 1){
+			OPENSSL_cleanse(&key, sizeof(key));
+			return -1;
+		}
+		/* Tickets from older keys are accepted, but replaced */
+		rc = current ? 1 : 2;
+	}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	params[0] = OSSL_PARAM_construct_octet_string(OSSL_MAC_PARAM_KEY, key.hmac_key, TICKET_KEY_SECRET_LEN);
+	params[1] = OSSL_PARAM_construct_utf8_string(OSSL_MAC_PARAM_DIGEST, (char *)"SHA256", 0);
+	params[2] = OSSL_PARAM_construct_end();
+	if(EVP_MAC_CTX_set_params(hctx, params) != 1){
+		rc = -1;
+	}
+#else
+	if(HMAC_Init_ex(hctx, key.hmac_key, TICKET_KEY_SECRET_LEN, EVP_sha256(), NULL) != 1){
+		rc = -1;
+	}
+#endif
+	OPENSSL_cleanse(&key, sizeof(key));
+	return rc;
+}
+
+
+/* Apply the session resumption settings of a listener to its new SSL_CTX. */
+int tls_session__ctx_init(struct mosquitto__listener *listener)
+{
+	int rc;
+
+	if(listener->tls_session_cache_size == 0){
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_OFF);
+	}else{
+		SSL_CTX_set_session_cache_mode(listener->ssl_ctx, SSL_SESS_CACHE_SERVER);
+		if(listener->tls_session_cache_size > 0){
+			SSL_CTX_sess_set_cache_size(listener->ssl_ctx, listener->tls_session_cache_size);
+		}
+	}
+	if(listener->tls_session_timeout > 0){
+		SSL_CTX_set_timeout(listener->ssl_ctx, listener->tls_session_timeout);
+	}
+
+	if(listener->tls_session_tickets == false){
+		SSL_CTX_set_options(listener->ssl_ctx, SSL_OP_NO_TICKET);
+		if(listener->tls_ticket_key_file){
+			log__printf(NULL, MOSQ_LOG_WARNING, "Warning: tls_ticket_key_file has no effect with tls_session_tickets false.");
+		}
+		return MOSQ_ERR_SUCCESS;
+	}
+	if(listener->tls_ticket_key_file == NULL){
+		/* OpenSSL generates its own ticket keys for this context */
+		return MOSQ_ERR_SUCCESS;
+	}
+
+	if(ctx_ex_index == -1){
+		ctx_ex_index = SSL_CTX_get_ex_new_index(0, NULL, NULL, NULL, NULL);
+		if(ctx_ex_index == -1){
+			return MOSQ_ERR_TLS;
+		}
+	}
+	if(listener->ticket_keys == NULL){
+		rc = tls_session__keys_read(listener->tls_ticket_key_file, &listener->ticket_keys);
+		if(rc) return rc;
+	}
+	SSL_CTX_set_ex_data(listener->ssl_ctx, ctx_ex_index, listener);
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+	SSL_CTX_set_tlsext_ticket_key_evp_cb(listener->ssl_ctx, tls_session__ticket_cb);
+#else
+	SSL_CTX_set_tlsext_ticket_key_cb(listener->ssl_ctx, tls_session__ticket_cb);
+#endif
+
+	return MOSQ_ERR_SUCCESS;
+}
+
+
+/* Read ticket key files again if they have changed, or unconditionally if
+ * force is set. A file that can't be read leaves the current keys in use. */
+void tls_session__keys_check(bool force)
+{
+	struct mosquitto__listener *listener;
+	struct mosquitto__tls_ticket_keys *keys, *old_keys;
+	struct stat statbuf;
+	int i;
+
+	if(force == false){
+		if(last_keys_check + TICKET_KEY_CHECK_INTERVAL > db.now_s){
+			return;
+		}
+	}
+	last_keys_check = db.now_s;
+
+	for(i=0; i<db.config->listener_count; i++){
+		listener = &db.config->listeners[i];
+		if(listener->ticket_keys == NULL){
+			continue;
+		}
+		if(force == false){
+			if(stat(listener->tls_ticket_key_file, &statbuf) < 0
+					|| statbuf.st_mtime == listener->ticket_keys->mtime){
+
+				continue;
+			}
+		}
+		if(tls_session__keys_read(listener->tls_ticket_key_file, &keys)){
+			continue;
+		}
+
+#ifdef WITH_TLS_POOL
+		tls_pool__lock();
+#endif
+		old_keys = listener->ticket_keys;
+		listener->ticket_keys = keys;
+#ifdef WITH_TLS_POOL
+		tls_pool__unlock();
+#endif
+		tls_session__keys_free(old_keys);
+		log__printf(NULL, MOSQ_LOG_INFO, "Loaded %d TLS session ticket key%s from \"%s\".",
+				keys->count, keys->count == 1 ? "" : "s", listener->tls_ticket_key_file);
+	}
+}
+
+
+void tls_session__cleanup(struct mosquitto__listener *listener)
+{
+	tls_session__keys_free(listener->ticket_keys);
+	listener->ticket_keys = NULL;
+}
+#endif
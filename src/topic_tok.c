@@ -30,89 +30,86 @@ Contributors:
 #include "utlist.h"
 
 
-static char *strtok_hier(char *str, char **saveptr)
+/* Split a topic or subscription into its levels. The tokens point into the
+ * original string, which must outlive them, so no copy of the topic is made.
+ * Topics with up to SUB__TOKENS_STACK levels are held in the sub__tokens
+ * struct itself, which is normally on the caller's stack. Deeper topics need
+ * an allocated array, so sub__topic_tokens_free() must always be called after
+ * a successful call. */
+int sub__topic_tokenise(const char *subtopic, struct sub__tokens *tokens)
 {
-	char *c;
-
-	if(str != NULL){
-		*saveptr = str;
-	}
-
-	if(*saveptr == NULL){
-		return NULL;
-	}
-
-	c = strchr(*saveptr, '/');
-	if(c){
-		str = *saveptr;
-		*saveptr = c+1;
-		c[0] = '\0';
-	}else if(*saveptr){
-		/* No match, but surplus string */
-		str = *saveptr;
-		*saveptr = NULL;
-	}
-	return str;
-}
-
-
-int sub__topic_tokenise(const char *subtopic, char **local_sub, char ***topics, const char **sharename)
-{
-	char *saveptr = NULL;
-	char *token;
+	const char *start, *end;
 	int count;
-	int topic_index = 0;
-	int i;
 	size_t len;
 
+	tokens->tokens = tokens->stack_tokens;
+	tokens->count = 0;
+	tokens->sharename.topic = NULL;
+	tokens->sharename.topic_len = 0;
+
 	len = strlen(subtopic);
-	if(len == 0){
+	if(len == 0 || len > UINT16_MAX){
 		return MOSQ_ERR_INVAL;
 	}
 
-	*local_sub = mosquitto__strdup(subtopic);
-	if((*local_sub) == NULL) return MOSQ_ERR_NOMEM;
-
-	count = 0;
-	saveptr = *local_sub;
-	while(saveptr){
-		saveptr = strchr(&saveptr[1], '/');
+	/* One token per level, plus the empty root for topics not starting with $ */
+	count = 2;
+	end = strchr(subtopic, '/');
+	while(end){
 		count++;
+		end = strchr(&end[1], '/');
 	}
-	*topics = mosquitto__calloc((size_t)(count+3) /* 3=$shared,sharename,NULL */, sizeof(char *));
-	if((*topics) == NULL){
-		mosquitto__free(*local_sub);
-		return MOSQ_ERR_NOMEM;
+	if(count > SUB__TOKENS_STACK){
+		tokens->tokens = mosquitto__malloc((size_t)count * sizeof(struct sub__token));
+		if(tokens->tokens == NULL){
+			tokens->tokens = tokens->stack_tokens;
+			return MOSQ_ERR_NOMEM;
+		}
 	}
 
-	if((*local_sub)[0] != '$'){
-		(*topics)[topic_index] = "";
-		topic_index++;
+	if(subtopic[0] != '$'){
+		tokens->tokens[0].topic = "";
+		tokens->tokens[0].topic_len = 0;
+		tokens->count++;
 	}
 
-	token = strtok_hier((*local_sub), &saveptr);
-	while(token){
-		(*topics)[topic_index] = token;
-		topic_index++;
-		token = strtok_hier(NULL, &saveptr);
+	start = subtopic;
+	while(1){
+		end = strchr(start, '/');
+		if(end == NULL){
+			end = &subtopic[len];
+		}
+		tokens->tokens[tokens->count].topic = start;
+		tokens->tokens[tokens->count].topic_len = (uint16_t)(end - start);
+		tokens->count++;
+		if(end[0] == '\0') break;
+		start = &end[1];
 	}
 
-	if(!strcmp((*topics)[0], "$share")){
-		if(count < 2){
-			mosquitto__free(*local_sub);
-			mosquitto__free(*topics);
-			return MOSQ_ERR_PROTOCOL;
-		}
+	if(tokens->tokens[0].topic_len == strlen("$share")
+			&& !strncmp(tokens->tokens[0].topic, "$share", strlen("$share"))){
 
-		if(sharename){
-			(*sharename) = (*topics)[1];
+		if(tokens->count < 2){
+			sub__topic_tokens_free(tokens);
+			return MOSQ_ERR_PROTOCOL;
 		}
 
-		for(i=1; i<count-1; i++){
-			(*topics)[i] = (*topics)[i+1];
-		}
-		(*topics)[0] = "";
-		(*topics)[count-1] = NULL;
+		/* $share/<sharename>/<filter> becomes <root>/<filter> */
+		tokens->sharename = tokens->tokens[1];
+		memmove(&tokens->tokens[1], &tokens->tokens[2], (size_t)(tokens->count-2) * sizeof(struct sub__token));
+		tokens->tokens[0].topic = "";
+		tokens->tokens[0].topic_len = 0;
+		tokens->count--;
 	}
 	return MOSQ_ERR_SUCCESS;
 }
+
+
+void sub__topic_tokens_free(struct sub__tokens *tokens)
+{
+	if(tokens->tokens != tokens->stack_tokens){
+		mosquitto__free(tokens->tokens);
+	}
+	tokens->tokens = tokens->stack_tokens;
+	tokens->count = 0;
+}
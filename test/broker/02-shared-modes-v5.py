@@ -0,0 +1,215 @@
+#!/usr/bin/env python3
+
+# Does each shared_subscription_mode choose the expected member of a shared
+# subscription?
+#
+# round_robin with shared_subscription_max_queued: a disconnected member
+# stops receiving messages once it has the maximum queued.
+# least_loaded: a member that doesn't acknowledge its messages only receives
+# a message when it is no busier than the others.
+# hash_topic: each topic always goes to the same member.
+# hash_property: each value of the property always goes to the same member,
+# and messages without the property are shared out in turn.
+
+from mosq_test_helper import *
+import select
+
+def write_config(filename, port, options):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        for option in options:
+            f.write("%s\n" % (option))
+
+
+def connect_member(port, client_id, qos, clean_start=True, connack_flags=0):
+    properties = b""
+    if clean_start == False:
+        properties = mqtt5_props.gen_uint32_prop(mqtt5_props.PROP_SESSION_EXPIRY_INTERVAL, 100)
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=60, clean_session=clean_start, proto_ver=5, properties=properties)
+    connack_packet = mosq_test.gen_connack(rc=0, flags=connack_flags, proto_ver=5)
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    if connack_flags == 0:
+        subscribe_packet = mosq_test.gen_subscribe(1, "$share/group/shared/#", qos, proto_ver=5)
+        suback_packet = mosq_test.gen_suback(1, qos, proto_ver=5)
+        mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    return sock
+
+
+def recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        r = sock.recv(n - len(data))
+        if len(r) == 0:
+            raise mosq_test.TestError
+        data += r
+    return data
+
+
+# Read QoS 0 PUBLISH packets from whichever members they arrive at, and
+# return (member, topic, user property value, payload) for each
+def recv_publishes(socks, count):
+    received = []
+    while len(received) < count:
+        (readable, _, _) = select.select(socks, [], [], 5)
+        if len(readable) == 0:
+            print("FAIL: Only received %d of %d messages" % (len(received), count))
+            raise mosq_test.TestError
+        for sock in readable:
+            if recv_exact(sock, 1) != b"\x30":
+                raise mosq_test.TestError
+            rl, _ = mosq_test.read_varint(sock, 0)
+            packet = recv_exact(sock, rl)
+            tlen, = struct.unpack("!H", packet[0:2])
+            topic = packet[2:2+tlen].decode('utf-8')
+            proplen = packet[2+tlen]
+            props = packet[3+tlen:3+tlen+proplen]
+            value = None
+            if len(props) > 0:
+                # A single user property
+                nlen, = struct.unpack("!H", props[1:3])
+                vlen, = struct.unpack("!H", props[3+nlen:5+nlen])
+                value = props[5+nlen:5+nlen+vlen].decode('utf-8')
+            received.append((socks.index(sock), topic, value, packet[3+tlen+proplen:]))
+    return received
+
+
+# Every key must have gone to a single member
+def check_pinned(received, key_index):
+    members = {}
+    for r in received:
+        key = r[key_index]
+        if members.setdefault(key, r[0]) != r[0]:
+            print("FAIL: %s sent to members %d and %d" % (key, members[key], r[0]))
+            raise mosq_test.TestError
+
+
+def do_test(options, test_function):
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port, options)
+
+    rc = 1
+    pub_connect_packet = mosq_test.gen_connect("shared-pub", keepalive=60, proto_ver=5)
+    pub_connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        pub = mosq_test.do_client_connect(pub_connect_packet, pub_connack_packet, port=port)
+        test_function(port, pub)
+        pub.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+def publish_qos1(pub, mid, payload):
+    publish_packet = mosq_test.gen_publish("shared/test", qos=1, mid=mid, payload=payload, proto_ver=5)
+    puback_packet = mosq_test.gen_puback(mid, proto_ver=5)
+    mosq_test.do_send_receive(pub, publish_packet, puback_packet, "puback %d" % (mid))
+
+
+def round_robin_max_queued_test(port, pub):
+    sock_a = connect_member(port, "member-a", 1)
+    sock_b = connect_member(port, "member-b", 1, clean_start=False)
+    sock_b.close()
+
+    # a, b, a, b, a, then b is skipped as it has two messages queued
+    for mid in range(1, 7):
+        publish_qos1(pub, mid, "message%d" % (mid))
+    for (mid, payload) in [(1, "message1"), (2, "message3"), (3, "message5"), (4, "message6")]:
+        publish_packet = mosq_test.gen_publish("shared/test", qos=1, mid=mid, payload=payload, proto_ver=5)
+        mosq_test.expect_packet(sock_a, "member a " + payload, publish_packet)
+        sock_a.send(mosq_test.gen_puback(mid, proto_ver=5))
+    mosq_test.do_ping(sock_a)
+
+    sock_b = connect_member(port, "member-b", 1, clean_start=False, connack_flags=1)
+    for (mid, payload) in [(1, "message2"), (2, "message4")]:
+        publish_packet = mosq_test.gen_publish("shared/test", qos=1, mid=mid, payload=payload, proto_ver=5)
+        mosq_test.expect_packet(sock_b, "member b " + payload, publish_packet)
+        sock_b.send(mosq_test.gen_puback(mid, proto_ver=5))
+    mosq_test.do_ping(sock_b)
+
+    sock_a.close()
+    sock_b.close()
+
+
+def least_loaded_test(port, pub):
+    sock_a = connect_member(port, "member-a", 1)
+    sock_b = connect_member(port, "member-b", 1)
+
+    # Both are idle, so the first message goes to a, which never
+    # acknowledges it. b is then always less busy.
+    publish_qos1(pub, 1, "message1")
+    publish_packet = mosq_test.gen_publish("shared/test", qos=1, mid=1, payload="message1", proto_ver=5)
+    mosq_test.expect_packet(sock_a, "member a message1", publish_packet)
+
+    for mid in range(2, 6):
+        payload = "message%d" % (mid)
+        publish_qos1(pub, mid, payload)
+        publish_packet = mosq_test.gen_publish("shared/test", qos=1, mid=mid-1, payload=payload, proto_ver=5)
+        mosq_test.expect_packet(sock_b, "member b " + payload, publish_packet)
+        sock_b.send(mosq_test.gen_puback(mid-1, proto_ver=5))
+        # Make sure the PUBACK has been handled before the next publish
+        mosq_test.do_ping(sock_b)
+    mosq_test.do_ping(sock_a)
+
+    sock_a.close()
+    sock_b.close()
+
+
+def hash_topic_test(port, pub):
+    socks = []
+    for i in range(0, 3):
+        socks.append(connect_member(port, "member-%d" % (i), 0))
+
+    for j in range(0, 2):
+        for i in range(0, 10):
+            pub.send(mosq_test.gen_publish("shared/%d" % (i), qos=0, payload="message", proto_ver=5))
+    received = recv_publishes(socks, 20)
+    check_pinned(received, 1)
+
+    for sock in socks:
+        mosq_test.do_ping(sock)
+        sock.close()
+
+
+def hash_property_test(port, pub):
+    socks = []
+    for i in range(0, 3):
+        socks.append(connect_member(port, "member-%d" % (i), 0))
+
+    for j in range(0, 2):
+        for i in range(0, 10):
+            properties = mqtt5_props.gen_string_pair_prop(mqtt5_props.PROP_USER_PROPERTY, "device", "device%d" % (i))
+            pub.send(mosq_test.gen_publish("shared/%d" % (j*10 + i), qos=0, payload="message", proto_ver=5, properties=properties))
+    received = recv_publishes(socks, 20)
+    check_pinned(received, 2)
+
+    # Without the property, each member in turn
+    for i in range(0, 3):
+        pub.send(mosq_test.gen_publish("shared/test", qos=0, payload="turn%d" % (i), proto_ver=5))
+    received = recv_publishes(socks, 3)
+    if sorted(r[0] for r in received) != [0, 1, 2]:
+        print("FAIL: Messages without the property not shared out in turn: %s" % (received))
+        raise mosq_test.TestError
+
+    for sock in socks:
+        mosq_test.do_ping(sock)
+        sock.close()
+
+
+do_test(["shared_subscription_max_queued 2"], round_robin_max_queued_test)
+do_test(["shared_subscription_mode least_loaded"], least_loaded_test)
+do_test(["shared_subscription_mode hash_topic"], hash_topic_test)
+do_test(["shared_subscription_mode hash_property", "shared_subscription_hash_property device"], hash_property_test)
+exit(0)
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+
+# Test whether the broker assigns topic aliases to outgoing publishes
+# MQTT v5
+#
+# Are aliases only used up to the smaller of the client's Topic Alias Maximum
+# and max_topic_alias_broker, is the least recently used alias reassigned
+# once they are all in use, and are aliases not used when either side has
+# set its maximum to 0? Are aliases forgotten when the client reconnects, so
+# that a message sent again carries its full topic?
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2, port3):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("max_topic_alias_broker 2\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port3))
+        f.write("allow_anonymous true\n")
+        f.write("max_topic_alias_broker 0\n")
+
+
+def alias_publish(topic, alias, payload):
+    props = b""
+    if alias:
+        props = mqtt5_props.gen_uint16_prop(mqtt5_props.PROP_TOPIC_ALIAS, alias)
+    return mosq_test.gen_publish(topic, qos=0, payload=payload, proto_ver=5, properties=props)
+
+
+# Publish each topic in turn, and check it arrives with the expected topic
+# and alias
+def check_aliases(port, client_id, alias_maximum, expected):
+    props = b""
+    if alias_maximum:
+        props = mqtt5_props.gen_uint16_prop(mqtt5_props.PROP_TOPIC_ALIAS_MAXIMUM, alias_maximum)
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=60, proto_ver=5, properties=props)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "alias/#", 0, proto_ver=5)
+    suback_packet = mosq_test.gen_suback(mid, 0, proto_ver=5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+
+    for (i, (topic, recv_topic, alias)) in enumerate(expected):
+        payload = "message%d" % (i)
+        sock.send(mosq_test.gen_publish(topic, qos=0, payload=payload, proto_ver=5))
+        mosq_test.expect_packet(sock, "%s %s" % (client_id, payload), alias_publish(recv_topic, alias, payload))
+    mosq_test.do_ping(sock)
+    sock.close()
+
+
+def check_resend(port):
+    props = mqtt5_props.gen_uint16_prop(mqtt5_props.PROP_TOPIC_ALIAS_MAXIMUM, 2) \
+        + mqtt5_props.gen_uint32_prop(mqtt5_props.PROP_SESSION_EXPIRY_INTERVAL, 100)
+    connect_packet = mosq_test.gen_connect("alias-resend", keepalive=60, clean_session=False, proto_ver=5, properties=props)
+    connack1_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+    connack2_packet = mosq_test.gen_connack(rc=0, flags=1, proto_ver=5)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "alias/#", 1, proto_ver=5)
+    suback_packet = mosq_test.gen_suback(mid, 1, proto_ver=5)
+
+    mid = 5
+    publish_packet = mosq_test.gen_publish("alias/a", qos=1, mid=mid, payload="message", proto_ver=5)
+    puback_packet = mosq_test.gen_puback(mid, proto_ver=5)
+
+    props = mqtt5_props.gen_uint16_prop(mqtt5_props.PROP_TOPIC_ALIAS, 1)
+    mid = 1
+    publish_recv_packet = mosq_test.gen_publish("alias/a", qos=1, mid=mid, payload="message", proto_ver=5, properties=props)
+    publish_dup_packet = mosq_test.gen_publish("alias/a", qos=1, mid=mid, payload="message", dup=True, proto_ver=5, properties=props)
+    puback_recv_packet = mosq_test.gen_puback(mid, proto_ver=5)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack1_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+    sock.send(publish_packet)
+    mosq_test.expect_packet(sock, "publish", publish_recv_packet)
+    mosq_test.expect_packet(sock, "puback", puback_packet)
+    sock.close()
+
+    sock = mosq_test.do_client_connect(connect_packet, connack2_packet, port=port)
+    mosq_test.expect_packet(sock, "publish dup", publish_dup_packet)
+    sock.send(puback_recv_packet)
+    sock.send(mosq_test.gen_publish("alias/a", qos=0, payload="message", proto_ver=5))
+    mosq_test.expect_packet(sock, "publish alias", alias_publish("", 1, "message"))
+    mosq_test.do_ping(sock)
+    sock.close()
+
+
+def do_test():
+    (port1, port2, port3) = mosq_test.get_port(3)
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port1, port2, port3)
+
+    rc = 1
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port1)
+
+    try:
+        # Limited by the client
+        check_aliases(port1, "alias-client-limit", 2, [
+            ("alias/a", "alias/a", 1),
+            ("alias/b", "alias/b", 2),
+            ("alias/a", "", 1),
+            ("alias/c", "alias/c", 2), # b is least recently used
+            ("alias/a", "", 1),
+            ("alias/b", "alias/b", 2), # c is least recently used
+            ("alias/c", "alias/c", 1)])
+
+        # Limited by the broker
+        check_aliases(port2, "alias-broker-limit", 10, [
+            ("alias/a", "alias/a", 1),
+            ("alias/b", "alias/b", 2),
+            ("alias/c", "alias/c", 1), # a is least recently used
+            ("alias/b", "", 2),
+            ("alias/c", "", 1)])
+
+        # No aliases from either side
+        check_aliases(port1, "alias-client-none", 0, [
+            ("alias/a", "alias/a", 0),
+            ("alias/a", "alias/a", 0)])
+        check_aliases(port3, "alias-broker-none", 10, [
+            ("alias/a", "alias/a", 0),
+            ("alias/a", "alias/a", 0)])
+
+        check_resend(port1)
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+do_test()
+exit(0)
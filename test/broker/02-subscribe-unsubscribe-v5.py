@@ -0,0 +1,205 @@
+#!/usr/bin/env python3
+
+# Each client subscription points at its entry in the subscription tree. Is
+# the right entry removed or replaced when:
+# - one of many clients subscribed to a topic unsubscribes
+# - a client subscribes again to the same topic with a different QoS and
+#   subscription identifier
+# - a client has a normal and a shared subscription on the same topic and
+#   unsubscribes from only one of them
+# - a client reconnects with clean start and its old session is removed
+# - a session is taken over by a new connection
+# MQTT v5
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+
+
+def connect_client(port, client_id, clean_start=True, connack_flags=0):
+    properties = b""
+    if clean_start == False:
+        properties = mqtt5_props.gen_uint32_prop(mqtt5_props.PROP_SESSION_EXPIRY_INTERVAL, 100)
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=60, clean_session=clean_start, proto_ver=5, properties=properties)
+    connack_packet = mosq_test.gen_connack(rc=0, flags=connack_flags, proto_ver=5)
+    return mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+
+
+def subscribe(sock, topic, qos, properties=b""):
+    subscribe_packet = mosq_test.gen_subscribe(1, topic, qos, proto_ver=5, properties=properties)
+    suback_packet = mosq_test.gen_suback(1, qos, proto_ver=5)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback %s" % (topic))
+
+
+def unsubscribe(sock, topic, reason_code=0):
+    unsubscribe_packet = mosq_test.gen_unsubscribe(2, topic, proto_ver=5)
+    unsuback_packet = mosq_test.gen_unsuback(2, reason_code=reason_code, proto_ver=5)
+    mosq_test.do_send_receive(sock, unsubscribe_packet, unsuback_packet, "unsuback %s" % (topic))
+
+
+# Publish a message, and make sure the broker has handled it before going on
+def publish(pub, payload, qos=0):
+    if qos == 0:
+        pub.send(mosq_test.gen_publish("leaf/test", qos=0, payload=payload, proto_ver=5))
+        mosq_test.do_ping(pub)
+    else:
+        publish_packet = mosq_test.gen_publish("leaf/test", qos=1, mid=1, payload=payload, proto_ver=5)
+        puback_packet = mosq_test.gen_puback(1, proto_ver=5)
+        mosq_test.do_send_receive(pub, publish_packet, puback_packet, "puback " + payload)
+
+
+# Each client must receive the message exactly once
+def expect_once(socks, payload, qos=0, mid=0, properties=b""):
+    publish_packet = mosq_test.gen_publish("leaf/test", qos=qos, mid=mid, payload=payload, proto_ver=5, properties=properties)
+    for sock in socks:
+        mosq_test.expect_packet(sock, payload, publish_packet)
+        if qos == 1:
+            sock.send(mosq_test.gen_puback(mid, proto_ver=5))
+        mosq_test.do_ping(sock)
+
+
+def many_clients_test(port, pub):
+    socks = []
+    for i in range(0, 5):
+        socks.append(connect_client(port, "leaf-many-%d" % (i)))
+        subscribe(socks[i], "leaf/#", 0)
+
+    unsubscribe(socks[2], "leaf/#")
+    # Nothing left to remove
+    unsubscribe(socks[2], "leaf/#", mqtt5_rc.MQTT_RC_NO_SUBSCRIPTION_EXISTED)
+
+    publish(pub, "many")
+    expect_once(socks[0:2] + socks[3:5], "many")
+    # A ping response only, not the message
+    mosq_test.do_ping(socks[2])
+
+    # Subscribing again works as before
+    subscribe(socks[2], "leaf/#", 0)
+    publish(pub, "many again")
+    expect_once(socks, "many again")
+
+    for sock in socks:
+        sock.close()
+
+
+def resubscribe_test(port, pub):
+    sock = connect_client(port, "leaf-resubscribe")
+    subscribe(sock, "leaf/#", 0)
+    props = mqtt5_props.gen_varint_prop(mqtt5_props.PROP_SUBSCRIPTION_IDENTIFIER, 5)
+    subscribe(sock, "leaf/#", 1, properties=props)
+
+    # The second subscription replaces the first
+    publish(pub, "resubscribe", qos=1)
+    expect_once([sock], "resubscribe", qos=1, mid=1, properties=props)
+
+    unsubscribe(sock, "leaf/#")
+    publish(pub, "resubscribe gone")
+    mosq_test.do_ping(sock)
+    sock.close()
+
+
+def shared_test(port, pub):
+    sock = connect_client(port, "leaf-shared")
+    subscribe(sock, "leaf/#", 0)
+    subscribe(sock, "$share/group/leaf/#", 0)
+
+    # The shared subscription is kept when the normal one is removed...
+    unsubscribe(sock, "leaf/#")
+    publish(pub, "shared")
+    expect_once([sock], "shared")
+
+    # ...and the other way round
+    subscribe(sock, "leaf/#", 0)
+    unsubscribe(sock, "$share/group/leaf/#")
+    publish(pub, "normal")
+    expect_once([sock], "normal")
+
+    unsubscribe(sock, "leaf/#")
+    publish(pub, "none")
+    mosq_test.do_ping(sock)
+    sock.close()
+
+
+def clean_start_test(port, pub):
+    other = connect_client(port, "leaf-clean-other")
+    subscribe(other, "leaf/#", 0)
+
+    sock = connect_client(port, "leaf-clean", clean_start=False)
+    subscribe(sock, "leaf/#", 0)
+    subscribe(sock, "leaf/+", 0)
+    sock.close()
+
+    # The old session and its subscriptions are removed, but not those of the
+    # other client
+    sock = connect_client(port, "leaf-clean")
+    publish(pub, "clean")
+    mosq_test.do_ping(sock)
+    expect_once([other], "clean")
+
+    sock.close()
+    other.close()
+
+
+def takeover_test(port, pub):
+    sock1 = connect_client(port, "leaf-takeover", clean_start=False)
+    subscribe(sock1, "leaf/#", 0)
+    subscribe(sock1, "leaf/+", 0)
+
+    sock2 = connect_client(port, "leaf-takeover", clean_start=False, connack_flags=1)
+    mosq_test.expect_packet(sock1, "takeover disconnect", mosq_test.gen_disconnect(reason_code=mqtt5_rc.MQTT_RC_SESSION_TAKEN_OVER, proto_ver=5))
+    sock1.close()
+
+    # One copy for each subscription, as for any MQTT v5 client
+    publish(pub, "takeover")
+    publish_packet = mosq_test.gen_publish("leaf/test", qos=0, payload="takeover", proto_ver=5)
+    mosq_test.expect_packet(sock2, "takeover 1", publish_packet)
+    mosq_test.expect_packet(sock2, "takeover 2", publish_packet)
+    mosq_test.do_ping(sock2)
+
+    # The subscriptions belong to the new connection
+    unsubscribe(sock2, "leaf/#")
+    unsubscribe(sock2, "leaf/+")
+    publish(pub, "takeover gone")
+    mosq_test.do_ping(sock2)
+
+    # Clean up the session
+    sock2.close()
+    sock2 = connect_client(port, "leaf-takeover")
+    sock2.close()
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        pub = connect_client(port, "leaf-pub")
+        many_clients_test(port, pub)
+        resubscribe_test(port, pub)
+        shared_test(port, pub)
+        clean_start_test(port, pub)
+        takeover_test(port, pub)
+        pub.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+do_test()
+exit(0)
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+# QoS 0 messages to connected clients with nothing waiting are written
+# directly. Is a message matching overlapping subscriptions still delivered
+# once? Are messages still handled correctly when they can't be written
+# directly: when upgraded by upgrade_outgoing_qos, when the client has no
+# room in flight, and when queued for an offline client with
+# queue_qos0_messages?
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("upgrade_outgoing_qos true\n")
+        f.write("queue_qos0_messages true\n")
+        f.write("max_inflight_messages 1\n")
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    keepalive = 60
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    sub0_connect_packet = mosq_test.gen_connect("direct-sub0", keepalive=keepalive)
+    sub1_connect_packet = mosq_test.gen_connect("direct-sub1", keepalive=keepalive)
+    offline_connect_packet = mosq_test.gen_connect("direct-offline", keepalive=keepalive, clean_session=False)
+    offline_connack_packet = mosq_test.gen_connack(rc=0, flags=1)
+    pub_connect_packet = mosq_test.gen_connect("direct-pub", keepalive=keepalive)
+
+    mid = 1
+    subscribe0a_packet = mosq_test.gen_subscribe(mid, "direct/#", 0)
+    subscribe0b_packet = mosq_test.gen_subscribe(mid, "direct/+", 0)
+    suback0_packet = mosq_test.gen_suback(mid, 0)
+    subscribe1_packet = mosq_test.gen_subscribe(mid, "direct/#", 1)
+    suback1_packet = mosq_test.gen_suback(mid, 1)
+
+    publish1_packet = mosq_test.gen_publish("direct/test", qos=0, payload="message1")
+    publish2_packet = mosq_test.gen_publish("direct/test", qos=0, payload="message2")
+    publish1_upgraded_packet = mosq_test.gen_publish("direct/test", qos=1, mid=1, payload="message1")
+    puback1_packet = mosq_test.gen_puback(1)
+    publish2_upgraded_packet = mosq_test.gen_publish("direct/test", qos=1, mid=2, payload="message2")
+    puback2_packet = mosq_test.gen_puback(2)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sub0 = mosq_test.do_client_connect(sub0_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sub0, subscribe0a_packet, suback0_packet, "suback0a")
+        mosq_test.do_send_receive(sub0, subscribe0b_packet, suback0_packet, "suback0b")
+
+        sub1 = mosq_test.do_client_connect(sub1_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sub1, subscribe1_packet, suback1_packet, "suback1")
+
+        offline = mosq_test.do_client_connect(offline_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(offline, subscribe0a_packet, suback0_packet, "suback offline")
+        offline.close()
+
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+        pub.send(publish1_packet)
+        pub.send(publish2_packet)
+        mosq_test.do_ping(pub)
+
+        # Once only, despite the overlapping subscriptions
+        mosq_test.expect_packet(sub0, "publish1", publish1_packet)
+        mosq_test.expect_packet(sub0, "publish2", publish2_packet)
+        mosq_test.do_ping(sub0)
+
+        # Upgraded to QoS 1, with the second message waiting for the first
+        # to be acknowledged
+        mosq_test.expect_packet(sub1, "publish1 upgraded", publish1_upgraded_packet)
+        mosq_test.do_send_receive(sub1, puback1_packet, publish2_upgraded_packet, "publish2 upgraded")
+        sub1.send(puback2_packet)
+        mosq_test.do_ping(sub1)
+
+        # Queued while offline
+        offline = mosq_test.do_client_connect(offline_connect_packet, offline_connack_packet, port=port)
+        mosq_test.expect_packet(offline, "offline publish1", publish1_packet)
+        mosq_test.expect_packet(offline, "offline publish2", publish2_packet)
+        mosq_test.do_ping(offline)
+
+        offline.close()
+        pub.close()
+        sub0.close()
+        sub1.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,104 @@
+#!/usr/bin/env python3
+
+# With conflate_queued_messages set on a listener, does a message queued for
+# a client replace one for the same topic that is still waiting in the queue,
+# both for offline clients and for connected clients with no room in flight?
+# Are messages in flight left alone, and is a client of a listener without
+# the option sent every message?
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("max_inflight_messages 1\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("conflate_queued_messages true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+
+
+def do_test():
+    (port1, port2) = mosq_test.get_port(2)
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port1, port2)
+
+    rc = 1
+    keepalive = 60
+
+    offline_connect_packet = mosq_test.gen_connect("conflate-offline", keepalive=keepalive, clean_session=False)
+    plain_connect_packet = mosq_test.gen_connect("conflate-plain", keepalive=keepalive, clean_session=False)
+    online_connect_packet = mosq_test.gen_connect("conflate-online", keepalive=keepalive)
+    pub_connect_packet = mosq_test.gen_connect("conflate-pub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    connack_present_packet = mosq_test.gen_connack(rc=0, flags=1)
+
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "conflate/#", 1)
+    suback_packet = mosq_test.gen_suback(mid, 1)
+
+    messages = [("conflate/a", "a1"), ("conflate/b", "b1"), ("conflate/a", "a2"), ("conflate/b", "b2"), ("conflate/c", "c1")]
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port1)
+
+    try:
+        for (port, connect_packet) in [(port1, offline_connect_packet), (port2, plain_connect_packet)]:
+            sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+            mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback")
+            sock.close()
+
+        online = mosq_test.do_client_connect(online_connect_packet, connack_packet, port=port1)
+        mosq_test.do_send_receive(online, subscribe_packet, suback_packet, "suback online")
+
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port1)
+        for (i, (topic, payload)) in enumerate(messages):
+            publish_packet = mosq_test.gen_publish(topic, qos=1, mid=i+1, payload=payload)
+            puback_packet = mosq_test.gen_puback(i+1)
+            mosq_test.do_send_receive(pub, publish_packet, puback_packet, "puback %d" % (i+1))
+
+        # a1 is in flight, so only the latest of each topic is queued after it
+        mosq_test.expect_packet(online, "online a1", mosq_test.gen_publish("conflate/a", qos=1, mid=1, payload="a1"))
+        online.send(mosq_test.gen_puback(1))
+        mosq_test.expect_packet(online, "online b2", mosq_test.gen_publish("conflate/b", qos=1, mid=4, payload="b2"))
+        online.send(mosq_test.gen_puback(4))
+        mosq_test.expect_packet(online, "online a2", mosq_test.gen_publish("conflate/a", qos=1, mid=3, payload="a2"))
+        online.send(mosq_test.gen_puback(3))
+        mosq_test.expect_packet(online, "online c1", mosq_test.gen_publish("conflate/c", qos=1, mid=5, payload="c1"))
+        online.send(mosq_test.gen_puback(5))
+        mosq_test.do_ping(online)
+
+        # The latest of each topic, in the position of the first message for
+        # that topic
+        sock = mosq_test.do_client_connect(offline_connect_packet, connack_present_packet, port=port1)
+        for (topic, payload, mid) in [("conflate/a", "a2", 3), ("conflate/b", "b2", 4), ("conflate/c", "c1", 5)]:
+            mosq_test.expect_packet(sock, "offline " + payload, mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload))
+            sock.send(mosq_test.gen_puback(mid))
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        # Every message
+        sock = mosq_test.do_client_connect(plain_connect_packet, connack_present_packet, port=port2)
+        for (i, (topic, payload)) in enumerate(messages):
+            mosq_test.expect_packet(sock, "plain " + payload, mosq_test.gen_publish(topic, qos=1, mid=i+1, payload=payload))
+            sock.send(mosq_test.gen_puback(i+1))
+        mosq_test.do_ping(sock)
+        sock.close()
+
+        online.close()
+        pub.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,148 @@
+#!/usr/bin/env python3
+
+# Stored messages share interned copies of their topic, source client id and
+# username, and of small payloads. Does every subscriber still receive the
+# right topic and payload when many messages from different clients repeat
+# them, including empty payloads and payloads either side of the 1024 byte
+# interning limit? Is a retained message that has been cleared and then set
+# again to a payload still in use by queued messages delivered correctly, and
+# does all of this survive a restart with persistence?
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("persistence true\n")
+        f.write("persistence_file %s\n" % (filename.replace('.conf', '.db')))
+
+
+def publish(pub, mid, topic, payload, retain=False):
+    publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload, retain=retain)
+    puback_packet = mosq_test.gen_puback(mid)
+    mosq_test.do_send_receive(pub, publish_packet, puback_packet, "puback %d" % (mid))
+
+
+# Receive and acknowledge each message in turn
+def expect_messages(sock, name, messages, first_mid=1):
+    for (i, (topic, payload)) in enumerate(messages):
+        mid = first_mid + i
+        publish_packet = mosq_test.gen_publish(topic, qos=1, mid=mid, payload=payload)
+        mosq_test.expect_packet(sock, "%s %d" % (name, mid), publish_packet)
+        sock.send(mosq_test.gen_puback(mid))
+    mosq_test.do_ping(sock)
+
+
+def check_retained(port, payload):
+    connect_packet = mosq_test.gen_connect("interned-retained", keepalive=60)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    subscribe_packet = mosq_test.gen_subscribe(1, "retained/#", 0)
+    suback_packet = mosq_test.gen_suback(1, 0)
+
+    sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port)
+    mosq_test.do_send_receive(sock, subscribe_packet, suback_packet, "suback retained")
+    if payload is not None:
+        publish_packet = mosq_test.gen_publish("retained/test", qos=0, payload=payload, retain=True)
+        mosq_test.expect_packet(sock, "retained", publish_packet)
+    mosq_test.do_ping(sock)
+    sock.close()
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    persistence_file = os.path.basename(__file__).replace('.py', '.db')
+    try:
+        os.remove(persistence_file)
+    except OSError:
+        pass
+
+    rc = 1
+    keepalive = 60
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    offline_connect_packet = mosq_test.gen_connect("interned-offline", keepalive=keepalive, clean_session=False)
+    offline_connack_packet = mosq_test.gen_connack(rc=0, flags=1)
+    online_connect_packet = mosq_test.gen_connect("interned-online", keepalive=keepalive)
+
+    subscribe_packet = mosq_test.gen_subscribe(1, "interned/#", 1)
+    suback_packet = mosq_test.gen_suback(1, 1)
+
+    payloads = ["online", "", "x"*1024, "y"*1025]
+    messages = []
+    for i in range(0, 3):
+        for topic in ["interned/a", "interned/b"]:
+            for payload in payloads:
+                messages.append((i, topic, payload))
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        offline = mosq_test.do_client_connect(offline_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(offline, subscribe_packet, suback_packet, "suback offline")
+        offline.close()
+
+        online = mosq_test.do_client_connect(online_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(online, subscribe_packet, suback_packet, "suback online")
+
+        # Identical topics and payloads from different clients and users
+        pubs = []
+        for i in range(0, 3):
+            connect_packet = mosq_test.gen_connect("interned-pub%d" % (i), keepalive=keepalive, username="user%d" % (i))
+            pubs.append(mosq_test.do_client_connect(connect_packet, connack_packet, port=port))
+        for (mid, (i, topic, payload)) in enumerate(messages):
+            publish(pubs[i], mid+1, topic, payload)
+
+        expect_messages(online, "online", [m[1:] for m in messages])
+
+        # Set, clear, and set again to a payload that queued messages share
+        publish(pubs[0], 1, "retained/test", "online", retain=True)
+        publish(pubs[1], 1, "retained/test", "", retain=True)
+        check_retained(port, None)
+        publish(pubs[2], 1, "retained/test", "online", retain=True)
+        check_retained(port, "online")
+
+        for pub in pubs:
+            pub.close()
+        online.close()
+
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+        check_retained(port, "online")
+
+        offline = mosq_test.do_client_connect(offline_connect_packet, offline_connack_packet, port=port)
+        expect_messages(offline, "offline", [m[1:] for m in messages])
+
+        # New messages share the copies loaded from the persistence file
+        pub = mosq_test.do_client_connect(mosq_test.gen_connect("interned-pub0", keepalive=keepalive, username="user0"), connack_packet, port=port)
+        publish(pub, 1, "interned/a", "online")
+        publish(pub, 2, "interned/b", "x"*1024)
+        expect_messages(offline, "offline after restart", [("interned/a", "online"), ("interned/b", "x"*1024)], len(messages)+1)
+        check_retained(port, "online")
+
+        pub.close()
+        offline.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        try:
+            os.remove(persistence_file)
+        except OSError:
+            pass
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,119 @@
+#!/usr/bin/env python3
+
+# With write_coalescing set, are bursts of QoS 1 and QoS 2 publishes sent in
+# a single segment acknowledged correctly and in order, are they delivered to
+# every subscriber and is the DISCONNECT sent on a session takeover still
+# delivered?
+
+from mosq_test_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("allow_anonymous true\n")
+        f.write("write_coalescing true\n")
+        f.write("set_tcp_nodelay true\n")
+
+
+# Coalesced packets arrive together, so may need more than one recv()
+def expect_packets(sock, name, expected):
+    packet_recvd = b""
+    while len(packet_recvd) < len(expected):
+        data = sock.recv(len(expected) - len(packet_recvd))
+        if len(data) == 0:
+            break
+        packet_recvd += data
+    if not mosq_test.packet_matches(name, packet_recvd, expected):
+        raise mosq_test.TestError
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    keepalive = 60
+    count = 20
+
+    sub1_connect_packet = mosq_test.gen_connect("coalesce-sub1", keepalive=keepalive)
+    sub2_connect_packet = mosq_test.gen_connect("coalesce-sub2", keepalive=keepalive)
+    pub_connect_packet = mosq_test.gen_connect("coalesce-pub", keepalive=keepalive)
+    connack_packet = mosq_test.gen_connack(rc=0)
+
+    mid = 1
+    subscribe1_packet = mosq_test.gen_subscribe(mid, "coalesce/#", 1)
+    suback_packet = mosq_test.gen_suback(mid, 1)
+    subscribe2_packet = mosq_test.gen_subscribe(mid, "coalesce/+", 1)
+
+    qos1_publish = b""
+    qos1_puback = b""
+    for i in range(0, count):
+        qos1_publish += mosq_test.gen_publish("coalesce/qos1", qos=1, mid=i+1, payload="message %02d" % (i))
+        qos1_puback += mosq_test.gen_puback(i+1)
+
+    qos2_publish = b""
+    qos2_pubrec = b""
+    qos2_pubrel = b""
+    qos2_pubcomp = b""
+    for i in range(0, count):
+        mid = 100 + i
+        qos2_publish += mosq_test.gen_publish("qos2/test", qos=2, mid=mid, payload="message %02d" % (i))
+        qos2_pubrec += mosq_test.gen_pubrec(mid)
+        qos2_pubrel += mosq_test.gen_pubrel(mid)
+        qos2_pubcomp += mosq_test.gen_pubcomp(mid)
+
+    takeover_connect_packet = mosq_test.gen_connect("coalesce-takeover", keepalive=keepalive, proto_ver=5)
+    takeover_connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+    takeover_disconnect_packet = mosq_test.gen_disconnect(reason_code=mqtt5_rc.MQTT_RC_SESSION_TAKEN_OVER, proto_ver=5)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        sub1 = mosq_test.do_client_connect(sub1_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sub1, subscribe1_packet, suback_packet, "suback1")
+        sub2 = mosq_test.do_client_connect(sub2_connect_packet, connack_packet, port=port)
+        mosq_test.do_send_receive(sub2, subscribe2_packet, suback_packet, "suback2")
+
+        pub = mosq_test.do_client_connect(pub_connect_packet, connack_packet, port=port)
+
+        # A burst of QoS 1 publishes in one segment
+        pub.send(qos1_publish)
+        expect_packets(pub, "pubacks", qos1_puback)
+        for sub in [sub1, sub2]:
+            expect_packets(sub, "publishes", qos1_publish)
+            sub.send(qos1_puback)
+            mosq_test.do_ping(sub)
+
+        # A burst of QoS 2 publishes, then their PUBRELs, in one segment each
+        pub.send(qos2_publish)
+        expect_packets(pub, "pubrecs", qos2_pubrec)
+        pub.send(qos2_pubrel)
+        expect_packets(pub, "pubcomps", qos2_pubcomp)
+        mosq_test.do_ping(pub)
+
+        # Session takeover
+        sock1 = mosq_test.do_client_connect(takeover_connect_packet, takeover_connack_packet, port=port)
+        sock2 = mosq_test.do_client_connect(takeover_connect_packet, takeover_connack_packet, port=port)
+        mosq_test.expect_packet(sock1, "disconnect", takeover_disconnect_packet)
+        mosq_test.do_ping(sock2)
+        sock1.close()
+        sock2.close()
+
+        pub.close()
+        sub1.close()
+        sub2.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -0,0 +1,218 @@
+#!/usr/bin/env python3
+
+# Does a bridge with bridge_compression set ask the remote broker for
+# compression, and once it is confirmed send large payloads deflated and
+# marked with the compression user property, and small payloads unchanged?
+#
+# Does a listener with accept_compression set confirm compression, inflate
+# marked payloads and remove the property before passing them on, and
+# disconnect clients whose payloads inflate to more than max_inflated_size?
+# Does a listener without it leave compression alone?
+
+from mosq_test_helper import *
+import zlib
+
+COMPRESSION_PROPERTY = mqtt5_props.gen_string_pair_prop(mqtt5_props.PROP_USER_PROPERTY, "mosquitto-compression", "deflate")
+
+def write_bridge_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("connection bridge_sample\n")
+        f.write("address 127.0.0.1:%d\n" % (port1))
+        f.write("topic bridge/# out 1\n")
+        f.write("notifications false\n")
+        f.write("restart_timeout 5\n")
+        f.write("bridge_protocol_version mqttv50\n")
+        f.write("bridge_compression deflate\n")
+        f.write("bridge_compression_threshold 100\n")
+
+
+def write_listener_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("accept_compression true\n")
+        f.write("max_inflated_size 1000\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+
+
+# Read a QoS 1 PUBLISH and return its topic, mid, properties and payload
+def read_publish_v5(sock):
+    cmd, = struct.unpack("!B", sock.recv(1))
+    if cmd != 0x32:
+        raise mosq_test.TestError
+    rl, _ = mosq_test.read_varint(sock, 0)
+    packet = b""
+    while len(packet) < rl:
+        packet += sock.recv(rl - len(packet))
+    tlen, = struct.unpack("!H", packet[0:2])
+    topic = packet[2:2+tlen].decode('utf-8')
+    mid, = struct.unpack("!H", packet[2+tlen:4+tlen])
+    pos = 4 + tlen
+    proplen = 0
+    shift = 0
+    while True:
+        b = packet[pos]
+        pos += 1
+        proplen += (b & 0x7F) << shift
+        shift += 7
+        if b & 0x80 == 0:
+            break
+    return (topic, mid, packet[pos:pos+proplen], packet[pos+proplen:])
+
+
+def do_bridge_test():
+    (port1, port2) = mosq_test.get_port(2)
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_bridge_config(conf_file, port1, port2)
+
+    rc = 1
+    keepalive = 60
+    client_id = socket.gethostname()+".bridge_sample"
+    connect_properties = mqtt5_props.gen_uint16_prop(mqtt5_props.PROP_RECEIVE_MAXIMUM, 20) + COMPRESSION_PROPERTY
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, clean_session=False, proto_ver=5, properties=connect_properties)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5, properties=COMPRESSION_PROPERTY, property_helper=False)
+
+    mid = 1
+    unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "bridge/#", proto_ver=5)
+    unsuback_packet = mosq_test.gen_unsuback(mid, proto_ver=5)
+
+    helper_connect_packet = mosq_test.gen_connect("helper", keepalive=keepalive, proto_ver=5)
+    helper_connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+    large_payload = b"compressible " * 50
+    mid = 1
+    helper_large_packet = mosq_test.gen_publish("bridge/large", qos=1, mid=mid, payload=large_payload, proto_ver=5)
+    helper_large_puback = mosq_test.gen_puback(mid, proto_ver=5)
+
+    mid = 2
+    small_payload = b"small"
+    helper_small_packet = mosq_test.gen_publish("bridge/small", qos=1, mid=mid, payload=small_payload, proto_ver=5)
+    helper_small_puback = mosq_test.gen_puback(mid, proto_ver=5)
+    bridge_small_packet = mosq_test.gen_publish("bridge/small", qos=1, mid=3, payload=small_payload, proto_ver=5)
+
+    ssock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    ssock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    ssock.settimeout(40)
+    ssock.bind(('', port1))
+    ssock.listen(5)
+
+    try:
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+        (bridge, address) = ssock.accept()
+        bridge.settimeout(20)
+
+        mosq_test.expect_packet(bridge, "connect", connect_packet)
+        bridge.send(connack_packet)
+
+        mosq_test.expect_packet(bridge, "unsubscribe", unsubscribe_packet)
+        bridge.send(unsuback_packet)
+
+        helper = mosq_test.do_client_connect(helper_connect_packet, helper_connack_packet, port=port2)
+        mosq_test.do_send_receive(helper, helper_large_packet, helper_large_puback, "helper puback large")
+
+        (topic, mid, properties, payload) = read_publish_v5(bridge)
+        if topic != "bridge/large" or mid != 2 or properties != COMPRESSION_PROPERTY:
+            print("FAIL: Incorrect compressed publish: %s %d %s" % (topic, mid, properties))
+            raise mosq_test.TestError
+        if len(payload) >= len(large_payload) or zlib.decompress(payload) != large_payload:
+            print("FAIL: Incorrect compressed payload: %s" % (payload))
+            raise mosq_test.TestError
+        bridge.send(mosq_test.gen_puback(mid, proto_ver=5))
+
+        # Below bridge_compression_threshold
+        mosq_test.do_send_receive(helper, helper_small_packet, helper_small_puback, "helper puback small")
+        mosq_test.expect_packet(bridge, "small publish", bridge_small_packet)
+        bridge.send(mosq_test.gen_puback(3, proto_ver=5))
+
+        helper.close()
+        bridge.close()
+        rc = 0
+    except (mosq_test.TestError, zlib.error, socket.timeout):
+        pass
+    finally:
+        os.remove(conf_file)
+        try:
+            bridge.close()
+        except NameError:
+            pass
+
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        ssock.close()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+def do_listener_test():
+    (port1, port2) = mosq_test.get_port(2)
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_listener_config(conf_file, port1, port2)
+
+    rc = 1
+    keepalive = 60
+    payload = b"compressible " * 50
+    compressed = zlib.compress(payload)
+    oversize = zlib.compress(b"x" * 2000)
+
+    connect_packet = mosq_test.gen_connect("remote-bridge", keepalive=keepalive, proto_ver=5, properties=COMPRESSION_PROPERTY)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=5, properties=COMPRESSION_PROPERTY)
+    connack_plain_packet = mosq_test.gen_connack(rc=0, proto_ver=5)
+
+    sub_connect_packet = mosq_test.gen_connect("sub", keepalive=keepalive, proto_ver=5)
+    mid = 1
+    subscribe_packet = mosq_test.gen_subscribe(mid, "compressed/#", 0, proto_ver=5)
+    suback_packet = mosq_test.gen_suback(mid, 0, proto_ver=5)
+
+    publish_compressed_packet = mosq_test.gen_publish("compressed/in", qos=0, payload=compressed, proto_ver=5, properties=COMPRESSION_PROPERTY)
+    publish_inflated_packet = mosq_test.gen_publish("compressed/in", qos=0, payload=payload, proto_ver=5)
+    publish_oversize_packet = mosq_test.gen_publish("compressed/in", qos=0, payload=oversize, proto_ver=5, properties=COMPRESSION_PROPERTY)
+    disconnect_packet = mosq_test.gen_disconnect(reason_code=mqtt5_rc.MQTT_RC_PACKET_TOO_LARGE, proto_ver=5)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port1)
+
+    try:
+        sub = mosq_test.do_client_connect(sub_connect_packet, connack_plain_packet, port=port1)
+        mosq_test.do_send_receive(sub, subscribe_packet, suback_packet, "suback")
+
+        # Compressed payloads are inflated and the property removed
+        sock = mosq_test.do_client_connect(connect_packet, connack_packet, port=port1)
+        sock.send(publish_compressed_packet)
+        mosq_test.expect_packet(sub, "inflated publish", publish_inflated_packet)
+
+        # Inflating to more than max_inflated_size
+        mosq_test.do_send_receive(sock, publish_oversize_packet, disconnect_packet, "disconnect")
+        sock.close()
+
+        # Without accept_compression, compression is not confirmed and the
+        # property is an ordinary user property
+        sock = mosq_test.do_client_connect(connect_packet, connack_plain_packet, port=port2)
+        sock.send(publish_compressed_packet)
+        mosq_test.expect_packet(sub, "unchanged publish", publish_compressed_packet)
+        sock.close()
+
+        mosq_test.do_ping(sub)
+        sub.close()
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+
+do_bridge_test()
+do_listener_test()
+exit(0)
@@ -0,0 +1,134 @@
+#!/usr/bin/env python3
+
+# Does a bridge with bridge_max_inflight_messages set only have that many
+# outgoing QoS 1 messages in flight, send the rest as the window opens, and
+# report what it has sent under $SYS?
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2, protocol_version):
+    with open(filename, 'w') as f:
+        f.write("port %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("sys_interval 1\n")
+        f.write("\n")
+        f.write("connection bridge_sample\n")
+        f.write("address 127.0.0.1:%d\n" % (port1))
+        f.write("topic bridge/# out 1\n")
+        f.write("notifications false\n")
+        f.write("restart_timeout 5\n")
+        f.write("bridge_protocol_version %s\n" % (protocol_version))
+        f.write("bridge_max_inflight_messages 2\n")
+
+
+def do_test(proto_ver):
+    if proto_ver == 4:
+        bridge_protocol = "mqttv311"
+        proto_ver_connect = 128+4
+    else:
+        bridge_protocol = "mqttv50"
+        proto_ver_connect = 5
+
+    (port1, port2) = mosq_test.get_port(2)
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port1, port2, bridge_protocol)
+
+    rc = 1
+    keepalive = 60
+    client_id = socket.gethostname()+".bridge_sample"
+    connect_packet = mosq_test.gen_connect(client_id, keepalive=keepalive, clean_session=False, proto_ver=proto_ver_connect)
+    connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+
+    # Outgoing only topics are unsubscribed from on the remote broker
+    mid = 1
+    unsubscribe_packet = mosq_test.gen_unsubscribe(mid, "bridge/#", proto_ver=proto_ver)
+    unsuback_packet = mosq_test.gen_unsuback(mid, proto_ver=proto_ver)
+
+    helper_connect_packet = mosq_test.gen_connect("helper", keepalive=keepalive, proto_ver=proto_ver)
+    helper_connack_packet = mosq_test.gen_connack(rc=0, proto_ver=proto_ver)
+
+    helper_publish_packets = []
+    helper_puback_packets = []
+    bridge_publish_packets = []
+    bridge_puback_packets = []
+    for mid in range(1, 5):
+        helper_publish_packets.append(mosq_test.gen_publish("bridge/inflight/%d" % (mid), qos=1, mid=mid, payload="message", proto_ver=proto_ver))
+        helper_puback_packets.append(mosq_test.gen_puback(mid, proto_ver=proto_ver))
+        bridge_publish_packets.append(mosq_test.gen_publish("bridge/inflight/%d" % (mid), qos=1, mid=mid+1, payload="message", proto_ver=proto_ver))
+        bridge_puback_packets.append(mosq_test.gen_puback(mid+1, proto_ver=proto_ver))
+
+    # Sent by the remote end to check that nothing else has been sent first
+    mid = 100
+    remote_publish_packet = mosq_test.gen_publish("remote/test", qos=1, mid=mid, payload="message", proto_ver=proto_ver)
+    if proto_ver == 5:
+        remote_puback_packet = mosq_test.gen_puback(mid, proto_ver=proto_ver, reason_code=mqtt5_rc.MQTT_RC_NO_MATCHING_SUBSCRIBERS)
+    else:
+        remote_puback_packet = mosq_test.gen_puback(mid, proto_ver=proto_ver)
+
+    mid = 1
+    sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/bridges/bridge_sample/messages/sent", 0, proto_ver=proto_ver)
+    sys_suback_packet = mosq_test.gen_suback(mid, 0, proto_ver=proto_ver)
+
+    ssock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    ssock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+    ssock.settimeout(40)
+    ssock.bind(('', port1))
+    ssock.listen(5)
+
+    try:
+        broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+        (bridge, address) = ssock.accept()
+        bridge.settimeout(20)
+
+        mosq_test.expect_packet(bridge, "connect", connect_packet)
+        bridge.send(connack_packet)
+
+        mosq_test.expect_packet(bridge, "unsubscribe", unsubscribe_packet)
+        bridge.send(unsuback_packet)
+
+        helper = mosq_test.do_client_connect(helper_connect_packet, helper_connack_packet, port=port2)
+        for i in range(0, 4):
+            mosq_test.do_send_receive(helper, helper_publish_packets[i], helper_puback_packets[i], "helper puback %d" % (i+1))
+
+        # Only the first two messages fit in the window
+        mosq_test.expect_packet(bridge, "publish 1", bridge_publish_packets[0])
+        mosq_test.expect_packet(bridge, "publish 2", bridge_publish_packets[1])
+        mosq_test.do_send_receive(bridge, remote_publish_packet, remote_puback_packet, "remote puback")
+
+        # Each acknowledgement releases the next message
+        mosq_test.do_send_receive(bridge, bridge_puback_packets[0], bridge_publish_packets[2], "publish 3")
+        mosq_test.do_send_receive(bridge, bridge_puback_packets[1], bridge_publish_packets[3], "publish 4")
+        bridge.send(bridge_puback_packets[2])
+        bridge.send(bridge_puback_packets[3])
+
+        mosq_test.do_send_receive(helper, sys_subscribe_packet, sys_suback_packet, "sys suback")
+        while True:
+            payload = mosq_test.read_publish(helper, proto_ver=proto_ver)
+            if payload == "4":
+                break
+        helper.close()
+        rc = 0
+
+        bridge.close()
+    except (mosq_test.TestError, ValueError, socket.timeout):
+        pass
+    finally:
+        os.remove(conf_file)
+        try:
+            bridge.close()
+        except NameError:
+            pass
+
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        ssock.close()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test(proto_ver=4)
+do_test(proto_ver=5)
+
+exit(0)
@@ -0,0 +1,124 @@
+#!/usr/bin/env python3
+
+# With tls_handshake_threads set, are TLS handshakes carried out without
+# holding up the main loop, are connections beyond max_tls_handshakes queued
+# until a slot is free, and are the handshakes counted under
+# $SYS/broker/tls/handshakes/?
+
+from mosq_test_helper import *
+import threading
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("sys_interval 1\n")
+        f.write("tls_handshake_threads 2\n")
+        f.write("max_tls_handshakes 2\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+
+
+# Read $SYS messages until the topics have the expected values. Values are
+# only published when they change, so are remembered between calls.
+def expect_sys_values(sock, values, prefix, expected):
+    while True:
+        cmd = sock.recv(1)
+        if len(cmd) == 0:
+            raise mosq_test.TestError
+        rl, _ = mosq_test.read_varint(sock, 0)
+        data = b""
+        while len(data) < rl:
+            data += sock.recv(rl - len(data))
+        tlen, = struct.unpack("!H", data[0:2])
+        values[data[2:2+tlen].decode('utf-8')] = data[2+tlen:].decode('utf-8')
+
+        for topic in expected:
+            if values.get(prefix + topic) != expected[topic]:
+                break
+        else:
+            return
+
+
+def tls_connect(port, result):
+    try:
+        sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+        context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+        ssock = context.wrap_socket(sock, server_hostname="localhost")
+        ssock.settimeout(20)
+        ssock.connect(("localhost", port))
+        result.append(ssock)
+    except (ssl.SSLError, OSError) as e:
+        print("FAIL: TLS connect: %s" % (e))
+
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("handshake-pool-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+helper_connect_packet = mosq_test.gen_connect("handshake-pool-helper", keepalive=keepalive)
+mid = 1
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/tls/handshakes/#", 0)
+sys_suback_packet = mosq_test.gen_suback(mid, 0)
+prefix = "$SYS/broker/tls/handshakes/"
+values = {}
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+stalled = []
+try:
+    helper = mosq_test.do_client_connect(helper_connect_packet, connack_packet, port=port2)
+    mosq_test.do_send_receive(helper, sys_subscribe_packet, sys_suback_packet, "sys suback")
+
+    # Connections that never start their handshake fill every slot
+    for i in range(0, 2):
+        stalled.append(mosq_test.client_connect_only(port=port1))
+    expect_sys_values(helper, values, prefix, {"pending": "2", "in progress": "2"})
+
+    # The main loop still serves other clients
+    mosq_test.do_ping(helper)
+
+    # A further connection waits for a free slot
+    result = []
+    t = threading.Thread(target=tls_connect, args=(port1, result))
+    t.start()
+    expect_sys_values(helper, values, prefix, {"pending": "3", "in progress": "2"})
+
+    stalled[0].close()
+    t.join()
+    if len(result) != 1:
+        raise mosq_test.TestError
+    ssock = result[0]
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    expect_sys_values(helper, values, prefix, {"completed": "1", "failed": "1", "pending": "1", "in progress": "1"})
+
+    # Data that isn't a TLS handshake
+    stalled[1].send(b"not a TLS handshake")
+    expect_sys_values(helper, values, prefix, {"completed": "1", "failed": "2", "pending": "0", "in progress": "0"})
+
+    mosq_test.do_ping(ssock)
+    ssock.close()
+    helper.close()
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    for sock in stalled:
+        sock.close()
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
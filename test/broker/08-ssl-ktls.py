@@ -0,0 +1,130 @@
+#!/usr/bin/env python3
+
+# Does a listener with tls_ktls set carry messages of all sizes correctly in
+# both directions, whether or not the kernel takes over record encryption,
+# and count the session under $SYS/broker/listeners/<port>/ktls/?
+
+from mosq_test_helper import *
+
+def write_config(filename, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("sys_interval 1\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("tls_ktls true\n")
+
+
+# Large packets span several TLS records, so may need more than one recv()
+def expect_packet_all(sock, name, expected):
+    packet_recvd = b""
+    while len(packet_recvd) < len(expected):
+        data = sock.recv(len(expected) - len(packet_recvd))
+        if len(data) == 0:
+            break
+        packet_recvd += data
+    if not mosq_test.packet_matches(name, packet_recvd, expected):
+        raise mosq_test.TestError
+
+
+# Read $SYS messages until the topics have one of the expected values
+def expect_sys_values(sock, expected):
+    values = {}
+    while True:
+        cmd = sock.recv(1)
+        if len(cmd) == 0:
+            raise mosq_test.TestError
+        rl, _ = mosq_test.read_varint(sock, 0)
+        data = b""
+        while len(data) < rl:
+            data += sock.recv(rl - len(data))
+        tlen, = struct.unpack("!H", data[0:2])
+        values[data[2:2+tlen].decode('utf-8')] = data[2+tlen:].decode('utf-8')
+
+        for topic in expected:
+            if topic not in values or values[topic] not in expected[topic]:
+                break
+        else:
+            return
+
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+write_config(conf_file, port1, port2)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("ktls-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+mid = 1
+subscribe_packet = mosq_test.gen_subscribe(mid, "ktls/#", 1)
+suback_packet = mosq_test.gen_suback(mid, 1)
+
+publish_packets = []
+for (i, size) in enumerate([10, 20000, 200000]):
+    payload = ("%d" % (i)) * size
+    mid = i + 1
+    publish_packets.append((
+        mosq_test.gen_publish("ktls/%d" % (size), qos=1, mid=mid+10, payload=payload),
+        mosq_test.gen_puback(mid+10),
+        mosq_test.gen_publish("ktls/%d" % (size), qos=1, mid=mid, payload=payload),
+        mosq_test.gen_puback(mid)))
+publish_qos0_packet = mosq_test.gen_publish("ktls/qos0", qos=0, payload="message")
+
+helper_connect_packet = mosq_test.gen_connect("ktls-helper", keepalive=keepalive)
+mid = 1
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/listeners/%d/ktls/#" % (port1), 0)
+sys_suback_packet = mosq_test.gen_suback(mid, 0)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+    ssock = context.wrap_socket(sock, server_hostname="localhost")
+    ssock.settimeout(20)
+    ssock.connect(("localhost", port1))
+
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    mosq_test.do_send_receive(ssock, subscribe_packet, suback_packet, "suback")
+
+    for (publish_send, puback_recv, publish_recv, puback_send) in publish_packets:
+        ssock.send(publish_send)
+        expect_packet_all(ssock, "publish", publish_recv)
+        expect_packet_all(ssock, "puback", puback_recv)
+        ssock.send(puback_send)
+
+    ssock.send(publish_qos0_packet)
+    expect_packet_all(ssock, "publish qos0", publish_qos0_packet)
+    mosq_test.do_ping(ssock)
+
+    # Whether or not send and receive were offloaded depends on the kernel
+    helper = mosq_test.do_client_connect(helper_connect_packet, connack_packet, port=port2)
+    mosq_test.do_send_receive(helper, sys_subscribe_packet, sys_suback_packet, "sys suback")
+    prefix = "$SYS/broker/listeners/%d/ktls/" % (port1)
+    expect_sys_values(helper, {
+        prefix + "sessions": ["1"],
+        prefix + "offloaded/send": ["0", "1"],
+        prefix + "offloaded/receive": ["0", "1"]})
+    helper.close()
+
+    rc = 0
+
+    ssock.close()
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
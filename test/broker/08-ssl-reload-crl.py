@@ -0,0 +1,107 @@
+#!/usr/bin/env python3
+
+# When the CRL of a listener is replaced and the broker is sent SIGHUP, are
+# new connections from a revoked client refused while existing connections
+# carry on? Is the server certificate chain still sent after the reload? If
+# the new CRL can't be loaded, does the listener keep its current one?
+
+from mosq_test_helper import *
+import shutil
+import signal
+
+def write_config(filename, crl_file, port1, port2):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("require_certificate true\n")
+        f.write("crlfile %s\n" % (crl_file))
+
+
+def tls_connect(port, certfile, keyfile):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+    context.load_cert_chain(certfile=certfile, keyfile=keyfile)
+    ssock = context.wrap_socket(sock, server_hostname="localhost")
+    ssock.settimeout(20)
+    ssock.connect(("localhost", port))
+    return ssock
+
+
+# With TLS v1.3 the client certificate is checked after the client has
+# finished its side of the handshake, so the refusal may only be seen on the
+# first read, and may arrive as a reset rather than an alert.
+def expect_revoked(port, connect_packet):
+    try:
+        ssock = tls_connect(port, "../ssl/client-revoked.crt", "../ssl/client-revoked.key")
+        mosq_test.do_send_receive(ssock, connect_packet, b"", "connack")
+    except (ssl.SSLEOFError, ConnectionResetError):
+        return
+    except ssl.SSLError as err:
+        if "certificate revoked" in err.strerror:
+            return
+        print("FAIL: %s" % (err.strerror))
+    raise mosq_test.TestError
+
+
+(port1, port2) = mosq_test.get_port(2)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+crl_file = os.path.basename(__file__).replace('.py', '.crl')
+write_config(conf_file, crl_file, port1, port2)
+shutil.copyfile("../ssl/crl-empty.pem", crl_file)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("reload-crl-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+revoked_connect_packet = mosq_test.gen_connect("reload-crl-revoked", keepalive=keepalive)
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    # Not yet revoked
+    revoked = tls_connect(port1, "../ssl/client-revoked.crt", "../ssl/client-revoked.key")
+    mosq_test.do_send_receive(revoked, revoked_connect_packet, connack_packet, "connack")
+
+    shutil.copyfile("../ssl/crl.pem", crl_file)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(1)
+
+    expect_revoked(port1, revoked_connect_packet)
+    ssock = tls_connect(port1, "../ssl/client.crt", "../ssl/client.key")
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    ssock.close()
+
+    # The connection made before the reload is left alone
+    mosq_test.do_ping(revoked)
+    revoked.close()
+
+    # A damaged CRL leaves the current one in place
+    with open(crl_file, 'w') as f:
+        f.write("-----BEGIN X509 CRL-----\nnot a crl\n-----END X509 CRL-----\n")
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(1)
+
+    expect_revoked(port1, revoked_connect_packet)
+    ssock = tls_connect(port1, "../ssl/client.crt", "../ssl/client.key")
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    ssock.close()
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    os.remove(crl_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
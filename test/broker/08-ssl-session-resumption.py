@@ -0,0 +1,139 @@
+#!/usr/bin/env python3
+
+# Can a TLS client resume its session, including after the broker has been
+# restarted when tls_ticket_key_file is set? Are tickets from a key removed
+# from the file refused after a SIGHUP? Is resumption refused when
+# tls_session_tickets is false and tls_session_cache_size is 0, and are
+# resumed sessions counted under $SYS/broker/listeners/<port>/tls/?
+
+from mosq_test_helper import *
+import signal
+
+def write_config(filename, key_file, port1, port2, port3):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port2))
+        f.write("allow_anonymous true\n")
+        f.write("sys_interval 1\n")
+        f.write("\n")
+        f.write("listener %d\n" % (port1))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("tls_ticket_key_file %s\n" % (key_file))
+        f.write("\n")
+        f.write("listener %d\n" % (port3))
+        f.write("allow_anonymous true\n")
+        f.write("cafile ../ssl/all-ca.crt\n")
+        f.write("certfile ../ssl/server.crt\n")
+        f.write("keyfile ../ssl/server.key\n")
+        f.write("tls_session_tickets false\n")
+        f.write("tls_session_cache_size 0\n")
+
+
+def write_key_file(filename):
+    with open(filename, 'wb') as f:
+        f.write(os.urandom(80))
+
+
+# Read $SYS messages until the topics have the expected values
+def expect_sys_values(sock, expected):
+    values = {}
+    while True:
+        cmd = sock.recv(1)
+        if len(cmd) == 0:
+            raise mosq_test.TestError
+        rl, _ = mosq_test.read_varint(sock, 0)
+        data = b""
+        while len(data) < rl:
+            data += sock.recv(rl - len(data))
+        tlen, = struct.unpack("!H", data[0:2])
+        values[data[2:2+tlen].decode('utf-8')] = data[2+tlen:].decode('utf-8')
+
+        for topic in expected:
+            if values.get(topic) != expected[topic]:
+                break
+        else:
+            return
+
+
+# Connect and return the session to resume next time, checking whether this
+# connection resumed the one given. Sessions can only be resumed with the
+# context they were created with.
+def tls_connect(context, port, connect_packet, connack_packet, session, resumed):
+    sock = socket.socket(socket.AF_INET, socket.SOCK_STREAM)
+    ssock = context.wrap_socket(sock, server_hostname="localhost", session=session)
+    ssock.settimeout(20)
+    ssock.connect(("localhost", port))
+    # With TLS v1.3 the ticket arrives after the handshake
+    mosq_test.do_send_receive(ssock, connect_packet, connack_packet, "connack")
+    if ssock.session_reused != resumed:
+        print("FAIL: Session resumed: %s, expected %s" % (ssock.session_reused, resumed))
+        raise mosq_test.TestError
+    session = ssock.session
+    ssock.close()
+    return session
+
+
+(port1, port2, port3) = mosq_test.get_port(3)
+conf_file = os.path.basename(__file__).replace('.py', '.conf')
+key_file = os.path.basename(__file__).replace('.py', '.keys')
+write_config(conf_file, key_file, port1, port2, port3)
+write_key_file(key_file)
+
+rc = 1
+keepalive = 60
+connect_packet = mosq_test.gen_connect("session-resumption-test", keepalive=keepalive)
+connack_packet = mosq_test.gen_connack(rc=0)
+
+helper_connect_packet = mosq_test.gen_connect("session-resumption-helper", keepalive=keepalive)
+mid = 1
+sys_subscribe_packet = mosq_test.gen_subscribe(mid, "$SYS/broker/listeners/+/tls/#", 0)
+sys_suback_packet = mosq_test.gen_suback(mid, 0)
+prefix1 = "$SYS/broker/listeners/%d/tls/" % (port1)
+prefix3 = "$SYS/broker/listeners/%d/tls/" % (port3)
+
+context = ssl.create_default_context(ssl.Purpose.SERVER_AUTH, cafile="../ssl/test-root-ca.crt")
+
+broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+
+try:
+    session = tls_connect(context, port1, connect_packet, connack_packet, None, False)
+    session = tls_connect(context, port1, connect_packet, connack_packet, session, True)
+
+    # Resumption disabled
+    session3 = tls_connect(context, port3, connect_packet, connack_packet, None, False)
+    tls_connect(context, port3, connect_packet, connack_packet, session3, False)
+
+    helper = mosq_test.do_client_connect(helper_connect_packet, connack_packet, port=port2)
+    mosq_test.do_send_receive(helper, sys_subscribe_packet, sys_suback_packet, "sys suback")
+    expect_sys_values(helper, {
+        prefix1 + "sessions": "2", prefix1 + "resumed": "1",
+        prefix3 + "sessions": "2", prefix3 + "resumed": "0"})
+    helper.close()
+
+    # Tickets are still accepted after a restart
+    broker.terminate()
+    broker.wait()
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), port=port2, use_conf=True)
+    session = tls_connect(context, port1, connect_packet, connack_packet, session, True)
+
+    # Replacing the key means earlier tickets are refused
+    write_key_file(key_file)
+    broker.send_signal(signal.SIGHUP)
+    time.sleep(1)
+    tls_connect(context, port1, connect_packet, connack_packet, session, False)
+
+    rc = 0
+except mosq_test.TestError:
+    pass
+finally:
+    os.remove(conf_file)
+    os.remove(key_file)
+    broker.terminate()
+    broker.wait()
+    (stdo, stde) = broker.communicate()
+    if rc:
+        print(stde.decode('utf-8'))
+
+exit(rc)
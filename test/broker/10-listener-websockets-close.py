@@ -0,0 +1,82 @@
+#!/usr/bin/env python3
+
+# Does the built in websockets support echo the status code of a close frame
+# and then close the connection? Are frames that break the framing rules
+# answered with a close frame carrying a protocol error, before the
+# connection is closed?
+
+from mosq_test_helper import *
+from websockets_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("protocol websockets\n")
+        f.write("allow_anonymous true\n")
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    connect_packet = mosq_test.gen_connect("ws-close-test", keepalive=60)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    normal_closure = struct.pack("!H", 1000)
+    protocol_error = struct.pack("!H", 1002)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        # Close with a status code and reason, after connecting
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet))
+        ws_expect_frame(sock, "connack", WS_OPCODE_BINARY, connack_packet)
+        sock.send(ws_frame(normal_closure + b"bye", WS_OPCODE_CLOSE))
+        ws_expect_frame(sock, "close echo", WS_OPCODE_CLOSE, normal_closure)
+        ws_expect_closed(sock, "close echo")
+        sock.close()
+
+        # Close without a status code, before connecting
+        sock = ws_connect(port)
+        sock.send(ws_frame(b"", WS_OPCODE_CLOSE))
+        ws_expect_frame(sock, "empty close echo", WS_OPCODE_CLOSE, b"")
+        ws_expect_closed(sock, "empty close echo")
+        sock.close()
+
+        # Frames from clients must be masked
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet, masked=False))
+        ws_expect_frame(sock, "unmasked close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "unmasked frame")
+        sock.close()
+
+        # No extensions are negotiated, so reserved bits must be clear
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet, rsv=0x40))
+        ws_expect_frame(sock, "reserved bits close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "reserved bits")
+        sock.close()
+
+        # MQTT is only carried in binary frames
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet, 0x1))
+        ws_expect_frame(sock, "text frame close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "text frame")
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
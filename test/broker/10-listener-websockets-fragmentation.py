@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Does the built in websockets support reassemble MQTT packets from fragmented
+# messages and from several packets in one frame, handle control frames in
+# between fragments, and read frames sent along with the upgrade request?
+# Are continuation frames without a message to continue, and new messages
+# started before the current one is finished, rejected with a protocol error?
+
+from mosq_test_helper import *
+from websockets_helper import *
+
+def write_config(filename, port):
+    with open(filename, 'w') as f:
+        f.write("listener %d\n" % (port))
+        f.write("protocol websockets\n")
+        f.write("allow_anonymous true\n")
+
+
+def do_test():
+    port = mosq_test.get_port()
+    conf_file = os.path.basename(__file__).replace('.py', '.conf')
+    write_config(conf_file, port)
+
+    rc = 1
+    connect_packet = mosq_test.gen_connect("ws-fragmentation-test", keepalive=60)
+    connack_packet = mosq_test.gen_connack(rc=0)
+    pingreq_packet = mosq_test.gen_pingreq()
+    pingresp_packet = mosq_test.gen_pingresp()
+    protocol_error = struct.pack("!H", 1002)
+
+    broker = mosq_test.start_broker(filename=os.path.basename(__file__), use_conf=True, port=port)
+
+    try:
+        # CONNECT split over three fragments, with a ping in between
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet[0:5], WS_OPCODE_BINARY, fin=False)
+                + ws_frame(connect_packet[5:10], WS_OPCODE_CONTINUATION, fin=False)
+                + ws_frame(b"ping", WS_OPCODE_PING)
+                + ws_frame(connect_packet[10:], WS_OPCODE_CONTINUATION))
+        ws_expect_frame(sock, "pong", WS_OPCODE_PONG, b"ping")
+        ws_expect_frame(sock, "connack", WS_OPCODE_BINARY, connack_packet)
+        sock.send(ws_frame(pingreq_packet))
+        ws_expect_frame(sock, "pingresp", WS_OPCODE_BINARY, pingresp_packet)
+        sock.close()
+
+        # Two MQTT packets in a single frame
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet + pingreq_packet))
+        ws_expect_frame(sock, "connack", WS_OPCODE_BINARY, connack_packet)
+        ws_expect_frame(sock, "pingresp", WS_OPCODE_BINARY, pingresp_packet)
+        sock.close()
+
+        # Frames sent with the upgrade request, without waiting for the response
+        sock = ws_connect(port, ws_frame(connect_packet) + ws_frame(pingreq_packet))
+        ws_expect_frame(sock, "early connack", WS_OPCODE_BINARY, connack_packet)
+        ws_expect_frame(sock, "early pingresp", WS_OPCODE_BINARY, pingresp_packet)
+        sock.close()
+
+        # Continuation without a message to continue
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet, WS_OPCODE_CONTINUATION))
+        ws_expect_frame(sock, "stray continuation close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "stray continuation")
+        sock.close()
+
+        # New message before the current one is finished
+        sock = ws_connect(port)
+        sock.send(ws_frame(connect_packet[0:5], WS_OPCODE_BINARY, fin=False)
+                + ws_frame(connect_packet[5:], WS_OPCODE_BINARY))
+        ws_expect_frame(sock, "interleaved message close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "interleaved message")
+        sock.close()
+
+        # Fragmented control frame
+        sock = ws_connect(port)
+        sock.send(ws_frame(b"ping", WS_OPCODE_PING, fin=False))
+        ws_expect_frame(sock, "fragmented ping close", WS_OPCODE_CLOSE, protocol_error)
+        ws_expect_closed(sock, "fragmented ping")
+        sock.close()
+
+        rc = 0
+    except mosq_test.TestError:
+        pass
+    finally:
+        os.remove(conf_file)
+        broker.terminate()
+        broker.wait()
+        (stdo, stde) = broker.communicate()
+        if rc:
+            print(stde.decode('utf-8'))
+            exit(rc)
+
+do_test()
+exit(0)
@@ -73,7 +73,7 @@ class MsgSequence(object):
 
         m = msg.message
         if m['qos'] == 0:
-            sock.send(mosq_test.gen_publish(topic=m['topic'], payload=m['payload']))
+            sock.send(mosq_test.gen_publish(topic=m['topic'], qos=0, payload=m['payload']))
         elif m['qos'] == 1:
             sock.send(mosq_test.gen_publish(mid=1, qos=1, topic=m['topic'], payload=m['payload']))
             mosq_test.expect_packet(sock, "helper puback", mosq_test.gen_puback(mid=1))
@@ -19,6 +19,7 @@ tests = [
     (1, './01-connect-windows-line-endings.py'),
     (2, './01-connect-zero-length-id.py'),
 
+    (1, './02-shared-modes-v5.py'),
     (1, './02-shared-qos0-v5.py'),
     (1, './02-subhier-crash.py'),
     (1, './02-subpub-qos0-long-topic.py'),
@@ -27,6 +28,7 @@ tests = [
     (1, './02-subpub-qos0-retain-as-publish.py'),
     (1, './02-subpub-qos0-send-retain.py'),
     (1, './02-subpub-qos0-subscription-id.py'),
+    (3, './02-subpub-qos0-topic-alias-out.py'),
     (1, './02-subpub-qos0-topic-alias-unknown.py'),
     (1, './02-subpub-qos0-topic-alias.py'),
     (1, './02-subpub-qos1-message-expiry-retain.py'),
@@ -46,6 +48,7 @@ tests = [
     (1, './02-subscribe-invalid-utf8.py'),
     (1, './02-subscribe-long-topic.py'),
     (1, './02-subscribe-persistence-flipflop.py'),
+    (1, './02-subscribe-unsubscribe-v5.py'),
 
     #(1, './03-publish-qos1-queued-bytes.py'),
     (1, './03-pattern-matching.py'),
@@ -59,6 +62,9 @@ tests = [
     (1, './03-publish-dollar.py'),
     (1, './03-publish-invalid-utf8.py'),
     (1, './03-publish-long-topic.py'),
+    (1, './03-publish-qos0-direct.py'),
+    (2, './03-publish-qos1-conflate.py'),
+    (1, './03-publish-qos1-interned.py'),
     (1, './03-publish-qos1-max-inflight-expire.py'),
     (1, './03-publish-qos1-max-inflight.py'),
     (1, './03-publish-qos1-no-subscribers-v5.py'),
@@ -67,6 +73,7 @@ tests = [
     (1, './03-publish-qos2-dup.py'),
     (1, './03-publish-qos2-max-inflight.py'),
     (1, './03-publish-qos2.py'),
+    (1, './03-publish-write-coalescing.py'),
 
     (1, './04-retain-check-source-persist.py'),
     (1, './04-retain-check-source.py'),
@@ -96,8 +103,10 @@ tests = [
     (2, './06-bridge-clean-session-csT-lcsF.py'),
     (2, './06-bridge-clean-session-csT-lcsN.py'),
     (2, './06-bridge-clean-session-csT-lcsT.py'),
+    (2, './06-bridge-compression.py'),
     (2, './06-bridge-fail-persist-resend-qos1.py'),
     (2, './06-bridge-fail-persist-resend-qos2.py'),
+    (2, './06-bridge-max-inflight.py'),
     (1, './06-bridge-no-local.py'),
     (2, './06-bridge-outgoing-retain.py'),
     (3, './06-bridge-per-listener-settings.py'),
@@ -132,7 +141,11 @@ tests = [
     (2, './08-ssl-connect-no-auth-wrong-ca.py'),
     (2, './08-ssl-connect-no-auth.py'),
     (2, './08-ssl-connect-no-identity.py'),
+    (2, './08-ssl-handshake-pool.py'),
     (1, './08-ssl-hup-disconnect.py'),
+    (2, './08-ssl-ktls.py'),
+    (2, './08-ssl-reload-crl.py'),
+    (3, './08-ssl-session-resumption.py'),
     (2, './08-tls-psk-pub.py'),
     (3, './08-tls-psk-bridge.py'),
 
@@ -162,6 +175,8 @@ tests = [
     (1, './09-pwfile-parse-invalid.py'),
 
     (2, './10-listener-mount-point.py'),
+    (1, './10-listener-websockets-close.py'),
+    (1, './10-listener-websockets-fragmentation.py'),
 
     (1, './11-message-expiry.py'),
     (1, './11-persistent-subscription.py'),
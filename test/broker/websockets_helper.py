@@ -0,0 +1,94 @@
+#!/usr/bin/env python3
+
+# Minimal websockets client framing, for testing the broker's built in
+# websockets support at the frame level.
+
+from mosq_test_helper import *
+import base64
+
+WS_OPCODE_CONTINUATION = 0x0
+WS_OPCODE_BINARY = 0x2
+WS_OPCODE_CLOSE = 0x8
+WS_OPCODE_PING = 0x9
+WS_OPCODE_PONG = 0xA
+
+def ws_frame(payload, opcode=WS_OPCODE_BINARY, fin=True, masked=True, rsv=0):
+    hdr = bytes([(0x80 if fin else 0) | rsv | opcode])
+    n = len(payload)
+    if n < 126:
+        hdr += bytes([(0x80 if masked else 0) | n])
+    else:
+        hdr += bytes([(0x80 if masked else 0) | 126]) + struct.pack("!H", n)
+    if not masked:
+        return hdr + payload
+    mask = os.urandom(4)
+    return hdr + mask + bytes(b ^ mask[i%4] for i, b in enumerate(payload))
+
+
+def ws_upgrade_request():
+    key = base64.b64encode(os.urandom(16)).decode('utf-8')
+    return ("GET /mqtt HTTP/1.1\r\n" \
+            + "Host: localhost\r\n" \
+            + "Upgrade: websocket\r\n" \
+            + "Connection: Upgrade\r\n" \
+            + "Sec-WebSocket-Key: %s\r\n" % (key) \
+            + "Sec-WebSocket-Version: 13\r\n" \
+            + "Sec-WebSocket-Protocol: mqtt\r\n\r\n").encode('utf-8')
+
+
+# Open a websockets connection. Anything in data is sent along with the
+# upgrade request, without waiting for the response.
+def ws_connect(port, data=b""):
+    sock = mosq_test.client_connect_only(port=port, timeout=10)
+    sock.send(ws_upgrade_request() + data)
+    response = b""
+    while b"\r\n\r\n" not in response:
+        r = sock.recv(1)
+        if len(r) == 0:
+            raise mosq_test.TestError
+        response += r
+    if not response.startswith(b"HTTP/1.1 101 "):
+        print("FAIL: Websockets upgrade refused: %s" % (response))
+        raise mosq_test.TestError
+    return sock
+
+
+def _recv_exact(sock, n):
+    data = b""
+    while len(data) < n:
+        r = sock.recv(n - len(data))
+        if len(r) == 0:
+            raise mosq_test.TestError
+        data += r
+    return data
+
+
+def ws_read_frame(sock):
+    hdr = _recv_exact(sock, 2)
+    n = hdr[1] & 0x7F
+    if n == 126:
+        n, = struct.unpack("!H", _recv_exact(sock, 2))
+    elif n == 127:
+        n, = struct.unpack("!Q", _recv_exact(sock, 8))
+    return (hdr[0] & 0x0F, _recv_exact(sock, n))
+
+
+def ws_expect_frame(sock, name, opcode, payload):
+    (r_opcode, r_payload) = ws_read_frame(sock)
+    if r_opcode != opcode or r_payload != payload:
+        print("FAIL: Received incorrect %s." % (name))
+        print("Received: opcode=%d payload=%s" % (r_opcode, r_payload))
+        print("Expected: opcode=%d payload=%s" % (opcode, payload))
+        raise mosq_test.TestError
+
+
+# The broker may close the connection with unread data from us still in its
+# receive buffer, in which case the close shows up as a reset.
+def ws_expect_closed(sock, name):
+    try:
+        data = sock.recv(1)
+    except ConnectionResetError:
+        return
+    if len(data) != 0:
+        print("FAIL: Connection not closed after %s." % (name))
+        raise mosq_test.TestError
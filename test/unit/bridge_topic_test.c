@@ -36,6 +36,28 @@ static void map_valid_helper(const char *topic, const char *local_prefix, const
 	}
 }
 
+static void map_out_helper(const char *topic, const char *local_prefix, const char *remote_prefix, const char *outgoing, const char *expected)
+{
+	struct mosquitto mosq;
+	struct mosquitto__bridge bridge;
+	const char *map_topic;
+	int rc;
+
+	memset(&mosq, 0, sizeof(struct mosquitto));
+	memset(&bridge, 0, sizeof(struct mosquitto__bridge));
+
+	mosq.bridge = &bridge;
+
+	rc = bridge__add_topic(&bridge, topic, bd_out, 0, local_prefix, remote_prefix);
+	CU_ASSERT_EQUAL(rc, 0);
+
+	rc = bridge__remap_topic_out(&mosq, outgoing, &map_topic);
+	CU_ASSERT_EQUAL(rc, 0);
+	CU_ASSERT_PTR_NOT_NULL(map_topic);
+	CU_ASSERT_STRING_EQUAL(map_topic, expected);
+	bridge__topics_cleanup(&bridge);
+}
+
 static void map_invalid_helper(const char *topic, const char *local_prefix, const char *remote_prefix)
 {
 	struct mosquitto mosq;
@@ -62,6 +84,93 @@ static void TEST_remap_valid(void)
 	map_valid_helper(NULL, "local", "remote", "local", "remote");
 }
 
+static void TEST_remap_wildcard(void)
+{
+	map_valid_helper("sensor/+/temp", "L/", "R/", "R/sensor/1/temp", "L/sensor/1/temp");
+	map_valid_helper("sensor/#", "long/local/", "R/", "R/sensor/1/temp", "long/local/sensor/1/temp");
+	map_valid_helper("sensor/#", "L/", "R/", "R/sensor", "L/sensor");
+	map_valid_helper("sensor/#", "L/", "R/", "R/other", "R/other");
+	map_valid_helper("+/temp", "L/", "R/", "R//temp", "L//temp");
+	map_valid_helper("+/temp", "L/", "R/", "R/a/b/temp", "R/a/b/temp");
+	map_valid_helper("#", NULL, "R/", "R/$SYS/x", "$SYS/x");
+}
+
+static void TEST_remap_out(void)
+{
+	map_out_helper("pattern", "L/", "R/", "L/pattern", "R/pattern");
+	map_out_helper("pattern", "L/", NULL, "L/pattern", "pattern");
+	map_out_helper("pattern", NULL, "remote/", "pattern", "remote/pattern");
+	map_out_helper("a/+/c", "L/", "R/", "L/a/b/c", "R/a/b/c");
+	map_out_helper("a/#", "L/", "R/", "L/a/b/c", "R/a/b/c");
+	map_out_helper("a/#", "L/", "R/", "L/x/b/c", "L/x/b/c");
+	map_out_helper(NULL, "local", "remote", "local", "remote");
+}
+
+static void TEST_remap_priority(void)
+{
+	struct mosquitto mosq;
+	struct mosquitto__bridge bridge;
+	char *map_topic;
+	int rc;
+
+	memset(&mosq, 0, sizeof(struct mosquitto));
+	memset(&bridge, 0, sizeof(struct mosquitto__bridge));
+
+	mosq.bridge = &bridge;
+
+	/* The first matching pattern in configuration order must be used. */
+	rc = bridge__add_topic(&bridge, "a/+", bd_in, 0, "first/", "R/");
+	CU_ASSERT_EQUAL(rc, 0);
+	rc = bridge__add_topic(&bridge, "a/b", bd_in, 0, "second/", "R/");
+	CU_ASSERT_EQUAL(rc, 0);
+	rc = bridge__add_topic(&bridge, "#", bd_in, 0, "third/", "R/");
+	CU_ASSERT_EQUAL(rc, 0);
+
+	map_topic = strdup("R/a/b");
+	rc = bridge__remap_topic_in(&mosq, &map_topic);
+	CU_ASSERT_EQUAL(rc, 0);
+	CU_ASSERT_STRING_EQUAL(map_topic, "first/a/b");
+	free(map_topic);
+
+	map_topic = strdup("R/x/y");
+	rc = bridge__remap_topic_in(&mosq, &map_topic);
+	CU_ASSERT_EQUAL(rc, 0);
+	CU_ASSERT_STRING_EQUAL(map_topic, "third/x/y");
+	free(map_topic);
+
+	bridge__topics_cleanup(&bridge);
+}
+
+static void TEST_connection_owns_topic(void)
+{
+	struct mosquitto__bridge bridge;
+	const char *topics[] = {"a", "a/b", "a/b/c", "sensor/1/temp", "sensor/2/temp", "$SYS/x", ""};
+	int i, j, owners, owner;
+
+	memset(&bridge, 0, sizeof(struct mosquitto__bridge));
+
+	bridge.connection_count = 1;
+	CU_ASSERT_EQUAL(bridge__connection_owns_topic(&bridge, "a/b"), true);
+
+	/* Each topic must belong to exactly one connection, always the same one. */
+	bridge.connection_count = 4;
+	for(i=0; i<(int)(sizeof(topics)/sizeof(char *)); i++){
+		owners = 0;
+		owner = -1;
+		for(j=0; j<bridge.connection_count; j++){
+			bridge.connection_index = j;
+			if(bridge__connection_owns_topic(&bridge, topics[i])){
+				owners++;
+				owner = j;
+			}
+		}
+		CU_ASSERT_EQUAL(owners, 1);
+		bridge.connection_index = owner;
+		CU_ASSERT_EQUAL(bridge__connection_owns_topic(&bridge, topics[i]), true);
+	}
+}
+
+
 static void TEST_remap_invalid(void)
 {
 	/* Examples from man page */
@@ -87,7 +196,11 @@ int init_bridge_tests(void)
 
 	if(0
 			|| !CU_add_test(test_suite, "Remap valid", TEST_remap_valid)
+			|| !CU_add_test(test_suite, "Remap wildcard", TEST_remap_wildcard)
+			|| !CU_add_test(test_suite, "Remap out", TEST_remap_out)
+			|| !CU_add_test(test_suite, "Remap priority", TEST_remap_priority)
 			|| !CU_add_test(test_suite, "Remap invalid", TEST_remap_invalid)
+			|| !CU_add_test(test_suite, "Connection owns topic", TEST_connection_owns_topic)
 			){
 
 		printf("Error adding Bridge remap CUnit tests.\n");
@@ -162,7 +162,7 @@ int sub__add(struct mosquitto *context, const char *sub, uint8_t qos, uint32_t i
 	return MOSQ_ERR_SUCCESS;
 }
 
-int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties, bool update)
+int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties, bool update)
 {
 	UNUSED(context);
 	UNUSED(mid);
@@ -170,6 +170,7 @@ int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_m
 	UNUSED(qos);
 	UNUSED(retain);
 	UNUSED(stored);
+	UNUSED(subscription_identifier);
 	UNUSED(properties);
 	UNUSED(update);
 
@@ -198,6 +199,18 @@ void db__msg_add_to_queued_stats(struct mosquitto_msg_data *msg_data, struct mos
 	UNUSED(msg);
 }
 
+void db__msg_add_to_inflight_index(struct mosquitto_msg_data *msg_data, struct mosquitto_client_msg *msg)
+{
+	UNUSED(msg_data);
+	UNUSED(msg);
+}
+
+struct mosquitto_client_msg *db__msg_queue_push(struct mosquitto_msg_data *msg_data)
+{
+	UNUSED(msg_data);
+	return mosquitto__calloc(1, sizeof(struct mosquitto_client_msg));
+}
+
 void context__add_to_by_id(struct mosquitto *context)
 {
 	if(context->in_by_id == false){
@@ -114,6 +114,18 @@ int send__pubrel(struct mosquitto *mosq, uint16_t mid, const mosquitto_property
 	return MOSQ_ERR_SUCCESS;
 }
 
+void packet__write_hold(struct mosquitto *mosq)
+{
+	UNUSED(mosq);
+}
+
+int packet__write_release(struct mosquitto *mosq)
+{
+	UNUSED(mosq);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 void context__add_to_by_id(struct mosquitto *context)
 {
 	if(context->in_by_id == false){
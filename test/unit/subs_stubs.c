@@ -20,7 +20,7 @@ struct mosquitto *context__init(mosq_sock_t sock)
 }
 
 
-int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, mosquitto_property *properties)
+int db__message_insert(struct mosquitto *context, uint16_t mid, enum mosquitto_msg_direction dir, uint8_t qos, bool retain, struct mosquitto_msg_store *stored, uint32_t subscription_identifier, mosquitto_property *properties, bool update)
 {
 	return MOSQ_ERR_SUCCESS;
 }
@@ -117,6 +117,18 @@ int send__pubrel(struct mosquitto *mosq, uint16_t mid, const mosquitto_property
 	return MOSQ_ERR_SUCCESS;
 }
 
+void packet__write_hold(struct mosquitto *mosq)
+{
+	UNUSED(mosq);
+}
+
+int packet__write_release(struct mosquitto *mosq)
+{
+	UNUSED(mosq);
+
+	return MOSQ_ERR_SUCCESS;
+}
+
 int mosquitto_acl_check(struct mosquitto *context, const char *topic, uint32_t payloadlen, void* payload, uint8_t qos, bool retain, int access)
 {
 	UNUSED(context);
@@ -185,11 +197,12 @@ int retain__queue(struct mosquitto *context, const char *sub, uint8_t sub_qos, u
 	return MOSQ_ERR_SUCCESS;
 }
 
-int retain__store(const char *topic, struct mosquitto_msg_store *stored, char **split_topics)
+int retain__store(const char *topic, struct mosquitto_msg_store *stored, const struct sub__token *tokens, int token_count)
 {
 	UNUSED(topic);
 	UNUSED(stored);
-	UNUSED(split_topics);
+	UNUSED(tokens);
+	UNUSED(token_count);
 
 	return MOSQ_ERR_SUCCESS;
 }
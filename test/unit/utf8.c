@@ -445,6 +445,80 @@ void TEST_utf8_mqtt_1_5_4_3(void)
 }
 
 
+/* Place characters either side of, and across, the 16 byte blocks and the
+ * overlapping final block that are checked together. */
+void TEST_utf8_block_boundaries(void)
+{
+	char buf[50];
+	int len;
+	int i;
+
+	for(len=15; len<=48; len++){
+		memset(buf, 'a', sizeof(buf));
+		utf8_helper_len(buf, len, MOSQ_ERR_SUCCESS);
+
+		for(i=0; i<len; i++){
+			/* Control character */
+			memset(buf, 'a', sizeof(buf));
+			buf[i] = 0x01;
+			utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+
+			/* Null */
+			buf[i] = '\0';
+			utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+
+			/* Invalid byte */
+			buf[i] = (char)0xFF;
+			utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+
+			/* Lone continuation byte */
+			buf[i] = (char)0x80;
+			utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+
+			if(i < len-1){
+				/* Two byte character, U+00E9 */
+				buf[i] = (char)0xC3; buf[i+1] = (char)0xA9;
+				utf8_helper_len(buf, len, MOSQ_ERR_SUCCESS);
+
+				/* Followed by a control character */
+				if(i < len-2){
+					buf[i+2] = 0x01;
+					utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+				}
+			}else{
+				/* Truncated at the end of the string */
+				buf[i] = (char)0xC3;
+				utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+			}
+
+			if(i < len-3){
+				/* Four byte character, U+1F600 */
+				memset(buf, 'a', sizeof(buf));
+				buf[i] = (char)0xF0; buf[i+1] = (char)0x9F; buf[i+2] = (char)0x98; buf[i+3] = (char)0x80;
+				utf8_helper_len(buf, len, MOSQ_ERR_SUCCESS);
+
+				/* Missing its last continuation byte */
+				buf[i+3] = 'a';
+				utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+			}
+		}
+
+		/* Only multi-byte characters */
+		memset(buf, 'a', sizeof(buf));
+		for(i=0; i+1<len; i+=2){
+			buf[i] = (char)0xC3; buf[i+1] = (char)0xA9;
+		}
+		utf8_helper_len(buf, len, MOSQ_ERR_SUCCESS);
+
+		/* A multi-byte character, then ASCII ending in a control character */
+		memset(buf, 'a', sizeof(buf));
+		buf[0] = (char)0xC3; buf[1] = (char)0xA9;
+		buf[len-1] = 0x7F;
+		utf8_helper_len(buf, len, MOSQ_ERR_MALFORMED_UTF8);
+	}
+}
+
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -470,6 +544,7 @@ int init_utf8_tests(void)
 			|| !CU_add_test(test_suite, "UTF-8 control characters", TEST_utf8_control_characters)
 			|| !CU_add_test(test_suite, "UTF-8 MQTT-1.5.4-2", TEST_utf8_mqtt_1_5_4_2)
 			|| !CU_add_test(test_suite, "UTF-8 MQTT-1.5.4-3", TEST_utf8_mqtt_1_5_4_3)
+			|| !CU_add_test(test_suite, "UTF-8 block boundaries", TEST_utf8_block_boundaries)
 			){
 
 		printf("Error adding UTF-8 CUnit tests.\n");
@@ -7,6 +7,7 @@ static void match_helper(const char *sub, const char *topic)
 {
 	int rc;
 	bool match;
+	struct mosquitto_topic_filter *filter;
 
 	rc = mosquitto_topic_matches_sub(sub, topic, &match);
 	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
@@ -21,12 +22,25 @@ static void match_helper(const char *sub, const char *topic)
 	if(match == false){
 		printf("2: %s:%s\n", sub, topic);
 	}
+
+	rc = mosquitto_topic_filter_compile(sub, &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = mosquitto_topic_matches_compiled(filter, topic, &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+		CU_ASSERT_EQUAL(match, true);
+		if(match == false){
+			printf("3: %s:%s\n", sub, topic);
+		}
+		mosquitto_topic_filter_free(filter);
+	}
 }
 
 static void no_match_helper(int rc_expected, const char *sub, const char *topic)
 {
 	int rc;
 	bool match;
+	struct mosquitto_topic_filter *filter;
 
 	rc = mosquitto_topic_matches_sub(sub, topic, &match);
 	CU_ASSERT_EQUAL(rc, rc_expected);
@@ -41,6 +55,47 @@ static void no_match_helper(int rc_expected, const char *sub, const char *topic)
 		printf("%d:%d %s:%s\n", rc, rc_expected, sub, topic);
 	}
 	CU_ASSERT_EQUAL(match, false);
+
+	/* An invalid subscription is rejected when compiled, an invalid topic
+	 * when matched. */
+	rc = mosquitto_topic_filter_compile(sub, &filter);
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = mosquitto_topic_matches_compiled(filter, topic, &match);
+		CU_ASSERT_EQUAL(match, false);
+		mosquitto_topic_filter_free(filter);
+	}else{
+		CU_ASSERT_PTR_NULL(filter);
+	}
+	CU_ASSERT_EQUAL(rc, rc_expected);
+	if(rc != rc_expected){
+		printf("compiled %d:%d %s:%s\n", rc, rc_expected, sub, topic);
+	}
+}
+
+
+static void compiled_helper(const char *sub, const char *topic, bool expected)
+{
+	int rc;
+	bool match;
+	struct mosquitto_topic_filter *filter;
+
+	rc = mosquitto_topic_filter_compile(sub, &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	if(rc != MOSQ_ERR_SUCCESS) return;
+
+	rc = mosquitto_topic_matches_compiled(filter, topic, &match);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(match, expected);
+	if(match != expected){
+		printf("compiled %s:%s\n", sub, topic);
+	}
+
+	/* Must agree with the uncompiled match */
+	rc = mosquitto_topic_matches_sub(sub, topic, &match);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	CU_ASSERT_EQUAL(match, expected);
+
+	mosquitto_topic_filter_free(filter);
 }
 
 /* ========================================================================
@@ -198,6 +253,123 @@ static void TEST_invalid(void)
 	no_match_helper(MOSQ_ERR_INVAL, "/#a", "foo/bar");
 }
 
+/* ========================================================================
+ * COMPILED FILTERS
+ * ======================================================================== */
+
+static void TEST_compiled_sys(void)
+{
+	/* Wildcards at the start of a filter don't match $ topics */
+	compiled_helper("#", "$SYS/bar", false);
+	compiled_helper("+/bar", "$SYS/bar", false);
+	compiled_helper("+/#", "$SYS/bar", false);
+	compiled_helper("$BOB/bar", "$SYS/bar", false);
+	compiled_helper("$SYS/#", "$SYS/bar", true);
+	compiled_helper("$SYS/+", "$SYS/bar", true);
+	compiled_helper("$SYS/bar", "$SYS/bar", true);
+	compiled_helper("$SYS/bar", "SYS/bar", false);
+	compiled_helper("SYS/bar", "$SYS/bar", false);
+	compiled_helper("foo/#", "foo/$bar", true);
+	compiled_helper("foo/+", "foo/$bar", true);
+}
+
+
+static void TEST_compiled_hash(void)
+{
+	/* # also matches its parent level */
+	compiled_helper("foo/#", "foo", true);
+	compiled_helper("foo/#", "foo/", true);
+	compiled_helper("foo/#", "foo/bar/baz", true);
+	compiled_helper("foo/#", "fo", false);
+	compiled_helper("foo/#", "foobar", false);
+	compiled_helper("foo/bar/#", "foo", false);
+	compiled_helper("foo/+/#", "foo", false);
+	compiled_helper("foo/+/#", "foo/bar", true);
+	compiled_helper("/#", "/foo/bar", true);
+	compiled_helper("/#", "foo/bar", false);
+	compiled_helper("#", "/", true);
+}
+
+
+static void TEST_compiled_plus(void)
+{
+	compiled_helper("+", "foo", true);
+	compiled_helper("+", "/foo", false);
+	compiled_helper("+/+", "/foo", true);
+	compiled_helper("foo/+", "foo/", true);
+	compiled_helper("foo/+", "foo", false);
+	compiled_helper("foo/+", "foo/bar/baz", false);
+	compiled_helper("foo/+/baz", "foo/bar/baz", true);
+	compiled_helper("foo/+/baz", "foo/bar/bar", false);
+	compiled_helper("foo/+/+/baz", "foo///baz", true);
+	compiled_helper("foo//+", "foo//bar", true);
+	compiled_helper("+/+/+", "a/b", false);
+	compiled_helper("+/+/+", "a/b/c/d", false);
+}
+
+
+static void TEST_compiled_invalid(void)
+{
+	int rc;
+	bool match;
+	struct mosquitto_topic_filter *filter;
+
+	rc = mosquitto_topic_filter_compile(NULL, &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+	CU_ASSERT_PTR_NULL(filter);
+
+	rc = mosquitto_topic_filter_compile("", &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+	CU_ASSERT_PTR_NULL(filter);
+
+	rc = mosquitto_topic_filter_compile("foo", NULL);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+
+	rc = mosquitto_topic_filter_compile("foo/#/bar", &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+	CU_ASSERT_PTR_NULL(filter);
+
+	rc = mosquitto_topic_filter_compile("foo/+bar", &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+	CU_ASSERT_PTR_NULL(filter);
+
+	rc = mosquitto_topic_matches_compiled(NULL, "foo", &match);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+	CU_ASSERT_EQUAL(match, false);
+
+	rc = mosquitto_topic_filter_compile("foo/+", &filter);
+	CU_ASSERT_EQUAL(rc, MOSQ_ERR_SUCCESS);
+	if(rc == MOSQ_ERR_SUCCESS){
+		rc = mosquitto_topic_matches_compiled(filter, NULL, &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+		CU_ASSERT_EQUAL(match, false);
+
+		rc = mosquitto_topic_matches_compiled(filter, "", &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+		CU_ASSERT_EQUAL(match, false);
+
+		rc = mosquitto_topic_matches_compiled(filter, "foo/bar", NULL);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+
+		/* Wildcards in the topic, whether or not the levels before them match */
+		rc = mosquitto_topic_matches_compiled(filter, "foo/+", &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+		CU_ASSERT_EQUAL(match, false);
+
+		rc = mosquitto_topic_matches_compiled(filter, "bar/#", &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+		CU_ASSERT_EQUAL(match, false);
+
+		rc = mosquitto_topic_matches_compiled(filter, "foo/bar/baz/+", &match);
+		CU_ASSERT_EQUAL(rc, MOSQ_ERR_INVAL);
+		CU_ASSERT_EQUAL(match, false);
+
+		mosquitto_topic_filter_free(filter);
+	}
+
+	mosquitto_topic_filter_free(NULL);
+}
+
 /* ========================================================================
  * PUB TOPIC CHECK
  * ======================================================================== */
@@ -280,6 +452,61 @@ static void TEST_sub_topic_invalid(void)
 	sub_topic_helper("#/sub/topic", MOSQ_ERR_INVAL);
 }
 
+/* Place wildcards either side of, and across, the 16 byte blocks and the
+ * overlapping final block that are checked together. */
+static void TEST_topic_check_block_boundaries(void)
+{
+	char buf[50];
+	size_t len;
+	size_t i;
+
+	for(len=15; len<=48; len++){
+		memset(buf, 'a', sizeof(buf));
+		buf[len] = '\0';
+		pub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+		sub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+
+		for(i=0; i<len; i++){
+			/* Wildcards inside a level */
+			memset(buf, 'a', sizeof(buf));
+			buf[len] = '\0';
+			buf[i] = '+';
+			pub_topic_helper(buf, MOSQ_ERR_INVAL);
+			sub_topic_helper(buf, MOSQ_ERR_INVAL);
+			buf[i] = '#';
+			pub_topic_helper(buf, MOSQ_ERR_INVAL);
+			sub_topic_helper(buf, MOSQ_ERR_INVAL);
+
+			/* Wildcards as a whole level */
+			buf[i] = '/';
+			pub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+			sub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+			if(i < len-1){
+				buf[i+1] = '+';
+				if(i < len-2){
+					buf[i+2] = '/';
+				}
+				pub_topic_helper(buf, MOSQ_ERR_INVAL);
+				sub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+
+				if(i < len-2){
+					/* "+" not followed by "/" */
+					buf[i+2] = 'a';
+					sub_topic_helper(buf, MOSQ_ERR_INVAL);
+				}
+			}
+		}
+
+		/* Trailing "#" level */
+		memset(buf, 'a', sizeof(buf));
+		buf[len-2] = '/';
+		buf[len-1] = '#';
+		buf[len] = '\0';
+		pub_topic_helper(buf, MOSQ_ERR_INVAL);
+		sub_topic_helper(buf, MOSQ_ERR_SUCCESS);
+	}
+}
+
 /* ========================================================================
  * TEST SUITE SETUP
  * ======================================================================== */
@@ -300,10 +527,15 @@ int init_util_topic_tests(void)
 			|| !CU_add_test(test_suite, "Matching: Valid no matching", TEST_valid_no_matching)
 			|| !CU_add_test(test_suite, "Matching: Invalid but matching", TEST_invalid_but_matching)
 			|| !CU_add_test(test_suite, "Matching: Invalid", TEST_invalid)
+			|| !CU_add_test(test_suite, "Compiled: $ topics", TEST_compiled_sys)
+			|| !CU_add_test(test_suite, "Compiled: # wildcard", TEST_compiled_hash)
+			|| !CU_add_test(test_suite, "Compiled: + wildcard", TEST_compiled_plus)
+			|| !CU_add_test(test_suite, "Compiled: Invalid", TEST_compiled_invalid)
 			|| !CU_add_test(test_suite, "Pub topic: Valid", TEST_pub_topic_valid)
 			|| !CU_add_test(test_suite, "Pub topic: Invalid", TEST_pub_topic_invalid)
 			|| !CU_add_test(test_suite, "Sub topic: Valid", TEST_sub_topic_valid)
 			|| !CU_add_test(test_suite, "Sub topic: Invalid", TEST_sub_topic_invalid)
+			|| !CU_add_test(test_suite, "Topic check: Block boundaries", TEST_topic_check_block_boundaries)
 			){
 
 		printf("Error adding util topic CUnit tests.\n");